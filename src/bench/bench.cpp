@@ -0,0 +1,405 @@
+#include "machine.hpp"
+#include "common.hpp"
+#include "opcodes.hpp"
+#include "trace.hpp"
+#include "session.hpp"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+#define R(x) (0x8000 | (x))
+#define DEC  0x7fff
+
+/*
+ * Every allocation made through operator new is counted, so that runs can
+ * report how much the interpreter allocates while executing.
+ */
+static std::atomic<uint64_t> s_allocations{0};
+
+void* operator new(size_t size)
+{
+	s_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+/*
+ * Number of read and write syscalls made by the process so far, taken from
+ * /proc/self/io. Returns -1 if the kernel does not expose it.
+ */
+static long long count_syscalls()
+{
+	FILE* f = fopen("/proc/self/io", "r");
+	if (!f)
+		return -1;
+
+	long long total = 0;
+	int found = 0;
+	char key[32];
+	long long value;
+	while (fscanf(f, "%31s %lld", key, &value) == 2) {
+		if (strcmp(key, "syscr:") == 0 || strcmp(key, "syscw:") == 0) {
+			total += value;
+			found++;
+		}
+	}
+	fclose(f);
+	return found == 2 ? total : -1;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * struct Program: Tiny builder for synthetic guest programs
+ */
+struct Program {
+	std::vector<uint16_t> words;
+
+	uint16_t here() const { return words.size(); }
+
+	Program& op(uint16_t code, std::initializer_list<uint16_t> args = {}) {
+		words.push_back(code);
+		words.insert(words.end(), args);
+		return *this;
+	}
+
+	/* Returns the position of the operand to patch later */
+	uint16_t hole(uint16_t code, std::initializer_list<uint16_t> args) {
+		op(code, args);
+		return here() - 1;
+	}
+
+	void patch(uint16_t pos, uint16_t value) { words.at(pos) = value; }
+};
+
+/*
+ * Wraps a loop body in two nested countdown loops, as values are 15 bits,
+ * so the body runs outer * inner times. Extra code can be emitted after the
+ * final HALT, where loop bodies can CALL into it.
+ */
+static Program make_loop(uint16_t outer, uint16_t inner,
+		std::function<void(Program&)> body,
+		std::function<void(Program&)> tail = nullptr)
+{
+	Program p;
+	p.op(SET, {R(1), outer});
+	uint16_t outer_loop = p.here();
+	p.op(SET, {R(0), inner});
+	uint16_t inner_loop = p.here();
+	body(p);
+	p.op(ADD, {R(0), R(0), DEC});
+	p.op(JNZ, {R(0), inner_loop});
+	p.op(ADD, {R(1), R(1), DEC});
+	p.op(JNZ, {R(1), outer_loop});
+	p.op(HALT);
+	if (tail)
+		tail(p);
+	return p;
+}
+
+struct Result {
+	std::string name;
+	uint64_t ticks;
+	double seconds;
+	uint64_t allocations;
+	long long syscalls;
+};
+
+struct Options {
+	const char* image = "../challenge.bin";
+	const char* input = "./bench/walkthrough.txt";
+	const char* session = "./bench/walkthrough.session";
+	const char* output = nullptr;
+	const char* filter = nullptr;
+	size_t max_ticks = 0;
+	int repeat = 3;
+};
+
+/*
+ * Runs a machine until it halts, runs out of input or reaches max_ticks,
+ * keeping the best of several runs. Input, if any, is read from the start
+ * of the given file on every run. A body, if given, drives the machine
+ * instead.
+ */
+static Result measure(const std::string& name, int repeat, const char* input,
+		std::function<void(Machine&)> setup, size_t max_ticks,
+		std::function<void(Machine&)> body = nullptr)
+{
+	Result best = {name, 0, 0.0, 0, 0};
+
+	int null_fd = open("/dev/null", O_RDWR);
+	for (int i = 0; i < repeat; i++) {
+		int in_fd = input ? open(input, O_RDONLY) : null_fd;
+		if (in_fd < 0) {
+			perror(input);
+			exit(1);
+		}
+
+		Machine m(in_fd, null_fd, null_fd);
+		setup(m);
+
+		uint64_t allocs = s_allocations.load();
+		long long syscalls = count_syscalls();
+		double start = now();
+
+		if (body) {
+			body(m);
+		} else if (max_ticks) {
+			while (m.state().ticks < max_ticks && m.tick(nullptr));
+		} else {
+			m.run(nullptr);
+		}
+
+		double elapsed = now() - start;
+		uint64_t allocs_end = s_allocations.load();
+		long long syscalls_end = count_syscalls();
+		if (in_fd != null_fd)
+			close(in_fd);
+		// Copying a long name allocates, so it is only done now
+		Result r = {name, m.state().ticks, elapsed,
+			allocs_end - allocs,
+			syscalls < 0 ? -1 : syscalls_end - syscalls};
+
+		if (i == 0 || r.seconds < best.seconds)
+			best = r;
+	}
+	close(null_fd);
+
+	return best;
+}
+
+static void report(const Result& r, FILE* json)
+{
+	double tps = r.seconds > 0 ? r.ticks / r.seconds : 0.0;
+	double ns = r.ticks ? r.seconds * 1e9 / r.ticks : 0.0;
+
+	printf("%-22s %12lu %14.0f %9.2f %10lu %10lld\n", r.name.c_str(),
+			r.ticks, tps, ns, r.allocations, r.syscalls);
+
+	if (json) {
+		fprintf(json, "{\"revision\":\"%s\",\"bench\":\"%s\","
+				"\"ticks\":%lu,\"seconds\":%.6f,"
+				"\"ticks_per_sec\":%.0f,\"ns_per_tick\":%.3f,"
+				"\"allocations\":%lu,\"syscalls\":%lld}\n",
+				BENCH_REVISION, r.name.c_str(), r.ticks,
+				r.seconds, tps, ns, r.allocations, r.syscalls);
+	}
+}
+
+static std::vector<std::pair<std::string, Program>> micro_benchmarks()
+{
+	std::vector<std::pair<std::string, Program>> res;
+
+	res.push_back({"micro/alu", make_loop(200, 10000, [](Program& p) {
+		p.op(ADD,  {R(2), R(2), R(3)});
+		p.op(MULT, {R(3), R(2), 0x0003});
+		p.op(MOD,  {R(4), R(2), 0x0007});
+		p.op(AND,  {R(5), R(2), R(3)});
+		p.op(OR,   {R(6), R(5), R(4)});
+		p.op(NOT,  {R(7), R(6)});
+		p.op(EQ,   {R(2), R(3), R(4)});
+		p.op(GT,   {R(3), R(2), R(5)});
+	})});
+
+	res.push_back({"micro/branch", make_loop(200, 10000, [](Program& p) {
+		p.op(JMP, {uint16_t(p.here() + 2)});
+		p.op(JZ,  {R(0), 0x0000});
+		p.op(JNZ, {R(0), uint16_t(p.here() + 3)});
+		p.op(JZ,  {0x0000, uint16_t(p.here() + 3)});
+		p.op(JNZ, {0x0000, 0x0000});
+		p.op(SET, {R(2), uint16_t(p.here() + 5)});
+		p.op(JMP, {R(2)});
+	})});
+
+	res.push_back({"micro/memory", make_loop(200, 10000, [](Program& p) {
+		p.op(RMEM, {R(2), 0x4000});
+		p.op(ADD,  {R(3), R(0), 0x4000});
+		p.op(WMEM, {R(3), R(2)});
+		p.op(RMEM, {R(4), R(3)});
+		p.op(WMEM, {0x4000, R(4)});
+	})});
+
+	uint16_t call_site = 0;
+	res.push_back({"micro/stack", make_loop(200, 10000, [&](Program& p) {
+		p.op(PUSH, {R(0)});
+		p.op(PUSH, {0x1234});
+		p.op(POP,  {R(2)});
+		p.op(POP,  {R(3)});
+		call_site = p.hole(CALL, {0x0000});
+	}, [&](Program& p) {
+		p.patch(call_site, p.here());
+		p.op(PUSH, {R(2)});
+		p.op(POP,  {R(2)});
+		p.op(RET);
+	})});
+
+	res.push_back({"micro/out", make_loop(10, 10000, [](Program& p) {
+		p.op(OUT, {0x0041});
+		p.op(OUT, {0x000a});
+	})});
+
+	return res;
+}
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s [-b BINARY] [-i INPUT] [-s SESSION] [-o RESULTS] [-f FILTER]"
+			" [-r REPEAT] [-t MAX_TICKS]\n", prog);
+	printf("  -b  image for macrobenchmarks (default ../challenge.bin)\n");
+	printf("  -i  scripted input fed to the image\n");
+	printf("  -s  recorded session replayed and verified as a benchmark\n");
+	printf("  -o  append machine-readable results (JSON lines)\n");
+	printf("  -f  only run benchmarks whose name contains FILTER\n");
+	printf("  -r  runs per benchmark, the fastest is kept\n");
+	printf("  -t  stop macrobenchmarks after this many ticks\n");
+}
+
+int main(int argc, char* argv[])
+{
+	Options opts;
+
+	int c;
+	while ((c = getopt(argc, argv, "b:i:s:o:f:r:t:h")) != -1) {
+		switch (c) {
+		case 'b': opts.image = optarg; break;
+		case 'i': opts.input = optarg; break;
+		case 's': opts.session = optarg; break;
+		case 'o': opts.output = optarg; break;
+		case 'f': opts.filter = optarg; break;
+		case 'r': opts.repeat = MAX(atoi(optarg), 1); break;
+		case 't': opts.max_ticks = strtoull(optarg, NULL, 10); break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	FILE* json = nullptr;
+	if (opts.output) {
+		json = fopen(opts.output, "a");
+		if (!json) {
+			perror(opts.output);
+			return 1;
+		}
+	}
+
+	auto selected = [&](const std::string& name) {
+		return !opts.filter || name.find(opts.filter) != std::string::npos;
+	};
+
+	printf("%-22s %12s %14s %9s %10s %10s\n", "BENCHMARK", "TICKS",
+			"TICKS/SEC", "NS/TICK", "ALLOCS", "SYSCALLS");
+
+	// Each microbenchmark runs on the generic handlers, then on the ones
+	// specialized for operand kinds
+	for (auto& bench : micro_benchmarks()) {
+		for (bool spec : {false, true}) {
+			std::string name = bench.first + (spec ? "-spec" : "");
+			if (!selected(name))
+				continue;
+
+			const Program& prog = bench.second;
+			report(measure(name, opts.repeat, nullptr,
+						[&](Machine& m) {
+				m.load_program(prog.words.data(),
+						prog.words.size());
+				m.setSpecialized(spec);
+			}, 0), json);
+		}
+	}
+
+	bool diverged = false;
+	if (selected("macro/walkthrough") ||
+			selected("macro/walkthrough-spec") ||
+			selected("macro/trace") || selected("macro/replay")) {
+		int image = open(opts.image, O_RDONLY);
+		if (image < 0) {
+			perror(opts.image);
+			return 1;
+		}
+
+		if (selected("macro/walkthrough")) {
+			report(measure("macro/walkthrough", opts.repeat, opts.input,
+						[&](Machine& m) {
+				lseek(image, 0, SEEK_SET);
+				m.load_program(image);
+			}, opts.max_ticks), json);
+		}
+
+		if (selected("macro/walkthrough-spec")) {
+			report(measure("macro/walkthrough-spec", opts.repeat,
+						opts.input, [&](Machine& m) {
+				lseek(image, 0, SEEK_SET);
+				m.load_program(image);
+				m.setSpecialized(true);
+			}, opts.max_ticks), json);
+		}
+
+		// Same run while recording a trace, which is compressed on a
+		// background thread and thrown away
+		std::unique_ptr<TraceWriter> trace;
+		if (selected("macro/trace")) {
+			report(measure("macro/trace", opts.repeat, opts.input,
+						[&](Machine& m) {
+				lseek(image, 0, SEEK_SET);
+				m.load_program(image);
+				trace.reset(new TraceWriter());
+				trace->open("/dev/null", m.state());
+				m.setTrace(trace.get());
+			}, opts.max_ticks), json);
+		}
+
+		// Replaying a session doubles as a regression test: the run
+		// fails if the output ever differs from the recording
+		Session session;
+		if (selected("macro/replay") && session.load(opts.session)) {
+			report(measure("macro/replay", opts.repeat, nullptr,
+						[&](Machine& m) {
+				lseek(image, 0, SEEK_SET);
+				m.load_program(image);
+			}, 0, [&](Machine& m) {
+				diverged |= !session.replay(m, stderr);
+			}), json);
+		} else if (selected("macro/replay")) {
+			fprintf(stderr, "Cannot load session %s\n", opts.session);
+		}
+
+		close(image);
+	}
+
+	if (json)
+		fclose(json);
+
+	return diverged ? 1 : 0;
+}
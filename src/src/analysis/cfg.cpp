@@ -0,0 +1,319 @@
+#include "analysis/cfg.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+
+#define NO_FUNCTION 0xffff
+
+uint64_t
+image_hash(const uint16_t* ram, size_t words)
+{
+	// FNV-1a over whole words
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < words; i++) {
+		hash ^= ram[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+Cfg::Cfg() :
+	m_kind(CODE_SPACE, DATA),
+	m_leader(CODE_SPACE, false),
+	m_block_of(CODE_SPACE, -1),
+	m_hash(0),
+	m_elapsed_ms(0)
+{
+
+}
+
+std::shared_ptr<const Cfg>
+Cfg::analyze(const uint16_t* ram, const std::set<uint16_t>& entries)
+{
+	double start = now_ms();
+
+	std::shared_ptr<Cfg> cfg(new Cfg());
+	cfg->m_hash = image_hash(ram, CODE_SPACE);
+	cfg->explore(ram, entries);
+	cfg->buildBlocks(ram);
+	cfg->buildFunctions();
+	cfg->m_elapsed_ms = now_ms() - start;
+
+	return cfg;
+}
+
+/*
+ * Recursive descent: decodes along every path from the entry points,
+ * marking instruction starts, operands and block leaders. Decoding stops at
+ * invalid opcodes and at code that would overlap an earlier decode.
+ */
+void
+Cfg::explore(const uint16_t* ram, const std::set<uint16_t>& entries)
+{
+	std::vector<uint16_t> work;
+	for (uint16_t entry : entries) {
+		if (entry >= CODE_SPACE)
+			continue;
+		m_entries.insert(entry);
+		m_leader[entry] = true;
+		work.push_back(entry);
+	}
+
+	while (!work.empty()) {
+		uint32_t addr = work.back();
+		work.pop_back();
+
+		while (addr < CODE_SPACE && m_kind[addr] == DATA) {
+			Instruction ins = decode(ram, addr);
+			if (!ins.valid || addr + ins.size() > CODE_SPACE)
+				break;
+
+			bool overlaps = false;
+			for (size_t i = 1; i < ins.size(); i++) {
+				overlaps |= m_kind[addr + i] != DATA;
+			}
+			if (overlaps)
+				break;
+
+			m_kind[addr] = INSN;
+			for (size_t i = 1; i < ins.size(); i++) {
+				m_kind[addr + i] = OPERAND;
+			}
+
+			uint16_t dest;
+			if (ins.target(dest)) {
+				m_leader[dest] = true;
+				work.push_back(dest);
+				if (ins.op == CALL) {
+					m_entries.insert(dest);
+				}
+			}
+
+			addr += ins.size();
+			if (ins.endsBlock() && addr < CODE_SPACE) {
+				m_leader[addr] = true;
+			}
+			if (!ins.fallsThrough())
+				break;
+		}
+	}
+}
+
+void
+Cfg::buildBlocks(const uint16_t* ram)
+{
+	uint32_t addr = 0;
+	while (addr < CODE_SPACE) {
+		if (m_kind[addr] != INSN) {
+			addr++;
+			continue;
+		}
+
+		BasicBlock bb;
+		bb.start = addr;
+		bb.function = NO_FUNCTION;
+		bb.indirect = false;
+
+		int32_t index = m_blocks.size();
+		Instruction ins;
+		for (;;) {
+			ins = decode(ram, addr);
+			m_block_of[addr] = index;
+
+			if (ins.op == CALL) {
+				uint16_t dest;
+				if (ins.target(dest)) {
+					bb.calls.push_back(dest);
+				} else {
+					bb.indirect = true;
+				}
+			}
+
+			addr += ins.size();
+			if (ins.endsBlock() || addr >= CODE_SPACE ||
+					m_kind[addr] != INSN || m_leader[addr])
+				break;
+		}
+		bb.end = addr;
+
+		uint16_t dest;
+		if (ins.op != CALL && ins.target(dest)) {
+			if (m_kind[dest] == INSN)
+				bb.succs.push_back(dest);
+		} else if (ins.op == JMP || ins.op == JNZ || ins.op == JZ) {
+			bb.indirect = true;
+		}
+		if (ins.fallsThrough() && addr < CODE_SPACE &&
+				m_kind[addr] == INSN) {
+			bb.succs.push_back(addr);
+		}
+
+		m_blocks.push_back(bb);
+	}
+
+	for (BasicBlock& bb : m_blocks) {
+		for (uint16_t succ : bb.succs) {
+			m_blocks[m_block_of[succ]].preds.push_back(bb.start);
+		}
+	}
+}
+
+void
+Cfg::buildFunctions()
+{
+	std::deque<int32_t> work;
+
+	for (uint16_t entry : m_entries) {
+		int32_t first = m_block_of[entry];
+		if (first < 0 || m_blocks[first].start != entry)
+			continue;
+
+		Function f;
+		f.entry = entry;
+		f.low = entry;
+		f.high = entry;
+
+		// Blocks shared between functions belong to the first one found
+		work.push_back(first);
+		while (!work.empty()) {
+			BasicBlock& bb = m_blocks[work.front()];
+			work.pop_front();
+			if (bb.function != NO_FUNCTION)
+				continue;
+
+			bb.function = entry;
+			f.blocks.push_back(bb.start);
+			f.low = std::min(f.low, bb.start);
+			f.high = std::max(f.high, bb.end);
+			f.callees.insert(bb.calls.begin(), bb.calls.end());
+			for (uint16_t succ : bb.succs) {
+				work.push_back(m_block_of[succ]);
+			}
+		}
+
+		if (!f.blocks.empty()) {
+			std::sort(f.blocks.begin(), f.blocks.end());
+			m_functions.push_back(f);
+		}
+	}
+}
+
+Cfg::Kind
+Cfg::kind(uint16_t addr) const
+{
+	return addr < CODE_SPACE ? Kind(m_kind[addr]) : DATA;
+}
+
+bool
+Cfg::isCode(uint16_t addr) const
+{
+	return kind(addr) != DATA;
+}
+
+const BasicBlock*
+Cfg::block(uint16_t addr) const
+{
+	if (addr >= CODE_SPACE || m_block_of[addr] < 0)
+		return nullptr;
+	return &m_blocks[m_block_of[addr]];
+}
+
+const Function*
+Cfg::function(uint16_t addr) const
+{
+	const BasicBlock* bb = block(addr);
+	if (!bb || bb->function == NO_FUNCTION)
+		return nullptr;
+
+	auto it = std::lower_bound(m_functions.begin(), m_functions.end(),
+			bb->function, [](const Function& f, uint16_t entry) {
+		return f.entry < entry;
+	});
+	return it != m_functions.end() && it->entry == bb->function ?
+		&*it : nullptr;
+}
+
+size_t
+Cfg::codeWords() const
+{
+	return std::count_if(m_kind.begin(), m_kind.end(),
+			[](uint8_t k) { return k != DATA; });
+}
+
+void
+Cfg::printSummary(FILE* out) const
+{
+	size_t code = codeWords();
+	fprintf(out, "CFG: %lu functions, %lu blocks, %lu code words, "
+			"%lu data words (%.2f ms)\n", m_functions.size(),
+			m_blocks.size(), code, CODE_SPACE - code,
+			m_elapsed_ms);
+
+	for (const Function& f : m_functions) {
+		fprintf(out, "fn_%04x [%04x, %04x) %3lu blocks, calls:",
+				f.entry, f.low, f.high, f.blocks.size());
+		for (uint16_t callee : f.callees) {
+			fprintf(out, " %04x", callee);
+		}
+		fprintf(out, "\n");
+	}
+}
+
+void
+Cfg::printBlocks(FILE* out, const uint16_t* ram) const
+{
+	for (const Function& f : m_functions) {
+		fprintf(out, "\nfn_%04x:\n", f.entry);
+		for (uint16_t start : f.blocks) {
+			const BasicBlock& bb = m_blocks[m_block_of[start]];
+			fprintf(out, "  block %04x-%04x%s ->", bb.start, bb.end,
+					bb.indirect ? " (indirect)" : "");
+			for (uint16_t succ : bb.succs) {
+				fprintf(out, " %04x", succ);
+			}
+			fprintf(out, "\n");
+
+			for (uint32_t addr = bb.start; addr < bb.end; ) {
+				Instruction ins = decode(ram, addr);
+				fprintf(out, "    0x%04x: %s\n", addr,
+						format(ins).c_str());
+				addr += ins.size();
+			}
+		}
+	}
+}
+
+CfgCache::CfgCache()
+{
+	m_entries.insert(0);
+}
+
+void
+CfgCache::addEntry(uint16_t addr)
+{
+	addEntries(&addr, &addr + 1);
+}
+
+std::shared_ptr<const Cfg>
+CfgCache::get(const uint16_t* ram)
+{
+	uint64_t hash = image_hash(ram, CODE_SPACE);
+
+	std::lock_guard<std::mutex> lock(m_mux);
+	if (m_cfg && m_cfg->imageHash() == hash && m_entries == m_analyzed) {
+		return m_cfg;
+	}
+
+	m_cfg = Cfg::analyze(ram, m_entries);
+	m_analyzed = m_entries;
+	return m_cfg;
+}
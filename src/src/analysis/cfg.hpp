@@ -0,0 +1,117 @@
+#pragma once
+
+#include "analysis/disasm.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+/*
+ * struct BasicBlock: Straight-line run of instructions [start, end). CALLs do
+ * not end a block, their destinations are listed in calls instead.
+ */
+struct BasicBlock {
+	uint16_t start;
+	uint16_t end;
+	uint16_t function;
+	std::vector<uint16_t> succs;
+	std::vector<uint16_t> preds;
+	std::vector<uint16_t> calls;
+	bool indirect;
+};
+
+/*
+ * struct Function: Blocks reachable from an entry point without following
+ * CALLs. [low, high) spans every block the function owns.
+ */
+struct Function {
+	uint16_t entry;
+	uint16_t low;
+	uint16_t high;
+	std::vector<uint16_t> blocks;
+	std::set<uint16_t> callees;
+};
+
+/*
+ * class Cfg: Control-flow graph recovered from a memory image by following
+ * control flow from a set of entry points. Words never reached as code are
+ * considered data.
+ */
+class Cfg {
+public:
+	enum Kind : uint8_t {
+		DATA = 0,
+		INSN = 1,
+		OPERAND = 2,
+	};
+
+	static std::shared_ptr<const Cfg> analyze(const uint16_t* ram,
+			const std::set<uint16_t>& entries);
+
+	Kind kind(uint16_t addr) const;
+	bool isCode(uint16_t addr) const;
+
+	const BasicBlock* block(uint16_t addr) const;
+	const Function* function(uint16_t addr) const;
+
+	const std::vector<BasicBlock>& blocks() const { return m_blocks; }
+	const std::vector<Function>& functions() const { return m_functions; }
+
+	size_t codeWords() const;
+	uint64_t imageHash() const { return m_hash; }
+	double elapsedMs() const { return m_elapsed_ms; }
+
+	void printSummary(FILE* out) const;
+	void printBlocks(FILE* out, const uint16_t* ram) const;
+
+private:
+	Cfg();
+
+	void explore(const uint16_t* ram, const std::set<uint16_t>& entries);
+	void buildBlocks(const uint16_t* ram);
+	void buildFunctions();
+
+	std::vector<uint8_t> m_kind;
+	std::vector<bool> m_leader;
+	std::vector<int32_t> m_block_of;
+	std::vector<BasicBlock> m_blocks;
+	std::vector<Function> m_functions;
+	std::set<uint16_t> m_entries;
+
+	uint64_t m_hash;
+	double m_elapsed_ms;
+};
+
+/*
+ * class CfgCache: Keeps the last analysis around until the image or the set
+ * of known entry points changes. Indirect call targets only show up at run
+ * time, so whoever sees them (profiler, debugger) can feed them back here.
+ */
+class CfgCache {
+public:
+	CfgCache();
+
+	std::shared_ptr<const Cfg> get(const uint16_t* ram);
+
+	void addEntry(uint16_t addr);
+	template <typename It>
+	void addEntries(It begin, It end) {
+		std::lock_guard<std::mutex> lock(m_mux);
+		for (; begin != end; ++begin) {
+			if (*begin <= 0x7fff)
+				m_entries.insert(*begin);
+		}
+	}
+
+private:
+	std::shared_ptr<const Cfg> m_cfg;
+	std::set<uint16_t> m_entries;
+	std::set<uint16_t> m_analyzed;
+	std::mutex m_mux;
+};
+
+uint64_t image_hash(const uint16_t* ram, size_t words);
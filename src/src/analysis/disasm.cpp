@@ -0,0 +1,103 @@
+#include "analysis/disasm.hpp"
+#include "analysis/symbols.hpp"
+
+#include <stdio.h>
+
+Instruction
+decode(const uint16_t* ram, uint16_t addr)
+{
+	Instruction ins;
+	ins.addr = addr;
+	ins.op = ram[addr];
+	ins.valid = ins.op < NUM_OPS;
+	ins.nargs = ins.valid ? op_size[ins.op] : 0;
+	for (size_t i = 0; i < 3; i++) {
+		ins.args[i] = i < ins.nargs ? ram[addr + 1 + i] : 0;
+	}
+	return ins;
+}
+
+bool
+Instruction::isBranch() const
+{
+	return valid && (op == JMP || op == JNZ || op == JZ ||
+			op == CALL || op == RET);
+}
+
+bool
+Instruction::endsBlock() const
+{
+	return !valid || op == HALT || op == JMP || op == JNZ || op == JZ ||
+		op == RET;
+}
+
+bool
+Instruction::fallsThrough() const
+{
+	return valid && op != HALT && op != JMP && op != RET;
+}
+
+bool
+Instruction::target(uint16_t& dest) const
+{
+	uint16_t value;
+	switch (valid ? op : HALT) {
+	case JMP:
+	case CALL:
+		value = args[0];
+		break;
+	case JNZ:
+	case JZ:
+		value = args[1];
+		break;
+	default:
+		return false;
+	}
+
+	if (value > 0x7fff)
+		return false;
+	dest = value;
+	return true;
+}
+
+std::string
+operand_repr(uint16_t value)
+{
+	char res[16];
+	if (value <= 0x7fff) {
+		snprintf(res, sizeof(res), "%04x", value);
+	} else if ((value & 0x7fff) <= 7) {
+		snprintf(res, sizeof(res), "R%u", value & 0x7fff);
+	} else {
+		snprintf(res, sizeof(res), "%04x?", value & 0x7fff);
+	}
+	return res;
+}
+
+/*
+ * With symbols, jump and call targets are printed by name
+ */
+std::string
+format(const Instruction& ins, const SymbolTable* symbols)
+{
+	char res[160];
+	if (!ins.valid) {
+		snprintf(res, sizeof(res), "%04x%10s???", ins.op, "");
+		return res;
+	}
+
+	uint16_t dest;
+	std::string name;
+	if (symbols && ins.target(dest))
+		name = symbols->describe(dest);
+
+	std::string text(res, snprintf(res, sizeof(res), "%-4s",
+				op_names[ins.op]));
+	for (size_t i = 0; i < ins.nargs; i++) {
+		bool named = !name.empty() && i + 1 == ins.nargs;
+		snprintf(res, sizeof(res), " %-5s", named ? name.c_str() :
+				operand_repr(ins.args[i]).c_str());
+		text += res;
+	}
+	return text;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "opcodes.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#define CODE_SPACE 0x8000
+
+class SymbolTable;
+
+/*
+ * struct Instruction: One decoded instruction. Operands keep their encoded
+ * form, so registers are still 0x8000..0x8007.
+ */
+struct Instruction {
+	uint16_t addr;
+	uint16_t op;
+	uint16_t args[3];
+	uint8_t nargs;
+	bool valid;
+
+	size_t size() const { return valid ? nargs + 1 : 1; }
+
+	bool isBranch() const;
+	bool endsBlock() const;
+	bool fallsThrough() const;
+
+	/* Literal destination of a jump or call, if it has one */
+	bool target(uint16_t& dest) const;
+};
+
+Instruction decode(const uint16_t* ram, uint16_t addr);
+
+std::string operand_repr(uint16_t value);
+std::string format(const Instruction& ins,
+		const SymbolTable* symbols = nullptr);
@@ -0,0 +1,321 @@
+#include "analysis/symbols.hpp"
+#include "analysis/cfg.hpp"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#define SYMBOL_LINE 512
+
+static const char* kind_names[] = {"func", "label", "data"};
+
+/*
+ * Names made only of hex digits would read back as addresses
+ */
+static bool valid_name(const std::string& name)
+{
+	if (name.empty() || isdigit((unsigned char)name[0]))
+		return false;
+
+	bool hex = true;
+	for (char c : name) {
+		if (!isalnum((unsigned char)c) && c != '_' && c != '.')
+			return false;
+		hex = hex && isxdigit((unsigned char)c);
+	}
+	return !hex;
+}
+
+SymbolTable::SymbolTable()
+{
+
+}
+
+void
+SymbolTable::clear()
+{
+	m_ranges.clear();
+	m_labels.clear();
+	m_comments.clear();
+	m_names.clear();
+}
+
+void
+SymbolTable::forget(const Symbol& sym)
+{
+	uint16_t addr = sym.addr;
+	m_names.erase(sym.name);
+	if (sym.kind == SYM_LABEL) {
+		m_labels.erase(addr);
+	} else {
+		m_ranges.erase(addr);
+	}
+}
+
+/*
+ * Adds a symbol, replacing any other with the same name or start. Fails if
+ * the name is not usable or a range would overlap another.
+ */
+bool
+SymbolTable::add(SymbolKind kind, uint16_t addr, uint16_t end,
+		const std::string& name)
+{
+	if (!valid_name(name))
+		return false;
+
+	auto& table = kind == SYM_LABEL ? m_labels : m_ranges;
+	if (kind == SYM_LABEL) {
+		end = addr + 1;
+	} else {
+		if (end <= addr)
+			return false;
+		auto next = m_ranges.upper_bound(addr);
+		if (next != m_ranges.end() && next->first < end)
+			return false;
+		const Symbol* prev = covering(addr);
+		if (prev && prev->addr != addr)
+			return false;
+	}
+
+	auto named = m_names.find(name);
+	if (named != m_names.end()) {
+		auto label = m_labels.find(named->second);
+		if (label != m_labels.end() && label->second.name == name) {
+			forget(label->second);
+		} else {
+			forget(m_ranges.at(named->second));
+		}
+	}
+	auto same = table.find(addr);
+	if (same != table.end())
+		forget(same->second);
+
+	table[addr] = Symbol{addr, end, kind, name};
+	m_names[name] = addr;
+	return true;
+}
+
+void
+SymbolTable::setComment(uint16_t addr, const std::string& text)
+{
+	if (text.empty()) {
+		m_comments.erase(addr);
+	} else {
+		m_comments[addr] = text;
+	}
+}
+
+/*
+ * Names every function the CFG found that has no symbol yet fn_XXXX, as the
+ * CFG and profiler reports call them. Returns how many were added.
+ */
+size_t
+SymbolTable::addFromCfg(const Cfg& cfg)
+{
+	size_t added = 0;
+	for (const Function& f : cfg.functions()) {
+		if (covering(f.entry))
+			continue;
+
+		uint16_t end = f.high > f.entry ? f.high : f.entry + 1;
+		auto next = m_ranges.upper_bound(f.entry);
+		if (next != m_ranges.end() && next->first < end)
+			end = next->first;
+
+		char name[16];
+		snprintf(name, sizeof(name), "fn_%04x", f.entry);
+		added += add(SYM_FUNC, f.entry, end, name);
+	}
+	return added;
+}
+
+/*
+ * Symbol starting at addr, labels first
+ */
+const Symbol*
+SymbolTable::at(uint16_t addr) const
+{
+	auto label = m_labels.find(addr);
+	if (label != m_labels.end())
+		return &label->second;
+	auto range = m_ranges.find(addr);
+	return range != m_ranges.end() ? &range->second : nullptr;
+}
+
+/*
+ * Function or data range holding addr
+ */
+const Symbol*
+SymbolTable::covering(uint16_t addr) const
+{
+	auto it = m_ranges.upper_bound(addr);
+	if (it == m_ranges.begin())
+		return nullptr;
+	--it;
+	return addr < it->second.end ? &it->second : nullptr;
+}
+
+const std::string*
+SymbolTable::comment(uint16_t addr) const
+{
+	auto it = m_comments.find(addr);
+	return it != m_comments.end() ? &it->second : nullptr;
+}
+
+bool
+SymbolTable::find(const std::string& name, uint16_t& addr) const
+{
+	auto it = m_names.find(name);
+	if (it == m_names.end())
+		return false;
+	addr = it->second;
+	return true;
+}
+
+/*
+ * "name" for an address with a symbol, "name+off" inside a range, or an
+ * empty string
+ */
+std::string
+SymbolTable::describe(uint16_t addr) const
+{
+	const Symbol* sym = at(addr);
+	if (sym)
+		return sym->name;
+
+	sym = covering(addr);
+	if (!sym)
+		return "";
+
+	char off[8];
+	snprintf(off, sizeof(off), "+%x", addr - sym->addr);
+	return sym->name + off;
+}
+
+/*
+ * Reads a hex address or a name with an optional +N/-N (hex), as the
+ * debugger's commands take them
+ */
+bool
+SymbolTable::parseAddress(const char* text, uint16_t& addr) const
+{
+	while (isspace((unsigned char)*text))
+		text++;
+	size_t len = strcspn(text, " \t\r\n");
+	if (len == 0)
+		return false;
+
+	std::string token(text, len);
+	char* end;
+	unsigned long value = strtoul(token.c_str(), &end, 16);
+	if (*end == '\0') {
+		if (value > 0xffff)
+			return false;
+		addr = value;
+		return true;
+	}
+
+	size_t sign = token.find_first_of("+-");
+	long offset = 0;
+	if (sign != std::string::npos) {
+		offset = strtol(token.c_str() + sign, &end, 16);
+		if (*end != '\0' || sign + 1 == token.size())
+			return false;
+		token.resize(sign);
+	}
+
+	uint16_t base;
+	if (!find(token, base))
+		return false;
+	addr = base + offset;
+	return true;
+}
+
+bool
+SymbolTable::save(const char* path) const
+{
+	FILE* out = fopen(path, "w");
+	if (!out)
+		return false;
+
+	// Merge the three tables back into address order
+	std::multimap<uint16_t, std::string> lines;
+	char line[64];
+	for (auto& table : {&m_ranges, &m_labels}) {
+		for (auto& entry : *table) {
+			const Symbol& sym = entry.second;
+			if (sym.kind == SYM_LABEL) {
+				snprintf(line, sizeof(line), "label   %04x      ",
+						sym.addr);
+			} else {
+				snprintf(line, sizeof(line), "%-7s %04x %04x ",
+						kind_names[sym.kind], sym.addr, sym.end);
+			}
+			lines.emplace(sym.addr, line + sym.name);
+		}
+	}
+	for (auto& entry : m_comments) {
+		snprintf(line, sizeof(line), "comment %04x ", entry.first);
+		lines.emplace(entry.first, line + entry.second);
+	}
+
+	for (auto& entry : lines) {
+		fprintf(out, "%s\n", entry.second.c_str());
+	}
+	return fclose(out) == 0;
+}
+
+/*
+ * Adds the entries in a symbol file to the table. Blank lines and lines
+ * starting with ';' are skipped, as is anything after a ';' but in
+ * comments. Stops at the first bad line.
+ */
+bool
+SymbolTable::load(const char* path)
+{
+	FILE* in = fopen(path, "r");
+	if (!in) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return false;
+	}
+
+	char line[SYMBOL_LINE];
+	size_t number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), in)) {
+		number++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		char kind[16];
+		unsigned addr, end;
+		char name[128];
+		int used = 0;
+		if (sscanf(line, " %15s%n", kind, &used) != 1 || kind[0] == ';')
+			continue;
+
+		const char* rest = line + used;
+		if (strcmp(kind, "comment") == 0) {
+			if (sscanf(rest, "%x %n", &addr, &used) < 1 || addr > 0xffff) {
+				ok = false;
+			} else {
+				setComment(addr, rest + used);
+			}
+		} else if (strcmp(kind, "label") == 0) {
+			ok = sscanf(rest, "%x %127[^; \t]", &addr, name) == 2 &&
+				addr <= 0xffff && add(SYM_LABEL, addr, addr, name);
+		} else {
+			SymbolKind k = strcmp(kind, "func") == 0 ? SYM_FUNC : SYM_DATA;
+			ok = (k == SYM_FUNC || strcmp(kind, "data") == 0) &&
+				sscanf(rest, "%x %x %127[^; \t]", &addr, &end, name) == 3 &&
+				end <= 0xffff && add(k, addr, end, name);
+		}
+
+		if (!ok)
+			fprintf(stderr, "%s:%lu: bad symbol entry\n", path, number);
+	}
+
+	fclose(in);
+	return ok;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+
+class Cfg;
+
+enum SymbolKind {
+	SYM_FUNC,
+	SYM_LABEL,
+	SYM_DATA,
+};
+
+/*
+ * struct Symbol: A named address. Functions and data cover [addr, end),
+ * labels only their own address.
+ */
+struct Symbol {
+	uint16_t addr;
+	uint16_t end;
+	SymbolKind kind;
+	std::string name;
+};
+
+/*
+ * class SymbolTable: Names and comments for a memory image, loaded from a
+ * text file with one entry per line:
+ *
+ *	func  05b2 05ee list_foreach   ; [start, end)
+ *	data  034b 034d selftest_consts
+ *	label 06fb read_loop
+ *	comment 06e7 Reads a line into the buffer at R1
+ *
+ * Ranges are kept sorted by start and do not nest, so the one covering an
+ * address is found with a binary search.
+ */
+class SymbolTable {
+public:
+	SymbolTable();
+
+	bool load(const char* path);
+	bool save(const char* path) const;
+	void clear();
+
+	bool add(SymbolKind kind, uint16_t addr, uint16_t end,
+			const std::string& name);
+	void setComment(uint16_t addr, const std::string& text);
+	size_t addFromCfg(const Cfg& cfg);
+
+	const Symbol* at(uint16_t addr) const;
+	const Symbol* covering(uint16_t addr) const;
+	const std::string* comment(uint16_t addr) const;
+	bool find(const std::string& name, uint16_t& addr) const;
+
+	std::string describe(uint16_t addr) const;
+	bool parseAddress(const char* text, uint16_t& addr) const;
+
+	size_t size() const { return m_names.size(); }
+	bool empty() const { return m_names.empty(); }
+
+private:
+	void forget(const Symbol& sym);
+
+	std::map<uint16_t, Symbol> m_ranges;
+	std::map<uint16_t, Symbol> m_labels;
+	std::map<uint16_t, std::string> m_comments;
+	std::unordered_map<std::string, uint16_t> m_names;
+};
@@ -0,0 +1,554 @@
+#include "assembler.hpp"
+#include "opcodes.hpp"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static std::string trim(const std::string& s)
+{
+	size_t start = s.find_first_not_of(" \t\r\n");
+	if (start == std::string::npos)
+		return "";
+	size_t end = s.find_last_not_of(" \t\r\n");
+	return s.substr(start, end + 1 - start);
+}
+
+static bool is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '@';
+}
+
+static bool is_hex(const std::string& s)
+{
+	size_t start = s.compare(0, 2, "0x") == 0 ? 2 : 0;
+	return s.size() > start &&
+		s.find_first_not_of("0123456789abcdefABCDEF", start) ==
+		std::string::npos;
+}
+
+/*
+ * Drops a comment, minding ';' inside quotes
+ */
+static std::string strip_comment(const std::string& line)
+{
+	char quote = 0;
+	for (size_t i = 0; i < line.size(); i++) {
+		char c = line[i];
+		if (quote) {
+			if (c == '\\')
+				i++;
+			else if (c == quote)
+				quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == ';') {
+			return line.substr(0, i);
+		}
+	}
+	return line;
+}
+
+/*
+ * Splits operands at commas and blanks, keeping quoted text whole
+ */
+static std::vector<std::string> split_operands(const std::string& text)
+{
+	std::vector<std::string> res;
+	std::string cur;
+	char quote = 0;
+	for (size_t i = 0; i < text.size(); i++) {
+		char c = text[i];
+		if (quote) {
+			cur += c;
+			if (c == '\\' && i + 1 < text.size())
+				cur += text[++i];
+			else if (c == quote)
+				quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+			cur += c;
+		} else if (c == ',' || isspace((unsigned char)c)) {
+			if (!cur.empty())
+				res.push_back(cur);
+			cur.clear();
+		} else {
+			cur += c;
+		}
+	}
+	if (!cur.empty())
+		res.push_back(cur);
+	return res;
+}
+
+/*
+ * Decodes a quoted literal, without its quotes
+ */
+static bool unquote(const std::string& text, std::string& res)
+{
+	if (text.size() < 2 || text.back() != text[0])
+		return false;
+
+	res.clear();
+	for (size_t i = 1; i + 1 < text.size(); i++) {
+		char c = text[i];
+		if (c == '\\' && i + 2 < text.size()) {
+			switch (text[++i]) {
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case '0': c = '\0'; break;
+			default:  c = text[i]; break;
+			}
+		}
+		res += c;
+	}
+	return true;
+}
+
+/*
+ * Replaces whole names in text
+ */
+static std::string substitute(const std::string& text,
+		const std::map<std::string, std::string>& names)
+{
+	std::string res;
+	size_t i = 0;
+	while (i < text.size()) {
+		if (!is_name_char(text[i])) {
+			res += text[i++];
+			continue;
+		}
+		size_t end = i;
+		while (end < text.size() && is_name_char(text[end]))
+			end++;
+		std::string name = text.substr(i, end - i);
+		auto it = names.find(name);
+		res += it != names.end() ? it->second : name;
+		i = end;
+	}
+	return res;
+}
+
+Assembler::Assembler() :
+	m_expansions(0)
+{
+}
+
+void
+Assembler::error(size_t line, const std::string& msg)
+{
+	char prefix[64];
+	snprintf(prefix, sizeof(prefix), ":%lu: ", line);
+	m_errors.push_back(m_name + prefix + msg);
+}
+
+/*
+ * Collects macro definitions and replaces macro calls by their bodies
+ */
+bool
+Assembler::expand(const std::vector<Line>& lines, std::vector<Line>& out,
+		size_t depth)
+{
+	if (depth > ASM_MAX_MACRO_DEPTH) {
+		error(lines.empty() ? 0 : lines[0].number, "macros nest too deep");
+		return false;
+	}
+
+	Macro* defining = nullptr;
+	for (auto& line : lines) {
+		std::string text = trim(strip_comment(line.text));
+		std::vector<std::string> words = split_operands(text);
+
+		if (defining) {
+			if (!words.empty() && words[0] == ".endm") {
+				defining = nullptr;
+			} else {
+				defining->body.push_back(line);
+			}
+			continue;
+		}
+
+		if (!words.empty() && words[0] == ".macro") {
+			if (words.size() < 2) {
+				error(line.number, ".macro needs a name");
+				return false;
+			}
+			defining = &m_macros[words[1]];
+			defining->params.assign(words.begin() + 2, words.end());
+			defining->body.clear();
+			continue;
+		}
+
+		// The address column of a disassembly listing
+		size_t colon = text.find(':');
+		if (text.compare(0, 2, "0x") == 0 && colon != std::string::npos &&
+				is_hex(text.substr(0, colon))) {
+			out.push_back({line.number, ".org " + text.substr(0, colon)});
+			text = trim(text.substr(colon + 1));
+			words = split_operands(text);
+			if (words.empty())
+				continue;
+		}
+
+		// A label may come before the call
+		size_t first = 0;
+		if (!words.empty() && words[0].back() == ':')
+			first = 1;
+
+		auto it = words.size() > first ? m_macros.find(words[first]) :
+			m_macros.end();
+		if (it == m_macros.end()) {
+			out.push_back({line.number, text});
+			continue;
+		}
+
+		const Macro& macro = it->second;
+		if (words.size() - first - 1 != macro.params.size()) {
+			error(line.number, "macro " + words[first] + " takes " +
+					std::to_string(macro.params.size()) + " arguments");
+			return false;
+		}
+
+		std::map<std::string, std::string> names;
+		for (size_t i = 0; i < macro.params.size(); i++) {
+			names[macro.params[i]] = words[first + 1 + i];
+		}
+
+		std::string unique = "_" + std::to_string(m_expansions++);
+		std::vector<Line> body;
+		if (first)
+			body.push_back({line.number, words[0]});
+		for (auto& b : macro.body) {
+			std::string text = substitute(b.text, names);
+			size_t at;
+			while ((at = text.find('@')) != std::string::npos) {
+				text.replace(at, 1, unique);
+			}
+			body.push_back({line.number, text});
+		}
+		if (!expand(body, out, depth + 1))
+			return false;
+	}
+
+	if (defining) {
+		error(lines.back().number, "missing .endm");
+		return false;
+	}
+	return true;
+}
+
+bool
+Assembler::parse(const Line& line, Statement& stmt)
+{
+	stmt.line = line.number;
+	std::string text = trim(strip_comment(line.text));
+
+	while (!text.empty()) {
+		size_t end = 0;
+		while (end < text.size() && is_name_char(text[end]))
+			end++;
+		if (end == 0 || end >= text.size() || text[end] != ':')
+			break;
+		stmt.labels.push_back(text.substr(0, end));
+		text = trim(text.substr(end + 1));
+	}
+
+	if (text.empty())
+		return true;
+
+	std::vector<std::string> words = split_operands(text);
+	std::string word = words[0];
+	stmt.operands.assign(words.begin() + 1, words.end());
+
+	if (word[0] != '.') {
+		for (uint16_t op = 0; op < NUM_OPS; op++) {
+			if (strcasecmp(word.c_str(), op_names[op]) == 0) {
+				stmt.kind = STMT_OP;
+				stmt.op = op;
+			}
+		}
+		/* A word that does not decode, as the disassembler lists it */
+		if (stmt.kind != STMT_OP && is_hex(word) && (words.size() == 1 ||
+					(words.size() == 2 && words[1] == "???"))) {
+			stmt.kind = STMT_WORD;
+			stmt.operands.assign(1, word);
+			return true;
+		}
+		if (stmt.kind != STMT_OP) {
+			error(line.number, "unknown instruction " + word);
+			return false;
+		}
+		if (stmt.operands.size() != op_size[stmt.op]) {
+			error(line.number, word + " takes " +
+					std::to_string(op_size[stmt.op]) + " operands");
+			return false;
+		}
+		return true;
+	}
+
+	size_t want = 0;
+	if (word == ".word") {
+		stmt.kind = STMT_WORD;
+		want = stmt.operands.empty() ? 1 : 0;
+	} else if (word == ".string") {
+		stmt.kind = STMT_STRING;
+		if (stmt.operands.size() != 1 ||
+				!unquote(stmt.operands[0], stmt.text) ||
+				stmt.operands[0][0] != '"') {
+			error(line.number, ".string takes one quoted string");
+			return false;
+		}
+	} else if (word == ".fill") {
+		stmt.kind = STMT_FILL;
+		if (stmt.operands.size() == 1)
+			stmt.operands.push_back("0");
+		want = 2;
+	} else if (word == ".org") {
+		stmt.kind = STMT_ORG;
+		want = 1;
+	} else if (word == ".equ") {
+		stmt.kind = STMT_EQU;
+		want = 2;
+	} else {
+		error(line.number, "unknown directive " + word);
+		return false;
+	}
+
+	if (want && stmt.operands.size() != want) {
+		error(line.number, word + " takes " + std::to_string(want) +
+				" operands");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Evaluates an operand: a register, a character, a number or a name, the
+ * last two with an optional offset
+ */
+bool
+Assembler::value(const std::string& token, size_t line, uint32_t& res)
+{
+	if (token.size() == 2 && toupper(token[0]) == 'R' && token[1] >= '0' &&
+			token[1] <= '7') {
+		res = 0x8000 + token[1] - '0';
+		return true;
+	}
+
+	if (token[0] == '\'') {
+		std::string c;
+		if (!unquote(token, c) || c.size() != 1) {
+			error(line, "bad character " + token);
+			return false;
+		}
+		res = (unsigned char)c[0];
+		return true;
+	}
+
+	std::string base = token;
+	long offset = 0;
+	size_t sign = token.find_first_of("+-", 1);
+	if (sign != std::string::npos) {
+		base = token.substr(0, sign);
+		std::string off = token.substr(sign + 1);
+		if (!is_hex(off)) {
+			error(line, "bad offset in " + token);
+			return false;
+		}
+		offset = strtol(off.c_str(), NULL, 16);
+		if (token[sign] == '-')
+			offset = -offset;
+	}
+
+	long v;
+	if (is_hex(base)) {
+		v = strtol(base.c_str(), NULL, 16);
+	} else if (isalpha((unsigned char)base[0]) || base[0] == '_') {
+		auto it = m_symbols.find(base);
+		if (it == m_symbols.end()) {
+			error(line, "undefined name " + base);
+			return false;
+		}
+		v = it->second;
+	} else {
+		error(line, "bad operand " + token);
+		return false;
+	}
+
+	v += offset;
+	if (v < 0 || v > 0xffff) {
+		error(line, "value out of range: " + token);
+		return false;
+	}
+	res = v;
+	return true;
+}
+
+size_t
+Assembler::size(const Statement& stmt, uint32_t addr)
+{
+	switch (stmt.kind) {
+	case STMT_OP:     return 1 + stmt.operands.size();
+	case STMT_WORD:   return stmt.operands.size();
+	case STMT_STRING: return stmt.text.size();
+	case STMT_FILL: {
+		uint32_t n = 0;
+		value(stmt.operands[0], stmt.line, n);
+		return n;
+	}
+	case STMT_ORG: {
+		uint32_t to = addr;
+		value(stmt.operands[0], stmt.line, to);
+		if (to < addr) {
+			error(stmt.line, ".org goes backwards");
+			return 0;
+		}
+		return to - addr;
+	}
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Assembles source into words(). Returns false, with errors() filled in,
+ * on any error. name is only used in the messages.
+ */
+bool
+Assembler::assemble(const std::string& source, const char* name)
+{
+	m_name = name;
+	m_macros.clear();
+	m_expansions = 0;
+	m_symbols.clear();
+	m_words.clear();
+	m_errors.clear();
+
+	std::vector<Line> lines;
+	size_t start = 0;
+	for (size_t number = 1; start <= source.size(); number++) {
+		size_t end = source.find('\n', start);
+		if (end == std::string::npos)
+			end = source.size();
+		lines.push_back({number, source.substr(start, end - start)});
+		start = end + 1;
+	}
+
+	std::vector<Line> expanded;
+	if (!expand(lines, expanded, 0))
+		return false;
+
+	std::vector<Statement> stmts(expanded.size());
+	for (size_t i = 0; i < expanded.size(); i++) {
+		parse(expanded[i], stmts[i]);
+	}
+	if (!m_errors.empty())
+		return false;
+
+	// First pass: where everything goes
+	uint32_t addr = 0;
+	for (auto& stmt : stmts) {
+		for (auto& label : stmt.labels) {
+			if (is_hex(label) || !m_symbols.emplace(label, addr).second)
+				error(stmt.line, "bad or duplicate label " + label);
+		}
+		if (stmt.kind == STMT_EQU) {
+			uint32_t v = 0;
+			if (value(stmt.operands[1], stmt.line, v) &&
+					!m_symbols.emplace(stmt.operands[0], v).second)
+				error(stmt.line, "duplicate name " + stmt.operands[0]);
+		}
+		addr += size(stmt, addr);
+		if (addr > ASM_MAX_WORDS) {
+			error(stmt.line, "image larger than memory");
+			return false;
+		}
+	}
+	if (!m_errors.empty())
+		return false;
+
+	// Second pass: the words
+	for (auto& stmt : stmts) {
+		uint32_t v = 0;
+		switch (stmt.kind) {
+		case STMT_OP:
+			m_words.push_back(stmt.op);
+			for (auto& operand : stmt.operands) {
+				if (value(operand, stmt.line, v) && v > 0x8007)
+					error(stmt.line, "operand out of range: " + operand);
+				m_words.push_back(v);
+			}
+			break;
+		case STMT_WORD:
+			for (auto& operand : stmt.operands) {
+				value(operand, stmt.line, v);
+				m_words.push_back(v);
+			}
+			break;
+		case STMT_STRING:
+			for (char c : stmt.text) {
+				m_words.push_back((unsigned char)c);
+			}
+			break;
+		case STMT_FILL:
+		case STMT_ORG: {
+			size_t n = size(stmt, m_words.size());
+			if (stmt.kind == STMT_FILL)
+				value(stmt.operands[1], stmt.line, v);
+			m_words.insert(m_words.end(), n, v);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	return m_errors.empty();
+}
+
+bool
+Assembler::assembleFile(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		m_errors.assign(1, std::string(path) + ": " + strerror(errno));
+		return false;
+	}
+
+	std::string source;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		source.append(buffer, n);
+	}
+	fclose(f);
+	return assemble(source, path);
+}
+
+/*
+ * Writes the image in the format load_program() reads: little-endian
+ * 16-bit words
+ */
+bool
+Assembler::write(const char* path) const
+{
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	std::vector<uint8_t> bytes;
+	bytes.reserve(m_words.size() * 2);
+	for (uint16_t w : m_words) {
+		bytes.push_back(w & 0xff);
+		bytes.push_back(w >> 8);
+	}
+	bool ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+	ok &= fclose(f) == 0;
+	if (!ok)
+		perror(path);
+	return ok;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define ASM_MAX_WORDS (0x1 << 16)
+#define ASM_MAX_MACRO_DEPTH 16
+
+/*
+ * class Assembler: Builds an image from the mnemonics the disassembler
+ * prints, e.g.
+ *
+ *	loop:	ADD  R0 R0 7fff   ; comments run to the end of the line
+ *		JNZ  R0 loop
+ *
+ * Operands are registers R0..R7, numbers, 'c' characters, and labels or
+ * constants with an optional +N or -N. Numbers are hexadecimal, with or
+ * without 0x, as the disassembler prints them, so a name made only of hex
+ * digits is a number. A "0x1234:" address at the start of a line moves to
+ * that address and a line holding only a number is a data word, which
+ * lets disassembly listings assemble back.
+ *
+ * Directives:
+ *	.org ADDR            continue at ADDR, padding with zeros
+ *	.word V, ...         data words
+ *	.string "text"       one word per character
+ *	.fill N [V]          N words of V
+ *	.equ NAME V          constant
+ *	.macro NAME [P, ...] / .endm
+ *
+ * Macros are expanded as text, parameters replaced by the arguments of the
+ * call. An @ in a name inside a macro becomes a number unique to each
+ * expansion, for local labels.
+ */
+class Assembler {
+public:
+	Assembler();
+
+	bool assemble(const std::string& source, const char* name);
+	bool assembleFile(const char* path);
+	bool write(const char* path) const;
+
+	const std::vector<uint16_t>& words() const { return m_words; }
+	const std::vector<std::string>& errors() const { return m_errors; }
+	const std::map<std::string, uint16_t>& symbols() const {
+		return m_symbols;
+	}
+
+private:
+	struct Line {
+		size_t number;
+		std::string text;
+	};
+
+	struct Macro {
+		std::vector<std::string> params;
+		std::vector<Line> body;
+	};
+
+	enum Kind { STMT_NONE, STMT_OP, STMT_WORD, STMT_STRING, STMT_FILL,
+		STMT_ORG, STMT_EQU };
+
+	struct Statement {
+		size_t line;
+		std::vector<std::string> labels;
+		Kind kind = STMT_NONE;
+		uint16_t op = 0;
+		std::vector<std::string> operands;
+		std::string text;
+	};
+
+	bool expand(const std::vector<Line>& lines, std::vector<Line>& out,
+			size_t depth);
+	bool parse(const Line& line, Statement& stmt);
+	bool value(const std::string& token, size_t line, uint32_t& res);
+	size_t size(const Statement& stmt, uint32_t addr);
+	void error(size_t line, const std::string& msg);
+
+	std::string m_name;
+	std::map<std::string, Macro> m_macros;
+	size_t m_expansions;
+	std::map<std::string, uint16_t> m_symbols;
+	std::vector<uint16_t> m_words;
+	std::vector<std::string> m_errors;
+};
@@ -29,6 +29,7 @@ MachineController::Comms::Comms()
 	pipe(m_out_pipe);
 	pipe(m_err_pipe);
 
+	fcntl(m_in_pipe[1], F_SETFL, O_NONBLOCK);
 	fcntl(m_out_pipe[0], F_SETFL, O_NONBLOCK);
 	fcntl(m_err_pipe[0], F_SETFL, O_NONBLOCK);
 }
@@ -40,10 +41,12 @@ MachineController::MachineController(
 	m_machine(m_comms.m_in_pipe[0], m_comms.m_out_pipe[1],
 			m_comms.m_err_pipe[1]),
 	m_program_loaded(false),
+	m_recording(false),
+	m_feeder(m_comms.m_in_pipe[1]),
 	m_out(out),
 	m_err(err)
 {
-
+	m_machine.setShadow(&m_shadow, true);
 }
 
 MachineController::~MachineController()
@@ -67,6 +70,7 @@ MachineController::load_program(const char* filename)
 
 	if (m_machine.load_program(fd) > 0) {
 		m_program_loaded = true;
+		m_shadow.reset();
 	}
 
 	close(fd);
@@ -85,6 +89,13 @@ MachineController::run_program()
 		return false;
 
 	m_program_loaded = false;
+	m_recording = !m_session_path.empty();
+	if (m_recording) {
+		m_session.start(m_machine.state());
+		m_machine.setSession(&m_session);
+	}
+	m_snapshots.start(m_machine, SNAPSHOT_DEFAULT_HZ);
+	m_feeder.start(m_machine, 0);
 	m_thread = std::thread(&MachineController::behaviour, this);
 	m_comms_bridge = std::thread(&MachineController::redirect_comms, this);
 	m_state = state::RUNNING;
@@ -111,6 +122,10 @@ MachineController::stop_running()
 	return true;
 }
 
+/*
+ * Writes a line of input without waiting: fails if the machine is that far
+ * behind, rather than blocking the caller
+ */
 bool
 MachineController::send_input(const char* input, size_t nbytes)
 {
@@ -118,12 +133,119 @@ MachineController::send_input(const char* input, size_t nbytes)
 	return n > 0 && size_t(n) == nbytes;
 }
 
+/*
+ * Streams a script into the running machine, paced by its reads. Fails if
+ * the machine is not running or another script is still being fed.
+ */
+bool
+MachineController::feed_script(const std::string& text)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	if (m_state != state::RUNNING)
+		return false;
+	return m_feeder.feed(text);
+}
+
+bool
+MachineController::feed_script_file(const char* path)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	if (m_state != state::RUNNING)
+		return false;
+	return m_feeder.feedFile(path);
+}
+
+void
+MachineController::cancel_script()
+{
+	m_feeder.cancel();
+}
+
+/*
+ * Records the next run into a session file, saved when the machine stops.
+ * An empty path stops recording.
+ */
+bool
+MachineController::record_session(const char* path)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	if (m_state != state::NOT_RUNNING)
+		return false;
+
+	m_session_path = path ? path : "";
+	return true;
+}
+
+const Shadow&
+MachineController::shadow() const
+{
+	return m_shadow;
+}
+
+/*
+ * Counters of the machine, safe to read while it runs
+ */
+const Metrics&
+MachineController::metrics() const
+{
+	return m_machine.metrics();
+}
+
+/*
+ * State of the machine for viewers, copied out a few times a second while
+ * it runs and whenever it waits for input
+ */
+const SnapshotBuffer&
+MachineController::snapshots() const
+{
+	return m_snapshots;
+}
+
+/*
+ * Progress of the script being fed, safe to poll from the UI thread
+ */
+const InputFeeder&
+MachineController::feeder() const
+{
+	return m_feeder;
+}
+
+/*
+ * Serves the machine's metrics in the Prometheus text format on a Unix
+ * socket for as long as the controller lives
+ */
+bool
+MachineController::serve_metrics(const char* path)
+{
+	if (m_metrics_server.running())
+		return false;
+
+	m_metrics_server.add("gui", &m_machine.metrics());
+	return m_metrics_server.start(path);
+}
+
 void
 MachineController::behaviour()
 {
 	m_machine.run(nullptr);
+	m_feeder.cancel();
+	m_feeder.stop();
+	m_snapshots.stop();
+	m_snapshots.publish(m_machine.state(), false);
 
 	std::unique_lock<std::mutex> lock(m_mux);
+	if (m_recording) {
+		m_machine.setSession(nullptr);
+		m_session.finish(m_machine.state());
+		if (!m_session.save(m_session_path.c_str())) {
+			m_err(("Could not save session " + m_session_path +
+						"\n").c_str());
+		}
+		m_recording = false;
+	}
 	m_state = state::NOT_RUNNING;
 	m_cond.notify_all();
 }
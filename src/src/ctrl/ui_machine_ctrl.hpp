@@ -2,11 +2,17 @@
 #define UI_MACHINE_CTRL_HPP
 
 #include "machine.hpp"
+#include "shadow.hpp"
+#include "session.hpp"
+#include "metrics.hpp"
+#include "snapshot.hpp"
+#include "feeder.hpp"
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include <string>
 
 class MachineController {
 public:
@@ -31,6 +37,16 @@ public:
 	bool run_program();
 	bool stop_running();
 	bool send_input(const char* input, size_t nbytes);
+	bool feed_script(const std::string& text);
+	bool feed_script_file(const char* path);
+	void cancel_script();
+	bool record_session(const char* path);
+
+	const Shadow& shadow() const;
+	const Metrics& metrics() const;
+	const SnapshotBuffer& snapshots() const;
+	const InputFeeder& feeder() const;
+	bool serve_metrics(const char* path);
 
 private:
 	void behaviour();
@@ -40,7 +56,14 @@ private:
 
 	Comms m_comms;
 	Machine m_machine;
+	Shadow m_shadow;
 	bool m_program_loaded;
+	Session m_session;
+	std::string m_session_path;
+	bool m_recording;
+	MetricsServer m_metrics_server;
+	SnapshotBuffer m_snapshots;
+	InputFeeder m_feeder;
 
 	std::function<void(const char* output)> m_out;
 	std::function<void(const char* output)> m_err;
@@ -0,0 +1,606 @@
+#include "debug_proto.hpp"
+#include "opcodes.hpp"
+#include "data_structures/stack.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+static bool
+read_full(int fd, void* data, size_t size)
+{
+	uint8_t* p = static_cast<uint8_t*>(data);
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool
+debug_read_frame(int fd, DebugFrame& frame)
+{
+	DebugFrameHeader header;
+	if (!read_full(fd, &header, sizeof(header)) ||
+			header.length > DBG_MAX_PAYLOAD)
+		return false;
+
+	frame.type = header.type;
+	frame.seq = header.seq;
+	frame.payload.resize(header.length);
+	return read_full(fd, frame.payload.data(), header.length);
+}
+
+/*
+ * Writes header and payload in one go, so frames from one writer never
+ * interleave on a socket
+ */
+bool
+debug_write_frame(int fd, const DebugFrame& frame)
+{
+	DebugFrameHeader header = {uint32_t(frame.payload.size()), frame.type,
+		frame.seq};
+
+	struct iovec iov[2] = {
+		{&header, sizeof(header)},
+		{const_cast<uint8_t*>(frame.payload.data()),
+			frame.payload.size()},
+	};
+	size_t left = sizeof(header) + frame.payload.size();
+	int first = 0;
+	while (left > 0) {
+		ssize_t n = writev(fd, iov + first, 2 - first);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		left -= n;
+		while (first < 2 && size_t(n) >= iov[first].iov_len) {
+			n -= iov[first].iov_len;
+			first++;
+		}
+		if (first < 2) {
+			iov[first].iov_base = (uint8_t*)iov[first].iov_base + n;
+			iov[first].iov_len -= n;
+		}
+	}
+	return true;
+}
+
+DebugProtocol::DebugProtocol() :
+	m_breaks(),
+	m_break_count(0)
+{
+}
+
+void
+DebugProtocol::error(DebugFrame& resp, uint16_t code, const char* text)
+{
+	resp.type = DBG_ERROR;
+	resp.payload.clear();
+	resp.put(code);
+	resp.put(text, strlen(text));
+}
+
+/*
+ * Answers a request that reads the machine or manages breakpoints
+ */
+void
+DebugProtocol::handle(const Machine::State& s, const DebugFrame& req,
+		DebugFrame& resp)
+{
+	resp.type = DBG_OK;
+	resp.seq = req.seq;
+	resp.payload.clear();
+
+	size_t pos = 0;
+	uint16_t addr;
+
+	switch (req.type) {
+	case DBG_READ_REGS: {
+		DebugRegs regs;
+		memset(&regs, 0, sizeof(regs));
+		regs.ip = s.ip;
+		memcpy(regs.reg, s.reg.data(), sizeof(regs.reg));
+		regs.waiting = s.ram[s.ip] == IN &&
+			s.buffer_offset == s.buffer_sz;
+		regs.stack_depth = s.stack.size();
+		regs.ticks = s.ticks;
+		resp.type = DBG_REGS;
+		resp.put(regs);
+		break;
+	}
+
+	case DBG_READ_RAM: {
+		DebugRange range;
+		size_t total = 0;
+		resp.type = DBG_RAM;
+		while (req.get(pos, range)) {
+			if (range.addr > s.ram.size() ||
+					range.count > s.ram.size() - range.addr) {
+				error(resp, DBG_ERR_RANGE, "range out of memory");
+				return;
+			}
+			total += sizeof(range) + range.count * sizeof(uint16_t);
+			if (total > DBG_MAX_PAYLOAD) {
+				error(resp, DBG_ERR_TOO_BIG, "response too big");
+				return;
+			}
+			resp.put(range);
+			resp.put(s.ram.data() + range.addr,
+					range.count * sizeof(uint16_t));
+		}
+		if (pos != req.payload.size())
+			error(resp, DBG_ERR_MALFORMED, "partial range");
+		break;
+	}
+
+	case DBG_READ_STACK: {
+		auto& stack = stack_container(s.stack);
+		uint32_t max = stack.size();
+		req.get(pos, max);
+		uint32_t depth = stack.size();
+		resp.type = DBG_STACK;
+		resp.put(depth);
+		for (auto it = stack.rbegin(); it != stack.rend() && max--; ++it) {
+			resp.put(*it);
+		}
+		break;
+	}
+
+	case DBG_BREAK_SET:
+		while (req.get(pos, addr)) {
+			m_break_count += !isBreakpoint(addr);
+			m_breaks[addr / 64] |= uint64_t(1) << (addr % 64);
+		}
+		break;
+
+	case DBG_BREAK_CLEAR:
+		if (req.payload.empty()) {
+			m_breaks.fill(0);
+			m_break_count = 0;
+		}
+		while (req.get(pos, addr)) {
+			m_break_count -= isBreakpoint(addr);
+			m_breaks[addr / 64] &= ~(uint64_t(1) << (addr % 64));
+		}
+		break;
+
+	case DBG_BREAK_LIST:
+		resp.type = DBG_BREAKS;
+		for (size_t w = 0; w < m_breaks.size(); w++) {
+			uint64_t bits = m_breaks[w];
+			while (bits) {
+				addr = w * 64 + __builtin_ctzll(bits);
+				resp.put(addr);
+				bits &= bits - 1;
+			}
+		}
+		break;
+
+	default:
+		error(resp, DBG_ERR_UNKNOWN, "unknown request");
+		break;
+	}
+}
+
+/*
+ * Answers a request that changes the machine. Returns false if it is not
+ * one of those.
+ */
+bool
+DebugProtocol::apply(Machine& m, Machine::State& s, const DebugFrame& req,
+		DebugFrame& resp)
+{
+	resp.type = DBG_OK;
+	resp.seq = req.seq;
+	resp.payload.clear();
+
+	size_t pos = 0;
+	switch (req.type) {
+	case DBG_WRITE_RAM: {
+		uint32_t addr;
+		if (!req.get(pos, addr) || (req.payload.size() - pos) % 2) {
+			error(resp, DBG_ERR_MALFORMED, "expected address and words");
+			return true;
+		}
+		size_t count = (req.payload.size() - pos) / 2;
+		if (addr > s.ram.size() || count > s.ram.size() - addr) {
+			error(resp, DBG_ERR_RANGE, "range out of memory");
+			return true;
+		}
+		std::vector<uint16_t> words(count);
+		memcpy(words.data(), req.payload.data() + pos, count * 2);
+		m.write(addr, words.data(), count);
+		return true;
+	}
+
+	case DBG_WRITE_REG: {
+		uint16_t index;
+		uint16_t value;
+		if (!req.get(pos, index) || !req.get(pos, value) || index > 8) {
+			error(resp, DBG_ERR_MALFORMED, "expected register and value");
+			return true;
+		}
+		if (index == 8) {
+			s.ip = value;
+		} else {
+			s.reg[index] = value;
+		}
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+DebugServer::DebugServer(DebugProtocol& proto) :
+	m_proto(proto),
+	m_in(-1),
+	m_out(-1),
+	m_owned(false),
+	m_wake{-1, -1},
+	m_attached(false),
+	m_attach_pending(false),
+	m_steps(0),
+	m_closed(false),
+	m_interrupt(false)
+{
+}
+
+DebugServer::~DebugServer()
+{
+	this->detach();
+}
+
+/*
+ * Waits for one client on a Unix socket, then serves it
+ */
+bool
+DebugServer::listen(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return false;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+			::listen(fd, 1) != 0) {
+		perror(path);
+		close(fd);
+		return false;
+	}
+
+	printf("Waiting for a debugger client on %s\n", path);
+	int client;
+	do {
+		client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	} while (client < 0 && errno == EINTR);
+	close(fd);
+	unlink(path);
+
+	if (client < 0) {
+		perror("accept");
+		return false;
+	}
+	return this->attach(client, client, true);
+}
+
+/*
+ * Serves a client on the given descriptors, which may be the same socket
+ * or two pipes. Owned descriptors are closed on detach.
+ */
+bool
+DebugServer::attach(int in, int out, bool owned)
+{
+	if (m_attached || pipe(m_wake) != 0)
+		return false;
+
+	m_in = in;
+	m_out = out;
+	m_owned = owned;
+	m_closed = false;
+	m_queue.clear();
+	m_steps = 0;
+	m_attached = true;
+	m_attach_pending = true;
+	m_interrupt.store(true);
+	m_reader = std::thread(&DebugServer::readerLoop, this);
+	return true;
+}
+
+void
+DebugServer::detach()
+{
+	if (!m_attached)
+		return;
+
+	char c = 0;
+	if (write(m_wake[1], &c, 1) != 1)
+		perror("write");
+	m_reader.join();
+
+	close(m_wake[0]);
+	close(m_wake[1]);
+	m_wake[0] = m_wake[1] = -1;
+	if (m_owned) {
+		close(m_in);
+		if (m_out != m_in)
+			close(m_out);
+	}
+	m_in = m_out = -1;
+	m_attached = false;
+	m_interrupt.store(false);
+}
+
+/*
+ * Queues the client's frames for the machine's thread. A stop request also
+ * raises the interrupt flag the running machine polls. When the client
+ * goes away the machine is interrupted too, so it can detach.
+ */
+void
+DebugServer::readerLoop()
+{
+	struct pollfd fds[2] = {
+		{m_in, POLLIN, 0},
+		{m_wake[0], POLLIN, 0},
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		DebugFrame frame;
+		if (!debug_read_frame(m_in, frame))
+			break;
+
+		std::lock_guard<std::mutex> lock(m_mux);
+		if (frame.type == DBG_STOP)
+			m_interrupt.store(true);
+		m_queue.push_back(std::move(frame));
+		m_cond.notify_all();
+	}
+
+	std::lock_guard<std::mutex> lock(m_mux);
+	m_closed = true;
+	m_interrupt.store(true);
+	m_cond.notify_all();
+}
+
+void
+DebugServer::send(const DebugFrame& frame)
+{
+	if (!debug_write_frame(m_out, frame)) {
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_closed = true;
+	}
+}
+
+void
+DebugServer::beforeOp(Machine& m)
+{
+	if (!m_attached)
+		return;
+
+	bool stepped = m_steps && --m_steps == 0;
+	if (m_interrupt.load(std::memory_order_relaxed)) {
+		m_interrupt.store(false);
+		this->serve(m, m_attach_pending ? DBG_STOP_ATTACH :
+				DBG_STOP_INTERRUPT);
+		m_attach_pending = false;
+	} else if (stepped) {
+		this->serve(m, DBG_STOP_STEP);
+	} else if (m_proto.isBreakpoint(getIP(m))) {
+		this->serve(m, DBG_STOP_BREAK);
+	}
+}
+
+/*
+ * The machine is about to halt, or to block on input. Halting is reported
+ * and ends the run; blocking on input is just another instruction.
+ */
+bool
+DebugServer::beforeHalted(Machine& m)
+{
+	const Machine::State& s = getState(m);
+	if (s.ram[s.ip] != HALT) {
+		this->beforeOp(m);
+		return true;
+	}
+
+	if (m_attached)
+		this->serve(m, DBG_STOP_HALT);
+	return false;
+}
+
+/*
+ * Reports the stop, then answers requests until one resumes the machine
+ */
+void
+DebugServer::serve(Machine& m, uint8_t reason)
+{
+	Machine::State& s = getState(m);
+
+	DebugStop stop;
+	memset(&stop, 0, sizeof(stop));
+	stop.reason = reason;
+	stop.ip = s.ip;
+	stop.ticks = s.ticks;
+
+	DebugFrame event;
+	event.type = DBG_STOPPED;
+	event.put(stop);
+	this->send(event);
+
+	for (;;) {
+		DebugFrame req;
+		{
+			std::unique_lock<std::mutex> lock(m_mux);
+			m_cond.wait(lock, [this] {
+				return !m_queue.empty() || m_closed;
+			});
+			if (m_queue.empty()) {
+				lock.unlock();
+				this->detach();
+				return;
+			}
+			req = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		DebugFrame resp;
+		resp.type = DBG_OK;
+		resp.seq = req.seq;
+		size_t pos = 0;
+
+		switch (req.type) {
+		case DBG_STEP: {
+			uint32_t count = 1;
+			req.get(pos, count);
+			m_steps = count ? count : 1;
+			this->send(resp);
+			return;
+		}
+
+		case DBG_CONTINUE:
+			m_steps = 0;
+			this->send(resp);
+			return;
+
+		case DBG_STOP:
+			m_interrupt.store(false);
+			this->send(resp);
+			break;
+
+		case DBG_DETACH:
+			this->send(resp);
+			this->detach();
+			return;
+
+		default:
+			if (!m_proto.apply(m, s, req, resp))
+				m_proto.handle(s, req, resp);
+			this->send(resp);
+			break;
+		}
+	}
+}
+
+DebugClient::DebugClient() :
+	m_fd(-1),
+	m_seq(0)
+{
+}
+
+DebugClient::~DebugClient()
+{
+	this->close();
+}
+
+bool
+DebugClient::connect(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		::close(fd);
+		return false;
+	}
+	m_fd = fd;
+	return true;
+}
+
+void
+DebugClient::close()
+{
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+}
+
+/*
+ * Keeps stop events aside. Returns true if the frame was one.
+ */
+bool
+DebugClient::dispatch(DebugFrame& frame)
+{
+	if (frame.type != DBG_STOPPED)
+		return false;
+
+	DebugStop stop;
+	size_t pos = 0;
+	if (frame.get(pos, stop))
+		m_stops.push_back(stop);
+	return true;
+}
+
+bool
+DebugClient::request(DebugFrame& req, DebugFrame& resp)
+{
+	m_seq = m_seq == UINT16_MAX ? 1 : m_seq + 1;
+	req.seq = m_seq;
+	if (!debug_write_frame(m_fd, req))
+		return false;
+
+	for (;;) {
+		if (!debug_read_frame(m_fd, resp))
+			return false;
+		if (!dispatch(resp) && resp.seq == req.seq)
+			return true;
+	}
+}
+
+bool
+DebugClient::request(uint16_t type, DebugFrame& resp)
+{
+	DebugFrame req;
+	req.type = type;
+	return this->request(req, resp);
+}
+
+bool
+DebugClient::waitStop(DebugStop& stop)
+{
+	while (m_stops.empty()) {
+		DebugFrame frame;
+		if (!debug_read_frame(m_fd, frame))
+			return false;
+		dispatch(frame);
+	}
+	stop = m_stops.front();
+	m_stops.pop_front();
+	return true;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define DBG_MAX_PAYLOAD (4 << 20)
+
+/*
+ * Debugger wire protocol. Every frame is a DebugFrameHeader followed by
+ * length bytes of payload, in host byte order. A response carries the seq
+ * of its request; events carry seq 0.
+ *
+ * Requests other than DBG_STOP are only served while the machine is
+ * stopped, so while it runs they wait. DBG_STOP interrupts it; its DBG_OK
+ * comes after the DBG_STOPPED event it causes.
+ */
+enum DebugMsg : uint16_t {
+	// Requests
+	DBG_READ_REGS = 1,   // -> DBG_REGS
+	DBG_READ_RAM,        // DebugRange[] -> DBG_RAM
+	DBG_WRITE_RAM,       // u32 addr, u16 words[] -> DBG_OK
+	DBG_WRITE_REG,       // u16 index (8 is ip), u16 value -> DBG_OK
+	DBG_READ_STACK,      // [u32 max words] -> DBG_STACK
+	DBG_BREAK_SET,       // u16 addr[] -> DBG_OK
+	DBG_BREAK_CLEAR,     // u16 addr[], or nothing for all -> DBG_OK
+	DBG_BREAK_LIST,      // -> DBG_BREAKS
+	DBG_STEP,            // [u32 count] -> DBG_OK, then DBG_STOPPED
+	DBG_CONTINUE,        // -> DBG_OK, then DBG_STOPPED
+	DBG_STOP,            // -> DBG_STOPPED, then DBG_OK
+	DBG_DETACH,          // -> DBG_OK
+
+	// Responses
+	DBG_OK = 0x100,
+	DBG_ERROR,           // u16 code, text
+	DBG_REGS,            // DebugRegs
+	DBG_RAM,             // {DebugRange, u16 words[count]}[]
+	DBG_STACK,           // u32 depth, u16 words[] from the top down
+	DBG_BREAKS,          // u16 addr[]
+
+	// Events
+	DBG_STOPPED = 0x200, // DebugStop
+};
+
+enum DebugError : uint16_t {
+	DBG_ERR_UNKNOWN = 1,
+	DBG_ERR_MALFORMED,
+	DBG_ERR_RANGE,
+	DBG_ERR_TOO_BIG,
+};
+
+enum DebugStopReason : uint8_t {
+	DBG_STOP_ATTACH = 1,
+	DBG_STOP_STEP,
+	DBG_STOP_BREAK,
+	DBG_STOP_INTERRUPT,
+	DBG_STOP_HALT,
+};
+
+struct DebugFrameHeader {
+	uint32_t length;
+	uint16_t type;
+	uint16_t seq;
+};
+
+struct DebugRange {
+	uint32_t addr;
+	uint32_t count;
+};
+
+struct DebugRegs {
+	uint16_t ip;
+	uint16_t reg[8];
+	uint16_t waiting;
+	uint32_t stack_depth;
+	uint64_t ticks;
+};
+
+struct DebugStop {
+	uint8_t reason;
+	uint8_t pad;
+	uint16_t ip;
+	uint32_t pad2;
+	uint64_t ticks;
+};
+
+static_assert(sizeof(DebugFrameHeader) == 8, "packed wire header");
+static_assert(sizeof(DebugRegs) == 32, "packed wire registers");
+static_assert(sizeof(DebugStop) == 16, "packed wire event");
+
+struct DebugFrame {
+	uint16_t type = 0;
+	uint16_t seq = 0;
+	std::vector<uint8_t> payload;
+
+	void put(const void* data, size_t size) {
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		payload.insert(payload.end(), p, p + size);
+	}
+
+	template <typename T>
+	void put(const T& value) {
+		put(&value, sizeof(T));
+	}
+
+	template <typename T>
+	bool get(size_t& pos, T& value) const {
+		if (pos + sizeof(T) > payload.size())
+			return false;
+		memcpy(&value, payload.data() + pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+};
+
+bool debug_read_frame(int fd, DebugFrame& frame);
+bool debug_write_frame(int fd, const DebugFrame& frame);
+
+/*
+ * class DebugProtocol: Answers the requests that inspect the machine or
+ * manage breakpoints. Knows nothing of transports or run control, so the
+ * text shell uses it in-process and DebugServer over a socket.
+ */
+class DebugProtocol {
+public:
+	DebugProtocol();
+
+	void handle(const Machine::State& s, const DebugFrame& req,
+			DebugFrame& resp);
+	bool apply(Machine& m, Machine::State& s, const DebugFrame& req,
+			DebugFrame& resp);
+
+	bool isBreakpoint(uint16_t ip) const {
+		return m_breaks[ip / 64] >> (ip % 64) & 1;
+	}
+
+	bool hasBreakpoints() const { return m_break_count != 0; }
+
+	static void error(DebugFrame& resp, uint16_t code, const char* text);
+
+private:
+	std::array<uint64_t, (0x1 << 16) / 64> m_breaks;
+	size_t m_break_count;
+};
+
+/*
+ * class DebugServer: Drives a machine from a remote client. Attach it as
+ * the machine's debugger; it stops at the next instruction and then at
+ * breakpoints, after steps and when the client asks. While stopped it
+ * serves requests on the machine's thread. A reader thread takes frames
+ * off the connection, so a stop request reaches a running machine.
+ */
+class DebugServer : public Machine::Debugger {
+public:
+	DebugServer(DebugProtocol& proto);
+	~DebugServer();
+
+	bool listen(const char* path);
+	bool attach(int in, int out, bool owned);
+	bool attached() const { return m_attached; }
+
+	void beforeOp(Machine& m) override;
+	bool beforeHalted(Machine& m) override;
+
+private:
+	void serve(Machine& m, uint8_t reason);
+	void send(const DebugFrame& frame);
+	void detach();
+	void readerLoop();
+
+	DebugProtocol& m_proto;
+
+	int m_in;
+	int m_out;
+	bool m_owned;
+	int m_wake[2];
+	bool m_attached;
+	bool m_attach_pending;
+	uint32_t m_steps;
+
+	std::thread m_reader;
+	std::mutex m_mux;
+	std::condition_variable m_cond;
+	std::deque<DebugFrame> m_queue;
+	bool m_closed;
+	std::atomic<bool> m_interrupt;
+};
+
+/*
+ * class DebugClient: The other end of a DebugServer socket. Requests wait
+ * for their response; stop events that arrive meanwhile are kept for
+ * waitStop().
+ */
+class DebugClient {
+public:
+	DebugClient();
+	~DebugClient();
+
+	bool connect(const char* path);
+	void close();
+
+	bool request(DebugFrame& req, DebugFrame& resp);
+	bool request(uint16_t type, DebugFrame& resp);
+	bool waitStop(DebugStop& stop);
+
+private:
+	bool dispatch(DebugFrame& frame);
+
+	int m_fd;
+	uint16_t m_seq;
+	std::deque<DebugStop> m_stops;
+};
@@ -0,0 +1,211 @@
+#include "diff.hpp"
+#include "data_structures/stack.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+DiffSet::DiffSet(size_t words) :
+	m_bits((words + 63) / 64, 0),
+	m_size(words)
+{
+}
+
+/*
+ * Marks every word that differs between a and b. Each 64-bit word of the
+ * set takes four rounds of two 8-word compares, packed down to one byte per
+ * word so a single movemask yields 16 results.
+ */
+void
+DiffSet::compare(const uint16_t* a, const uint16_t* b, size_t words)
+{
+	m_bits.assign((words + 63) / 64, 0);
+	m_size = words;
+
+	size_t pos = 0;
+#ifdef __SSE2__
+	for (; pos + 64 <= words; pos += 64) {
+		uint64_t bits = 0;
+		for (size_t i = 0; i < 64; i += 16) {
+			const __m128i* pa = (const __m128i*)(a + pos + i);
+			const __m128i* pb = (const __m128i*)(b + pos + i);
+			__m128i lo = _mm_cmpeq_epi16(_mm_loadu_si128(pa),
+					_mm_loadu_si128(pb));
+			__m128i hi = _mm_cmpeq_epi16(_mm_loadu_si128(pa + 1),
+					_mm_loadu_si128(pb + 1));
+			uint32_t equal = _mm_movemask_epi8(
+					_mm_packs_epi16(lo, hi));
+			bits |= uint64_t(~equal & 0xffff) << i;
+		}
+		m_bits[pos / 64] = bits;
+	}
+#endif
+	for (; pos < words; pos++) {
+		if (a[pos] != b[pos])
+			m_bits[pos / 64] |= uint64_t(1) << (pos % 64);
+	}
+}
+
+void
+DiffSet::intersect(const DiffSet& other)
+{
+	for (size_t i = 0; i < m_bits.size(); i++) {
+		m_bits[i] &= i < other.m_bits.size() ? other.m_bits[i] : 0;
+	}
+}
+
+void
+DiffSet::unite(const DiffSet& other)
+{
+	if (other.m_size > m_size) {
+		m_bits.resize(other.m_bits.size(), 0);
+		m_size = other.m_size;
+	}
+	for (size_t i = 0; i < other.m_bits.size(); i++) {
+		m_bits[i] |= other.m_bits[i];
+	}
+}
+
+/*
+ * Marks the words in [from, to) as changed, growing the set if needed
+ */
+void
+DiffSet::mark(size_t from, size_t to)
+{
+	if (to > m_size) {
+		m_bits.resize((to + 63) / 64, 0);
+		m_size = to;
+	}
+	for (size_t pos = from; pos < to; pos++) {
+		m_bits[pos / 64] |= uint64_t(1) << (pos % 64);
+	}
+}
+
+size_t
+DiffSet::count() const
+{
+	size_t total = 0;
+	for (uint64_t bits : m_bits) {
+		total += __builtin_popcountll(bits);
+	}
+	return total;
+}
+
+/*
+ * Run-length encodes the changed words in [from, to)
+ */
+std::vector<DiffSpan>
+DiffSet::spans(size_t from, size_t to) const
+{
+	std::vector<DiffSpan> res;
+	to = to < m_size ? to : m_size;
+	if (from >= to)
+		return res;
+
+	for (size_t w = from / 64; w * 64 < to; w++) {
+		uint64_t bits = m_bits[w];
+		if (w == from / 64)
+			bits &= ~uint64_t(0) << (from % 64);
+		if ((w + 1) * 64 > to && to % 64)
+			bits &= ~(~uint64_t(0) << (to % 64));
+
+		while (bits) {
+			uint32_t start = __builtin_ctzll(bits);
+			uint64_t rest = ~(bits >> start);
+			uint32_t length = rest ? __builtin_ctzll(rest) : 64 - start;
+			uint32_t pos = w * 64 + start;
+
+			if (!res.empty() &&
+					res.back().start + res.back().length == pos) {
+				res.back().length += length;
+			} else {
+				res.push_back({pos, length});
+			}
+
+			if (start + length == 64)
+				break;
+			bits &= ~uint64_t(0) << (start + length);
+		}
+	}
+	return res;
+}
+
+DiffSet
+diff_memory(const uint16_t* a, const uint16_t* b, size_t words)
+{
+	DiffSet res;
+	res.compare(a, b, words);
+	return res;
+}
+
+/*
+ * Diffs each snapshot against the next one. Returns the words that changed
+ * in every step, or in any step.
+ */
+DiffSet
+diff_series(const std::vector<const uint16_t*>& images, size_t words,
+		bool every)
+{
+	DiffSet res(words);
+	if (images.size() < 2)
+		return res;
+
+	DiffSet step;
+	res.compare(images[0], images[1], words);
+	for (size_t i = 2; i < images.size(); i++) {
+		step.compare(images[i - 1], images[i], words);
+		if (every) {
+			res.intersect(step);
+		} else {
+			res.unite(step);
+		}
+	}
+	return res;
+}
+
+/*
+ * Compares two stacks from the bottom up, so the frames they share line up.
+ * Positions only one of them has count as changed. The deques are walked
+ * in place: they are not contiguous, and stacks are too short for SSE2 to
+ * pay for a copy.
+ */
+DiffSet
+diff_stacks(const std::stack<uint16_t>& a, const std::stack<uint16_t>& b)
+{
+	auto& ca = stack_container(a);
+	auto& cb = stack_container(b);
+	size_t common = ca.size() < cb.size() ? ca.size() : cb.size();
+
+	DiffSet res(ca.size() > cb.size() ? ca.size() : cb.size());
+	auto ia = ca.begin();
+	auto ib = cb.begin();
+	for (size_t pos = 0; pos < common; pos++, ++ia, ++ib) {
+		if (*ia != *ib)
+			res.mark(pos, pos + 1);
+	}
+	res.mark(common, res.size());
+	return res;
+}
+
+void
+print_spans(FILE* out, const std::vector<DiffSpan>& spans, size_t max)
+{
+	size_t words = 0;
+	for (size_t i = 0; i < spans.size(); i++) {
+		words += spans[i].length;
+		if (i >= max)
+			continue;
+		if (spans[i].length == 1) {
+			fprintf(out, "  %04x\n", spans[i].start);
+		} else {
+			fprintf(out, "  %04x-%04x (%u words)\n", spans[i].start,
+					spans[i].start + spans[i].length - 1,
+					spans[i].length);
+		}
+	}
+	if (spans.size() > max)
+		fprintf(out, "  ... %lu more spans\n", spans.size() - max);
+	fprintf(out, "%lu words changed in %lu spans\n", words, spans.size());
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <stack>
+#include <vector>
+
+/*
+ * struct DiffSpan: A run of consecutive changed words
+ */
+struct DiffSpan {
+	uint32_t start;
+	uint32_t length;
+};
+
+/*
+ * class DiffSet: One bit per word of a snapshot, set where it changed.
+ * Comparisons run 16 words at a time with SSE2 when available; spans are
+ * extracted a 64-bit word at a time, so unchanged regions cost almost
+ * nothing.
+ */
+class DiffSet {
+public:
+	DiffSet(size_t words = 0);
+
+	void compare(const uint16_t* a, const uint16_t* b, size_t words);
+	void intersect(const DiffSet& other);
+	void unite(const DiffSet& other);
+	void mark(size_t from, size_t to);
+
+	size_t size() const { return m_size; }
+	bool test(size_t pos) const {
+		return pos < m_size && (m_bits[pos / 64] >> (pos % 64) & 1);
+	}
+	size_t count() const;
+	std::vector<DiffSpan> spans(size_t from = 0,
+			size_t to = SIZE_MAX) const;
+
+private:
+	std::vector<uint64_t> m_bits;
+	size_t m_size;
+};
+
+DiffSet diff_memory(const uint16_t* a, const uint16_t* b, size_t words);
+DiffSet diff_series(const std::vector<const uint16_t*>& images, size_t words,
+		bool every);
+DiffSet diff_stacks(const std::stack<uint16_t>& a,
+		const std::stack<uint16_t>& b);
+
+void print_spans(FILE* out, const std::vector<DiffSpan>& spans, size_t max);
@@ -0,0 +1,597 @@
+#include "explorer.hpp"
+#include "common.hpp"
+#include "hle.hpp"
+#include "data_structures/stack.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+
+
+/*
+ * struct Snapshot: A state reached during the search, stored as the pages
+ * of memory that differ from the root state plus the rest of the machine
+ */
+struct Explorer::Snapshot {
+	std::vector<uint16_t> pages;
+	std::vector<uint16_t> words;
+	std::array<uint16_t, 8> reg;
+	std::vector<uint16_t> stack;
+	uint16_t ip;
+	size_t ticks;
+	uint64_t ram_hash;
+};
+
+struct Explorer::Worker {
+	Worker() : machine(-1, -1, -1) {}
+
+	Machine machine;
+	Hle hle;
+	std::string output;
+};
+
+struct Explorer::Task {
+	uint32_t node;
+	std::string command;
+};
+
+struct Explorer::Result {
+	uint64_t hash;
+	Outcome outcome;
+	size_t ticks;
+	std::string label;
+	std::unique_ptr<Snapshot> snapshot;
+	std::vector<std::string> derived;
+	size_t runs;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Room title in the game output ("== Foothills =="), or an empty string
+ */
+static std::string find_title(const std::string& text)
+{
+	std::string title;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		if (end == std::string::npos)
+			end = text.size();
+
+		if (end - pos > 6 && text.compare(pos, 3, "== ") == 0 &&
+				text.compare(end - 3, 3, " ==") == 0) {
+			title = text.substr(pos + 3, end - pos - 6);
+		}
+		pos = end + 1;
+	}
+	return title;
+}
+
+/*
+ * Turns the "- item" lists printed by the game into commands: exits are
+ * walked through, things of interest taken and inventory items used
+ */
+static void derive_commands(const std::string& text,
+		std::vector<std::string>& res)
+{
+	const char* verb = nullptr;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string line = text.substr(pos, end - pos);
+		pos = end + 1;
+
+		if (!line.empty() && line.back() == ':') {
+			if (line.find("exit") != std::string::npos) {
+				verb = "";
+			} else if (line.find("interest") != std::string::npos) {
+				verb = "take ";
+			} else if (line.find("inventory") != std::string::npos) {
+				verb = "use ";
+			} else {
+				verb = nullptr;
+			}
+		} else if (verb && line.compare(0, 2, "- ") == 0) {
+			std::string cmd = verb + line.substr(2);
+			if (std::find(res.begin(), res.end(), cmd) == res.end())
+				res.push_back(cmd);
+		} else {
+			verb = nullptr;
+		}
+	}
+}
+
+Explorer::Explorer(const Machine::State& root) :
+	m_root(root),
+	m_probes({"look", "inv"}),
+	m_derive(true),
+	m_threads(std::max(1u, std::thread::hardware_concurrency())),
+	m_max_depth(EXPLORE_DEFAULT_DEPTH),
+	m_max_states(EXPLORE_DEFAULT_STATES),
+	m_tick_limit(EXPLORE_TICK_LIMIT),
+	m_hle(true),
+	m_runs(0),
+	m_ticks(0),
+	m_depth(0),
+	m_truncated(false),
+	m_elapsed(0)
+{
+	m_root.buffer_sz = 0;
+	m_root.buffer_offset = 0;
+	// Workers map the root memory and only copy the pages they write
+	m_root.ram.makeShared();
+}
+
+Explorer::~Explorer() {}
+
+void
+Explorer::setVocabulary(const std::vector<std::string>& words)
+{
+	m_vocabulary = words;
+}
+
+/*
+ * Reads one command per line. Empty lines and lines starting with '#' are
+ * skipped.
+ */
+bool
+Explorer::loadVocabulary(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	std::vector<std::string> words;
+	char line[MAX_INPUT_SIZE];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '\0' && line[0] != '#')
+			words.push_back(line);
+	}
+	fclose(f);
+
+	m_vocabulary = words;
+	return true;
+}
+
+void
+Explorer::setDerive(bool active)
+{
+	m_derive = active;
+}
+
+void
+Explorer::setThreads(size_t threads)
+{
+	m_threads = MAX(threads, 1);
+}
+
+void
+Explorer::setMaxDepth(size_t depth)
+{
+	m_max_depth = depth;
+}
+
+void
+Explorer::setMaxStates(size_t states)
+{
+	m_max_states = MAX(states, 1);
+}
+
+void
+Explorer::setTickLimit(size_t ticks)
+{
+	m_tick_limit = ticks;
+}
+
+void
+Explorer::setHle(bool active)
+{
+	m_hle = active;
+}
+
+std::unique_ptr<Explorer::Worker>
+Explorer::makeWorker() const
+{
+	std::unique_ptr<Worker> w(new Worker());
+	w->machine.m_state = m_root;
+	w->machine.trackRamHash(true);
+	w->machine.trackDirty(true);
+	w->machine.setOutput(&w->output);
+	if (m_hle) {
+		w->hle.addChallengeRoutines();
+		w->machine.setHle(&w->hle);
+	}
+	return w;
+}
+
+/*
+ * Puts a snapshot on the worker's machine. Only the pages the last run
+ * wrote, or the last restore copied in, go back to the root first; the
+ * snapshot's pages are then marked dirty so the next restore undoes them
+ * too.
+ */
+void
+Explorer::restore(Worker& w, const Snapshot& snap) const
+{
+	Machine& m = w.machine;
+	Machine::State& s = m.m_state;
+
+	// The hash comes from the snapshot, no need to follow the rollback
+	m.m_track_hash = false;
+	m.rollback(m_root);
+	m.m_track_hash = true;
+
+	for (size_t i = 0; i < snap.pages.size(); i++) {
+		size_t page = snap.pages[i];
+		memcpy(&s.ram[page * EXPLORE_PAGE_WORDS],
+				&snap.words[i * EXPLORE_PAGE_WORDS],
+				EXPLORE_PAGE_WORDS * sizeof(uint16_t));
+		m.m_dirty[page / 64] |= uint64_t(1) << (page % 64);
+	}
+	s.reg = snap.reg;
+	s.stack = std::stack<uint16_t>(std::deque<uint16_t>(
+				snap.stack.begin(), snap.stack.end()));
+	s.ip = snap.ip;
+	s.ticks = snap.ticks;
+	s.buffer_sz = 0;
+	s.buffer_offset = 0;
+	m.m_ram_hash = snap.ram_hash;
+}
+
+/*
+ * Only dirty pages can differ from the root. Those written back to the
+ * root's contents are left out.
+ */
+std::unique_ptr<Explorer::Snapshot>
+Explorer::capture(const Worker& w) const
+{
+	const Machine& m = w.machine;
+	const Machine::State& s = m.m_state;
+
+	std::unique_ptr<Snapshot> snap(new Snapshot());
+	for (size_t i = 0; i < m.m_dirty.size(); i++) {
+		uint64_t bits = m.m_dirty[i];
+		while (bits) {
+			size_t page = i * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			size_t offset = page * EXPLORE_PAGE_WORDS;
+			if (memcmp(&s.ram[offset], &m_root.ram[offset],
+					EXPLORE_PAGE_WORDS * sizeof(uint16_t)) == 0)
+				continue;
+			snap->pages.push_back(page);
+			snap->words.insert(snap->words.end(), &s.ram[offset],
+					&s.ram[offset] + EXPLORE_PAGE_WORDS);
+		}
+	}
+
+	const auto& stack = stack_container(s.stack);
+	snap->reg = s.reg;
+	snap->stack.assign(stack.begin(), stack.end());
+	snap->ip = s.ip;
+	snap->ticks = s.ticks;
+	snap->ram_hash = w.machine.m_ram_hash;
+	return snap;
+}
+
+/*
+ * Runs the probe commands on a copy of a state and collects the commands
+ * their output suggests. Returns the first room title they print.
+ */
+std::string
+Explorer::probe(Worker& w, const Snapshot& snap,
+		std::vector<std::string>& derived) const
+{
+	std::string title;
+	for (const std::string& cmd : m_probes) {
+		restore(w, snap);
+		w.output.clear();
+		w.machine.feed((cmd + "\n").c_str());
+		if (!w.machine.runUntilInput(m_tick_limit))
+			continue;
+
+		derive_commands(w.output, derived);
+		if (title.empty())
+			title = find_title(w.output);
+	}
+	return title;
+}
+
+void
+Explorer::execute(Worker& w, const Task& task, Result& res) const
+{
+	restore(w, *m_snapshots[task.node]);
+	w.output.clear();
+	res.runs = 1;
+
+	if (!w.machine.feed((task.command + "\n").c_str())) {
+		res.outcome = TIMEOUT;
+		res.ticks = 0;
+		return;
+	}
+
+	size_t start = w.machine.m_state.ticks;
+	bool blocked = w.machine.runUntilInput(m_tick_limit);
+	res.ticks = w.machine.m_state.ticks - start;
+
+	if (!blocked && res.ticks >= m_tick_limit) {
+		res.outcome = TIMEOUT;
+		return;
+	}
+
+	res.hash = w.machine.stateHash();
+	res.outcome = blocked ? NEW_STATE : HALTED;
+
+	// States from earlier levels are not written while a level runs
+	if (m_seen.count(res.hash)) {
+		res.outcome = SEEN_STATE;
+		return;
+	}
+
+	res.label = find_title(w.output);
+	if (blocked) {
+		res.snapshot = capture(w);
+		if (m_derive) {
+			std::string title = probe(w, *res.snapshot,
+					res.derived);
+			res.runs += m_probes.size();
+			if (res.label.empty())
+				res.label = title;
+		}
+	}
+}
+
+/*
+ * Explores level by level until max depth or max states are reached. Returns
+ * false if the root state is not waiting for input.
+ */
+bool
+Explorer::run()
+{
+	double start = now();
+
+	m_nodes.clear();
+	m_edges.clear();
+	m_snapshots.clear();
+	m_seen.clear();
+	m_runs = 0;
+	m_ticks = 0;
+	m_depth = 0;
+	m_truncated = false;
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	workers.push_back(makeWorker());
+	Worker& first = *workers.front();
+	if (!first.machine.waitingInput())
+		return false;
+
+	Node root = {first.machine.stateHash(), EXPLORE_NONE, 0, "", "",
+		false, {}};
+	m_snapshots.push_back(capture(first));
+	if (m_derive) {
+		root.label = probe(first, *m_snapshots.front(), root.derived);
+		m_runs += m_probes.size();
+	}
+	m_nodes.push_back(root);
+	m_seen[root.hash] = 0;
+
+	while (workers.size() < m_threads) {
+		workers.push_back(makeWorker());
+	}
+
+	std::vector<uint32_t> frontier = {0};
+	while (!frontier.empty() && m_depth < m_max_depth) {
+		std::vector<Task> tasks;
+		for (uint32_t node : frontier) {
+			for (const std::string& cmd : m_vocabulary) {
+				tasks.push_back({node, cmd});
+			}
+			for (const std::string& cmd : m_nodes[node].derived) {
+				if (std::find(m_vocabulary.begin(),
+						m_vocabulary.end(), cmd) ==
+						m_vocabulary.end())
+					tasks.push_back({node, cmd});
+			}
+		}
+
+		std::vector<Result> results(tasks.size());
+		std::atomic<size_t> next{0};
+		std::vector<std::thread> threads;
+		for (auto& worker : workers) {
+			Worker* w = worker.get();
+			threads.push_back(std::thread([&, w]() {
+				size_t i;
+				while ((i = next.fetch_add(1)) < tasks.size()) {
+					execute(*w, tasks[i], results[i]);
+				}
+			}));
+		}
+		for (std::thread& t : threads) {
+			t.join();
+		}
+
+		// Merging in task order keeps ids and parents deterministic
+		std::vector<uint32_t> next_frontier;
+		for (size_t i = 0; i < tasks.size(); i++) {
+			Result& r = results[i];
+			Edge e = {tasks[i].node, EXPLORE_NONE, tasks[i].command,
+				r.ticks, r.outcome};
+			m_runs += r.runs;
+			m_ticks += r.ticks;
+
+			if (r.outcome != TIMEOUT) {
+				auto it = m_seen.find(r.hash);
+				if (it != m_seen.end()) {
+					e.to = it->second;
+					e.outcome = SEEN_STATE;
+				} else if (m_nodes.size() >= m_max_states) {
+					e.outcome = DROPPED;
+					m_truncated = true;
+				} else {
+					const Node& parent = m_nodes[e.from];
+					Node n = {r.hash, e.from, parent.depth + 1,
+						e.command, r.label.empty() ?
+						parent.label : r.label,
+						r.outcome == HALTED,
+						std::move(r.derived)};
+					e.to = m_nodes.size();
+					m_seen[n.hash] = e.to;
+					m_nodes.push_back(std::move(n));
+					m_snapshots.push_back(std::move(r.snapshot));
+					if (!m_nodes.back().halted)
+						next_frontier.push_back(e.to);
+				}
+			}
+			m_edges.push_back(e);
+		}
+
+		for (uint32_t node : frontier) {
+			m_snapshots[node].reset();
+			m_nodes[node].derived.clear();
+		}
+		frontier.swap(next_frontier);
+		m_depth++;
+	}
+
+	m_memory = m_root.ram.usage();
+	for (auto& w : workers) {
+		m_memory += w->machine.state().ram.usage();
+	}
+	m_elapsed = now() - start;
+	return true;
+}
+
+/*
+ * Commands that lead from the root to a node
+ */
+std::vector<std::string>
+Explorer::path(uint32_t node) const
+{
+	std::vector<std::string> res;
+	while (node < m_nodes.size() && m_nodes[node].parent != EXPLORE_NONE) {
+		res.push_back(m_nodes[node].command);
+		node = m_nodes[node].parent;
+	}
+	std::reverse(res.begin(), res.end());
+	return res;
+}
+
+void
+Explorer::printSummary(FILE* out) const
+{
+	size_t halted = std::count_if(m_nodes.begin(), m_nodes.end(),
+			[](const Node& n) { return n.halted; });
+	size_t timeouts = std::count_if(m_edges.begin(), m_edges.end(),
+			[](const Edge& e) { return e.outcome == TIMEOUT; });
+	double elapsed = m_elapsed > 0 ? m_elapsed : 1e-9;
+
+	fprintf(out, "Explored %lu states (%lu halted) over %lu transitions "
+			"to depth %lu%s\n", m_nodes.size(), halted,
+			m_edges.size(), m_depth,
+			m_truncated ? ", stopped at the state limit" : "");
+	fprintf(out, "%lu runs, %lu timed out, %lu ticks in %.3f s on %lu "
+			"threads\n", m_runs, timeouts, m_ticks, m_elapsed,
+			m_threads);
+	fprintf(out, "%.1f states/s, %.1f runs/s, %.0f ticks/s\n",
+			m_nodes.size() / elapsed, m_runs / elapsed,
+			m_ticks / elapsed);
+	fprintf(out, "%lu KB of memory shared, %lu KB private\n",
+			m_memory.shared / 1024, m_memory.priv / 1024);
+}
+
+/*
+ * Writes the state graph, as Graphviz if the path ends in ".dot" and as
+ * tab separated node and edge records otherwise
+ */
+bool
+Explorer::save(const char* path) const
+{
+	FILE* out = fopen(path, "w");
+	if (!out)
+		return false;
+
+	size_t len = strlen(path);
+	bool dot = len >= 4 && strcmp(path + len - 4, ".dot") == 0;
+	bool ok = dot ? saveDot(out) : saveTsv(out);
+	return fclose(out) == 0 && ok;
+}
+
+static std::string dot_escape(const std::string& s)
+{
+	std::string res;
+	for (char c : s) {
+		if (c == '"' || c == '\\')
+			res.push_back('\\');
+		res.push_back(c);
+	}
+	return res;
+}
+
+bool
+Explorer::saveDot(FILE* out) const
+{
+	fprintf(out, "digraph explore {\n");
+	fprintf(out, "\tnode [shape=box];\n");
+	for (size_t i = 0; i < m_nodes.size(); i++) {
+		const Node& n = m_nodes[i];
+		fprintf(out, "\tn%lu [label=\"%lu: %s\"%s];\n", i, i,
+				dot_escape(n.label).c_str(),
+				n.halted ? ", style=filled" : "");
+	}
+
+	// Commands that leave the state untouched would only add noise
+	for (const Edge& e : m_edges) {
+		if (e.to == EXPLORE_NONE || e.to == e.from)
+			continue;
+		fprintf(out, "\tn%u -> n%u [label=\"%s\"];\n", e.from, e.to,
+				dot_escape(e.command).c_str());
+	}
+	fprintf(out, "}\n");
+	return !ferror(out);
+}
+
+bool
+Explorer::saveTsv(FILE* out) const
+{
+	static const char* const outcomes[] = {
+		"new", "seen", "halted", "timeout", "dropped",
+	};
+
+	fprintf(out, "#node\tid\tdepth\thash\tlabel\tpath\n");
+	for (size_t i = 0; i < m_nodes.size(); i++) {
+		const Node& n = m_nodes[i];
+		fprintf(out, "node\t%lu\t%u\t%016lx\t%s\t", i, n.depth, n.hash,
+				n.halted ? "[halted]" : n.label.c_str());
+		std::vector<std::string> cmds = path(i);
+		for (size_t j = 0; j < cmds.size(); j++) {
+			fprintf(out, "%s%s", j ? ";" : "", cmds[j].c_str());
+		}
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "#edge\tfrom\tto\toutcome\tticks\tcommand\n");
+	for (const Edge& e : m_edges) {
+		fprintf(out, "edge\t%u\t", e.from);
+		if (e.to == EXPLORE_NONE) {
+			fprintf(out, "-");
+		} else {
+			fprintf(out, "%u", e.to);
+		}
+		fprintf(out, "\t%s\t%lu\t%s\n", outcomes[e.outcome], e.ticks,
+				e.command.c_str());
+	}
+	return !ferror(out);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <array>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Snapshots keep the pages the machine's dirty tracking reports */
+#define EXPLORE_PAGE_WORDS DIRTY_PAGE_WORDS
+#define EXPLORE_DEFAULT_DEPTH 6
+#define EXPLORE_DEFAULT_STATES 20000
+#define EXPLORE_TICK_LIMIT 5000000
+#define EXPLORE_NONE UINT32_MAX
+
+/*
+ * class Explorer: Breadth-first search over game states. Starting from a
+ * machine blocked on input, every command is fed to each state on the
+ * frontier and the machine runs until it blocks again. States are told apart
+ * by Machine::stateHash, so each distinct one is expanded only once.
+ *
+ * Besides a fixed vocabulary, commands can be derived from what the game
+ * prints: exits, things of interest and inventory items seen by the probe
+ * commands (look, inv) after reaching a state. Each level of the search is
+ * spread over a pool of worker threads with a machine each.
+ */
+class Explorer {
+public:
+	enum Outcome : uint8_t {
+		NEW_STATE,
+		SEEN_STATE,
+		HALTED,
+		TIMEOUT,
+		DROPPED,
+	};
+
+	struct Node {
+		uint64_t hash;
+		uint32_t parent;
+		uint32_t depth;
+		std::string command;
+		std::string label;
+		bool halted;
+		std::vector<std::string> derived;
+	};
+
+	struct Edge {
+		uint32_t from;
+		uint32_t to;
+		std::string command;
+		size_t ticks;
+		Outcome outcome;
+	};
+
+	Explorer(const Machine::State& root);
+	~Explorer();
+
+	void setVocabulary(const std::vector<std::string>& words);
+	bool loadVocabulary(const char* path);
+	void setDerive(bool active);
+	void setThreads(size_t threads);
+	void setMaxDepth(size_t depth);
+	void setMaxStates(size_t states);
+	void setTickLimit(size_t ticks);
+	void setHle(bool active);
+
+	bool run();
+
+	const std::vector<Node>& nodes() const { return m_nodes; }
+	const std::vector<Edge>& edges() const { return m_edges; }
+	std::vector<std::string> path(uint32_t node) const;
+
+	void printSummary(FILE* out) const;
+	bool save(const char* path) const;
+
+private:
+	struct Snapshot;
+	struct Worker;
+	struct Task;
+	struct Result;
+
+	std::unique_ptr<Worker> makeWorker() const;
+	void restore(Worker& w, const Snapshot& snap) const;
+	std::unique_ptr<Snapshot> capture(const Worker& w) const;
+	std::string probe(Worker& w, const Snapshot& snap,
+			std::vector<std::string>& derived) const;
+	void execute(Worker& w, const Task& task, Result& res) const;
+
+	bool saveDot(FILE* out) const;
+	bool saveTsv(FILE* out) const;
+
+	Machine::State m_root;
+
+	std::vector<std::string> m_vocabulary;
+	std::vector<std::string> m_probes;
+	bool m_derive;
+	size_t m_threads;
+	size_t m_max_depth;
+	size_t m_max_states;
+	size_t m_tick_limit;
+	bool m_hle;
+
+	std::vector<Node> m_nodes;
+	std::vector<Edge> m_edges;
+	std::vector<std::unique_ptr<Snapshot>> m_snapshots;
+	std::unordered_map<uint64_t, uint32_t> m_seen;
+
+	size_t m_runs;
+	size_t m_ticks;
+	size_t m_depth;
+	bool m_truncated;
+	MemoryUsage m_memory;
+	double m_elapsed;
+};
@@ -0,0 +1,191 @@
+#include "feeder.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+InputFeeder::InputFeeder(int fd) :
+	m_fd(fd),
+	m_reads(0),
+	m_first(0),
+	m_cancel(false),
+	m_feeding(false),
+	m_sent(0),
+	m_consumed(0),
+	m_total(0)
+{
+}
+
+InputFeeder::~InputFeeder()
+{
+	cancel();
+	if (m_thread.joinable())
+		m_thread.join();
+	stop();
+}
+
+/*
+ * Feeds the lines of text. Fails if a script is still being fed.
+ */
+bool
+InputFeeder::feed(const std::string& text)
+{
+	return begin(text, "");
+}
+
+/*
+ * Feeds the lines of a file, read on the feeding thread
+ */
+bool
+InputFeeder::feedFile(const char* path)
+{
+	return begin("", path);
+}
+
+bool
+InputFeeder::begin(const std::string& text, const std::string& path)
+{
+	if (m_feeding.load())
+		return false;
+
+	// The last feed has finished, so this does not wait
+	if (m_thread.joinable())
+		m_thread.join();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_cancel = false;
+		m_first = m_reads;
+	}
+	m_error.clear();
+	m_sent = 0;
+	m_consumed = 0;
+	m_total = 0;
+	m_feeding = true;
+	m_thread = std::thread(&InputFeeder::feedLoop, this, text, path);
+	return true;
+}
+
+/*
+ * Stops feeding after the line being written, if any. Lines already in the
+ * pipe are still read by the machine.
+ */
+void
+InputFeeder::cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_cancel = true;
+	}
+	m_cv.notify_all();
+}
+
+/*
+ * Called by the machine on its thread. Only the reads matter here: each is
+ * the machine coming back for another line.
+ */
+void
+InputFeeder::publish(const Machine::State&, bool waiting)
+{
+	if (!waiting)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_reads++;
+		m_consumed = std::min<uint64_t>(m_sent, m_reads - m_first);
+	}
+	m_cv.notify_all();
+}
+
+bool
+InputFeeder::split(const std::string& text, std::vector<std::string>& lines)
+{
+	size_t start = 0;
+	while (start < text.size()) {
+		size_t end = text.find('\n', start);
+		if (end == std::string::npos)
+			end = text.size();
+
+		std::string line = text.substr(start, end - start);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.size() + 2 > MAX_INPUT_SIZE) {
+			m_error = "line " + std::to_string(lines.size() + 1) +
+				" is longer than " + std::to_string(MAX_INPUT_SIZE - 2) +
+				" characters";
+			return false;
+		}
+
+		lines.push_back(line + "\n");
+		start = end + 1;
+	}
+	return true;
+}
+
+void
+InputFeeder::feedLoop(std::string text, std::string path)
+{
+	if (!path.empty()) {
+		FILE* f = fopen(path.c_str(), "r");
+		char buffer[4096];
+		size_t n;
+		while (f && (n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+			text.append(buffer, n);
+		}
+		if (!f || ferror(f)) {
+			m_error = "cannot read " + path;
+			if (f)
+				fclose(f);
+			m_feeding = false;
+			return;
+		}
+		fclose(f);
+	}
+
+	std::vector<std::string> lines;
+	if (!split(text, lines)) {
+		m_feeding = false;
+		return;
+	}
+	m_total = lines.size();
+
+	std::unique_lock<std::mutex> lock(m_mux);
+	for (const std::string& line : lines) {
+		m_cv.wait(lock, [&] {
+			return m_cancel || m_sent < m_reads - m_first + FEED_WINDOW;
+		});
+		if (m_cancel)
+			break;
+
+		lock.unlock();
+		size_t done = 0;
+		while (done < line.size() && !m_cancel) {
+			ssize_t n = write(m_fd, line.data() + done, line.size() - done);
+			if (n < 0 && errno == EAGAIN) {
+				// Someone else filled the pipe, wait for the machine
+				struct pollfd pfd = {m_fd, POLLOUT, 0};
+				poll(&pfd, 1, FEED_POLL_MS);
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		lock.lock();
+
+		if (m_cancel)
+			break;
+		if (done < line.size()) {
+			m_error = "cannot write to the machine's input";
+			break;
+		}
+		m_sent++;
+	}
+	m_feeding = false;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "publisher.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Lines written to the machine's input ahead of what it has read */
+#define FEED_WINDOW 2
+/* How often a write waiting for room in a full pipe checks for cancel */
+#define FEED_POLL_MS 100
+
+/*
+ * class InputFeeder: Streams a script into the machine's input descriptor
+ * from its own thread, a line at a time.
+ *
+ * Attached to the machine with start(m, 0), it hears every time the machine
+ * blocks on IN for a new line, and keeps no more than FEED_WINDOW lines
+ * written ahead of those reads, so a long script never fills the pipe and
+ * cancelling takes effect within a couple of lines. Nothing here blocks
+ * the caller: feeding, progress and cancelling only touch atomics or hand
+ * work to the feeding thread.
+ */
+class InputFeeder : public StatePublisher {
+public:
+	explicit InputFeeder(int fd);
+	~InputFeeder();
+
+	bool feed(const std::string& text);
+	bool feedFile(const char* path);
+	void cancel();
+
+	bool feeding() const { return m_feeding.load(); }
+	size_t sent() const { return m_sent.load(); }
+	size_t consumed() const { return m_consumed.load(); }
+	size_t total() const { return m_total.load(); }
+
+	/* Why the last script stopped short, once feeding() is false */
+	const std::string& error() const { return m_error; }
+
+	void publish(const Machine::State& s, bool waiting) override;
+
+private:
+	bool begin(const std::string& text, const std::string& path);
+	void feedLoop(std::string text, std::string path);
+	bool split(const std::string& text, std::vector<std::string>& lines);
+
+	int m_fd;
+	std::thread m_thread;
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+	uint64_t m_reads;
+	uint64_t m_first;
+	std::string m_error;
+
+	std::atomic<bool> m_cancel;
+	std::atomic<bool> m_feeding;
+	std::atomic<size_t> m_sent;
+	std::atomic<size_t> m_consumed;
+	std::atomic<size_t> m_total;
+};
@@ -0,0 +1,491 @@
+#include "fuzzer.hpp"
+#include "common.hpp"
+#include "hle.hpp"
+#include "opcodes.hpp"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <thread>
+
+static const char* const default_seeds[] = {
+	"look", "inv", "help", "take tablet", "use tablet", "go north",
+};
+
+static const char* const default_tokens[] = {
+	"go", "look", "take", "drop", "use", "inv", "help",
+	"north", "south", "east", "west", "up", "down",
+	"tablet", "lantern", "can", "coin", "teleporter", "book", "orb",
+	"doorway", "bridge", "ladder", "passage", "continue", "darkness",
+};
+
+/*
+ * Hit counts are compared in buckets (1, 2, 3, 4-7, 8-15, 16-31, 32-127,
+ * 128+), one bit each, so looping a few more times is not new coverage
+ */
+static uint8_t count_class(uint8_t hits)
+{
+	if (hits <= 2)
+		return hits;
+	if (hits == 3)
+		return 4;
+	if (hits < 8)
+		return 8;
+	if (hits < 16)
+		return 16;
+	if (hits < 32)
+		return 32;
+	if (hits < 128)
+		return 64;
+	return 128;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Fuzzer::Worker {
+	Worker() :
+		machine(-1, -1, -1),
+		trace(COVERAGE_MAP_SIZE, 0),
+		virgin(COVERAGE_MAP_SIZE, 0)
+	{
+
+	}
+
+	uint64_t random() {
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		return rng * 0x2545f4914f6cdd1dULL;
+	}
+
+	size_t below(size_t n) { return n ? random() % n : 0; }
+
+	char printable() { return char(0x20 + below(0x7f - 0x20)); }
+
+	Machine machine;
+	Hle hle;
+	std::string output;
+	std::vector<uint8_t> trace;
+	std::vector<uint8_t> virgin;
+	std::vector<std::string> corpus;
+	uint64_t rng;
+
+	size_t ticks = 0;
+	size_t dirty_pages = 0;
+	size_t halts = 0;
+	size_t hangs = 0;
+};
+
+Fuzzer::Fuzzer(const Machine::State& base) :
+	m_base(base),
+	m_threads(std::max(1u, std::thread::hardware_concurrency())),
+	m_tick_limit(FUZZ_TICK_LIMIT),
+	m_hle(true),
+	m_seed(0x5eed),
+	m_virgin(COVERAGE_MAP_SIZE, 0),
+	m_halts(0),
+	m_hangs(0),
+	m_execs(0),
+	m_stop(false),
+	m_ticks(0),
+	m_dirty_pages(0),
+	m_elapsed(0)
+{
+	m_base.buffer_sz = 0;
+	m_base.buffer_offset = 0;
+	// Workers map the base memory and only copy the pages they write
+	m_base.ram.makeShared();
+	m_dictionary.assign(default_tokens,
+			default_tokens + ARRAY_SIZE(default_tokens));
+}
+
+Fuzzer::~Fuzzer() {}
+
+void
+Fuzzer::addSeed(const std::string& input)
+{
+	if (input.size() < MAX_INPUT_SIZE - 1 &&
+			input.find('\n') == std::string::npos)
+		m_seeds.push_back(input);
+}
+
+static bool read_lines(const char* path, std::vector<std::string>& res)
+{
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	char line[MAX_INPUT_SIZE];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '#')
+			res.push_back(line);
+	}
+	fclose(f);
+	return true;
+}
+
+/*
+ * One seed per line, lines starting with '#' are skipped
+ */
+bool
+Fuzzer::loadSeeds(const char* path)
+{
+	std::vector<std::string> lines;
+	if (!read_lines(path, lines))
+		return false;
+	for (const std::string& line : lines) {
+		addSeed(line);
+	}
+	return true;
+}
+
+void
+Fuzzer::addToken(const std::string& token)
+{
+	if (!token.empty())
+		m_dictionary.push_back(token);
+}
+
+/*
+ * One token per line, replacing the built in dictionary. A file without
+ * any token leaves the dictionary as it was and fails.
+ */
+bool
+Fuzzer::loadDictionary(const char* path)
+{
+	std::vector<std::string> lines;
+	if (!read_lines(path, lines))
+		return false;
+	if (std::none_of(lines.begin(), lines.end(),
+				[](const std::string& l) { return !l.empty(); })) {
+		fprintf(stderr, "%s: no tokens\n", path);
+		return false;
+	}
+	m_dictionary.clear();
+	for (const std::string& line : lines) {
+		addToken(line);
+	}
+	return true;
+}
+
+void
+Fuzzer::setThreads(size_t threads)
+{
+	m_threads = MAX(threads, 1);
+}
+
+void
+Fuzzer::setTickLimit(size_t ticks)
+{
+	m_tick_limit = ticks;
+}
+
+void
+Fuzzer::setHle(bool active)
+{
+	m_hle = active;
+}
+
+void
+Fuzzer::setRandomSeed(uint64_t seed)
+{
+	m_seed = seed ? seed : 1;
+}
+
+void
+Fuzzer::stop()
+{
+	m_stop = true;
+}
+
+std::unique_ptr<Fuzzer::Worker>
+Fuzzer::makeWorker(uint64_t seed) const
+{
+	std::unique_ptr<Worker> w(new Worker());
+	w->rng = seed;
+	w->machine.m_state = m_base;
+	w->machine.setOutput(&w->output);
+	w->machine.setCoverage(w->trace.data());
+	w->machine.trackDirty(true);
+	if (m_hle) {
+		w->hle.addChallengeRoutines();
+		w->machine.setHle(&w->hle);
+	}
+	return w;
+}
+
+/*
+ * Havoc: stacks a few random edits on a corpus entry. Lines stay printable
+ * and short enough to fit in the input buffer with their newline.
+ */
+void
+Fuzzer::mutate(Worker& w, std::string& input) const
+{
+	input = w.corpus[w.below(w.corpus.size())];
+
+	size_t edits = 1 + w.below(FUZZ_MAX_STACKED);
+	for (size_t i = 0; i < edits; i++) {
+		size_t pos = w.below(input.size());
+		switch (w.below(8)) {
+		case 0:
+			if (!input.empty()) {
+				char c = input[pos] ^ (1 << w.below(7));
+				input[pos] = c >= 0x20 && c < 0x7f ?
+					c : w.printable();
+			}
+			break;
+		case 1:
+			if (!input.empty())
+				input[pos] = w.printable();
+			break;
+		case 2:
+			input.insert(input.begin() + pos, w.printable());
+			break;
+		case 3:
+			if (!input.empty())
+				input.erase(pos, 1 + w.below(MIN(
+							input.size() - pos, 4)));
+			break;
+		case 4:
+			if (!m_dictionary.empty())
+				input.insert(pos, m_dictionary[w.below(
+							m_dictionary.size())] + " ");
+			break;
+		case 5: {
+			// Replace the word around pos
+			if (m_dictionary.empty())
+				break;
+			size_t start = input.rfind(' ', pos);
+			start = start == std::string::npos ? 0 : start + 1;
+			size_t end = input.find(' ', pos);
+			end = end == std::string::npos ? input.size() : end;
+			input.replace(start, end - start, m_dictionary[w.below(
+						m_dictionary.size())]);
+			break;
+		}
+		case 6: {
+			const std::string& other =
+				w.corpus[w.below(w.corpus.size())];
+			size_t from = w.below(other.size() + 1);
+			input = input.substr(0, pos) + other.substr(from);
+			break;
+		}
+		case 7:
+			if (!input.empty()) {
+				size_t len = 1 + w.below(input.size() - pos);
+				input.insert(pos, input.substr(pos, len));
+			}
+			break;
+		}
+
+		if (input.size() > MAX_INPUT_SIZE - 2)
+			input.resize(MAX_INPUT_SIZE - 2);
+	}
+}
+
+void
+Fuzzer::execute(Worker& w, const std::string& input)
+{
+	w.machine.rollback(m_base);
+	memset(w.trace.data(), 0, w.trace.size());
+	w.output.clear();
+
+	w.machine.feed((input + "\n").c_str());
+	bool blocked = w.machine.runUntilInput(m_tick_limit);
+	size_t ticks = w.machine.m_state.ticks - m_base.ticks;
+	w.ticks += ticks;
+	w.dirty_pages += w.machine.dirtyPages();
+	if (!blocked) {
+		if (ticks >= m_tick_limit) {
+			w.hangs++;
+		} else {
+			w.halts++;
+		}
+	}
+
+	// Most executions find nothing new, so the first pass only looks at
+	// the worker's own copy of the coverage seen so far
+	bool fresh = false;
+	const uint64_t* words = (const uint64_t*) w.trace.data();
+	for (size_t i = 0; i < w.trace.size() / 8; i++) {
+		if (!words[i])
+			continue;
+		for (size_t j = i * 8; j < i * 8 + 8; j++) {
+			w.trace[j] = count_class(w.trace[j]);
+			fresh |= (w.trace[j] & ~w.virgin[j]) != 0;
+		}
+	}
+	if (!fresh || !merge(w))
+		return;
+
+	size_t edges = 0;
+	for (uint8_t hits : w.trace) {
+		edges += hits != 0;
+	}
+	if (blocked) {
+		record(CORPUS, input, edges);
+	} else {
+		record(ticks >= m_tick_limit ? HUNG : HALTED, input, edges);
+	}
+}
+
+/*
+ * Folds a worker's trace into the shared map. Returns whether it had
+ * anything no worker had seen yet.
+ */
+bool
+Fuzzer::merge(Worker& w)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	bool fresh = false;
+	for (size_t i = 0; i < m_virgin.size(); i++) {
+		fresh |= (w.trace[i] & ~m_virgin[i]) != 0;
+		m_virgin[i] |= w.trace[i];
+	}
+	w.virgin = m_virgin;
+	return fresh;
+}
+
+void
+Fuzzer::record(Kind kind, const std::string& input, size_t edges)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	if (kind == CORPUS) {
+		m_corpus.push_back({kind, input, edges});
+	} else if (m_findings.size() < FUZZ_MAX_FINDINGS) {
+		m_findings.push_back({kind, input, edges});
+	}
+}
+
+/*
+ * Runs the seeds, then mutated inputs until execs executions have been
+ * made or stop() is called. Returns false if the snapshot is not waiting
+ * for input.
+ */
+bool
+Fuzzer::run(size_t execs)
+{
+	double start = now();
+
+	if (m_base.ram[m_base.ip] != IN)
+		return false;
+
+	if (m_seeds.empty()) {
+		for (const char* seed : default_seeds) {
+			addSeed(seed);
+		}
+	}
+	m_stop = false;
+	m_execs = 0;
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	for (size_t i = 0; i < m_threads; i++) {
+		workers.push_back(makeWorker(m_seed * (i + 1) *
+					0x9e3779b97f4a7c15ULL | 1));
+	}
+
+	// Seeds stay in the corpus whether or not they find anything
+	Worker& first = *workers.front();
+	for (const std::string& seed : m_seeds) {
+		size_t size = m_corpus.size();
+		execute(first, seed);
+		m_execs++;
+		if (m_corpus.size() == size)
+			m_corpus.push_back({CORPUS, seed, 0});
+	}
+
+	std::vector<std::thread> threads;
+	for (auto& worker : workers) {
+		Worker* w = worker.get();
+		threads.push_back(std::thread([&, w]() {
+			std::string input;
+			while (!m_stop && m_execs.fetch_add(1) < execs) {
+				{
+					std::lock_guard<std::mutex> lock(m_mux);
+					for (size_t i = w->corpus.size();
+							i < m_corpus.size(); i++) {
+						w->corpus.push_back(
+							m_corpus[i].input);
+					}
+				}
+				mutate(*w, input);
+				execute(*w, input);
+			}
+		}));
+	}
+	for (std::thread& t : threads) {
+		t.join();
+	}
+
+	m_execs = MIN(m_execs.load(), execs);
+	m_memory = m_base.ram.usage();
+	for (auto& w : workers) {
+		m_memory += w->machine.state().ram.usage();
+		m_ticks += w->ticks;
+		m_dirty_pages += w->dirty_pages;
+		m_halts += w->halts;
+		m_hangs += w->hangs;
+	}
+	m_elapsed += now() - start;
+	return true;
+}
+
+size_t
+Fuzzer::edges() const
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	size_t count = 0;
+	for (uint8_t bits : m_virgin) {
+		count += bits != 0;
+	}
+	return count;
+}
+
+void
+Fuzzer::printSummary(FILE* out) const
+{
+	size_t execs = m_execs.load();
+	double elapsed = m_elapsed > 0 ? m_elapsed : 1e-9;
+	double per_exec = execs ? 1.0 / execs : 0.0;
+
+	fprintf(out, "%lu execs in %.3f s: %.0f execs/s on %lu threads\n",
+			execs, m_elapsed, execs / elapsed, m_threads);
+	fprintf(out, "%lu edges, %lu inputs in corpus, %lu halts, %lu hangs\n",
+			edges(), m_corpus.size(), m_halts, m_hangs);
+	fprintf(out, "%.0f ticks and %.2f dirty pages per exec\n",
+			m_ticks * per_exec, m_dirty_pages * per_exec);
+	fprintf(out, "%lu KB of memory shared, %lu KB private\n",
+			m_memory.shared / 1024, m_memory.priv / 1024);
+}
+
+/*
+ * Writes the corpus and the findings as "kind<TAB>edges<TAB>input" lines
+ */
+bool
+Fuzzer::save(const char* path) const
+{
+	static const char* const kinds[] = {"corpus", "halt", "hang"};
+
+	FILE* out = fopen(path, "w");
+	if (!out)
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_mux);
+	for (const auto* list : {&m_corpus, &m_findings}) {
+		for (const Finding& f : *list) {
+			fprintf(out, "%s\t%lu\t%s\n", kinds[f.kind],
+					f.edges, f.input.c_str());
+		}
+	}
+	return fclose(out) == 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define FUZZ_DEFAULT_EXECS 100000
+#define FUZZ_TICK_LIMIT 1000000
+#define FUZZ_MAX_STACKED 8
+#define FUZZ_MAX_FINDINGS 64
+
+/*
+ * class Fuzzer: Coverage guided fuzzing of the line the game is waiting
+ * for. Every execution starts from the same snapshot, feeds one mutated
+ * line and runs until the game blocks on input again. Lines that make the
+ * game take control flow edges (or hit counts of them) never seen before
+ * are kept in the corpus and mutated further.
+ *
+ * Machines are reset with Machine::rollback, which only copies back the
+ * pages written by the last execution. Workers keep a private trace map and
+ * only take the shared lock when their trace has something new for them.
+ */
+class Fuzzer {
+public:
+	enum Kind : uint8_t {
+		CORPUS,
+		HALTED,
+		HUNG,
+	};
+
+	struct Finding {
+		Kind kind;
+		std::string input;
+		size_t edges;
+	};
+
+	Fuzzer(const Machine::State& base);
+	~Fuzzer();
+
+	void addSeed(const std::string& input);
+	bool loadSeeds(const char* path);
+	void addToken(const std::string& token);
+	bool loadDictionary(const char* path);
+
+	void setThreads(size_t threads);
+	void setTickLimit(size_t ticks);
+	void setHle(bool active);
+	void setRandomSeed(uint64_t seed);
+
+	bool run(size_t execs);
+	void stop();
+
+	size_t edges() const;
+	const std::vector<Finding>& corpus() const { return m_corpus; }
+	const std::vector<Finding>& findings() const { return m_findings; }
+
+	void printSummary(FILE* out) const;
+	bool save(const char* path) const;
+
+private:
+	struct Worker;
+
+	std::unique_ptr<Worker> makeWorker(uint64_t seed) const;
+	void mutate(Worker& w, std::string& input) const;
+	void execute(Worker& w, const std::string& input);
+	bool merge(Worker& w);
+	void record(Kind kind, const std::string& input, size_t edges);
+
+	Machine::State m_base;
+
+	std::vector<std::string> m_seeds;
+	std::vector<std::string> m_dictionary;
+	size_t m_threads;
+	size_t m_tick_limit;
+	bool m_hle;
+	uint64_t m_seed;
+
+	std::vector<Finding> m_corpus;
+	std::vector<Finding> m_findings;
+	std::vector<uint8_t> m_virgin;
+	size_t m_halts;
+	size_t m_hangs;
+	mutable std::mutex m_mux;
+
+	std::atomic<size_t> m_execs;
+	std::atomic<bool> m_stop;
+	size_t m_ticks;
+	size_t m_dirty_pages;
+	MemoryUsage m_memory;
+	double m_elapsed;
+};
@@ -0,0 +1,195 @@
+#include "handlers.hpp"
+#include "opcodes.hpp"
+
+enum OperandKind {
+	OPERAND_LITERAL = 0,
+	OPERAND_REGISTER = 1,
+};
+
+static inline bool
+is_register(uint16_t a)
+{
+	return a >= 0x8000 && a <= 0x8007;
+}
+
+static inline bool
+is_valid(uint16_t a)
+{
+	return a <= 0x8007;
+}
+
+static inline int
+kind(uint16_t a)
+{
+	return a >= 0x8000 ? OPERAND_REGISTER : OPERAND_LITERAL;
+}
+
+struct OpAdd  { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return (b + c) & 0x7fff; } };
+struct OpMult { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return (b * c) & 0x7fff; } };
+struct OpMod  { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return (b % c) & 0x7fff; } };
+struct OpAnd  { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return (b & c) & 0x7fff; } };
+struct OpOr   { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return (b | c) & 0x7fff; } };
+struct OpEq   { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return b == c; } };
+struct OpGt   { uint16_t operator()(uint16_t b, uint16_t c) const {
+	return b > c; } };
+
+/*
+ * The variants themselves. They live in a class of their own, befriended
+ * by Machine, so that they can reach its state and its memory hooks.
+ */
+class HandlerVariants {
+public:
+	template <int K>
+	static inline uint16_t val(const Machine& m, uint16_t a) {
+		return K == OPERAND_REGISTER ? m.m_state.reg[a & 7] : a;
+	}
+
+	static inline uint16_t& reg(Machine& m, uint16_t a) {
+		return m.m_state.reg[a & 7];
+	}
+
+	template <int B>
+	static bool set(Machine& m, const uint16_t* p) {
+		reg(m, p[1]) = val<B>(m, p[2]);
+		m.m_state.ip += 3;
+		return true;
+	}
+
+	template <typename F, int B, int C>
+	static bool alu(Machine& m, const uint16_t* p) {
+		reg(m, p[1]) = F()(val<B>(m, p[2]), val<C>(m, p[3]));
+		m.m_state.ip += 4;
+		return true;
+	}
+
+	template <int B>
+	static bool not_(Machine& m, const uint16_t* p) {
+		reg(m, p[1]) = ~val<B>(m, p[2]) & 0x7fff;
+		m.m_state.ip += 3;
+		return true;
+	}
+
+	template <int A>
+	static bool jmp(Machine& m, const uint16_t* p) {
+		m.m_state.ip = val<A>(m, p[1]);
+		return true;
+	}
+
+	template <bool NonZero, int A, int B>
+	static bool branch(Machine& m, const uint16_t* p) {
+		if ((val<A>(m, p[1]) != 0) == NonZero) {
+			m.m_state.ip = val<B>(m, p[2]);
+		} else {
+			m.m_state.ip += 3;
+		}
+		return true;
+	}
+
+	template <int B>
+	static bool rmem(Machine& m, const uint16_t* p) {
+		reg(m, p[1]) = m.load(val<B>(m, p[2])) & 0x7fff;
+		m.m_state.ip += 3;
+		return true;
+	}
+
+	template <int A, int B>
+	static bool wmem(Machine& m, const uint16_t* p) {
+		m.store(val<A>(m, p[1]), val<B>(m, p[2]));
+		m.m_state.ip += 3;
+		return true;
+	}
+
+	template <int A>
+	static bool out(Machine& m, const uint16_t* p) {
+		m.put_char(val<A>(m, p[1]));
+		m.m_state.ip += 2;
+		return true;
+	}
+};
+
+typedef Handlers::Handler Handler;
+typedef HandlerVariants V;
+
+template <typename F>
+static Handler
+alu_variant(uint16_t b, uint16_t c)
+{
+	static const Handler variants[2][2] = {
+		{V::alu<F, 0, 0>, V::alu<F, 0, 1>},
+		{V::alu<F, 1, 0>, V::alu<F, 1, 1>},
+	};
+	return variants[kind(b)][kind(c)];
+}
+
+template <bool NonZero>
+static Handler
+branch_variant(uint16_t a, uint16_t b)
+{
+	static const Handler variants[2][2] = {
+		{V::branch<NonZero, 0, 0>, V::branch<NonZero, 0, 1>},
+		{V::branch<NonZero, 1, 0>, V::branch<NonZero, 1, 1>},
+	};
+	return variants[kind(a)][kind(b)];
+}
+
+/*
+ * Returns the variant for the instruction at p, which must be followed by
+ * at least three words, or null where the generic handler has to run
+ */
+Handler
+Handlers::decode(const uint16_t* p)
+{
+	static const Handler set[2] = {V::set<0>, V::set<1>};
+	static const Handler not_[2] = {V::not_<0>, V::not_<1>};
+	static const Handler jmp[2] = {V::jmp<0>, V::jmp<1>};
+	static const Handler rmem[2] = {V::rmem<0>, V::rmem<1>};
+	static const Handler out[2] = {V::out<0>, V::out<1>};
+	static const Handler wmem[2][2] = {
+		{V::wmem<0, 0>, V::wmem<0, 1>},
+		{V::wmem<1, 0>, V::wmem<1, 1>},
+	};
+
+	uint16_t a = p[1], b = p[2], c = p[3];
+	switch (p[0]) {
+	case SET:
+		return is_register(a) && is_valid(b) ? set[kind(b)] : nullptr;
+	case NOT:
+		return is_register(a) && is_valid(b) ? not_[kind(b)] : nullptr;
+	case RMEM:
+		return is_register(a) && is_valid(b) ? rmem[kind(b)] : nullptr;
+	case JMP:
+		return is_valid(a) ? jmp[kind(a)] : nullptr;
+	case OUT:
+		return is_valid(a) ? out[kind(a)] : nullptr;
+	case WMEM:
+		return is_valid(a) && is_valid(b) ? wmem[kind(a)][kind(b)] :
+			nullptr;
+	case JNZ:
+	case JZ:
+		if (!is_valid(a) || !is_valid(b))
+			return nullptr;
+		return p[0] == JNZ ? branch_variant<true>(a, b) :
+			branch_variant<false>(a, b);
+	default:
+		break;
+	}
+
+	if (!is_register(a) || !is_valid(b) || !is_valid(c))
+		return nullptr;
+	switch (p[0]) {
+	case EQ:   return alu_variant<OpEq>(b, c);
+	case GT:   return alu_variant<OpGt>(b, c);
+	case ADD:  return alu_variant<OpAdd>(b, c);
+	case MULT: return alu_variant<OpMult>(b, c);
+	case MOD:  return alu_variant<OpMod>(b, c);
+	case AND:  return alu_variant<OpAnd>(b, c);
+	case OR:   return alu_variant<OpOr>(b, c);
+	default:   return nullptr;
+	}
+}
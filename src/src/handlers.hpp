@@ -0,0 +1,24 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+
+/*
+ * class Handlers: Instruction handlers specialized at compile time for the
+ * kind of each operand, literal or register. Every variant is straight-line
+ * code: operands are read without testing their kind and without the
+ * bounds checks of get_val() and get_reg().
+ *
+ * decode() picks the variant for one instruction site. Instructions with
+ * operands the generic handlers would reject, and those with side effects
+ * beyond registers and memory (HALT, CALL, RET, IN, NOP), get no variant
+ * and keep going through the generic handlers. Neither do PUSH and POP:
+ * their cost is in the stack itself, which the dispatch does not change.
+ */
+class Handlers {
+public:
+	typedef bool (*Handler)(Machine& m, const uint16_t* p);
+
+	static Handler decode(const uint16_t* p);
+};
@@ -0,0 +1,555 @@
+#include "hle.hpp"
+#include "common.hpp"
+#include "analysis/cfg.hpp"
+
+#define CAP(x) ((x)&0x7fff)
+
+HleContext::HleContext(Machine& m, Machine::State& s, std::string* capture) :
+	m_machine(m),
+	m_state(s),
+	m_capture(capture)
+{
+
+}
+
+uint16_t
+HleContext::mem(uint16_t addr) const
+{
+	if (&m_state == &m_machine.m_state)
+		return m_machine.load(addr);
+	return m_state.ram[addr];
+}
+
+void
+HleContext::wmem(uint16_t addr, uint16_t value)
+{
+	if (&m_state == &m_machine.m_state) {
+		m_machine.store(addr, value);
+	} else {
+		m_state.ram[addr] = value;
+	}
+}
+
+void
+HleContext::out(uint16_t c)
+{
+	if (m_capture) {
+		m_capture->push_back(char(c));
+	} else {
+		m_machine.put_char(c);
+	}
+}
+
+/*
+ * Takes the next character like the routine's IN would. On the live state
+ * the IN's tick is not accounted for yet, hence the + 1.
+ */
+bool
+HleContext::in(uint16_t& c)
+{
+	if (m_state.buffer_offset == m_state.buffer_sz)
+		return false;
+	if (!m_capture)
+		m_machine.startLine(m_state.ticks + 1);
+	c = m_state.buffer[m_state.buffer_offset];
+	m_state.buffer_offset++;
+	return true;
+}
+
+bool
+HleContext::lineReady() const
+{
+	size_t left = m_state.buffer_sz - m_state.buffer_offset;
+	return memchr(m_state.buffer + m_state.buffer_offset, '\n', left);
+}
+
+bool
+HleContext::native(uint16_t addr) const
+{
+	return m_machine.m_hle && m_machine.m_hle->native(addr);
+}
+
+/*
+ * Runs the native version of the routine at addr as if it had been CALLed.
+ * The CALL itself is accounted for by the caller.
+ */
+bool
+HleContext::call(uint16_t addr)
+{
+	return m_machine.m_hle && m_machine.m_hle->invoke(addr, *this);
+}
+
+/*
+ * Native routines. Each one mirrors the guest code it replaces (see
+ * analysis/functions) including the ticks every instruction would take.
+ */
+
+/* 084d: r0 = r0 ^ r1, built from AND/NOT/OR */
+static bool hle_xor(HleContext& c)
+{
+	uint16_t r2 = CAP(~CAP(c.r(0) & c.r(1)));
+	c.r(0) = CAP(CAP(c.r(0) | c.r(1)) & r2);
+	c.tick(9);
+	return true;
+}
+
+/* 05f8: prints r0, used as a list_foreach callback */
+static bool hle_putc(HleContext& c)
+{
+	c.out(c.r(0));
+	c.tick(2);
+	return true;
+}
+
+/* 05fb: prints r0 ^ r2, the callback for encrypted strings */
+static bool hle_putc_xor(HleContext& c)
+{
+	uint16_t r1 = c.r(1);
+	c.r(1) = c.r(2);
+	c.tick(3);
+	hle_xor(c);
+	c.out(c.r(0));
+	c.r(1) = r1;
+	c.tick(3);
+	return true;
+}
+
+/* 0645: list_find callback, stops the iteration when r0 == r2 */
+static bool hle_match(HleContext& c)
+{
+	c.r(0) = c.r(0) == c.r(2);
+	if (!c.r(0)) {
+		c.tick(3);
+		return true;
+	}
+
+	c.r(2) = c.r(1);
+	c.r(1) = 0x7fff;
+	c.tick(5);
+	return true;
+}
+
+/*
+ * 05b2: list_foreach(r0 = list, r1 = callback). Calls the callback with
+ * r0 = element, r1 = index for every element of a length-prefixed list.
+ * Only handled natively if the callback is native too.
+ */
+static bool hle_foreach(HleContext& c)
+{
+	if (!c.native(c.r(1)))
+		return false;
+
+	uint16_t saved[] = {c.r(0), c.r(3), c.r(4), c.r(5), c.r(6)};
+
+	c.r(6) = c.r(0);
+	c.r(5) = c.r(1);
+	c.r(4) = CAP(c.mem(c.r(0)));
+	c.r(1) = 0;
+	c.tick(9);
+
+	for (;;) {
+		c.r(3) = CAP(0x0001 + c.r(1));
+		c.r(0) = c.r(3) > c.r(4);
+		c.tick(3);
+		if (c.r(0))
+			break;
+
+		c.r(3) = CAP(c.r(3) + c.r(6));
+		c.r(0) = CAP(c.mem(c.r(3)));
+		c.tick(3);
+		c.call(c.r(5));
+
+		c.r(1) = CAP(c.r(1) + 0x0001);
+		c.tick(2);
+		if (!c.r(1))
+			break;
+	}
+
+	c.r(0) = saved[0];
+	c.r(3) = saved[1];
+	c.r(4) = saved[2];
+	c.r(5) = saved[3];
+	c.r(6) = saved[4];
+	c.tick(6);
+	return true;
+}
+
+/* 05ee: print_string(r0 = length-prefixed string) */
+static bool hle_print(HleContext& c)
+{
+	if (!c.native(0x05b2) || !c.native(0x05f8))
+		return false;
+
+	uint16_t r1 = c.r(1);
+	c.r(1) = 0x05f8;
+	c.tick(3);
+	c.call(0x05b2);
+	c.r(1) = r1;
+	c.tick(2);
+	return true;
+}
+
+/*
+ * 0607: list_search(r0 = list, r1 = callback, r2 = argument). Returns in r0
+ * the r2 left by the callback that stopped the iteration, or 7fff.
+ */
+static bool hle_search(HleContext& c)
+{
+	if (!c.native(0x05b2) || !c.native(c.r(1)))
+		return false;
+
+	uint16_t r1 = c.r(1);
+	uint16_t r3 = c.r(3);
+
+	c.r(3) = CAP(c.mem(c.r(0)));
+	c.tick(4);
+	if (!c.r(3)) {
+		c.r(0) = 0x7fff;
+		c.tick(1);
+	} else {
+		c.tick(1);
+		c.call(0x05b2);
+		c.tick(1);
+		if (c.r(1)) {
+			c.r(0) = 0x7fff;
+			c.tick(1);
+		} else {
+			c.r(0) = c.r(2);
+			c.tick(2);
+		}
+	}
+
+	c.r(3) = r3;
+	c.r(1) = r1;
+	c.tick(3);
+	return true;
+}
+
+/* 0623: list_index(r0 = list, r1 = value), r0 = index or 7fff */
+static bool hle_index(HleContext& c)
+{
+	if (!c.native(0x0607) || !c.native(0x05b2) || !c.native(0x0645))
+		return false;
+
+	uint16_t r1 = c.r(1);
+	uint16_t r2 = c.r(2);
+
+	c.r(2) = c.r(1);
+	c.r(1) = 0x0645;
+	c.tick(5);
+	c.call(0x0607);
+	c.r(2) = r2;
+	c.r(1) = r1;
+	c.tick(3);
+	return true;
+}
+
+/*
+ * 06e7: get_input(r0 = capacity, r1 = buffer). Stores up to r0 characters
+ * of a line after the length word at r1 and discards the rest of the line.
+ * Every register is restored, only the buffer changes.
+ */
+static bool hle_readline(HleContext& c)
+{
+	if (!c.lineReady())
+		return false;
+
+	uint16_t r0 = c.r(0), r1 = c.r(1), r4 = c.r(4);
+	uint16_t r2, r5;
+
+	r2 = CAP(r1 + r0);
+	r0 = r1;
+	r5 = 0;
+	c.tick(8);
+
+	for (;;) {
+		r0 = CAP(r0 + 0x0001);
+		c.tick(3);
+		if (r0 > r2)
+			break;
+
+		c.in(r4);
+		c.tick(3);
+		if (r4 == '\n')
+			break;
+
+		c.wmem(r0, r4);
+		r5 = CAP(r5 + 0x0001);
+		c.tick(3);
+	}
+
+	c.wmem(r1, r5);
+	c.tick(1);
+
+	for (;;) {
+		c.tick(2);
+		if (r4 == '\n')
+			break;
+		c.in(r4);
+		c.tick(2);
+	}
+
+	c.tick(6);
+	return true;
+}
+
+Hle::Hle() :
+	m_hooked(CODE_SPACE, false),
+	m_verifying(false),
+	m_verify_addr(0),
+	m_verify_ip(0),
+	m_verify_depth(0)
+{
+
+}
+
+void
+Hle::add(uint16_t addr, const Entry& entry)
+{
+	m_entries[addr] = entry;
+}
+
+/*
+ * The routines documented in analysis/functions. They only bind to images
+ * whose code at those addresses is identical to challenge.bin.
+ */
+void
+Hle::addChallengeRoutines()
+{
+	add(0x05b2, {"list_foreach", hle_foreach, 0x3c,
+			0xaea30908f76743ceULL, false});
+	add(0x05ee, {"print_string", hle_print, 0x0a,
+			0x0d0da5ecc20de639ULL, false});
+	add(0x05f8, {"putc", hle_putc, 0x03,
+			0xb98e4b174de2b0dcULL, false});
+	add(0x05fb, {"putc_xor", hle_putc_xor, 0x0c,
+			0xbdb562c05a44a6d5ULL, false});
+	add(0x0607, {"list_search", hle_search, 0x1c,
+			0x4d085b8ee2fd855cULL, false});
+	add(0x0623, {"list_index", hle_index, 0x11,
+			0x66311a25c4509eb8ULL, false});
+	add(0x0645, {"match", hle_match, 0x0e,
+			0x8b598fda6ca24868ULL, false});
+	add(0x06e7, {"get_input", hle_readline, 0x4a,
+			0xd5fee87c6b642110ULL, true});
+	add(0x084d, {"xor", hle_xor, 0x18,
+			0x8e35e43cc64dfb62ULL, false});
+}
+
+/*
+ * Checks every routine against the code currently in memory. Returns how
+ * many of them can be used.
+ */
+size_t
+Hle::bind(const Machine::State& s)
+{
+	size_t bound = 0;
+	for (auto& entry : m_entries) {
+		Entry& e = entry.second;
+		e.bound = entry.first + e.length <= CODE_SPACE &&
+			image_hash(s.ram.data() + entry.first, e.length) == e.hash;
+		m_hooked[entry.first] = e.bound;
+		bound += e.bound;
+	}
+	return bound;
+}
+
+bool
+Hle::setEnabled(uint16_t addr, bool active)
+{
+	auto it = m_entries.find(addr);
+	if (it == m_entries.end())
+		return false;
+	it->second.enabled = active;
+	return true;
+}
+
+bool
+Hle::setVerify(uint16_t addr, bool active)
+{
+	auto it = m_entries.find(addr);
+	if (it == m_entries.end())
+		return false;
+	it->second.verify = active;
+	return true;
+}
+
+void
+Hle::setEnabledAll(bool active)
+{
+	for (auto& entry : m_entries) {
+		entry.second.enabled = active;
+	}
+}
+
+void
+Hle::setVerifyAll(bool active)
+{
+	for (auto& entry : m_entries) {
+		entry.second.verify = active;
+	}
+}
+
+void
+Hle::print(FILE* out) const
+{
+	fprintf(out, "%-6s %-14s %-8s %12s %10s %10s\n", "ADDR", "NAME",
+			"STATE", "HITS", "VERIFIED", "MISMATCH");
+	for (auto& entry : m_entries) {
+		const Entry& e = entry.second;
+		const char* state = !e.bound ? "unbound" :
+			!e.enabled ? "off" : e.verify ? "verify" : "on";
+		fprintf(out, "%04x   %-14s %-8s %12lu %10lu %10lu\n",
+				entry.first, e.name, state, e.hits,
+				e.verified, e.mismatches);
+	}
+}
+
+bool
+Hle::native(uint16_t addr) const
+{
+	if (addr >= CODE_SPACE || !m_hooked[addr])
+		return false;
+	const Entry& e = m_entries.at(addr);
+	return e.enabled;
+}
+
+bool
+Hle::invoke(uint16_t addr, HleContext& ctx)
+{
+	if (!native(addr))
+		return false;
+
+	Entry& e = m_entries.at(addr);
+	if (!e.fn(ctx))
+		return false;
+	e.hits++;
+	return true;
+}
+
+/*
+ * Called right after a CALL lands on ip. Runs the native routine in place of
+ * the guest one and performs its RET.
+ */
+void
+Hle::enter(Machine& m)
+{
+	Machine::State& s = m.m_state;
+	if (m_verifying || !native(s.ip))
+		return;
+
+	Entry& e = m_entries.at(s.ip);
+	if (e.reads_input && !m.fetchLine())
+		return;
+
+	if (!e.verify) {
+		HleContext ctx(m, s, nullptr);
+		if (!e.fn(ctx))
+			return;
+		e.hits++;
+		s.ip = s.stack.top();
+		s.stack.pop();
+		return;
+	}
+
+	if (!m_expected) {
+		m_expected.reset(new Machine::State());
+	}
+	*m_expected = s;
+	m_expected_out.clear();
+	m_actual_out.clear();
+
+	HleContext ctx(m, *m_expected, &m_expected_out);
+	if (!e.fn(ctx))
+		return;
+	m_expected->ip = m_expected->stack.top();
+	m_expected->stack.pop();
+
+	m_verifying = true;
+	m_verify_addr = s.ip;
+	m_verify_ip = m_expected->ip;
+	m_verify_depth = m_expected->stack.size();
+	m.setHook(Machine::HOOK_HLE_VERIFY, true);
+}
+
+void
+Hle::onOutput(uint16_t c)
+{
+	if (m_verifying) {
+		m_actual_out.push_back(char(c));
+	}
+}
+
+/*
+ * Called before every instruction while a verification is pending. The guest
+ * routine is done once it is back at the return address with the stack as
+ * deep as it was before the CALL.
+ */
+void
+Hle::checkVerify(Machine& m)
+{
+	const Machine::State& s = m.m_state;
+	if (s.ip != m_verify_ip || s.stack.size() != m_verify_depth)
+		return;
+
+	m_verifying = false;
+	m.setHook(Machine::HOOK_HLE_VERIFY, false);
+
+	Entry& e = m_entries.at(m_verify_addr);
+	std::string why;
+	if (compare(s, why)) {
+		e.verified++;
+		e.hits++;
+		return;
+	}
+
+	e.mismatches++;
+	e.enabled = false;
+	dprintf(m.m_err, "HLE mismatch in %s (%04x): %s, disabled\n",
+			e.name, m_verify_addr, why.c_str());
+}
+
+bool
+Hle::compare(const Machine::State& real, std::string& why) const
+{
+	const Machine::State& exp = *m_expected;
+	char msg[128];
+
+	// The instruction at the return address has already been counted
+	if (exp.ticks != real.ticks - 1) {
+		snprintf(msg, sizeof(msg), "ticks %lu != %lu", exp.ticks,
+				real.ticks - 1);
+		why = msg;
+		return false;
+	}
+
+	for (size_t i = 0; i < exp.reg.size(); i++) {
+		if (exp.reg[i] != real.reg[i]) {
+			snprintf(msg, sizeof(msg), "R%lu %04x != %04x", i,
+					exp.reg[i], real.reg[i]);
+			why = msg;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < CODE_SPACE; i++) {
+		if (exp.ram[i] != real.ram[i]) {
+			snprintf(msg, sizeof(msg), "ram[%04lx] %04x != %04x",
+					i, exp.ram[i], real.ram[i]);
+			why = msg;
+			return false;
+		}
+	}
+
+	if (exp.buffer_offset != real.buffer_offset) {
+		why = "input position differs";
+		return false;
+	}
+
+	if (m_expected_out != m_actual_out) {
+		why = "output differs";
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * class HleContext: What a native routine sees. It works either on the live
+ * machine state or, when verifying, on a copy of it whose output is captured
+ * instead of written.
+ */
+class HleContext {
+public:
+	HleContext(Machine& m, Machine::State& s, std::string* capture);
+
+	uint16_t& r(size_t n) { return m_state.reg[n]; }
+	uint16_t mem(uint16_t addr) const;
+	void wmem(uint16_t addr, uint16_t value);
+
+	void out(uint16_t c);
+	bool in(uint16_t& c);
+	bool lineReady() const;
+
+	void tick(size_t n) { m_state.ticks += n; }
+
+	bool native(uint16_t addr) const;
+	bool call(uint16_t addr);
+
+private:
+	Machine& m_machine;
+	Machine::State& m_state;
+	std::string* m_capture;
+};
+
+/*
+ * class Hle: High-level emulation registry. Maps guest routine entry points
+ * to native implementations that leave registers, RAM, output and the tick
+ * count exactly as the guest code would. Routines are entered when a CALL
+ * lands on them, and their RET is performed by the registry.
+ *
+ * A routine only binds if the code at its address matches the one it was
+ * written against. In verify mode the native version runs on a copy of the
+ * state, the guest code runs for real, and both results are compared when
+ * the guest returns.
+ */
+class Hle {
+public:
+	typedef bool (*Routine)(HleContext& ctx);
+
+	struct Entry {
+		const char* name;
+		Routine fn;
+		uint16_t length;
+		uint64_t hash;
+		bool reads_input;
+
+		bool bound = false;
+		bool enabled = true;
+		bool verify = false;
+		uint64_t hits = 0;
+		uint64_t verified = 0;
+		uint64_t mismatches = 0;
+	};
+
+	Hle();
+
+	void add(uint16_t addr, const Entry& entry);
+	void addChallengeRoutines();
+
+	size_t bind(const Machine::State& s);
+
+	bool setEnabled(uint16_t addr, bool active);
+	bool setVerify(uint16_t addr, bool active);
+	void setEnabledAll(bool active);
+	void setVerifyAll(bool active);
+
+	const std::map<uint16_t, Entry>& entries() const { return m_entries; }
+	void print(FILE* out) const;
+
+	void enter(Machine& m);
+	void onOutput(uint16_t c);
+	void checkVerify(Machine& m);
+
+	bool native(uint16_t addr) const;
+	bool invoke(uint16_t addr, HleContext& ctx);
+
+private:
+	bool compare(const Machine::State& real, std::string& why) const;
+
+	std::map<uint16_t, Entry> m_entries;
+	std::vector<bool> m_hooked;
+
+	bool m_verifying;
+	uint16_t m_verify_addr;
+	uint16_t m_verify_ip;
+	size_t m_verify_depth;
+	std::unique_ptr<Machine::State> m_expected;
+	std::string m_expected_out;
+	std::string m_actual_out;
+};
@@ -0,0 +1,120 @@
+#include "live.hpp"
+#include "data_structures/stack.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+LiveExport::LiveExport() :
+	m_live(nullptr)
+{
+}
+
+LiveExport::~LiveExport()
+{
+	this->stop();
+	this->close();
+}
+
+/*
+ * Creates the segment, e.g. "/synacor-1234", replacing any left behind by
+ * an earlier run
+ */
+bool
+LiveExport::open(const char* name)
+{
+	this->close();
+
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("shm_open");
+		return false;
+	}
+	if (ftruncate(fd, sizeof(live_state)) != 0) {
+		perror("ftruncate");
+		::close(fd);
+		shm_unlink(name);
+		return false;
+	}
+
+	void* mem = mmap(NULL, sizeof(live_state), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		shm_unlink(name);
+		return false;
+	}
+
+	m_live = static_cast<live_state*>(mem);
+	m_live->magic = LIVE_MAGIC;
+	m_live->version = LIVE_VERSION;
+	m_live->size = sizeof(live_state);
+	m_live->pid = getpid();
+	m_name = name;
+	return true;
+}
+
+void
+LiveExport::close()
+{
+	if (!m_live)
+		return;
+
+	munmap(m_live, sizeof(live_state));
+	shm_unlink(m_name.c_str());
+	m_live = nullptr;
+	m_name.clear();
+}
+
+/*
+ * Publishing only makes sense once the segment is open
+ */
+bool
+LiveExport::start(Machine& m, unsigned hz)
+{
+	if (!m_live)
+		return false;
+	return StatePublisher::start(m, hz);
+}
+
+/*
+ * Copies the state into the segment. Runs on the machine's thread; seq is
+ * odd for the duration of the copy.
+ */
+void
+LiveExport::publish(const Machine::State& s, bool waiting)
+{
+	if (!m_live)
+		return;
+
+	uint64_t seq = m_live->seq;
+	__atomic_store_n(&m_live->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	m_live->publishes++;
+	m_live->ticks = s.ticks;
+	m_live->time_ns = uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+	m_live->ip = s.ip;
+	memcpy(m_live->reg, s.reg.data(), sizeof(m_live->reg));
+	m_live->waiting_input = waiting;
+
+	auto& stack = stack_container(s.stack);
+	size_t words = stack.size() < LIVE_STACK_WORDS ? stack.size() :
+		LIVE_STACK_WORDS;
+	m_live->stack_depth = stack.size();
+	m_live->stack_words = words;
+	std::copy(stack.end() - words, stack.end(), m_live->stack);
+	memcpy(m_live->ram, s.ram.data(), sizeof(m_live->ram));
+
+	__atomic_store_n(&m_live->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+uint64_t
+LiveExport::publishes() const
+{
+	return m_live ? m_live->publishes : 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "publisher.hpp"
+#include "live_state.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#define LIVE_DEFAULT_HZ 30
+
+/*
+ * class LiveExport: Publishes the machine's RAM, registers and top of the
+ * stack to a POSIX shared-memory segment (laid out as in live_state.h) so
+ * outside tools can watch a running machine.
+ *
+ * Publishes as a StatePublisher; the copy is made under a sequence lock,
+ * so readers never stop the machine.
+ */
+class LiveExport : public StatePublisher {
+public:
+	LiveExport();
+	~LiveExport();
+
+	bool open(const char* name);
+	void close();
+	bool start(Machine& m, unsigned hz);
+
+	void publish(const Machine::State& s, bool waiting) override;
+
+	const std::string& name() const { return m_name; }
+	uint64_t publishes() const;
+
+private:
+	std::string m_name;
+	live_state* m_live;
+};
@@ -0,0 +1,66 @@
+#ifndef SYNACOR_LIVE_STATE_H
+#define SYNACOR_LIVE_STATE_H
+
+/*
+ * Layout of the shared-memory segment a running machine publishes its state
+ * to (see LiveExport). Plain C so outside tools can map it:
+ *
+ *   int fd = shm_open("/synacor-1234", O_RDONLY, 0);
+ *   const struct live_state* live = mmap(NULL, sizeof(struct live_state),
+ *           PROT_READ, MAP_SHARED, fd, 0);
+ *   struct live_state snap;
+ *   while (!live_state_read(live, &snap))
+ *           ;
+ *
+ * The segment is guarded by a sequence lock: seq is odd while the machine
+ * is writing. A copy is consistent when seq was even before it and did not
+ * change after it. Readers never block the machine; they just retry.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define LIVE_MAGIC 0x4c4e5953u /* "SYNL" */
+#define LIVE_VERSION 1
+
+#define LIVE_RAM_WORDS 0x10000
+#define LIVE_STACK_WORDS 1024
+
+struct live_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;          /* sizeof(struct live_state) */
+	uint32_t pid;           /* process running the machine */
+
+	uint64_t seq;           /* odd while a publish is in progress */
+	uint64_t publishes;
+	uint64_t ticks;
+	uint64_t time_ns;       /* CLOCK_REALTIME of the publish */
+
+	uint16_t ip;
+	uint16_t reg[8];
+	uint16_t waiting_input; /* 1 if blocked on IN */
+	uint32_t stack_depth;   /* full depth of the guest stack */
+	uint32_t stack_words;   /* words copied to stack[], from the top */
+	uint32_t reserved;
+
+	uint16_t stack[LIVE_STACK_WORDS]; /* stack[0] is the deepest copied */
+	uint16_t ram[LIVE_RAM_WORDS];
+};
+
+/*
+ * Copies a consistent snapshot into dst. Returns 0 if a publish got in the
+ * way, in which case the copy must be retried.
+ */
+static inline int
+live_state_read(const struct live_state* src, struct live_state* dst)
+{
+	uint64_t before = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+	if (before & 1)
+		return 0;
+	memcpy(dst, src, sizeof(*dst));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&src->seq, __ATOMIC_RELAXED) == before;
+}
+
+#endif /* SYNACOR_LIVE_STATE_H */
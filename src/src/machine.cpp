@@ -1,34 +1,24 @@
 #include "machine.hpp"
 #include "machine_debug.hpp"
 #include "common.hpp"
+#include "opcodes.hpp"
+#include "profiler.hpp"
+#include "sampler.hpp"
+#include "hle.hpp"
+#include "handlers.hpp"
+#include "shadow.hpp"
+#include "trace.hpp"
+#include "session.hpp"
+#include "taint.hpp"
+#include "publisher.hpp"
 
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <signal.h>
 
-#define HALT 0
-#define SET  1
-#define PUSH 2
-#define POP  3
-#define EQ   4
-#define GT   5
-#define JMP  6
-#define JNZ  7
-#define JZ   8
-#define ADD  9
-#define MULT 10
-#define MOD  11
-#define AND  12
-#define OR   13
-#define NOT  14
-#define RMEM 15
-#define WMEM 16
-#define CALL 17
-#define RET  18
-#define OUT  19
-#define IN   20
-#define NOP  21
+#include "data_structures/stack.h"
 
 #define ASSERT_REG(x) {if ((x)<= 0x7fff || ((x)&0x7fff)>7) { \
 	dprintf(m_err, "Invalid REG! (%04x)\n", (x)); return 1;}}
@@ -37,7 +27,7 @@
 #define CAP(x) ((x)&0x7fff)
 
 Machine::State::State() :
-	ram({0}),
+	ram(),
 	reg({0}),
 	stack(),
 	ip(0),
@@ -81,6 +71,216 @@ Machine::load_program(int fd) {
 	return total_bytes;
 }
 
+size_t
+Machine::load_program(const uint16_t* words, size_t count)
+{
+	count = MIN(count, m_state.ram.size());
+	m_state.ram.fill(0);
+	memcpy(m_state.ram.data(), words, count * sizeof(*words));
+	m_state.reg = {0};
+	m_state.ip = 0;
+	return count * sizeof(*words);
+}
+
+const Machine::State&
+Machine::state() const
+{
+	return m_state;
+}
+
+/*
+ * Sends guest output to a string instead of the output descriptor. Passing
+ * nullptr restores the descriptor.
+ */
+void
+Machine::setOutput(std::string* capture)
+{
+	m_capture = capture;
+}
+
+/*
+ * Queues a line of input, as if it had been read from the input descriptor.
+ * The line must end in a newline and fit in the input buffer.
+ */
+bool
+Machine::feed(const char* line)
+{
+	size_t len = strlen(line);
+	if (len == 0 || len >= MAX_INPUT_SIZE || line[len-1] != '\n')
+		return false;
+
+	memcpy(m_state.buffer, line, len + 1);
+	m_state.buffer_sz = len;
+	m_state.buffer_offset = 0;
+	return true;
+}
+
+/*
+ * True when the next instruction is an IN that would have to read a new line
+ */
+bool
+Machine::waitingInput() const
+{
+	return m_state.ram[m_state.ip] == IN &&
+		m_state.buffer_offset == m_state.buffer_sz;
+}
+
+/*
+ * Runs until the guest asks for a line that has not been fed yet. Returns
+ * false if it halted, failed or spent max_ticks before that.
+ */
+bool
+Machine::runUntilInput(size_t max_ticks)
+{
+	size_t end = m_state.ticks + max_ticks;
+	bool res = true;
+	m_run_start = Metrics::now();
+	while (res && !waitingInput()) {
+		res = m_state.ticks < end && tick(nullptr);
+	}
+	m_run_ns += Metrics::now() - m_run_start;
+	m_run_start = 0;
+	publishMetrics(res);
+	return res;
+}
+
+static inline uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint64_t
+ram_key(uint16_t addr, uint16_t value)
+{
+	return mix64((uint64_t(addr) << 16 | value) + 0x9e3779b97f4a7c15ULL);
+}
+
+/*
+ * Order independent hash of the whole memory: the XOR of one key per
+ * (address, value) pair. A write only has to swap the key of the old value
+ * for the one of the new value.
+ */
+uint64_t
+Machine::ramHash(const State& s)
+{
+	uint64_t hash = 0;
+	for (size_t addr = 0; addr < s.ram.size(); addr++) {
+		hash ^= ram_key(addr, s.ram[addr]);
+	}
+	return hash;
+}
+
+/*
+ * Keeps the memory hash up to date on every write, so stateHash does not
+ * need to go over the whole memory
+ */
+void
+Machine::trackRamHash(bool active)
+{
+	m_track_hash = active;
+	if (active) {
+		m_ram_hash = ramHash(m_state);
+	}
+}
+
+/*
+ * Hash of everything that decides what the guest does next: memory,
+ * registers, stack and ip. Ticks and consumed input are left out, so the
+ * same state reached by different paths hashes the same.
+ */
+uint64_t
+Machine::stateHash() const
+{
+	uint64_t hash = m_track_hash ? m_ram_hash : ramHash(m_state);
+	hash = mix64(hash ^ m_state.ip);
+	for (uint16_t r : m_state.reg) {
+		hash = mix64(hash ^ r);
+	}
+	for (uint16_t v : stack_container(m_state.stack)) {
+		hash = mix64(hash ^ (0x10000 | v));
+	}
+	return hash;
+}
+
+/*
+ * Records which pages of memory get written from now on, so rollback only
+ * has to copy those back
+ */
+void
+Machine::trackDirty(bool active)
+{
+	m_track_dirty = active;
+	m_dirty.fill(0);
+}
+
+size_t
+Machine::dirtyPages() const
+{
+	size_t count = 0;
+	for (uint64_t bits : m_dirty) {
+		count += __builtin_popcountll(bits);
+	}
+	return count;
+}
+
+/*
+ * Returns to base, a state whose memory matched this machine's when dirty
+ * tracking was started. Costs one page copy per page written since then,
+ * instead of a copy of the whole state.
+ */
+void
+Machine::rollback(const State& base)
+{
+	for (size_t i = 0; i < m_dirty.size(); i++) {
+		uint64_t bits = m_dirty[i];
+		while (bits) {
+			size_t page = i * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			size_t offset = page * DIRTY_PAGE_WORDS;
+			if (m_track_hash) {
+				for (size_t a = offset; a < offset + DIRTY_PAGE_WORDS;
+						a++) {
+					m_ram_hash ^= ram_key(a, m_state.ram[a]) ^
+						ram_key(a, base.ram[a]);
+				}
+			}
+			memcpy(&m_state.ram[offset], &base.ram[offset],
+					DIRTY_PAGE_WORDS * sizeof(uint16_t));
+		}
+	}
+	m_dirty.fill(0);
+
+	m_state.reg = base.reg;
+	m_state.stack = base.stack;
+	m_state.ip = base.ip;
+	m_state.ticks = base.ticks;
+	m_state.buffer_sz = base.buffer_sz;
+	m_state.buffer_offset = base.buffer_offset;
+	memcpy(m_state.buffer, base.buffer, base.buffer_sz);
+	m_cov_pending = false;
+}
+
+/*
+ * Counts control flow edges into map, which holds COVERAGE_MAP_SIZE
+ * saturating counters. Every branch instruction (JMP, JNZ, JZ, CALL, RET)
+ * and the ip it leads to make up an edge, so a conditional jump taken and
+ * not taken count separately.
+ */
+void
+Machine::setCoverage(uint8_t* map)
+{
+	m_coverage = map;
+	m_cov_pending = false;
+	setHook(HOOK_COVERAGE, map != nullptr);
+}
+
 uint16_t&
 Machine::get_reg(uint16_t a)
 {
@@ -114,6 +314,11 @@ Machine::readline()
 			return false;
 		}
 
+		if (nbytes == 0) {
+			// End of input
+			return false;
+		}
+
 		if (m_state.buffer[offset] == '\n') {
 			m_state.buffer[offset+1] = '\0';
 			m_state.buffer_sz = offset + 1;
@@ -127,6 +332,66 @@ Machine::readline()
 	return false;
 }
 
+uint16_t
+Machine::load(uint16_t addr)
+{
+	uint16_t value = m_state.ram.at(addr);
+	if (m_shadow) {
+		m_shadow->onRead(addr, m_state.ip, value);
+	}
+	return value;
+}
+
+/*
+ * Writes memory from outside the guest, such as a debugger client, through
+ * the same hooks as WMEM so traces, watchpoints, the RAM hash and the dirty
+ * pages see it
+ */
+void
+Machine::write(uint16_t addr, const uint16_t* words, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		this->store(addr + i, words[i]);
+	}
+}
+
+void
+Machine::store(uint16_t addr, uint16_t value)
+{
+	uint16_t& word = m_state.ram.at(addr);
+	if (m_shadow) {
+		m_shadow->onWrite(addr, m_state.ip, word, value);
+	}
+	if (m_trace) {
+		m_trace->onWrite(addr, value);
+	}
+	if (m_track_hash) {
+		m_ram_hash ^= ram_key(addr, word) ^ ram_key(addr, value);
+	}
+	if (m_track_dirty) {
+		size_t page = addr / DIRTY_PAGE_WORDS;
+		m_dirty[page / 64] |= uint64_t(1) << (page % 64);
+	}
+	word = value;
+}
+
+void
+Machine::put_char(uint16_t c)
+{
+	if (m_hle) {
+		m_hle->onOutput(c);
+	}
+	if (m_session) {
+		m_session->onOutput(c);
+	}
+	m_counters.out_bytes++;
+	if (m_capture) {
+		m_capture->push_back(c);
+	} else {
+		dprintf(m_out, "%c", c);
+	}
+}
+
 bool
 Machine::Set(uint16_t a, uint16_t b) {
 	ASSERT_REG(a);
@@ -159,6 +424,8 @@ bool
 Machine::Push(uint16_t a) {
 	ASSERT_VALID(a);
 	m_state.stack.push(get_val( a));
+	if (m_state.stack.size() > m_counters.stack_max)
+		m_counters.stack_max = m_state.stack.size();
 	m_state.ip += 2;
 	return true;
 }
@@ -241,10 +508,19 @@ Machine::Not(uint16_t a, uint16_t b) {
 }
 
 bool
-Machine::Call(uint16_t a) {
+Machine::Call(uint16_t a, Debugger* dbg) {
 	ASSERT_VALID(a);
 	Push(m_state.ip + 2);
 	Jmp(a);
+
+	// The profiler follows CALL/RET pairs, traces record one instruction
+	// per tick, taint follows guest registers and a debugger may stop
+	// inside the routine, so routines stay in guest code while any of them
+	// is attached
+	if (m_hle && !m_profiler && !m_trace && !m_taint &&
+			!(dbg && dbg->needsGuestCode())) {
+		m_hle->enter(*this);
+	}
 	return true;
 }
 
@@ -272,7 +548,7 @@ bool
 Machine::Rmem(uint16_t a, uint16_t b) {
 	ASSERT_REG(a);
 	ASSERT_VALID(b);
-	get_reg(a) = CAP(m_state.ram.at(get_val(b)));
+	get_reg(a) = CAP(load(get_val(b)));
 	m_state.ip += 3;
 	return true;
 }
@@ -281,7 +557,7 @@ bool
 Machine::Wmem(uint16_t a, uint16_t b) {
 	ASSERT_VALID(a);
 	ASSERT_VALID(b);
-	m_state.ram.at(get_val(a)) = get_val(b);
+	store(get_val(a), get_val(b));
 	m_state.ip += 3;
 	return true;
 }
@@ -297,17 +573,58 @@ Machine::Ret() {
 bool
 Machine::Out(uint16_t a) {
 	ASSERT_VALID(a);
-	dprintf(m_out, "%c", get_val(a));
+	put_char(get_val(a));
 	m_state.ip += 2;
 	return true;
 }
 
+/*
+ * Reads the next line once the buffer is drained, with what goes around
+ * waiting for it: viewers and metrics see the machine wait, and the time
+ * blocked is kept apart. Both IN and native routines read through here.
+ * Returns false at the end of input.
+ */
+bool
+Machine::fetchLine()
+{
+	if (m_state.buffer_offset != m_state.buffer_sz)
+		return true;
+
+	// Viewers see the machine as it waits, not as it last ticked
+	for (StatePublisher* p : m_publishers) {
+		p->publish(m_state, true);
+	}
+	publishMetrics(true);
+
+	uint64_t start = Metrics::now();
+	bool ok = this->readline();
+	m_counters.input_ns += Metrics::now() - start;
+	publishMetrics(false);
+	return ok;
+}
+
+/*
+ * Called before the guest takes a character from the buffer, at the tick
+ * of the IN that takes it. Lines are counted, and go to the session, on
+ * their first character, however they got into the buffer.
+ */
+void
+Machine::startLine(uint64_t tick)
+{
+	if (m_state.buffer_offset != 0)
+		return;
+	m_counters.in_lines++;
+	if (m_session) {
+		m_session->onInput(tick, m_state.buffer);
+	}
+}
+
 bool
 Machine::In(uint16_t a) {
 	ASSERT_VALID(a);
-	if (m_state.buffer_offset == m_state.buffer_sz &&
-			this->readline() == false)
+	if (!this->fetchLine())
 		return false;
+	this->startLine(m_state.ticks);
 	get_reg(a) = m_state.buffer[m_state.buffer_offset];
 	m_state.buffer_offset++;
 	m_state.ip += 2;
@@ -341,7 +658,29 @@ bool Machine::tick(Debugger* dbg) {
 		return false;
 	}
 
+	m_counters.ops[op]++;
+	if ((m_state.ticks & (METRICS_PUBLISH_TICKS - 1)) == 0) {
+		publishMetrics(false);
+	}
+
+	uint32_t hooks = m_hooks.load(std::memory_order_relaxed);
+	if (hooks) {
+		instrument(hooks, op);
+	}
+
 	uint16_t* p = &op;
+	if (!m_decoded.empty() && m_state.ip <= 0xfffc) {
+		Decoded& d = m_decoded[m_state.ip];
+		uint64_t words;
+		memcpy(&words, p, sizeof(words));
+		if (d.words != words) {
+			d.words = words;
+			d.fn = Handlers::decode(p);
+		}
+		if (d.fn)
+			return d.fn(*this, p);
+	}
+
 	switch (op) {
 		case HALT:
 			dprintf(m_out, "Program halted!\n");
@@ -367,7 +706,7 @@ bool Machine::tick(Debugger* dbg) {
 		case NOT:  return Not (p[1], p[2]);
 		case RMEM: return Rmem(p[1], p[2]);
 		case WMEM: return Wmem(p[1], p[2]);
-		case CALL: return Call(p[1]);
+		case CALL: return Call(p[1], dbg);
 		case RET:  return Ret ();
 		case OUT:  return Out (p[1]);
 		case IN:   return In  (p[1]);
@@ -376,10 +715,232 @@ bool Machine::tick(Debugger* dbg) {
 	}
 }
 
+/*
+ * Runs until the machine halts or, given a limit, has executed max_ticks
+ * instructions in total
+ */
+void
+Machine::run(Debugger* dbg, uint64_t max_ticks)
+{
+	m_run_start = Metrics::now();
+	if (max_ticks == 0) {
+		while (tick(dbg));
+	} else {
+		while (m_state.ticks < max_ticks && tick(dbg));
+	}
+	m_run_ns += Metrics::now() - m_run_start;
+	m_run_start = 0;
+	publishMetrics(false);
+}
+
+/*
+ * Hands the counters over to readers. Time executing is the time spent in
+ * run() or runUntilInput(), less the time blocked reading input.
+ */
+void
+Machine::publishMetrics(bool waiting)
+{
+	uint64_t run_ns = m_run_ns;
+	if (m_run_start)
+		run_ns += Metrics::now() - m_run_start;
+	m_counters.run_ns = run_ns > m_counters.input_ns ?
+		run_ns - m_counters.input_ns : 0;
+	m_metrics.publish(m_state.ticks, m_counters, m_run_start != 0,
+			waiting);
+}
+
+const Metrics&
+Machine::metrics() const
+{
+	return m_metrics;
+}
+
+void
+Machine::setHook(uint32_t hook, bool active)
+{
+	if (active) {
+		m_hooks.fetch_or(hook);
+	} else {
+		m_hooks.fetch_and(~hook);
+	}
+}
+
+void
+Machine::instrument(uint32_t hooks, uint16_t op)
+{
+	if (hooks & HOOK_COVERAGE) {
+		uint16_t ip = m_state.ip;
+		if (m_cov_pending) {
+			uint32_t edge = (uint32_t(m_cov_from) << 16 | ip) *
+				0x9e3779b1u;
+			uint8_t& hits = m_coverage[edge >> (32 - COVERAGE_BITS)];
+			hits += hits != 0xff;
+		}
+		m_cov_pending = op == JMP || op == JNZ || op == JZ ||
+			op == CALL || op == RET;
+		m_cov_from = ip;
+	}
+
+	if (hooks & HOOK_PROFILE) {
+		m_profiler->onOp(m_state.ip, op);
+	}
+
+	if (hooks & HOOK_SAMPLE) {
+		m_hooks.fetch_and(~HOOK_SAMPLE);
+		if (m_sampler) {
+			m_sampler->take(m_state);
+		}
+	}
+
+	if (hooks & HOOK_HLE_VERIFY) {
+		m_hle->checkVerify(*this);
+	}
+
+	if (hooks & HOOK_FETCH) {
+		m_shadow->onFetch(m_state.ip, op);
+	}
+
+	if (hooks & HOOK_TRACE) {
+		m_trace->step(m_state, op);
+	}
+
+	if (hooks & HOOK_TAINT) {
+		m_taint->step(m_state, op);
+	}
+
+	if (hooks & HOOK_PUBLISH) {
+		m_hooks.fetch_and(~HOOK_PUBLISH);
+		for (StatePublisher* p : m_publishers) {
+			if (p->takeDue())
+				p->publish(m_state, false);
+		}
+	}
+}
+
+void
+Machine::setProfiler(Profiler* profiler)
+{
+	m_profiler = profiler;
+	setHook(HOOK_PROFILE, profiler != nullptr);
+}
+
+void
+Machine::setSampler(Sampler* sampler)
+{
+	m_sampler = sampler;
+}
+
+/*
+ * Attaches shadow memory, which counts every read and write from then on.
+ * Counting instruction fetches as well goes through the per tick hooks, so
+ * it is left to the caller.
+ */
+void
+Machine::setShadow(Shadow* shadow, bool fetches)
+{
+	setHook(HOOK_FETCH, false);
+	m_shadow = shadow;
+	setHook(HOOK_FETCH, shadow && fetches);
+}
+
+/*
+ * Attaches a trace recorder, which gets every instruction and memory write
+ * from then on. Closing the trace is left to the caller.
+ */
+void
+Machine::setTrace(TraceWriter* trace)
+{
+	setHook(HOOK_TRACE, false);
+	m_trace = trace;
+	setHook(HOOK_TRACE, trace != nullptr);
+}
+
+/*
+ * Attaches taint tracking, which follows input through every instruction
+ * from then on. Values already in the machine start out clean.
+ */
+void
+Machine::setTaint(Taint* taint)
+{
+	setHook(HOOK_TAINT, false);
+	m_taint = taint;
+	setHook(HOOK_TAINT, taint != nullptr);
+}
+
+/*
+ * Attaches a publisher, which copies the state out when it is due and
+ * whenever the machine blocks on input. Only call these from the machine's
+ * thread or while it is not running.
+ */
+void
+Machine::addPublisher(StatePublisher* publisher)
+{
+	m_publishers.push_back(publisher);
+}
+
+void
+Machine::removePublisher(StatePublisher* publisher)
+{
+	m_publishers.erase(std::remove(m_publishers.begin(),
+				m_publishers.end(), publisher), m_publishers.end());
+}
+
+/*
+ * Attaches a session, which records every line read and every character
+ * written from then on
+ */
+void
+Machine::setSession(Session* session)
+{
+	m_session = session;
+}
+
+/*
+ * Attaches a registry of native routines, binding those whose code matches
+ * the current image. Returns how many were bound.
+ */
+size_t
+Machine::setHle(Hle* hle)
+{
+	m_hle = hle;
+	return hle ? hle->bind(m_state) : 0;
+}
+
+/*
+ * Runs instructions through the handlers specialized for their operand
+ * kinds. Each instruction site is decoded once and keeps its variant for
+ * as long as the words it was decoded from stay the same, so code that
+ * rewrites itself is decoded again on its next run.
+ */
+void
+Machine::setSpecialized(bool active)
+{
+	if (active) {
+		m_decoded.assign(0x1 << 16, Decoded{0, nullptr});
+	} else {
+		m_decoded.clear();
+		m_decoded.shrink_to_fit();
+	}
+}
+
+/*
+ * Asks the machine to record a sample before its next instruction. Only
+ * touches a lock-free atomic, so it is safe to call from a signal handler.
+ */
+void
+Machine::requestSample()
+{
+	m_hooks.fetch_or(HOOK_SAMPLE, std::memory_order_relaxed);
+}
+
+/*
+ * Asks the machine to publish its state to the publishers that are due
+ * before its next instruction. Safe to call from any thread.
+ */
 void
-Machine::run(Debugger* dbg)
+Machine::requestPublish()
 {
-	while (tick(dbg));
+	m_hooks.fetch_or(HOOK_PUBLISH, std::memory_order_relaxed);
 }
 
 void
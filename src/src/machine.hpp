@@ -7,13 +7,36 @@
 #include <stdio.h>
 
 #include <memory>
+#include <atomic>
 #include <array>
 #include <stack>
 #include <mutex>
 #include <condition_variable>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+#include "metrics.hpp"
 
 #define MAX_INPUT_SIZE 128
 
+#define DIRTY_PAGE_WORDS 256
+#define DIRTY_PAGES ((0x1 << 16) / DIRTY_PAGE_WORDS)
+
+#define COVERAGE_BITS 14
+#define COVERAGE_MAP_SIZE (0x1 << COVERAGE_BITS)
+
+class Profiler;
+class Sampler;
+class Hle;
+class Explorer;
+class Shadow;
+class TraceWriter;
+class Taint;
+class StatePublisher;
+class Session;
+class HandlerVariants;
+
 /*
  * struct machine: Represents the state of the virtual machine at any point
  * in time
@@ -24,7 +47,7 @@ public:
 		State();
 		~State();
 
-		std::array<uint16_t, 0x1 << 16> ram;
+		Memory ram;
 		std::array<uint16_t, 8> reg;
 		std::stack<uint16_t> stack;
 		uint16_t ip;
@@ -40,6 +63,12 @@ public:
 		virtual void beforeOp(Machine& m) = 0;
 		virtual bool beforeHalted(Machine& m) = 0;
 
+		/*
+		 * True while the debugger has to see each instruction and
+		 * input stop of the guest, which native routines would hide
+		 */
+		virtual bool needsGuestCode() const { return false; }
+
 		const State& getState(const Machine& m);
 
 		State& getState(Machine& m) {
@@ -51,21 +80,86 @@ public:
 	};
 
 	friend class Debugger;
+	friend class Hle;
+	friend class HleContext;
+	friend class Explorer;
+	friend class Fuzzer;
+	friend class Timeline;
+	friend class HandlerVariants;
 
 	Machine(int in, int out, int err);
 	~Machine() {}
 
 	bool tick(Debugger* dbg);
-	void run(Debugger* dbg);
+	void run(Debugger* dbg, uint64_t max_ticks = 0);
 	void stop();
 
+	void setProfiler(Profiler* profiler);
+	void setSampler(Sampler* sampler);
+	void requestSample();
+	void requestPublish();
+	size_t setHle(Hle* hle);
+	void setSpecialized(bool active);
+	bool specialized() const { return !m_decoded.empty(); }
+
 	size_t load_program(int fd);
+	size_t load_program(const uint16_t* words, size_t count);
+
+	const State& state() const;
+	void write(uint16_t addr, const uint16_t* words, size_t count);
+
+	void setOutput(std::string* capture);
+	bool feed(const char* line);
+	bool waitingInput() const;
+	bool runUntilInput(size_t max_ticks);
+
+	void trackRamHash(bool active);
+	uint64_t stateHash() const;
+	static uint64_t ramHash(const State& s);
+
+	void trackDirty(bool active);
+	size_t dirtyPages() const;
+	void rollback(const State& base);
+
+	void setCoverage(uint8_t* map);
+	void setShadow(Shadow* shadow, bool fetches);
+	void setTrace(TraceWriter* trace);
+	void setTaint(Taint* taint);
+	void addPublisher(StatePublisher* publisher);
+	void removePublisher(StatePublisher* publisher);
+
+	const Metrics& metrics() const;
+	void setSession(Session* session);
 
 private:
+	/*
+	 * Instrumentation hooks. The interpreter loop tests the whole mask
+	 * once per tick, so idle hooks cost nothing beyond that single load.
+	 */
+	enum Hook : uint32_t {
+		HOOK_PROFILE = 1 << 0,
+		HOOK_SAMPLE  = 1 << 1,
+		HOOK_HLE_VERIFY = 1 << 2,
+		HOOK_COVERAGE = 1 << 3,
+		HOOK_FETCH = 1 << 4,
+		HOOK_TRACE = 1 << 5,
+		HOOK_TAINT = 1 << 6,
+		HOOK_PUBLISH = 1 << 7,
+	};
+
+	void setHook(uint32_t hook, bool active);
+	void instrument(uint32_t hooks, uint16_t op);
+
 	uint16_t& get_reg(uint16_t a);
 	uint16_t get_val(uint16_t a);
 
 	bool readline();
+	bool fetchLine();
+	void startLine(uint64_t tick);
+	void publishMetrics(bool waiting);
+	uint16_t load(uint16_t addr);
+	void store(uint16_t addr, uint16_t value);
+	void put_char(uint16_t c);
 
 	bool Set (uint16_t a, uint16_t b);
 	bool Push(uint16_t a);
@@ -83,7 +177,7 @@ private:
 	bool Not (uint16_t a, uint16_t b);
 	bool Rmem(uint16_t a, uint16_t b);
 	bool Wmem(uint16_t a, uint16_t b);
-	bool Call(uint16_t a);
+	bool Call(uint16_t a, Debugger* dbg);
 	bool Ret ();
 	bool Out (uint16_t a);
 	bool In  (uint16_t a);
@@ -97,6 +191,45 @@ private:
 
 	bool m_stop_flag = false;
 
+	std::string* m_capture = nullptr;
+	bool m_track_hash = false;
+	uint64_t m_ram_hash = 0;
+
+	bool m_track_dirty = false;
+	std::array<uint64_t, DIRTY_PAGES / 64> m_dirty{};
+
+	uint8_t* m_coverage = nullptr;
+	uint16_t m_cov_from = 0;
+	bool m_cov_pending = false;
+
+	Shadow* m_shadow = nullptr;
+	TraceWriter* m_trace = nullptr;
+	Taint* m_taint = nullptr;
+	std::vector<StatePublisher*> m_publishers;
+	Session* m_session = nullptr;
+
+	// Counted on the machine's thread, published to m_metrics
+	Metrics::Counters m_counters;
+	uint64_t m_run_ns = 0;
+	uint64_t m_run_start = 0;
+	Metrics m_metrics;
+
+	std::atomic<uint32_t> m_hooks{0};
+	Profiler* m_profiler = nullptr;
+	Sampler* m_sampler = nullptr;
+	Hle* m_hle = nullptr;
+
+	/*
+	 * An instruction site decoded for the specialized handlers: the words
+	 * at ip it was decoded from, and its handler, null where the generic
+	 * one runs
+	 */
+	struct Decoded {
+		uint64_t words;
+		bool (*fn)(Machine& m, const uint16_t* p);
+	};
+	std::vector<Decoded> m_decoded;
+
 	std::mutex m_mux;
 	std::condition_variable m_cond;
 };
@@ -2,8 +2,14 @@
 #include "common.hpp"
 #include "machine.hpp"
 #include "data_structures/stack.h"
+#include "analysis/disasm.hpp"
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#include <deque>
 
 #define CIRCULAR_SIZE 105
 #define MAX_BREAKPOINTS 500
@@ -12,24 +18,7 @@
 #define MAX_MEMORIES 10
 
 #define MAX_ADDR 0x7fff
-
-static std::string op_to_mem_repr(uint16_t addr);
-
-static std::string op_to_mem_repr(uint16_t addr) {
-	static char res[50];
-	if (addr <= 0x7fff) {
-		snprintf(res, 50, "%04x", addr);
-		return res;
-	}
-
-	addr &= 0x7fff;
-	if (addr <= 7) {
-		snprintf(res, 50, "R%u", addr);
-	} else {
-		snprintf(res, 50, "%04x?", addr);
-	}
-	return res;
-}
+#define HEXDUMP_LINE 128
 
 Debugger::Debugger() :
 	m_states(MAX_STATES),
@@ -42,7 +31,8 @@ Debugger::Debugger() :
 	m_dbg_stack(false),
 	m_dbg_regs(false),
 	m_dbg_disass(false),
-	m_dbg_memory(false)
+	m_dbg_memory(false),
+	m_dbg_diff(false)
 {
 
 }
@@ -58,16 +48,42 @@ Debugger::setDebug(bool value)
 	m_dbg_enabled = value;
 }
 
+/*
+ * The shell is a client of the debugger protocol like any other, only
+ * in-process: commands are requests to m_proto, printed from the response.
+ * Returns false, after printing it, if the answer is not of the given type.
+ */
+bool
+Debugger::request(const Machine::State& s, DebugFrame& req, DebugFrame& resp,
+		uint16_t type)
+{
+	m_proto.handle(s, req, resp);
+	if (resp.type == type)
+		return true;
+
+	if (resp.type == DBG_ERROR && resp.payload.size() >= 2) {
+		printf("Error: %.*s\n", int(resp.payload.size() - 2),
+				(const char*)resp.payload.data() + 2);
+	}
+	return false;
+}
+
 void
 Debugger::printStack(const Machine::State& s)
 {
-	std::stack<uint16_t> tmp = s.stack;
+	DebugFrame req, resp;
+	req.type = DBG_READ_STACK;
+	if (!request(s, req, resp, DBG_STACK))
+		return;
+
+	size_t pos = 0;
+	uint32_t depth = 0;
+	uint16_t val;
+	resp.get(pos, depth);
 
 	printf("STACK TOP\n");
-	while (tmp.size()) {
-		uint16_t val = tmp.top();
+	while (resp.get(pos, val)) {
 		printf(": 0x%04x\n", val);
-		tmp.pop();
 	}
 	printf("STACK BASE\n");
 }
@@ -79,29 +95,37 @@ char get_printable(uint16_t val) {
 	return '.';
 }
 
+/*
+ * Formats one 16-word row of a memory dump into buffer, which should hold
+ * at least HEXDUMP_LINE bytes. Words not marked in exist are left blank.
+ */
 void debugger_print_helper(char* buffer, size_t nbytes, uint16_t page,
 		uint16_t* values, uint16_t* exist) {
-	nbytes -= snprintf(buffer, nbytes, "%04x: ", page);
+	size_t n = 0;
+	auto append = [&](const char* fmt, auto... args) {
+		if (n < nbytes)
+			n += snprintf(buffer + n, nbytes - n, fmt, args...);
+	};
+
+	append("%04x: ", page);
 	for (int i=0; i<16; i++) {
 		if (i == 8) {
-			nbytes -= snprintf(buffer, nbytes, " ");
+			append(" ");
 		}
 		if (exist[i]) {
-			nbytes -= snprintf(buffer, nbytes, "%04x ", values[i]);
+			append("%04x ", values[i]);
 		} else {
-			nbytes -= snprintf(buffer, nbytes, "     ");
+			append("     ");
 		}
 	}
-	nbytes -= snprintf(buffer, nbytes, "| ");
+	append("| ");
 	for (int i=0; i<16; i++) {
 		if (i == 8) {
-			nbytes -= snprintf(buffer, nbytes, " ");
+			append(" ");
 		}
-		nbytes -= snprintf(buffer, nbytes, "%c", exist[i] ?
-				get_printable(values[i]) : ' ');
+		append("%c", exist[i] ? get_printable(values[i]) : ' ');
 	}
-	nbytes -= snprintf(buffer, nbytes, " |\n");
-	fflush(stdout);
+	append(" |\n");
 }
 
 void
@@ -114,19 +138,27 @@ Debugger::printMemory(const Machine::State& s, uint16_t addr,
 	uint16_t next_page = curr_page + 0x10;
 	size_t num_elems = 0;
 
-	char strbuffer[80];
+	char strbuffer[HEXDUMP_LINE];
+
+	DebugFrame req, resp;
+	req.type = DBG_READ_RAM;
+	req.put(DebugRange{addr, size});
+	if (!request(s, req, resp, DBG_RAM))
+		return;
+	const uint8_t* words = resp.payload.data() + sizeof(DebugRange);
 
 	printf("MEMORY DUMP (%04x, %04x)\n", addr, addr + size);
 	while (size) {
 		int index = addr - curr_page;
 		exist[index] = 1;
-		buffer[index] = s.ram[addr];
+		memcpy(&buffer[index], words, sizeof(uint16_t));
+		words += sizeof(uint16_t);
 		size--;
 		addr++;
 		num_elems++;
 		if (addr == next_page) {
-			debugger_print_helper(strbuffer, 80, curr_page,
-					buffer, exist);
+			debugger_print_helper(strbuffer, HEXDUMP_LINE,
+					curr_page, buffer, exist);
 			printf("%s", strbuffer);
 			curr_page = next_page;
 			next_page += 0x10;
@@ -137,7 +169,8 @@ Debugger::printMemory(const Machine::State& s, uint16_t addr,
 	}
 
 	if (num_elems) {
-		debugger_print_helper(strbuffer, 80, curr_page, buffer, exist);
+		debugger_print_helper(strbuffer, HEXDUMP_LINE, curr_page, buffer,
+				exist);
 		printf("%s", strbuffer);
 	}
 }
@@ -145,12 +178,21 @@ Debugger::printMemory(const Machine::State& s, uint16_t addr,
 void
 Debugger::printRegs(const Machine::State& s)
 {
-	auto& reg = s.reg;
+	DebugFrame req, resp;
+	req.type = DBG_READ_REGS;
+	if (!request(s, req, resp, DBG_REGS))
+		return;
+
+	DebugRegs regs;
+	size_t pos = 0;
+	resp.get(pos, regs);
+
+	auto& reg = regs.reg;
 	printf("R0: %04x, R1: %04x, R2: %04x, R3: %04x\n",
 			reg[0], reg[1], reg[2], reg[3]);
 	printf("R4: %04x, R5: %04x, R6: %04x, R7: %04x\n",
 			reg[4], reg[5], reg[6], reg[7]);
-	printf("IP: %04x    TICKS: %lu\n", s.ip, s.ticks);
+	printf("IP: %04x    TICKS: %lu\n", regs.ip, regs.ticks);
 }
 
 void
@@ -162,53 +204,139 @@ Debugger::disassemble(const Machine::State& s, size_t opcodes)
 void
 Debugger::disassemble(const Machine::State& s, size_t opcodes, size_t ip)
 {
-	uint16_t op;
-
-	std::string op_names[] = {
-		"HALT", "SET", "PUSH", "POP", "EQ",  "GT", "JMP", "JNZ",
-		"JZ",   "ADD", "MULT", "MOD", "AND", "OR", "NOT", "RMEM",
-		"WMEM", "CALL", "RET", "OUT", "IN", "NOP"
-	};
-
-	uint16_t op_size[] = {
-		0, 2, 1, 1, 3, 3, 1, 2,
-		2, 3, 3, 3, 3, 3, 2, 2,
-		2, 1, 0, 1, 1, 0
-	};
-
-	int currLine = 0;
+	m_disass_next_op_size = 1;
 
 	bool first = true;
 	for (; opcodes--; ) {
 		if (ip > MAX_ADDR)
 			break;
 
-		op = s.ram[ip];
+		Instruction ins = decode(s.ram.data(), ip);
 		if (first) {
-			m_disass_next_op_size = 1;
+			m_disass_next_op_size = ins.size();
 		}
-		printf("0x%04lx: ", ip);
-		if (op >= ARRAY_SIZE(op_names)) {
-			printf("%04x%10s???\n", op, "");
+
+		const Symbol* sym = m_symbols.at(ip);
+		if (sym)
+			printf("%s:\n", sym->name.c_str());
+		std::string text = format(ins, &m_symbols);
+		const std::string* note = m_symbols.comment(ip);
+		if (note) {
+			printf("0x%04lx: %-26s ; %s\n", ip, text.c_str(),
+					note->c_str());
 		} else {
-			size_t num_ops = op_size[op];
-			if (first) {
-				m_disass_next_op_size = num_ops + 1;
-			}
-			printf("%-4s", op_names[op].c_str());
-			for (size_t i=0; i<num_ops; i++) {
-				printf(" %-5s", op_to_mem_repr(s.ram[ip+1+i])
-						.c_str());
-			}
-			printf("\n");
-			ip += num_ops;
+			printf("0x%04lx: %s\n", ip, text.c_str());
 		}
-		ip++;
-		currLine++;
+		ip += ins.size();
 		first = false;
 	}
 }
 
+bool
+Debugger::loadSymbols(const char* path)
+{
+	return m_symbols.load(path);
+}
+
+/*
+ * Reads an address for a command: hex, or a symbol with an optional +N/-N
+ */
+bool
+Debugger::address(const char* args, uint16_t& addr) const
+{
+	if (m_symbols.parseAddress(args, addr))
+		return true;
+
+	char token[64] = "";
+	sscanf(args, "%63s", token);
+	printf("Unknown address %s.\n", token);
+	return false;
+}
+
+/*
+ * Walks the stack for words that look like return addresses, right after a
+ * CALL, so it can be wrong where data happens to match
+ */
+void
+Debugger::printBacktrace(const Machine::State& s)
+{
+	DebugFrame req, resp;
+	req.type = DBG_READ_STACK;
+	if (!request(s, req, resp, DBG_STACK))
+		return;
+
+	std::string where = m_symbols.describe(s.ip);
+	printf("#0  %04x %s\n", s.ip, where.c_str());
+
+	size_t pos = 0, frame = 1;
+	uint32_t depth = 0;
+	uint16_t val;
+	resp.get(pos, depth);
+	while (resp.get(pos, val)) {
+		if (val < 2 || val > MAX_ADDR)
+			continue;
+
+		Instruction call = decode(s.ram.data(), val - 2);
+		if (!call.valid || call.op != CALL)
+			continue;
+
+		where = m_symbols.describe(val - 2);
+		printf("#%-2lu %04x %s", frame++, val - 2, where.c_str());
+		uint16_t dest;
+		if (call.target(dest)) {
+			std::string callee = m_symbols.describe(dest);
+			printf("%scalls %s", where.empty() ? "" : ", ",
+					callee.empty() ? operand_repr(dest).c_str() :
+					callee.c_str());
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * Names the functions the CFG finds that have no symbol yet, and writes the
+ * whole table to path if given
+ */
+void
+Debugger::symbolsFromCfg(const Machine::State& s, const char* path)
+{
+	if (m_profiler) {
+		auto targets = m_profiler->callTargets();
+		m_cfg_cache.addEntries(targets.begin(), targets.end());
+	}
+	m_cfg_cache.addEntry(s.ip);
+
+	size_t added = m_symbols.addFromCfg(*m_cfg_cache.get(s.ram.data()));
+	printf("%lu functions named, %lu symbols.\n", added, m_symbols.size());
+	if (path && !m_symbols.save(path))
+		printf("Could not write %s.\n", path);
+}
+
+void
+Debugger::analyze(const Machine::State& s, const char* path)
+{
+	if (m_profiler) {
+		auto targets = m_profiler->callTargets();
+		m_cfg_cache.addEntries(targets.begin(), targets.end());
+	}
+	m_cfg_cache.addEntry(s.ip);
+
+	auto cfg = m_cfg_cache.get(s.ram.data());
+	if (!path) {
+		cfg->printSummary(stdout);
+		return;
+	}
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		printf("Could not open %s.\n", path);
+		return;
+	}
+	cfg->printSummary(f);
+	cfg->printBlocks(f, s.ram.data());
+	fclose(f);
+}
+
 void
 Debugger::dumpState(const Machine::State& s)
 {
@@ -227,16 +355,35 @@ Debugger::dumpState(const Machine::State& s)
 	if (m_dbg_disass) {
 		disassemble(s, m_debug_opcodes, m_disass_pos);
 	}
+
+	if (m_dbg_diff) {
+		if (m_diff_prev.size() == s.ram.size()) {
+			DiffSet diff = diff_memory(m_diff_prev.data(),
+					s.ram.data(), s.ram.size());
+			if (diff.count()) {
+				printf("MEMORY CHANGED\n");
+				print_spans(stdout, diff.spans(), 16);
+			}
+		}
+		m_diff_prev.assign(s.ram.begin(), s.ram.end());
+	}
 }
 
 void
-Debugger::listBreakpoints()
+Debugger::listBreakpoints(const Machine::State& s)
 {
+	DebugFrame req, resp;
+	req.type = DBG_BREAK_LIST;
+	if (!request(s, req, resp, DBG_BREAKS))
+		return;
+
 	printf("BREAKPOINTS: \n");
-	if (m_breakpoints.size() == 0) {
+	if (resp.payload.empty()) {
 		printf("   EMPTY\n");
 	} else {
-		for (uint16_t p : m_breakpoints) {
+		size_t pos = 0;
+		uint16_t p;
+		while (resp.get(pos, p)) {
 			printf(" + %04x\n", p);
 		}
 	}
@@ -245,81 +392,135 @@ Debugger::listBreakpoints()
 void
 Debugger::saveStack(const Machine::State& s, size_t save_pos)
 {
-	if (save_pos >= m_stacks.size())
+	if (save_pos >= m_stacks.size()) {
+		printf("Invalid save position.\n");
 		return;
+	}
 	this->m_stacks[save_pos] = {true, s.stack};
 }
 
 void
 Debugger::compareStacks(size_t pos0, size_t pos1)
 {
-	if (!m_stacks.at(pos0).first) {
-		std::cerr << "No stack found at position=" << pos0 << std::endl;
+	if (pos0 >= m_stacks.size() || !m_stacks[pos0].first) {
+		printf("No stack found at position=%lu\n", pos0);
+		return;
 	}
 
-	if (!m_stacks.at(pos1).first) {
-		std::cerr << "No stack found at position=" << pos1 << std::endl;
+	if (pos1 >= m_stacks.size() || !m_stacks[pos1].first) {
+		printf("No stack found at position=%lu\n", pos1);
+		return;
 	}
 
-	stack_show_compare(m_stacks.at(pos0).second, m_stacks.at(pos1).second);
+	auto& c0 = stack_container(m_stacks[pos0].second);
+	auto& c1 = stack_container(m_stacks[pos1].second);
+	DiffSet diff = diff_stacks(m_stacks[pos0].second,
+			m_stacks[pos1].second);
+
+	printf("STACK DIFF (%lu, %lu elements)\n", c0.size(), c1.size());
+	for (const DiffSpan& span : diff.spans()) {
+		for (size_t i = span.start; i < span.start + span.length; i++) {
+			printf("%4lu: ", i);
+			if (i < c0.size()) {
+				printf("%04x - ", c0[i]);
+			} else {
+				printf(".... - ");
+			}
+			if (i < c1.size()) {
+				printf("%04x\n", c1[i]);
+			} else {
+				printf("....\n");
+			}
+		}
+	}
+	printf("%lu of %lu positions differ\n", diff.count(), diff.size());
 }
 
+/*
+ * Prints the rows of [addr, addr + size) where two saved memories differ,
+ * followed by the changed spans. The whole image is compared at once,
+ * which takes microseconds.
+ */
 void
-Debugger::compareMemory(size_t pos0, size_t pos1, uint16_t addr, uint16_t size)
+Debugger::compareMemory(size_t pos0, size_t pos1, uint16_t addr, size_t size)
 {
-	if (pos0 > m_rams.size() || pos1 > m_rams.size())
+	if (pos0 >= m_rams.size() || pos1 >= m_rams.size())
 		return;
 
-	if (!m_rams.at(pos0).first || !m_rams.at(pos1).first)
+	if (!m_rams.at(pos0).first || !m_rams.at(pos1).first) {
+		printf("No memory saved at %lu or %lu\n", pos0, pos1);
 		return;
+	}
 
 	auto& ram1 = m_rams.at(pos0).second;
 	auto& ram2 = m_rams.at(pos1).second;
+	DiffSet diff = diff_memory(ram1.data(), ram2.data(), ram1.size());
+	std::vector<DiffSpan> spans = diff.spans(addr, addr + size);
 
 	uint16_t buffer1[16] = {0};
 	uint16_t buffer2[16] = {0};
 	uint16_t exist[16] = {0};
-	uint16_t curr_page = addr & (~0xf);
-	uint16_t next_page = curr_page + 0x10;
-	size_t num_equals = 0;
-
-	char buffer[80];
-
-	printf("MEMORY DIFF (%04x, %04x)\n", addr, addr + size);
-	while (size) {
-		int index = addr - curr_page;
-		exist[index] = ram1[addr] != ram2[addr];
-		if (exist[index]) {
-			buffer1[index] = ram1[addr];
-			buffer2[index] = ram2[addr];
-			num_equals++;
-		}
-		size--;
-		addr++;
-		if (addr == next_page) {
-			if (num_equals) {
-				debugger_print_helper(buffer, 80, curr_page,
-						buffer1, exist);
-				debugger_print_helper(buffer, 80, curr_page,
-						buffer2, exist);
+	char buffer[HEXDUMP_LINE];
+
+	printf("MEMORY DIFF (%04x, %04lx)\n", addr, addr + size);
+	size_t next_row = 0;
+	for (const DiffSpan& span : spans) {
+		size_t row = MAX(size_t(span.start & ~0xf), next_row);
+		for (; row < span.start + span.length; row += 0x10) {
+			for (size_t i = 0; i < 16; i++) {
+				size_t pos = row + i;
+				exist[i] = pos >= addr && pos < addr + size &&
+					diff.test(pos);
+				buffer1[i] = ram1[pos];
+				buffer2[i] = ram2[pos];
 			}
-			curr_page = next_page;
-			next_page += 0x10;
-			memset(exist, 0, sizeof(exist));
-			num_equals = 0;
+			debugger_print_helper(buffer, HEXDUMP_LINE, row,
+					buffer1, exist);
+			printf("%s", buffer);
+			debugger_print_helper(buffer, HEXDUMP_LINE, row,
+					buffer2, exist);
+			printf("%s", buffer);
+		}
+		next_row = row;
+	}
+	print_spans(stdout, spans, 32);
+}
+
+/*
+ * Diffs a series of saved memories, each against the next, and lists the
+ * words that changed in every step (or in any of them)
+ */
+void
+Debugger::compareMemorySeries(const std::vector<size_t>& positions,
+		bool every)
+{
+	std::vector<const uint16_t*> images;
+	for (size_t pos : positions) {
+		if (pos >= m_rams.size() || !m_rams[pos].first) {
+			printf("No memory saved at %lu\n", pos);
+			return;
 		}
+		images.push_back(m_rams[pos].second.data());
 	}
-	if (num_equals) {
-		debugger_print_helper(buffer, 80, curr_page, buffer1, exist);
-		debugger_print_helper(buffer, 80, curr_page, buffer2, exist);
+
+	if (images.size() < 2) {
+		printf("Need at least two saved memories\n");
+		return;
 	}
+
+	DiffSet diff = diff_series(images, 0x8000, every);
+	printf("Words changed in %s of %lu steps:\n", every ? "every" : "any",
+			images.size() - 1);
+	print_spans(stdout, diff.spans(), 64);
 }
 
 void
 Debugger::saveState(const Machine::State& s, size_t save_pos)
 {
-	if (save_pos > m_states.size())
+	if (save_pos >= m_states.size()) {
+		printf("Invalid save position.\n");
 		return;
+	}
 	this->m_states.at(save_pos).first = true;
 	this->m_states.at(save_pos).second = s;
 }
@@ -327,28 +528,27 @@ Debugger::saveState(const Machine::State& s, size_t save_pos)
 void
 Debugger::loadState(Machine::State& s, size_t save_pos)
 {
-	if (save_pos > m_states.size())
-		return;
-	if (!m_states.at(save_pos).first)
+	if (save_pos >= m_states.size() || !m_states.at(save_pos).first) {
+		printf("Invalid load position.\n");
 		return;
+	}
 	s = m_states.at(save_pos).second;
 }
 
 void
 Debugger::saveMemory(const Machine::State& s, size_t save_pos)
 {
-	if (save_pos > m_rams.size())
+	if (save_pos >= m_rams.size()) {
+		printf("Invalid save position.\n");
 		return;
+	}
 	this->m_rams.at(save_pos) = { true, s.ram };
 }
 
 void
 Debugger::loadMemory(Machine::State& s, size_t save_pos)
 {
-	if (save_pos > m_rams.size())
-		return;
-
-	if (m_rams.at(save_pos).first == false) {
+	if (save_pos >= m_rams.size() || m_rams.at(save_pos).first == false) {
 		printf("Invalid load position.\n");
 		return;
 	}
@@ -356,162 +556,1378 @@ Debugger::loadMemory(Machine::State& s, size_t save_pos)
 	s.ram = m_rams.at(save_pos).second;
 }
 
+/*
+ * Makes the machine's memory the base image of every state and memory
+ * saved from now on, which then only hold the pages that differ from it
+ */
 void
-Debugger::setBreakpoint(uint16_t ip, bool active)
+Debugger::shareMemory(Machine::State& s)
 {
-	if (active) {
-		this->m_breakpoints.insert(ip);
-	} else {
-		auto it = this->m_breakpoints.find(ip);
-		if (it != this->m_breakpoints.end()) {
-			this->m_breakpoints.erase(it);
-		}
+	if (!s.ram.makeShared()) {
+		printf("Cannot create a shared memory image.\n");
+		return;
 	}
+	printf("Saved states now share the current memory.\n");
 }
 
-bool
-Debugger::shell(Machine::State& s)
+void
+Debugger::printMemoryUsage(const Machine::State& s)
+{
+	MemoryUsage total = s.ram.usage();
+	printf("%-10s %10s %10s\n", "MEMORY", "SHARED", "PRIVATE");
+	printf("%-10s %9luK %9luK\n", "machine", total.shared / 1024,
+			total.priv / 1024);
+
+	for (size_t i = 0; i < m_states.size(); i++) {
+		if (!m_states[i].first)
+			continue;
+		MemoryUsage u = m_states[i].second.ram.usage();
+		printf("state %-4lu %9luK %9luK\n", i, u.shared / 1024,
+				u.priv / 1024);
+		total += u;
+	}
+	for (size_t i = 0; i < m_rams.size(); i++) {
+		if (!m_rams[i].first)
+			continue;
+		MemoryUsage u = m_rams[i].second.usage();
+		printf("memory %-3lu %9luK %9luK\n", i, u.shared / 1024,
+				u.priv / 1024);
+		total += u;
+	}
+	printf("%-10s %9luK %9luK\n", "total", total.shared / 1024,
+			total.priv / 1024);
+}
+
+void
+Debugger::setBreakpoint(const Machine::State& s, uint16_t ip, bool active)
+{
+	DebugFrame req, resp;
+	req.type = active ? DBG_BREAK_SET : DBG_BREAK_CLEAR;
+	req.put(ip);
+	request(s, req, resp, DBG_OK);
+}
+
+/*
+ * Hands the machine over to a remote client on a Unix socket. Breakpoints
+ * are shared with the shell, which comes back when the client detaches.
+ */
+void
+Debugger::serve(const char* path)
+{
+	m_server.reset(new DebugServer(m_proto));
+	if (!m_server->listen(path))
+		m_server.reset();
+}
+
+void
+Debugger::setProfiling(Machine& m, bool active)
+{
+	if (active && !m_profiler) {
+		m_profiler.reset(new Profiler());
+	}
+	m.setProfiler(active ? m_profiler.get() : nullptr);
+}
+
+void
+Debugger::reportProfile(const char* prefix)
+{
+	if (!m_profiler) {
+		printf("Profiler was never enabled.\n");
+		return;
+	}
+
+	ProfileReport report = m_profiler->report();
+	report.symbols = &m_symbols;
+	report.print(stdout, 20);
+
+	if (prefix && !report.save(prefix)) {
+		printf("Could not write profile to %s.*\n", prefix);
+	}
+}
+
+void
+Debugger::setSampling(Machine& m, bool active, unsigned hz)
+{
+	if (!active) {
+		if (m_sampler)
+			m_sampler->stop();
+		return;
+	}
+
+	if (!m_sampler) {
+		m_sampler.reset(new Sampler());
+	}
+	if (!m_sampler->start(m, hz)) {
+		printf("Could not start sampling at %u Hz.\n", hz);
+	}
+}
+
+void
+Debugger::reportSamples(const char* prefix)
 {
-	static char prev_buffer[256];
+	if (!m_sampler) {
+		printf("Sampler was never enabled.\n");
+		return;
+	}
 
-	bool res = true;
-	while (true) {
-		this->dumpState(s);
+	ProfileReport report = m_sampler->report();
+	report.symbols = &m_symbols;
+	report.print(stdout, 20);
+	if (m_sampler->dropped()) {
+		printf("(%lu older samples were overwritten)\n",
+				m_sampler->dropped());
+	}
 
-		printf("(debug) ");
+	if (prefix && !report.save(prefix)) {
+		printf("Could not write samples to %s.*\n", prefix);
+	}
+}
 
-		char buffer[256];
-		fgets(buffer, 256, stdin);
+void
+Debugger::setHle(Machine& m, bool active)
+{
+	if (!active) {
+		m.setHle(nullptr);
+		return;
+	}
+
+	if (!m_hle) {
+		m_hle.reset(new Hle());
+		m_hle->addChallengeRoutines();
+	}
+	size_t bound = m.setHle(m_hle.get());
+	printf("%lu of %lu native routines match this image.\n", bound,
+			m_hle->entries().size());
+}
 
-		char *cmd = buffer;
+/*
+ * Parses "<addr|all> [0|1]" and switches native routines, or their
+ * verification, on or off
+ */
+void
+Debugger::configureHle(const char* args, bool verify)
+{
+	if (!m_hle) {
+		printf("HLE is not enabled.\n");
+		return;
+	}
 
-		if (buffer[0] == '\n') {
-			cmd = prev_buffer;
+	char which[16];
+	int active = 1;
+	if (sscanf(args, "%15s %d", which, &active) < 1) {
+		m_hle->print(stdout);
+		return;
+	}
+
+	if (strcmp(which, "all") == 0) {
+		if (verify) {
+			m_hle->setVerifyAll(active);
 		} else {
-			memcpy(prev_buffer, buffer, sizeof(256));
+			m_hle->setEnabledAll(active);
 		}
+		return;
+	}
 
-		if (strncmp(cmd, "stack_on", 8) == 0) {
-			m_dbg_stack = true;
+	uint16_t addr = strtol(which, NULL, 16);
+	bool found = verify ? m_hle->setVerify(addr, active) :
+		m_hle->setEnabled(addr, active);
+	if (!found) {
+		printf("No native routine at %04x.\n", addr);
+	}
+}
 
-		} else if (strncmp(cmd, "stack_off", 9) == 0) {
-			m_dbg_stack = false;
+/*
+ * Explores the game states reachable from the current one, which has to be
+ * waiting for input
+ */
+void
+Debugger::explore(const Machine& m, size_t depth, const char* path)
+{
+	if (!m.waitingInput()) {
+		printf("The machine is not waiting for input.\n");
+		return;
+	}
 
-		} else if (strncmp(cmd, "stack_save", 10) == 0) {
-			int save_pos = strtol(cmd + 11, NULL, 10);
-			// TODO: Continue here
-			this->saveStack(s, save_pos);
+	m_explorer.reset(new Explorer(m.state()));
+	if (depth)
+		m_explorer->setMaxDepth(depth);
+	if (!m_explore_vocab.empty() &&
+			!m_explorer->loadVocabulary(m_explore_vocab.c_str())) {
+		printf("Could not read %s.\n", m_explore_vocab.c_str());
+		return;
+	}
 
-		} else if (strncmp(cmd, "stack_compare", 13) == 0) {
-			char *endstr = NULL;
-			int pos0 = strtol(cmd + 14, &endstr, 10);
-			int pos1 = strtol(endstr, NULL, 10);
-			this->compareStacks(pos0, pos1);
+	m_explorer->run();
+	m_explorer->printSummary(stdout);
+	if (path && !m_explorer->save(path)) {
+		printf("Could not write %s.\n", path);
+	}
+}
+
+void
+Debugger::printExplorePath(uint32_t node)
+{
+	if (!m_explorer || node >= m_explorer->nodes().size()) {
+		printf("No such state.\n");
+		return;
+	}
+
+	for (const std::string& cmd : m_explorer->path(node)) {
+		printf("%s\n", cmd.c_str());
+	}
+}
+
+/*
+ * Fuzzes the line the machine is waiting for, starting from its current
+ * state every time
+ */
+void
+Debugger::fuzz(const Machine& m, size_t execs, const char* path)
+{
+	if (!m.waitingInput()) {
+		printf("The machine is not waiting for input.\n");
+		return;
+	}
 
-		} else if (strncmp(cmd, "regs_on", 7) == 0) {
-			this->m_dbg_regs = 1;
+	Fuzzer fuzzer(m.state());
+	fuzzer.run(execs);
+	fuzzer.printSummary(stdout);
+	for (const Fuzzer::Finding& f : fuzzer.findings()) {
+		printf("%s: %s\n", f.kind == Fuzzer::HUNG ? "hang" : "halt",
+				f.input.c_str());
+	}
+	if (path && !fuzzer.save(path)) {
+		printf("Could not write %s.\n", path);
+	}
+}
 
-		} else if (strncmp(cmd, "regs_off", 8) == 0) {
-			this->m_dbg_regs = 0;
+void
+Debugger::setShadow(Machine& m, bool active, bool fetches)
+{
+	if (!active) {
+		m.setShadow(nullptr, false);
+		return;
+	}
 
-		} else if (strncmp(cmd, "disass_on", 9) == 0) {
-			this->m_dbg_disass = 1;
+	if (!m_shadow)
+		m_shadow.reset(new Shadow());
+	m_shadow_fetches |= fetches;
+	m.setShadow(m_shadow.get(), m_shadow_fetches);
+}
 
-		} else if (strncmp(cmd, "disass_off", 10) == 0) {
-			this->m_dbg_disass = 0;
+/*
+ * Parses "<addr> [size] [rwx]" and sets or clears a watchpoint. Clearing
+ * "all" removes every watchpoint.
+ */
+void
+Debugger::setWatch(Machine& m, const char* args, bool active)
+{
+	char addr_str[16] = "";
+	char kinds_str[8] = "w";
+	unsigned size = 1;
+	int n = sscanf(args, "%15s %u %7s", addr_str, &size, kinds_str);
+	if (n < 1) {
+		printf("Usage: watch <addr> [size] [rwx]\n");
+		return;
+	}
 
-		} else if (strncmp(cmd, "memory_on", 9) == 0) {
-			this->m_dbg_memory = 1;
+	if (!active && strcmp(addr_str, "all") == 0) {
+		if (m_shadow)
+			m_shadow->clearWatches();
+		return;
+	}
 
-		} else if (strncmp(cmd, "memory_off", 10) == 0) {
-			this->m_dbg_memory = 0;
+	uint8_t kinds = active ? parse_access(kinds_str) :
+		Shadow::READ | Shadow::WRITE | Shadow::FETCH;
+	if (!kinds) {
+		printf("Invalid access kind: %s\n", kinds_str);
+		return;
+	}
 
-		} else if (strncmp(cmd, "memory_save", 11) == 0) {
-			int save_pos = strtol(cmd + 12, NULL, 10);
-			this->saveMemory(s, save_pos);
+	if (active || m_shadow) {
+		this->setShadow(m, true, kinds & Shadow::FETCH);
+		m_shadow->watch(strtol(addr_str, NULL, 16), size, kinds,
+				active);
+	}
+}
 
-		} else if (strncmp(cmd, "memory_load", 11) == 0) {
-			int save_pos = strtol(cmd + 12, NULL, 10);
-			this->loadMemory(s, save_pos);
+/*
+ * Starts recording a trace to the given file, or stops the current one if
+ * path is null
+ */
+void
+Debugger::setTrace(Machine& m, const char* path)
+{
+	if (m_trace) {
+		m.setTrace(nullptr);
+		bool ok = m_trace->close(m.state());
+		printf("Trace: %lu records, %lu bytes encoded, %lu written%s\n",
+				m_trace->records(), m_trace->rawBytes(),
+				m_trace->compressedBytes(),
+				ok ? "" : " (write failed)");
+		m_trace.reset();
+	}
 
-		} else if (strncmp(cmd, "memory_cmp", 10) == 0) {
-			char *endstr = NULL;
-			int pos0 = strtol(cmd + 11, &endstr, 10);
-			int pos1 = strtol(endstr, NULL, 10);
-			this->compareMemory(pos0, pos1, 0, 0x800);
+	if (!path)
+		return;
+
+	m_trace.reset(new TraceWriter());
+	if (!m_trace->open(path, m.state())) {
+		m_trace.reset();
+		return;
+	}
+	m.setTrace(m_trace.get());
+}
+
+/*
+ * Narrows the value scan with a predicate, or starts a new one. A new scan
+ * without a predicate just records the current values for relative scans.
+ */
+void
+Debugger::scanMemory(const Machine::State& s, const char* args, bool restart)
+{
+	Scanner::Op op = Scanner::SCAN_ANY;
+	uint16_t value = 0;
+	bool empty = args[strspn(args, " \t\n")] == '\0';
+	if (!(restart && empty) && !Scanner::parse(args, op, value)) {
+		printf("Usage: scan <== N|!= N|> N|< N|changed|unchanged|"
+				"increased|decreased>\n");
+		return;
+	}
+
+	if (restart)
+		m_scanner.reset();
+	m_scanner.scan(s.ram.data(), op, value);
+	m_scanner.print(stdout, s.ram.data(), 16);
+}
 
-		} else if (strncmp(cmd, "dump", 4) == 0) {
-			size_t addr = strtol(cmd+5, NULL, 16);
-			this->m_disass_pos = addr;
+/*
+ * Starts taint tracking from a clean slate, or detaches it. The labels
+ * gathered so far stay around for reports.
+ */
+void
+Debugger::setTaint(Machine& m, bool active, Taint::Mode mode)
+{
+	if (!active) {
+		m.setTaint(nullptr);
+		return;
+	}
 
-		} else if (strncmp(cmd, "dops", 4) == 0) {
-			this->m_debug_opcodes = strtol(cmd + 5, NULL, 16);
+	m_taint.reset(new Taint(mode));
+	m.setTaint(m_taint.get());
+}
 
-		} else if (strncmp(cmd, "save", 4) == 0) {
-			size_t pos = strtol(cmd+5, NULL, 10);
-			this->saveState(s, pos);
+/*
+ * Lists the branches, or the instructions, that depended on the given
+ * input byte (or line). Without one, lists those that depended on any.
+ */
+void
+Debugger::reportTaint(const Machine::State& s, const char* args,
+		bool branches)
+{
+	if (!m_taint) {
+		printf("Taint tracking is off\n");
+		return;
+	}
 
-		} else if (strncmp(cmd, "load", 4) == 0) {
-			size_t pos = strtol(cmd+5, NULL, 10);
-			this->loadState(s, pos);
+	uint64_t labels = ~uint64_t(0);
+	unsigned label;
+	if (sscanf(args, "%u", &label) == 1)
+		labels = uint64_t(1) << (label % TAINT_LABELS);
 
-		} else if (strncmp(cmd, "s", 1) == 0) {
-			this->m_sskips = strtol(cmd+2, NULL, 10);
-			break;
+	if (branches) {
+		m_taint->printBranches(stdout, s, labels);
+	} else {
+		m_taint->printUses(stdout, s, labels);
+	}
+}
 
-		} else if (strncmp(cmd, "b", 1) == 0) {
-			this->setBreakpoint(strtol(cmd+2, NULL, 16), true);
+/*
+ * Parses "[name] [hz]" and starts publishing the machine's state to shared
+ * memory, or stops and removes the segment
+ */
+void
+Debugger::setLive(Machine& m, const char* args, bool active)
+{
+	if (m_live) {
+		printf("Live export %s: %lu publishes\n", m_live->name().c_str(),
+				m_live->publishes());
+		m_live.reset();
+	}
 
-		} else if (strncmp(cmd, "ub", 2) == 0) {
-			this->setBreakpoint(strtol(cmd+3, NULL, 16), false);
+	if (!active)
+		return;
+
+	char name[128];
+	unsigned hz = LIVE_DEFAULT_HZ;
+	if (sscanf(args, "%127s %u", name, &hz) < 1)
+		snprintf(name, sizeof(name), "/synacor-%d", getpid());
 
-		} else if (strncmp(cmd, "lb", 2) == 0) {
-			this->listBreakpoints();
+	m_live.reset(new LiveExport());
+	if (!m_live->open(name) || !m_live->start(m, hz)) {
+		m_live.reset();
+		return;
+	}
+	printf("Publishing to %s at %u Hz\n", name, hz);
+}
+
+/*
+ * Serves the machine's metrics on a Unix socket, or stops serving them if
+ * path is null
+ */
+void
+Debugger::serveMetrics(Machine& m, const char* path)
+{
+	m_metrics.reset();
+	if (!path)
+		return;
 
-		} else if (strncmp(cmd, "c", 1) == 0) {
-			this->m_dbg_enabled = false;
-			this->m_skips = strtol(cmd+2, NULL, 10);
+	m_metrics.reset(new MetricsServer());
+	m_metrics->add("debugger", &m.metrics());
+	if (!m_metrics->start(path)) {
+		m_metrics.reset();
+		return;
+	}
+	printf("Serving metrics on %s\n", path);
+}
+
+/*
+ * Splits a line into statements at semicolons. "on" and "repeat" take the
+ * rest of the line, since their bodies are statements themselves.
+ */
+static std::vector<std::string> split_statements(const std::string& line)
+{
+	const char* space = " \t\r\n";
+	std::vector<std::string> res;
+
+	size_t pos = 0;
+	while (pos < line.size()) {
+		size_t start = line.find_first_not_of(" \t\r\n;", pos);
+		if (start == std::string::npos || line[start] == '#')
 			break;
 
-		} else if (strncmp(cmd, "p", 1) == 0) {
-			uint16_t start_pos = strtol(cmd+2, NULL, 16);
-			this->m_memory_pos = start_pos;
+		size_t word_end = line.find_first_of(" \t\r\n;", start);
+		std::string word = line.substr(start, word_end - start);
+		size_t end = word == "on" || word == "repeat" ?
+			std::string::npos : line.find(';', start);
+		if (end == std::string::npos)
+			end = line.size();
 
-		} else if (strncmp(cmd, "q", 1) == 0) {
-			res = false;
+		size_t last = line.find_last_not_of(space, end - 1);
+		res.push_back(line.substr(start, last + 1 - start));
+		pos = end + 1;
+	}
+	return res;
+}
+
+/*
+ * Splits "HEAD do BODY" in two. Returns false if there is no "do".
+ */
+static bool split_do(const char* args, std::string& head, std::string& body)
+{
+	std::string text(args);
+	size_t pos = 0;
+	while ((pos = text.find("do", pos)) != std::string::npos) {
+		bool starts = pos == 0 || isspace(text[pos - 1]);
+		bool ends = pos + 2 == text.size() || isspace(text[pos + 2]);
+		if (starts && ends) {
+			head = text.substr(0, pos);
+			body = text.substr(pos + 2);
+			return true;
+		}
+		pos += 2;
+	}
+	return false;
+}
+
+static std::vector<size_t> parse_positions(const char* str)
+{
+	std::vector<size_t> positions;
+	char *endstr = NULL;
+	for (;;) {
+		size_t pos = strtoul(str, &endstr, 10);
+		if (endstr == str)
 			break;
+		positions.push_back(pos);
+		str = endstr;
+	}
+	return positions;
+}
 
-		} else if (strncmp(cmd, "halt", 4) == 0) {
-			this->halt();
+static const char* event_name(int event)
+{
+	static const char* names[] = {"step", "break", "watch", "input", "halt"};
+	return names[event];
+}
 
-		} else {
-			this->dumpState(s);
+/*
+ * The shell's commands. Names match exactly, so "s" no longer shadows
+ * "save" nor "b" the commands after it.
+ */
+const std::vector<Debugger::Command>&
+Debugger::commands()
+{
+	static const std::vector<Command> table = {
+	{"help", "", "list the commands",
+		[](Debugger&, const CommandArgs&) {
+			for (auto& c : commands()) {
+				std::string usage = std::string(c.name) + " " + c.args;
+				printf("  %-28s %s\n", usage.c_str(), c.help);
+			}
+			return ACTION_STAY;
+		}},
+
+	// Run control
+	{"s", "[N]", "step one instruction, or N",
+		[](Debugger& d, const CommandArgs& a) {
+			d.m_sskips = strtol(a.args, NULL, 10);
+			return ACTION_RESUME;
+		}},
+	{"c", "[N]", "continue, passing N breakpoints",
+		[](Debugger& d, const CommandArgs& a) {
+			d.m_dbg_enabled = false;
+			d.m_skips = strtol(a.args, NULL, 10);
+			return ACTION_RESUME;
+		}},
+	{"q", "", "stop debugging and let the machine run to its end",
+		[](Debugger&, const CommandArgs&) { return ACTION_QUIT; }},
+	{"halt", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			d.halt();
+			return ACTION_STAY;
+		}},
+	{"b", "ADDR", "set a breakpoint",
+		[](Debugger& d, const CommandArgs& a) {
+			uint16_t addr;
+			if (d.address(a.args, addr))
+				d.setBreakpoint(a.s, addr, true);
+			return ACTION_STAY;
+		}},
+	{"ub", "ADDR", "clear a breakpoint",
+		[](Debugger& d, const CommandArgs& a) {
+			uint16_t addr;
+			if (d.address(a.args, addr))
+				d.setBreakpoint(a.s, addr, false);
+			return ACTION_STAY;
+		}},
+	{"bt", "", "show the calls the stack returns to",
+		[](Debugger& d, const CommandArgs& a) {
+			d.printBacktrace(a.s);
+			return ACTION_STAY;
+		}},
+	{"lb", "", "list breakpoints",
+		[](Debugger& d, const CommandArgs& a) {
+			d.listBreakpoints(a.s);
+			return ACTION_STAY;
+		}},
+	{"serve", "SOCKET", "hand the machine to a protocol client",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[108];
+			if (sscanf(a.args, "%107s", path) != 1) {
+				printf("Usage: serve <socket>\n");
+				return ACTION_STAY;
+			}
+			d.serve(path);
+			return d.m_server ? ACTION_RESUME : ACTION_STAY;
+		}},
+
+	// Scripting
+	{"source", "FILE", "run the commands in a file",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			if (sscanf(a.args, "%255s", path) != 1) {
+				printf("Usage: source <file>\n");
+			} else {
+				d.source(path);
+			}
+			return ACTION_STAY;
+		}},
+	{"repeat", "N do CMDS", "run the commands N times",
+		[](Debugger& d, const CommandArgs& a) {
+			std::string count, body;
+			if (!split_do(a.args, count, body)) {
+				printf("Usage: repeat <n> do <commands>\n");
+			} else {
+				d.queueCommands(body, true, strtoul(count.c_str(), NULL,
+							10));
+			}
+			return ACTION_STAY;
+		}},
+	{"on", "EVENT [at ADDR] do CMDS",
+		"run commands on break, watch, input or halt",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setHandler(a.s, a.args);
+			return ACTION_STAY;
+		}},
+	{"on_clear", "", "remove every handler",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_handlers.clear();
+			return ACTION_STAY;
+		}},
+	{"echo", "TEXT", "print the text",
+		[](Debugger&, const CommandArgs& a) {
+			const char* text = a.args;
+			while (isspace(*text))
+				text++;
+			printf("%s\n", text);
+			return ACTION_STAY;
+		}},
+
+	// Views
+	{"stack_on", "", "show the stack at every stop",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_stack = true;
+			return ACTION_STAY;
+		}},
+	{"stack_off", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_stack = false;
+			return ACTION_STAY;
+		}},
+	{"regs_on", "", "show the registers at every stop",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_regs = true;
+			return ACTION_STAY;
+		}},
+	{"regs_off", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_regs = false;
+			return ACTION_STAY;
+		}},
+	{"regs", "", "show the registers",
+		[](Debugger& d, const CommandArgs& a) {
+			d.printRegs(a.s);
+			return ACTION_STAY;
+		}},
+	{"stack", "", "show the stack",
+		[](Debugger& d, const CommandArgs& a) {
+			d.printStack(a.s);
+			return ACTION_STAY;
+		}},
+	{"disass_on", "", "show the code at every stop",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_disass = true;
+			return ACTION_STAY;
+		}},
+	{"disass_off", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_disass = false;
+			return ACTION_STAY;
+		}},
+	{"memory_on", "", "show memory from p at every stop",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_memory = true;
+			return ACTION_STAY;
+		}},
+	{"memory_off", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_memory = false;
+			return ACTION_STAY;
+		}},
+	{"diff_on", "", "show memory changes at every stop",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_diff = true;
+			d.m_diff_prev.clear();
+			return ACTION_STAY;
+		}},
+	{"diff_off", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			d.m_dbg_diff = false;
+			return ACTION_STAY;
+		}},
+	{"dump", "ADDR", "disassemble from ADDR",
+		[](Debugger& d, const CommandArgs& a) {
+			uint16_t addr;
+			if (d.address(a.args, addr))
+				d.m_disass_pos = addr;
+			return ACTION_STAY;
+		}},
+	{"dops", "N", "instructions to disassemble (hex)",
+		[](Debugger& d, const CommandArgs& a) {
+			d.m_debug_opcodes = strtol(a.args, NULL, 16);
+			return ACTION_STAY;
+		}},
+	{"p", "ADDR", "show memory from ADDR",
+		[](Debugger& d, const CommandArgs& a) {
+			uint16_t addr;
+			if (d.address(a.args, addr))
+				d.m_memory_pos = addr;
+			return ACTION_STAY;
+		}},
+
+	// Saved states
+	{"save", "N", "save the whole state in slot N",
+		[](Debugger& d, const CommandArgs& a) {
+			d.saveState(a.s, strtol(a.args, NULL, 10));
+			return ACTION_STAY;
+		}},
+	{"load", "N", "restore the state in slot N",
+		[](Debugger& d, const CommandArgs& a) {
+			d.loadState(a.s, strtol(a.args, NULL, 10));
+			return ACTION_STAY;
+		}},
+	{"stack_save", "N", "save the stack in slot N",
+		[](Debugger& d, const CommandArgs& a) {
+			d.saveStack(a.s, strtol(a.args, NULL, 10));
+			return ACTION_STAY;
+		}},
+	{"stack_compare", "N M", "compare two saved stacks",
+		[](Debugger& d, const CommandArgs& a) {
+			char* endstr = NULL;
+			int pos0 = strtol(a.args, &endstr, 10);
+			int pos1 = strtol(endstr, NULL, 10);
+			d.compareStacks(pos0, pos1);
+			return ACTION_STAY;
+		}},
+	{"memory_save", "N", "save memory in slot N",
+		[](Debugger& d, const CommandArgs& a) {
+			d.saveMemory(a.s, strtol(a.args, NULL, 10));
+			return ACTION_STAY;
+		}},
+	{"memory_load", "N", "restore memory from slot N",
+		[](Debugger& d, const CommandArgs& a) {
+			d.loadMemory(a.s, strtol(a.args, NULL, 10));
+			return ACTION_STAY;
+		}},
+	{"memory_cmp", "N M [ADDR [SIZE]]", "compare two saved memories",
+		[](Debugger& d, const CommandArgs& a) {
+			char* endstr = NULL;
+			int pos0 = strtol(a.args, &endstr, 10);
+			int pos1 = strtol(endstr, &endstr, 10);
+			size_t addr = strtoul(endstr, &endstr, 16);
+			size_t size = strtoul(endstr, NULL, 16);
+			addr = MIN(addr, size_t(0x7fff));
+			d.compareMemory(pos0, pos1, addr,
+					size ? size : 0x8000 - addr);
+			return ACTION_STAY;
+		}},
+	{"memory_share", "", "share the current memory with saved states",
+		[](Debugger& d, const CommandArgs& a) {
+			d.shareMemory(a.s);
+			return ACTION_STAY;
+		}},
+	{"memory_usage", "", "shared and private memory of saved states",
+		[](Debugger& d, const CommandArgs& a) {
+			d.printMemoryUsage(a.s);
+			return ACTION_STAY;
+		}},
+	{"memory_cmp_all", "N...", "words changed in every step of the series",
+		[](Debugger& d, const CommandArgs& a) {
+			d.compareMemorySeries(parse_positions(a.args), true);
+			return ACTION_STAY;
+		}},
+	{"memory_cmp_any", "N...", "words changed in any step of the series",
+		[](Debugger& d, const CommandArgs& a) {
+			d.compareMemorySeries(parse_positions(a.args), false);
+			return ACTION_STAY;
+		}},
+
+	// Profiling
+	{"prof_on", "", "count instructions per routine",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setProfiling(a.m, true);
+			return ACTION_STAY;
+		}},
+	{"prof_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setProfiling(a.m, false);
+			return ACTION_STAY;
+		}},
+	{"prof_reset", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			if (d.m_profiler)
+				d.m_profiler->reset();
+			return ACTION_STAY;
+		}},
+	{"prof_report", "[PREFIX]", "print, or write PREFIX files",
+		[](Debugger& d, const CommandArgs& a) {
+			char prefix[256];
+			bool has_prefix = sscanf(a.args, "%255s", prefix) == 1;
+			d.reportProfile(has_prefix ? prefix : nullptr);
+			return ACTION_STAY;
+		}},
+	{"sample_on", "[HZ]", "sample the call stack on a timer",
+		[](Debugger& d, const CommandArgs& a) {
+			unsigned hz = strtoul(a.args, NULL, 10);
+			d.setSampling(a.m, true, hz ? hz : SAMPLE_DEFAULT_HZ);
+			return ACTION_STAY;
+		}},
+	{"sample_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setSampling(a.m, false, 0);
+			return ACTION_STAY;
+		}},
+	{"sample_report", "[PREFIX]", "print, or write PREFIX files",
+		[](Debugger& d, const CommandArgs& a) {
+			char prefix[256];
+			bool has_prefix = sscanf(a.args, "%255s", prefix) == 1;
+			d.reportSamples(has_prefix ? prefix : nullptr);
+			return ACTION_STAY;
+		}},
+	{"sym_load", "FILE", "add the symbols in a file",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			if (sscanf(a.args, "%255s", path) != 1) {
+				printf("Usage: sym_load <file>\n");
+			} else if (d.loadSymbols(path)) {
+				printf("%lu symbols.\n", d.m_symbols.size());
+			}
+			return ACTION_STAY;
+		}},
+	{"sym_save", "FILE", "write the symbols to a file",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			if (sscanf(a.args, "%255s", path) != 1) {
+				printf("Usage: sym_save <file>\n");
+			} else if (!d.m_symbols.save(path)) {
+				printf("Could not write %s.\n", path);
+			}
+			return ACTION_STAY;
+		}},
+	{"sym_cfg", "[FILE]", "name the functions the CFG finds",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			bool has_path = sscanf(a.args, "%255s", path) == 1;
+			d.symbolsFromCfg(a.s, has_path ? path : nullptr);
+			return ACTION_STAY;
+		}},
+	{"sym", "ADDR|NAME", "look up a symbol",
+		[](Debugger& d, const CommandArgs& a) {
+			uint16_t addr;
+			if (!d.address(a.args, addr))
+				return ACTION_STAY;
+			std::string name = d.m_symbols.describe(addr);
+			const std::string* note = d.m_symbols.comment(addr);
+			printf("%04x %s%s%s\n", addr, name.c_str(),
+					note ? " ; " : "", note ? note->c_str() : "");
+			return ACTION_STAY;
+		}},
+	{"cfg", "[FILE]", "control flow summary, with every block to FILE",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			bool has_path = sscanf(a.args, "%255s", path) == 1;
+			d.analyze(a.s, has_path ? path : nullptr);
+			return ACTION_STAY;
+		}},
+
+	// Native routines
+	{"hle_on", "", "run known routines natively",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setHle(a.m, true);
+			return ACTION_STAY;
+		}},
+	{"hle_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setHle(a.m, false);
+			return ACTION_STAY;
+		}},
+	{"hle_enable", "ADDR|all [0|1]", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.configureHle(a.args, false);
+			return ACTION_STAY;
+		}},
+	{"hle_verify", "ADDR|all [0|1]", "check routines against the guest",
+		[](Debugger& d, const CommandArgs& a) {
+			d.configureHle(a.args, true);
+			return ACTION_STAY;
+		}},
+	{"hle", "", "list native routines",
+		[](Debugger& d, const CommandArgs&) {
+			if (d.m_hle)
+				d.m_hle->print(stdout);
+			return ACTION_STAY;
+		}},
+
+	// Memory access
+	{"shadow_on", "[x]", "count accesses, x for fetches too",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setShadow(a.m, true, strchr(a.args, 'x'));
+			return ACTION_STAY;
+		}},
+	{"shadow_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setShadow(a.m, false, false);
+			return ACTION_STAY;
+		}},
+	{"shadow_reset", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			if (d.m_shadow)
+				d.m_shadow->reset();
+			return ACTION_STAY;
+		}},
+	{"shadow_report", "[N [rwx]]", "most accessed words",
+		[](Debugger& d, const CommandArgs& a) {
+			unsigned top = 20;
+			char kinds[8] = "rwx";
+			sscanf(a.args, "%u %7s", &top, kinds);
+			if (d.m_shadow)
+				d.m_shadow->print(stdout, parse_access(kinds), top);
+			return ACTION_STAY;
+		}},
+	{"watch", "ADDR [SIZE] [rw]", "stop on access",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setWatch(a.m, a.args, true);
+			return ACTION_STAY;
+		}},
+	{"unwatch", "ADDR", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setWatch(a.m, a.args, false);
+			return ACTION_STAY;
+		}},
+	{"watches", "", "list watchpoints",
+		[](Debugger& d, const CommandArgs&) {
+			if (d.m_shadow)
+				d.m_shadow->printWatches(stdout);
+			return ACTION_STAY;
+		}},
+	{"scan_new", "...", "start a value scan",
+		[](Debugger& d, const CommandArgs& a) {
+			d.scanMemory(a.s, a.args, true);
+			return ACTION_STAY;
+		}},
+	{"scan", "...", "narrow the value scan",
+		[](Debugger& d, const CommandArgs& a) {
+			d.scanMemory(a.s, a.args, !d.m_scanner.started());
+			return ACTION_STAY;
+		}},
+	{"scan_list", "[N]", "",
+		[](Debugger& d, const CommandArgs& a) {
+			size_t max = strtoul(a.args, NULL, 10);
+			d.m_scanner.print(stdout, a.s.ram.data(), max ? max : 64);
+			return ACTION_STAY;
+		}},
+
+	// Recording and tracking
+	{"trace_on", "FILE", "record an execution trace",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			if (sscanf(a.args, "%255s", path) == 1) {
+				d.setTrace(a.m, path);
+			} else {
+				printf("Usage: trace_on <file>\n");
+			}
+			return ACTION_STAY;
+		}},
+	{"trace_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setTrace(a.m, nullptr);
+			return ACTION_STAY;
+		}},
+	{"taint_on", "[lines]", "track input through the machine",
+		[](Debugger& d, const CommandArgs& a) {
+			bool lines = strstr(a.args, "lines") != nullptr;
+			d.setTaint(a.m, true, lines ? Taint::TAINT_LINES :
+					Taint::TAINT_BYTES);
+			return ACTION_STAY;
+		}},
+	{"taint_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setTaint(a.m, false, Taint::TAINT_BYTES);
+			return ACTION_STAY;
+		}},
+	{"taint_branches", "[N]", "branches decided by input",
+		[](Debugger& d, const CommandArgs& a) {
+			d.reportTaint(a.s, a.args, true);
+			return ACTION_STAY;
+		}},
+	{"taint_uses", "[N]", "instructions reading input",
+		[](Debugger& d, const CommandArgs& a) {
+			d.reportTaint(a.s, a.args, false);
+			return ACTION_STAY;
+		}},
+	{"taint", "", "",
+		[](Debugger& d, const CommandArgs&) {
+			if (d.m_taint)
+				d.m_taint->printSummary(stdout);
+			return ACTION_STAY;
+		}},
+	{"live_on", "[NAME [HZ]]", "publish state to shared memory",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setLive(a.m, a.args, true);
+			return ACTION_STAY;
+		}},
+	{"live_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.setLive(a.m, a.args, false);
+			return ACTION_STAY;
+		}},
+	{"metrics_on", "SOCKET", "serve metrics",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[108];
+			if (sscanf(a.args, "%107s", path) == 1) {
+				d.serveMetrics(a.m, path);
+			} else {
+				printf("Usage: metrics_on <socket>\n");
+			}
+			return ACTION_STAY;
+		}},
+	{"metrics_off", "", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.serveMetrics(a.m, nullptr);
+			return ACTION_STAY;
+		}},
+	{"metrics", "", "print metrics",
+		[](Debugger&, const CommandArgs& a) {
+			std::string out;
+			Metrics::writePrometheus(out, {{"debugger",
+					a.m.metrics().snapshot()}});
+			fputs(out.c_str(), stdout);
+			return ACTION_STAY;
+		}},
+
+	// Search
+	{"fuzz", "[N [FILE]]", "fuzz the input",
+		[](Debugger& d, const CommandArgs& a) {
+			size_t execs = 0;
+			char path[256];
+			int n = sscanf(a.args, "%lu %255s", &execs, path);
+			d.fuzz(a.m, execs ? execs : FUZZ_DEFAULT_EXECS,
+					n == 2 ? path : nullptr);
+			return ACTION_STAY;
+		}},
+	{"explore", "[DEPTH [FILE]]", "explore the game's states",
+		[](Debugger& d, const CommandArgs& a) {
+			size_t depth = 0;
+			char path[256];
+			int n = sscanf(a.args, "%lu %255s", &depth, path);
+			d.explore(a.m, depth, n == 2 ? path : nullptr);
+			return ACTION_STAY;
+		}},
+	{"explore_vocab", "[FILE]", "",
+		[](Debugger& d, const CommandArgs& a) {
+			char path[256];
+			bool has_path = sscanf(a.args, "%255s", path) == 1;
+			d.m_explore_vocab = has_path ? path : "";
+			return ACTION_STAY;
+		}},
+	{"explore_path", "NODE", "",
+		[](Debugger& d, const CommandArgs& a) {
+			d.printExplorePath(strtoul(a.args, NULL, 10));
+			return ACTION_STAY;
+		}},
+	};
+	return table;
+}
+
+const Debugger::Command*
+Debugger::findCommand(const std::string& name)
+{
+	for (auto& c : commands()) {
+		if (name == c.name)
+			return &c;
+	}
+	return nullptr;
+}
+
+/*
+ * Puts the statements of text at the front of the queue, times times over,
+ * so they run before anything already queued
+ */
+void
+Debugger::queueCommands(const std::string& text, bool echo, size_t times)
+{
+	std::vector<std::string> stmts = split_statements(text);
+	std::deque<std::pair<bool, std::string>> batch;
+	for (size_t i = 0; i < times; i++) {
+		for (auto& stmt : stmts) {
+			batch.emplace_back(echo, stmt);
 		}
 	}
+	m_pending.insert(m_pending.begin(), batch.begin(), batch.end());
+}
 
-	return res;
+/*
+ * Queues the commands of a script file. Lines starting with # are comments.
+ */
+bool
+Debugger::source(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	std::deque<std::pair<bool, std::string>> script;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		for (auto& stmt : split_statements(line)) {
+			script.emplace_back(true, stmt);
+		}
+	}
+	fclose(f);
+
+	m_pending.insert(m_pending.begin(), script.begin(), script.end());
+	return true;
+}
+
+/*
+ * In batch mode the shell never prompts: once the queued commands are done
+ * the machine runs on, stopping only where a handler is set
+ */
+void
+Debugger::setBatch(bool value)
+{
+	m_batch = value;
+}
+
+/*
+ * on break [at ADDR] do CMDS, on watch do CMDS, on input do CMDS, on halt do
+ * CMDS. Without arguments lists the handlers.
+ */
+void
+Debugger::setHandler(const Machine::State& s, const char* args)
+{
+	std::string head, body;
+	if (!split_do(args, head, body)) {
+		if (strspn(args, " \t") != strlen(args)) {
+			printf("Usage: on break|watch|input|halt [at <addr>] do"
+					" <commands>\n");
+			return;
+		}
+		for (auto& h : m_handlers) {
+			printf("on %s", event_name(h.event));
+			if (!h.any)
+				printf(" at %04x", h.addr);
+			printf(" do %s\n", h.commands.c_str());
+		}
+		return;
+	}
+
+	char event[16], at[8], where[64];
+	uint16_t addr = 0;
+	int n = sscanf(head.c_str(), "%15s %7s %63s", event, at, where);
+	if (n == 3 && !address(where, addr))
+		return;
+	Handler h;
+	h.any = n < 3 || strcmp(at, "at") != 0;
+	h.addr = addr;
+	h.commands = body.substr(body.find_first_not_of(" \t"));
+
+	int found = -1;
+	for (int e = EVENT_BREAK; e <= EVENT_HALT; e++) {
+		if (n >= 1 && strcmp(event, event_name(e)) == 0)
+			found = e;
+	}
+	if (found < 0 || (!h.any && found != EVENT_BREAK)) {
+		printf("Usage: on break|watch|input|halt [at <addr>] do"
+				" <commands>\n");
+		return;
+	}
+	h.event = Event(found);
+
+	if (h.event == EVENT_BREAK && !h.any)
+		this->setBreakpoint(s, h.addr, true);
+	m_handlers.push_back(h);
+}
+
+/*
+ * Queues the commands of the handlers for the event that stopped the
+ * machine, in the order they were set
+ */
+void
+Debugger::fireHandlers(uint16_t ip)
+{
+	for (auto it = m_handlers.rbegin(); it != m_handlers.rend(); ++it) {
+		if (it->event == m_event && (it->any || it->addr == ip))
+			this->queueCommands(it->commands, true, 1);
+	}
+}
+
+/*
+ * Takes a trailing redirection off text: ">" or ">>" as a word of its own,
+ * then the file as the last word, after the command name and at least
+ * keep words of arguments.
+ */
+static void
+split_redirect(std::string& text, size_t keep, std::string& path,
+		bool& append)
+{
+	std::vector<std::pair<size_t, size_t>> words;
+	for (size_t pos = text.find_first_not_of(" \t");
+			pos != std::string::npos;
+			pos = text.find_first_not_of(" \t", pos)) {
+		size_t end = text.find_first_of(" \t", pos);
+		if (end == std::string::npos)
+			end = text.size();
+		words.push_back(std::make_pair(pos, end - pos));
+		pos = end;
+	}
+	if (words.size() < keep + 3)
+		return;
+
+	auto last = words[words.size() - 3];
+	auto op = words[words.size() - 2];
+	auto file = words.back();
+	std::string sep = text.substr(op.first, op.second);
+	if (sep != ">" && sep != ">>")
+		return;
+
+	append = sep == ">>";
+	path = text.substr(file.first, file.second);
+	text.erase(last.first + last.second);
+}
+
+/*
+ * Runs one statement. A trailing "> FILE" or ">> FILE" sends what it
+ * prints to the file instead. Handlers and repeats keep it for the
+ * statements they run. Scan predicates compare with > too, so "scan > 5"
+ * is a predicate and "scan > 5 > FILE" redirects.
+ */
+Debugger::Action
+Debugger::execute(Machine& m, Machine::State& s, const std::string& stmt)
+{
+	std::string text = stmt;
+	std::string path;
+	bool append = false;
+
+	std::string name = text.substr(0, text.find_first_of(" \t"));
+	if (name == "scan" || name == "scan_new") {
+		split_redirect(text, 1, path, append);
+	} else if (name != "on" && name != "repeat") {
+		split_redirect(text, 0, path, append);
+	}
+
+	size_t name_end = text.find_first_of(" \t");
+	const char* args = text.c_str() + (name_end == std::string::npos ?
+			text.size() : name_end);
+
+	const Command* cmd = findCommand(name);
+	if (!cmd) {
+		printf("Unknown command: %s (try help)\n", name.c_str());
+		return ACTION_STAY;
+	}
+
+	int saved = -1;
+	if (!path.empty()) {
+		fflush(stdout);
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT |
+				(append ? O_APPEND : O_TRUNC), 0644);
+		if (fd < 0) {
+			perror(path.c_str());
+			return ACTION_STAY;
+		}
+		saved = dup(STDOUT_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+
+	Action action = cmd->fn(*this, CommandArgs{m, s, args});
+
+	// The guest writes straight to the descriptor, so keep the two in order
+	fflush(stdout);
+	if (saved >= 0) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+	return action;
+}
+
+/*
+ * Takes commands from the queue (scripts, handlers, repeats) and, once it
+ * is empty, from the prompt. An empty line repeats the last one. Returns
+ * false when the machine should stop at a halt.
+ */
+bool
+Debugger::shell(Machine& m)
+{
+	Machine::State& s = getState(m);
+	this->fireHandlers(s.ip);
+
+	for (;;) {
+		if (m_pending.empty()) {
+			if (m_batch) {
+				m_dbg_enabled = false;
+				m_skips = 0;
+				return m_event != EVENT_HALT;
+			}
+
+			this->dumpState(s);
+			printf("(debug) ");
+			fflush(stdout);
+
+			char buffer[256];
+			if (!fgets(buffer, sizeof(buffer), stdin)) {
+				printf("\n");
+				m_batch = true;
+				continue;
+			}
+
+			std::string line(buffer);
+			if (line.find_first_not_of(" \t\r\n") == std::string::npos) {
+				line = m_last_line;
+			} else {
+				m_last_line = line;
+			}
+			this->queueCommands(line, false, 1);
+			continue;
+		}
+
+		auto stmt = m_pending.front();
+		m_pending.pop_front();
+		if (stmt.first)
+			printf("(debug) %s\n", stmt.second.c_str());
+
+		switch (this->execute(m, s, stmt.second)) {
+		case ACTION_STAY:
+			break;
+		case ACTION_RESUME:
+			return true;
+		case ACTION_QUIT:
+			m_quit = true;
+			m_pending.clear();
+			m_dbg_enabled = false;
+			return m_event != EVENT_HALT;
+		}
+	}
 }
 
 void
 Debugger::beforeOp(Machine& m)
 {
+	if (m_server) {
+		if (m_server->attached()) {
+			m_server->beforeOp(m);
+			return;
+		}
+		printf("Debugger client detached\n");
+		m_server.reset();
+		this->setDebug(true);
+	}
+
+	if (m_quit)
+		return;
+
 	Machine::State& s = getState(m);
 	this->m_disass_pos = s.ip;
 
+	Shadow::Hit hit;
+	bool watched = false;
+	if (m_shadow && m_shadow->takeHit(hit)) {
+		printf("Watchpoint %s %04x at %04x: %04x -> %04x\n",
+				access_repr(hit.kind).c_str(), hit.addr, hit.ip,
+				hit.old_value, hit.value);
+		this->m_sskips = 0;
+		this->setDebug(true);
+		watched = true;
+	}
+
+	bool breakpoint = m_proto.isBreakpoint(s.ip);
+	m_event = watched ? EVENT_WATCH : breakpoint ? EVENT_BREAK : EVENT_STEP;
+
 	if (m_dbg_enabled) {
 		if (this->m_sskips > 0) {
 			this->m_sskips--;
 		} else {
-			this->shell(s);
+			this->shell(m);
 		}
 	} else {
-		auto it = this->m_breakpoints.find(s.ip);
-		if (it != this->m_breakpoints.end()) {
+		if (breakpoint) {
 			if (m_skips > 0) {
 				m_skips--;
 			} else {
 				this->setDebug(true);
-				this->shell(s);
+				this->shell(m);
 			}
 		}
 	}
@@ -520,13 +1936,42 @@ Debugger::beforeOp(Machine& m)
 bool
 Debugger::beforeHalted(Machine& m)
 {
+	if (m_server && m_server->attached())
+		return m_server->beforeHalted(m);
+
 	Machine::State& s = getState(m);
+	bool halted = s.ram[s.ip] == HALT;
+	if (m_quit)
+		return !halted;
+
 	this->m_disass_pos = s.ip;
 	this->m_skips = 0;
 	this->m_sskips = 0;
 	this->setDebug(true);
-	this->shell(s);
-	return true;
+	m_event = halted ? EVENT_HALT : EVENT_INPUT;
+	return this->shell(m);
+}
+
+/*
+ * Native routines would hide the instructions to step through, the
+ * breakpoints inside them and the input stops they read through. In batch
+ * mode nothing is left to see once the debugger runs freely, with neither
+ * breakpoints nor input handlers set.
+ */
+bool
+Debugger::needsGuestCode() const
+{
+	if (m_quit)
+		return false;
+	if (m_server && m_server->attached())
+		return true;
+	if (!m_batch || m_dbg_enabled || m_proto.hasBreakpoints())
+		return true;
+	for (const Handler& h : m_handlers) {
+		if (h.event == EVENT_INPUT)
+			return true;
+	}
+	return false;
 }
 
 void
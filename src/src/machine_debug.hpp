@@ -1,9 +1,25 @@
 #pragma once
 
 #include "machine.hpp"
-
+#include "profiler.hpp"
+#include "sampler.hpp"
+#include "analysis/cfg.hpp"
+#include "analysis/symbols.hpp"
+#include "hle.hpp"
+#include "explorer.hpp"
+#include "fuzzer.hpp"
+#include "shadow.hpp"
+#include "trace.hpp"
+#include "diff.hpp"
+#include "scanner.hpp"
+#include "taint.hpp"
+#include "live.hpp"
+#include "metrics.hpp"
+#include "debug_proto.hpp"
+
+#include <deque>
+#include <string>
 #include <vector>
-#include <set>
 
 class Debugger : public Machine::Debugger {
 public:
@@ -12,8 +28,11 @@ public:
 
 	bool beforeHalted(Machine& m) override;
 	void beforeOp(Machine& m) override;
+	bool needsGuestCode() const override;
 
-	bool shell(Machine::State& s);
+	bool shell(Machine& m);
+	bool source(const char* path);
+	void setBatch(bool value);
 
 	void printStack(const Machine::State& m);
 	void printMemory(const Machine::State& m, uint16_t addr,
@@ -26,14 +45,43 @@ public:
 	void disassemble(const Machine::State& m, size_t opcodes,
 			size_t ip);
 
-	void setBreakpoint(uint16_t ip, bool active);
-	void listBreakpoints();
+	bool loadSymbols(const char* path);
+	void printBacktrace(const Machine::State& m);
+	void symbolsFromCfg(const Machine::State& m, const char* path);
+
+	void analyze(const Machine::State& m, const char* path);
+	void setHle(Machine& m, bool active);
+	void configureHle(const char* args, bool verify);
+	void explore(const Machine& m, size_t depth, const char* path);
+	void printExplorePath(uint32_t node);
+	void fuzz(const Machine& m, size_t execs, const char* path);
+	void setShadow(Machine& m, bool active, bool fetches);
+	void setWatch(Machine& m, const char* args, bool active);
+	void setTrace(Machine& m, const char* path);
+	void scanMemory(const Machine::State& s, const char* args,
+			bool restart);
+	void setTaint(Machine& m, bool active, Taint::Mode mode);
+	void setLive(Machine& m, const char* args, bool active);
+	void serveMetrics(Machine& m, const char* path);
+	void reportTaint(const Machine::State& s, const char* args,
+			bool branches);
+
+	void setBreakpoint(const Machine::State& s, uint16_t ip, bool active);
+	void listBreakpoints(const Machine::State& s);
+	void serve(const char* path);
 
 	void setDebug(bool value);
 
+	void setProfiling(Machine& m, bool active);
+	void reportProfile(const char* prefix);
+	void setSampling(Machine& m, bool active, unsigned hz);
+	void reportSamples(const char* prefix);
+
 	void compareStacks(size_t pos0, size_t pos1);
 	void compareMemory(size_t pos0, size_t pos1, uint16_t addr,
-			uint16_t size);
+			size_t size);
+	void compareMemorySeries(const std::vector<size_t>& positions,
+			bool every);
 
 	void saveState(const Machine::State& m, size_t pos);
 	void saveStack(const Machine::State& m, size_t pos);
@@ -43,14 +91,81 @@ public:
 	void loadStack(Machine::State&, size_t pos);
 	void loadMemory(Machine::State&, size_t pos);
 
+	void shareMemory(Machine::State& s);
+	void printMemoryUsage(const Machine::State& s);
+
 	void halt();
 	void run(Machine& m);
 
 private:
+	enum Action {
+		ACTION_STAY,    // prompt for the next command
+		ACTION_RESUME,  // let the machine run
+		ACTION_QUIT,    // stop debugging
+	};
+
+	/*
+	 * Why the shell was entered, to pick the handlers to run
+	 */
+	enum Event {
+		EVENT_STEP,
+		EVENT_BREAK,
+		EVENT_WATCH,
+		EVENT_INPUT,
+		EVENT_HALT,
+	};
+
+	struct CommandArgs {
+		Machine& m;
+		Machine::State& s;
+		const char* args;
+	};
+
+	struct Command {
+		const char* name;
+		const char* args;
+		const char* help;
+		Action (*fn)(Debugger& d, const CommandArgs& a);
+	};
+
+	struct Handler {
+		Event event;
+		bool any;
+		uint16_t addr;
+		std::string commands;
+	};
+
+	bool address(const char* args, uint16_t& addr) const;
+
+	static const std::vector<Command>& commands();
+	static const Command* findCommand(const std::string& name);
+	Action execute(Machine& m, Machine::State& s, const std::string& stmt);
+	void queueCommands(const std::string& text, bool echo, size_t times);
+	void setHandler(const Machine::State& s, const char* args);
+	void fireHandlers(uint16_t ip);
+
+	bool request(const Machine::State& s, DebugFrame& req,
+			DebugFrame& resp, uint16_t type);
+
 	std::vector<std::pair<bool, Machine::State>> m_states;
 	std::vector<std::pair<bool, std::stack<uint16_t>>> m_stacks;
-	std::vector<std::pair<bool, std::array<uint16_t, 1 << 16>>> m_rams;
-	std::set<uint16_t> m_breakpoints;
+	std::vector<std::pair<bool, Memory>> m_rams;
+	DebugProtocol m_proto;
+	std::unique_ptr<DebugServer> m_server;
+	std::unique_ptr<Profiler> m_profiler;
+	std::unique_ptr<Sampler> m_sampler;
+	CfgCache m_cfg_cache;
+	SymbolTable m_symbols;
+	std::unique_ptr<Hle> m_hle;
+	std::unique_ptr<Explorer> m_explorer;
+	std::string m_explore_vocab;
+	std::unique_ptr<Shadow> m_shadow;
+	bool m_shadow_fetches = false;
+	std::unique_ptr<TraceWriter> m_trace;
+	Scanner m_scanner;
+	std::unique_ptr<Taint> m_taint;
+	std::unique_ptr<LiveExport> m_live;
+	std::unique_ptr<MetricsServer> m_metrics;
 
 	size_t m_debug_opcodes;
 	size_t m_skips;
@@ -60,10 +175,20 @@ private:
 	bool m_dbg_regs;
 	bool m_dbg_disass;
 	bool m_dbg_memory;
+	bool m_dbg_diff;
+	std::vector<uint16_t> m_diff_prev;
 
 	size_t m_disass_pos = 0;
 	size_t m_disass_next_op_size = 0;
 	size_t m_memory_pos = 0;
+
+	// Statements waiting to run, and whether to echo them
+	std::deque<std::pair<bool, std::string>> m_pending;
+	std::vector<Handler> m_handlers;
+	std::string m_last_line;
+	Event m_event = EVENT_STEP;
+	bool m_batch = false;
+	bool m_quit = false;
 };
 
 void machine_dump(struct machine* machine);
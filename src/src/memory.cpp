@@ -0,0 +1,251 @@
+#include "memory.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+/* Bits of a /proc/self/pagemap entry */
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE (1ULL << 61)
+#define PAGEMAP_EXCLUSIVE (1ULL << 56)
+
+static size_t page_bytes()
+{
+	static const size_t bytes = sysconf(_SC_PAGESIZE);
+	return bytes;
+}
+
+static bool is_zero(const uint16_t* words, size_t bytes)
+{
+	const uint16_t* end = words + bytes / sizeof(uint16_t);
+	return std::all_of(words, end, [](uint16_t w) { return w == 0; });
+}
+
+BaseImage::BaseImage() :
+	m_fd(-1),
+	m_words(nullptr)
+{
+}
+
+BaseImage::~BaseImage()
+{
+	if (m_words)
+		munmap(m_words, MEMORY_BYTES);
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+/*
+ * Copies words into a new memfd and seals it, so no one can change the
+ * image under the machines mapping it. Returns nullptr on failure.
+ */
+std::shared_ptr<const BaseImage>
+BaseImage::create(const uint16_t* words)
+{
+	std::shared_ptr<BaseImage> image(new BaseImage());
+	image->m_fd = memfd_create("synacor-base",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (image->m_fd < 0)
+		return nullptr;
+
+	const char* bytes = reinterpret_cast<const char*>(words);
+	size_t done = 0;
+	while (done < MEMORY_BYTES) {
+		ssize_t n = write(image->m_fd, bytes + done, MEMORY_BYTES - done);
+		if (n <= 0)
+			return nullptr;
+		done += n;
+	}
+
+	if (fcntl(image->m_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		return nullptr;
+
+	void* p = mmap(NULL, MEMORY_BYTES, PROT_READ, MAP_SHARED, image->m_fd, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	image->m_words = static_cast<uint16_t*>(p);
+	return image;
+}
+
+Memory::Memory() :
+	m_words(nullptr)
+{
+	map(nullptr);
+}
+
+Memory::Memory(const Memory& other) :
+	m_words(nullptr)
+{
+	map(other.m_base);
+	copyFrom(other);
+}
+
+/*
+ * Takes other's mapping and leaves it a fresh one of zeros, so a moved-from
+ * Memory is still usable like a std::array
+ */
+Memory::Memory(Memory&& other) :
+	m_base(std::move(other.m_base)),
+	m_words(other.m_words)
+{
+	other.m_words = nullptr;
+	other.map(nullptr);
+}
+
+Memory::~Memory()
+{
+	if (m_words)
+		munmap(m_words, MEMORY_BYTES);
+}
+
+Memory&
+Memory::operator=(const Memory& other)
+{
+	if (this == &other)
+		return *this;
+
+	if (m_base != other.m_base || !m_words)
+		map(other.m_base);
+	copyFrom(other);
+	return *this;
+}
+
+Memory&
+Memory::operator=(Memory&& other)
+{
+	if (this == &other)
+		return *this;
+
+	// other keeps the mapping this one had
+	std::swap(m_base, other.m_base);
+	std::swap(m_words, other.m_words);
+	return *this;
+}
+
+/*
+ * Replaces the words with a fresh private mapping of base, or of zeros
+ */
+void
+Memory::map(const std::shared_ptr<const BaseImage>& base)
+{
+	void* p;
+	if (base) {
+		p = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				base->fd(), 0);
+	} else {
+		p = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (p == MAP_FAILED)
+		throw std::bad_alloc();
+
+	if (m_words)
+		munmap(m_words, MEMORY_BYTES);
+	m_words = static_cast<uint16_t*>(p);
+	m_base = base;
+}
+
+/*
+ * Makes the words match other's, which maps the same base. Only pages that
+ * differ are written, so a fresh copy stays shared wherever other is.
+ */
+void
+Memory::copyFrom(const Memory& other)
+{
+	size_t words = page_bytes() / sizeof(uint16_t);
+
+	for (size_t offset = 0; offset < MEMORY_WORDS; offset += words) {
+		uint16_t* mine = m_words + offset;
+		const uint16_t* theirs = other.m_words + offset;
+		if (memcmp(mine, theirs, words * sizeof(uint16_t)) != 0)
+			memcpy(mine, theirs, words * sizeof(uint16_t));
+	}
+}
+
+/*
+ * Turns the current contents into a base image of their own, so copies
+ * made from now on share them. Fails if no memfd could be made, leaving
+ * the memory as it was.
+ */
+bool
+Memory::makeShared()
+{
+	auto base = BaseImage::create(m_words);
+	if (!base)
+		return false;
+	map(base);
+	return true;
+}
+
+/*
+ * Starts over from the contents of base
+ */
+void
+Memory::attach(const std::shared_ptr<const BaseImage>& base)
+{
+	map(base);
+}
+
+/*
+ * Filling with zeros drops the base and every private page
+ */
+void
+Memory::fill(uint16_t value)
+{
+	if (value == 0) {
+		map(nullptr);
+	} else {
+		std::fill(begin(), end(), value);
+	}
+}
+
+/*
+ * Asks the kernel which pages are private copies: present (or swapped),
+ * anonymous and mapped only here. Without access to pagemap, pages that
+ * differ from the base count as private.
+ */
+MemoryUsage
+Memory::usage() const
+{
+	size_t bytes = page_bytes();
+	size_t pages = MEMORY_BYTES / bytes;
+	std::vector<uint64_t> entries(pages);
+
+	int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	off_t offset = uintptr_t(m_words) / bytes * sizeof(uint64_t);
+	ssize_t want = pages * sizeof(uint64_t);
+	bool pagemap = fd >= 0 && pread(fd, entries.data(), want, offset) == want;
+	if (fd >= 0)
+		close(fd);
+
+	MemoryUsage res;
+	for (size_t page = 0; page < pages; page++) {
+		const uint16_t* words = m_words + page * bytes / sizeof(uint16_t);
+		bool priv;
+		if (pagemap) {
+			uint64_t e = entries[page];
+			priv = (e & PAGEMAP_SWAPPED) || ((e & PAGEMAP_PRESENT) &&
+					!(e & PAGEMAP_FILE) && (e & PAGEMAP_EXCLUSIVE));
+		} else if (m_base) {
+			priv = memcmp(words, m_base->words() + (words - m_words),
+					bytes) != 0;
+		} else {
+			priv = !is_zero(words, bytes);
+		}
+
+		if (priv) {
+			res.priv += bytes;
+		} else if (m_base) {
+			res.shared += bytes;
+		}
+	}
+	return res;
+}
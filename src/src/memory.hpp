@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory>
+#include <stdexcept>
+
+#define MEMORY_WORDS (0x1 << 16)
+#define MEMORY_BYTES (MEMORY_WORDS * sizeof(uint16_t))
+
+/*
+ * class BaseImage: A read-only memory image in a sealed memfd, for any
+ * number of Memory objects to map privately. Pages nobody has written stay
+ * in the page cache once, however many machines use them.
+ */
+class BaseImage {
+public:
+	static std::shared_ptr<const BaseImage> create(const uint16_t* words);
+	~BaseImage();
+
+	int fd() const { return m_fd; }
+	const uint16_t* words() const { return m_words; }
+
+private:
+	BaseImage();
+
+	int m_fd;
+	uint16_t* m_words;
+};
+
+/*
+ * struct MemoryUsage: Bytes of one Memory still read from the base image,
+ * and bytes it holds a copy of its own
+ */
+struct MemoryUsage {
+	size_t shared = 0;
+	size_t priv = 0;
+
+	MemoryUsage& operator+=(const MemoryUsage& other) {
+		shared += other.shared;
+		priv += other.priv;
+		return *this;
+	}
+};
+
+/*
+ * class Memory: The machine's 64K words, used like the std::array it
+ * replaces. The words live in a private mapping, either of nothing (zero
+ * pages, allocated on first write) or of a BaseImage, where the kernel
+ * copies a page on its first write. Copies of a Memory map the same base
+ * and only copy the pages that differ from it, so saved states and worker
+ * machines cost what they have diverged.
+ */
+class Memory {
+public:
+	Memory();
+	Memory(const Memory& other);
+	Memory(Memory&& other);
+	~Memory();
+
+	Memory& operator=(const Memory& other);
+	Memory& operator=(Memory&& other);
+
+	bool makeShared();
+	void attach(const std::shared_ptr<const BaseImage>& base);
+	const std::shared_ptr<const BaseImage>& base() const { return m_base; }
+	MemoryUsage usage() const;
+
+	uint16_t* data() { return m_words; }
+	const uint16_t* data() const { return m_words; }
+	static constexpr size_t size() { return MEMORY_WORDS; }
+
+	uint16_t& operator[](size_t i) { return m_words[i]; }
+	const uint16_t& operator[](size_t i) const { return m_words[i]; }
+	uint16_t& at(size_t i) {
+		if (i >= MEMORY_WORDS)
+			throw std::out_of_range("Memory::at");
+		return m_words[i];
+	}
+	const uint16_t& at(size_t i) const {
+		if (i >= MEMORY_WORDS)
+			throw std::out_of_range("Memory::at");
+		return m_words[i];
+	}
+
+	uint16_t* begin() { return m_words; }
+	uint16_t* end() { return m_words + MEMORY_WORDS; }
+	const uint16_t* begin() const { return m_words; }
+	const uint16_t* end() const { return m_words + MEMORY_WORDS; }
+
+	void fill(uint16_t value);
+
+private:
+	void map(const std::shared_ptr<const BaseImage>& base);
+	void copyFrom(const Memory& other);
+
+	std::shared_ptr<const BaseImage> m_base;
+	uint16_t* m_words;
+};
@@ -0,0 +1,320 @@
+#include "metrics.hpp"
+#include "opcodes.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static_assert(METRICS_OPS == NUM_OPS, "one counter per opcode");
+
+Metrics::Metrics() :
+	m_ticks(0),
+	m_rate(0),
+	m_ops(),
+	m_out_bytes(0),
+	m_in_lines(0),
+	m_input_ns(0),
+	m_run_ns(0),
+	m_stack_max(0),
+	m_running(false),
+	m_waiting(false),
+	m_rate_ticks(0),
+	m_rate_ns(0)
+{
+}
+
+uint64_t
+Metrics::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Stores the machine's counters for readers. The rate is measured over at
+ * least METRICS_RATE_NS, so it does not jitter with the publishing period.
+ */
+void
+Metrics::publish(uint64_t ticks, const Counters& c, bool running,
+		bool waiting)
+{
+	auto relaxed = std::memory_order_relaxed;
+
+	uint64_t t = now();
+	if (ticks < m_rate_ticks || m_rate_ns == 0) {
+		m_rate_ticks = ticks;
+		m_rate_ns = t;
+	} else if (t - m_rate_ns >= METRICS_RATE_NS) {
+		m_rate.store((ticks - m_rate_ticks) * 1000000000 /
+				(t - m_rate_ns), relaxed);
+		m_rate_ticks = ticks;
+		m_rate_ns = t;
+	}
+
+	m_ticks.store(ticks, relaxed);
+	for (size_t i = 0; i < METRICS_OPS; i++) {
+		m_ops[i].store(c.ops[i], relaxed);
+	}
+	m_out_bytes.store(c.out_bytes, relaxed);
+	m_in_lines.store(c.in_lines, relaxed);
+	m_input_ns.store(c.input_ns, relaxed);
+	m_run_ns.store(c.run_ns, relaxed);
+	m_stack_max.store(c.stack_max, relaxed);
+	m_running.store(running, relaxed);
+	m_waiting.store(waiting, relaxed);
+}
+
+MetricsSnapshot
+Metrics::snapshot() const
+{
+	auto relaxed = std::memory_order_relaxed;
+
+	MetricsSnapshot s;
+	s.running = m_running.load(relaxed);
+	s.waiting = m_waiting.load(relaxed);
+	s.ticks = m_ticks.load(relaxed);
+	s.ticks_per_sec = s.running && !s.waiting ? m_rate.load(relaxed) : 0;
+	for (size_t i = 0; i < METRICS_OPS; i++) {
+		s.ops[i] = m_ops[i].load(relaxed);
+	}
+	s.out_bytes = m_out_bytes.load(relaxed);
+	s.in_lines = m_in_lines.load(relaxed);
+	s.input_ns = m_input_ns.load(relaxed);
+	s.run_ns = m_run_ns.load(relaxed);
+	s.stack_max = m_stack_max.load(relaxed);
+	s.wmem = s.ops[WMEM];
+	return s;
+}
+
+/*
+ * Renders the snapshots in the Prometheus text exposition format, one
+ * series per machine, labelled by name
+ */
+void
+Metrics::writePrometheus(std::string& out,
+		const std::vector<std::pair<std::string, MetricsSnapshot>>& machines)
+{
+	char line[256];
+	auto family = [&](const char* name, const char* type,
+			const char* help) {
+		snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+				name, help, name, type);
+		out += line;
+	};
+	auto sample = [&](const char* name, const std::string& machine,
+			double value) {
+		snprintf(line, sizeof(line), "%s{machine=\"%s\"} %.17g\n", name,
+				machine.c_str(), value);
+		out += line;
+	};
+
+	struct Gauge {
+		const char* name;
+		const char* type;
+		const char* help;
+		double (*get)(const MetricsSnapshot&);
+	} gauges[] = {
+		{"synacor_ticks_total", "counter", "Instructions executed.",
+			[](const MetricsSnapshot& s) { return double(s.ticks); }},
+		{"synacor_ticks_per_second", "gauge",
+			"Instructions executed per second, recently.",
+			[](const MetricsSnapshot& s) { return s.ticks_per_sec; }},
+		{"synacor_out_bytes_total", "counter", "Characters written.",
+			[](const MetricsSnapshot& s) {
+				return double(s.out_bytes); }},
+		{"synacor_in_lines_total", "counter",
+			"Input lines taken by the guest.",
+			[](const MetricsSnapshot& s) {
+				return double(s.in_lines); }},
+		{"synacor_input_wait_seconds_total", "counter",
+			"Time spent blocked waiting for input.",
+			[](const MetricsSnapshot& s) { return s.input_ns / 1e9; }},
+		{"synacor_run_seconds_total", "counter",
+			"Time spent executing instructions.",
+			[](const MetricsSnapshot& s) { return s.run_ns / 1e9; }},
+		{"synacor_stack_max_depth", "gauge",
+			"Deepest the guest stack has been.",
+			[](const MetricsSnapshot& s) {
+				return double(s.stack_max); }},
+		{"synacor_wmem_total", "counter", "WMEM instructions executed.",
+			[](const MetricsSnapshot& s) { return double(s.wmem); }},
+		{"synacor_running", "gauge",
+			"1 while the machine is being run.",
+			[](const MetricsSnapshot& s) { return double(s.running); }},
+		{"synacor_waiting_input", "gauge",
+			"1 while the machine is blocked on input.",
+			[](const MetricsSnapshot& s) { return double(s.waiting); }},
+	};
+
+	for (auto& g : gauges) {
+		family(g.name, g.type, g.help);
+		for (auto& m : machines) {
+			sample(g.name, m.first, g.get(m.second));
+		}
+	}
+
+	family("synacor_ops_total", "counter",
+			"Instructions executed, by opcode.");
+	for (auto& m : machines) {
+		for (size_t op = 0; op < METRICS_OPS; op++) {
+			snprintf(line, sizeof(line),
+					"synacor_ops_total{machine=\"%s\",op=\"%s\"} %lu\n",
+					m.first.c_str(), op_names[op], m.second.ops[op]);
+			out += line;
+		}
+	}
+}
+
+MetricsServer::MetricsServer() :
+	m_fd(-1),
+	m_wake{-1, -1}
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+	this->stop();
+}
+
+void
+MetricsServer::add(const char* name, const Metrics* metrics)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+	m_machines.emplace_back(name, metrics);
+}
+
+std::string
+MetricsServer::render() const
+{
+	std::vector<std::pair<std::string, MetricsSnapshot>> snaps;
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		for (auto& m : m_machines) {
+			snaps.emplace_back(m.first, m.second->snapshot());
+		}
+	}
+
+	std::string out;
+	Metrics::writePrometheus(out, snaps);
+	return out;
+}
+
+/*
+ * Listens on the given socket path, replacing a stale socket left there
+ */
+bool
+MetricsServer::start(const char* path)
+{
+	if (m_fd >= 0)
+		return false;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return false;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+			listen(fd, 8) != 0 || pipe(m_wake) != 0) {
+		perror(path);
+		close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_path = path;
+	m_thread = std::thread(&MetricsServer::serveLoop, this);
+	return true;
+}
+
+void
+MetricsServer::stop()
+{
+	if (m_fd < 0)
+		return;
+
+	char c = 0;
+	if (write(m_wake[1], &c, 1) != 1)
+		perror("write");
+	m_thread.join();
+
+	close(m_fd);
+	close(m_wake[0]);
+	close(m_wake[1]);
+	unlink(m_path.c_str());
+	m_fd = -1;
+	m_wake[0] = m_wake[1] = -1;
+	m_path.clear();
+}
+
+/*
+ * Answers each connection with the current metrics. The request itself is
+ * not parsed, only drained for a moment so clients see a clean close.
+ */
+void
+MetricsServer::serveLoop()
+{
+	struct pollfd fds[2] = {
+		{m_fd, POLLIN, 0},
+		{m_wake[0], POLLIN, 0},
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		int client = accept4(m_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+
+		struct pollfd req = {client, POLLIN, 0};
+		char buffer[1024];
+		if (poll(&req, 1, 100) > 0 &&
+				read(client, buffer, sizeof(buffer)) < 0) {
+			close(client);
+			continue;
+		}
+
+		std::string body = render();
+		char header[128];
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %lu\r\n\r\n", body.size());
+		std::string response = header + body;
+
+		const char* p = response.data();
+		size_t left = response.size();
+		while (left > 0) {
+			ssize_t n = send(client, p, left, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			p += n;
+			left -= n;
+		}
+		close(client);
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define METRICS_OPS 22
+#define METRICS_PUBLISH_TICKS (0x1 << 16)
+#define METRICS_RATE_NS 250000000L
+
+/*
+ * struct MetricsSnapshot: A copy of a machine's counters, as of its latest
+ * publication
+ */
+struct MetricsSnapshot {
+	uint64_t ticks;
+	double ticks_per_sec;
+	std::array<uint64_t, METRICS_OPS> ops;
+	uint64_t out_bytes;
+	uint64_t in_lines;
+	uint64_t input_ns;
+	uint64_t run_ns;
+	uint64_t stack_max;
+	uint64_t wmem;
+	bool running;
+	bool waiting;
+};
+
+/*
+ * class Metrics: Runtime counters of one machine. The machine's thread
+ * accumulates them in a plain Counters struct and publishes it here every
+ * METRICS_PUBLISH_TICKS ticks and around input waits. Publishing stores
+ * into relaxed atomics, so any thread can take a snapshot without locks.
+ * Fields of a snapshot may come from two neighbouring publications.
+ */
+class Metrics {
+public:
+	struct Counters {
+		std::array<uint64_t, METRICS_OPS> ops{};
+		uint64_t out_bytes = 0;
+		uint64_t in_lines = 0;
+		uint64_t input_ns = 0;
+		uint64_t run_ns = 0;
+		uint64_t stack_max = 0;
+	};
+
+	Metrics();
+
+	void publish(uint64_t ticks, const Counters& c, bool running,
+			bool waiting);
+	MetricsSnapshot snapshot() const;
+
+	static uint64_t now();
+	static void writePrometheus(std::string& out,
+			const std::vector<std::pair<std::string,
+				MetricsSnapshot>>& machines);
+
+private:
+	std::atomic<uint64_t> m_ticks;
+	std::atomic<uint64_t> m_rate;
+	std::array<std::atomic<uint64_t>, METRICS_OPS> m_ops;
+	std::atomic<uint64_t> m_out_bytes;
+	std::atomic<uint64_t> m_in_lines;
+	std::atomic<uint64_t> m_input_ns;
+	std::atomic<uint64_t> m_run_ns;
+	std::atomic<uint64_t> m_stack_max;
+	std::atomic<bool> m_running;
+	std::atomic<bool> m_waiting;
+
+	// Only touched by the publishing thread
+	uint64_t m_rate_ticks;
+	uint64_t m_rate_ns;
+};
+
+/*
+ * class MetricsServer: Serves the metrics of a set of machines in the
+ * Prometheus text format on a Unix socket, one HTTP/1.0 response per
+ * connection, e.g. curl --unix-socket PATH http://localhost/metrics
+ */
+class MetricsServer {
+public:
+	MetricsServer();
+	~MetricsServer();
+
+	void add(const char* name, const Metrics* metrics);
+	bool start(const char* path);
+	void stop();
+	bool running() const { return m_fd >= 0; }
+
+	std::string render() const;
+
+private:
+	void serveLoop();
+
+	std::vector<std::pair<std::string, const Metrics*>> m_machines;
+	mutable std::mutex m_mux;
+
+	std::string m_path;
+	int m_fd;
+	int m_wake[2];
+	std::thread m_thread;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#define HALT 0
+#define SET  1
+#define PUSH 2
+#define POP  3
+#define EQ   4
+#define GT   5
+#define JMP  6
+#define JNZ  7
+#define JZ   8
+#define ADD  9
+#define MULT 10
+#define MOD  11
+#define AND  12
+#define OR   13
+#define NOT  14
+#define RMEM 15
+#define WMEM 16
+#define CALL 17
+#define RET  18
+#define OUT  19
+#define IN   20
+#define NOP  21
+
+#define NUM_OPS 22
+
+static const char* const op_names[NUM_OPS] = {
+	"HALT", "SET", "PUSH", "POP", "EQ",  "GT", "JMP", "JNZ",
+	"JZ",   "ADD", "MULT", "MOD", "AND", "OR", "NOT", "RMEM",
+	"WMEM", "CALL", "RET", "OUT", "IN", "NOP"
+};
+
+/* Number of operands taken by each opcode */
+static const uint8_t op_size[NUM_OPS] = {
+	0, 2, 1, 1, 3, 3, 1, 2,
+	2, 3, 3, 3, 3, 3, 2, 2,
+	2, 1, 0, 1, 1, 0
+};
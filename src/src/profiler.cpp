@@ -0,0 +1,252 @@
+#include "profiler.hpp"
+#include "common.hpp"
+#include "analysis/symbols.hpp"
+
+#include <algorithm>
+#include <set>
+
+/* How many shadow frames a RET may unwind looking for its return address */
+#define MAX_UNWIND 8
+
+ProfileReport::ProfileReport() :
+	hits(PROFILE_ADDR_SPACE, 0)
+{
+
+}
+
+std::string
+ProfileReport::frameName(uint16_t frame) const
+{
+	if (symbols && frame < PROFILE_ADDR_SPACE) {
+		const Symbol* sym = symbols->at(frame);
+		if (sym)
+			return sym->name;
+	}
+
+	char res[16];
+	if (frame == PROFILE_ROOT_FRAME) {
+		return "[root]";
+	} else if (frame == PROFILE_TRUNCATED_FRAME) {
+		return "[...]";
+	} else if (frame & 0x8000) {
+		snprintf(res, sizeof(res), "call@%04x", frame & 0x7fff);
+	} else {
+		snprintf(res, sizeof(res), "fn_%04x", frame);
+	}
+	return res;
+}
+
+std::map<uint16_t, ProfileReport::Function>
+ProfileReport::functions() const
+{
+	std::map<uint16_t, Function> res;
+	std::set<uint16_t> seen;
+
+	for (auto& entry : stacks) {
+		auto& stack = entry.first;
+		if (stack.empty())
+			continue;
+
+		// Recursive frames only count once towards inclusive time
+		seen.clear();
+		for (uint16_t frame : stack) {
+			if (seen.insert(frame).second) {
+				res[frame].inclusive += entry.second;
+			}
+		}
+		res[stack.back()].exclusive += entry.second;
+	}
+
+	for (auto& entry : calls) {
+		res[entry.first].calls = entry.second;
+	}
+
+	return res;
+}
+
+void
+ProfileReport::print(FILE* out, size_t top) const
+{
+	double total_pct = total ? 100.0 / total : 0.0;
+
+	auto funcs = functions();
+	std::vector<std::pair<uint16_t, Function>> sorted(funcs.begin(),
+			funcs.end());
+	std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) {
+		return a.second.exclusive > b.second.exclusive;
+	});
+
+	fprintf(out, "PROFILE: %lu %s, %lu functions\n", total, unit,
+			sorted.size());
+	fprintf(out, "%-16s %10s %14s %7s %14s %7s\n", "FUNCTION", "CALLS",
+			"EXCLUSIVE", "%", "INCLUSIVE", "%");
+	for (size_t i = 0; i < MIN(top, sorted.size()); i++) {
+		auto& f = sorted[i];
+		fprintf(out, "%-16s %10lu %14lu %6.2f%% %14lu %6.2f%%\n",
+				frameName(f.first).c_str(), f.second.calls,
+				f.second.exclusive,
+				f.second.exclusive * total_pct,
+				f.second.inclusive,
+				f.second.inclusive * total_pct);
+	}
+
+	std::vector<uint16_t> addrs;
+	for (size_t i = 0; i < hits.size(); i++) {
+		if (hits[i])
+			addrs.push_back(i);
+	}
+	std::sort(addrs.begin(), addrs.end(), [this](uint16_t a, uint16_t b) {
+		return hits[a] > hits[b];
+	});
+
+	fprintf(out, "\nHOT ADDRESSES\n");
+	for (size_t i = 0; i < MIN(top, addrs.size()); i++) {
+		std::string where = symbols ? symbols->describe(addrs[i]) : "";
+		fprintf(out, "0x%04x: %14lu %6.2f%%%s%s\n", addrs[i],
+				hits[addrs[i]], hits[addrs[i]] * total_pct,
+				where.empty() ? "" : "  ", where.c_str());
+	}
+}
+
+void
+ProfileReport::writeCollapsed(FILE* out) const
+{
+	for (auto& entry : stacks) {
+		const char* sep = "";
+		for (uint16_t frame : entry.first) {
+			fprintf(out, "%s%s", sep, frameName(frame).c_str());
+			sep = ";";
+		}
+		fprintf(out, " %lu\n", entry.second);
+	}
+}
+
+/*
+ * Writes <prefix>.txt with the report and <prefix>.folded with the
+ * collapsed stacks, which flamegraph.pl and compatible tools read directly
+ */
+bool
+ProfileReport::save(const char* prefix) const
+{
+	std::string name(prefix);
+
+	FILE* f = fopen((name + ".txt").c_str(), "w");
+	if (!f)
+		return false;
+	print(f, SIZE_MAX);
+	fclose(f);
+
+	f = fopen((name + ".folded").c_str(), "w");
+	if (!f)
+		return false;
+	writeCollapsed(f);
+	fclose(f);
+	return true;
+}
+
+Profiler::Profiler()
+{
+	reset();
+}
+
+void
+Profiler::reset()
+{
+	m_hits.assign(PROFILE_ADDR_SPACE, 0);
+	m_nodes.clear();
+	m_nodes.push_back({PROFILE_ROOT_FRAME, 0, 0, 0});
+	m_children.clear();
+	m_frames.clear();
+	m_frames.reserve(PROFILE_MAX_DEPTH);
+	m_overflow = 0;
+	m_node = 0;
+	m_prev_ip = 0;
+	m_pending = 0;
+}
+
+void
+Profiler::enter(uint16_t ip)
+{
+	if (m_frames.size() >= PROFILE_MAX_DEPTH) {
+		m_overflow++;
+		return;
+	}
+
+	uint64_t key = (uint64_t(m_node) << 16) | ip;
+	auto it = m_children.find(key);
+	uint32_t child;
+	if (it == m_children.end()) {
+		child = m_nodes.size();
+		m_nodes.push_back({ip, m_node, 0, 0});
+		m_children.emplace(key, child);
+	} else {
+		child = it->second;
+	}
+
+	m_frames.push_back({m_node, uint16_t(m_prev_ip + 2)});
+	m_nodes[child].calls++;
+	m_node = child;
+}
+
+void
+Profiler::leave(uint16_t ip)
+{
+	if (m_overflow) {
+		m_overflow--;
+		return;
+	}
+
+	// Code that juggles its return addresses may not RET to the frame on
+	// top, so look a few frames down before giving up on the match
+	size_t limit = m_frames.size() > MAX_UNWIND ?
+		m_frames.size() - MAX_UNWIND : 0;
+	for (size_t i = m_frames.size(); i > limit; i--) {
+		if (m_frames[i - 1].ret == ip) {
+			m_node = m_frames[i - 1].caller;
+			m_frames.resize(i - 1);
+			return;
+		}
+	}
+}
+
+ProfileReport
+Profiler::report() const
+{
+	ProfileReport res;
+	res.hits = m_hits;
+
+	std::vector<uint16_t> stack;
+	for (size_t i = 0; i < m_nodes.size(); i++) {
+		const Node& node = m_nodes[i];
+		res.total += node.self;
+		if (node.calls) {
+			res.calls[node.func] += node.calls;
+		}
+		if (!node.self)
+			continue;
+
+		stack.clear();
+		for (uint32_t n = i; n != 0; n = m_nodes[n].parent) {
+			stack.push_back(m_nodes[n].func);
+		}
+		stack.push_back(PROFILE_ROOT_FRAME);
+		std::reverse(stack.begin(), stack.end());
+		res.stacks[stack] += node.self;
+	}
+
+	return res;
+}
+
+/*
+ * Every function entry seen so far, including the destinations of indirect
+ * calls that static analysis cannot resolve
+ */
+std::set<uint16_t>
+Profiler::callTargets() const
+{
+	std::set<uint16_t> res;
+	for (size_t i = 1; i < m_nodes.size(); i++) {
+		res.insert(m_nodes[i].func);
+	}
+	return res;
+}
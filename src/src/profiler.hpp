@@ -0,0 +1,113 @@
+#pragma once
+
+#include "opcodes.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class SymbolTable;
+
+#define PROFILE_ADDR_SPACE 0x8000
+#define PROFILE_MAX_DEPTH 1024
+
+/* Frame id used for whatever was executing when profiling started */
+#define PROFILE_ROOT_FRAME 0xffff
+/* Frame id placed at the root of a backtrace that was cut short */
+#define PROFILE_TRUNCATED_FRAME 0xfffe
+
+/*
+ * struct ProfileReport: Aggregated result of a profiling session. Stacks are
+ * stored root first as lists of function entry addresses.
+ */
+struct ProfileReport {
+	struct Function {
+		uint64_t inclusive = 0;
+		uint64_t exclusive = 0;
+		uint64_t calls = 0;
+	};
+
+	ProfileReport();
+
+	std::map<uint16_t, Function> functions() const;
+
+	void print(FILE* out, size_t top) const;
+	void writeCollapsed(FILE* out) const;
+	bool save(const char* prefix) const;
+
+	std::string frameName(uint16_t frame) const;
+
+	std::vector<uint64_t> hits;
+	std::map<std::vector<uint16_t>, uint64_t> stacks;
+	std::map<uint16_t, uint64_t> calls;
+	uint64_t total = 0;
+	const char* unit = "ticks";
+	/* Names functions in reports, when set */
+	const SymbolTable* symbols = nullptr;
+};
+
+/*
+ * class Profiler: Counts executions per address and keeps a shadow call
+ * stack, built from the CALL/RET instructions the machine executes, to
+ * attribute ticks to guest functions.
+ */
+class Profiler {
+public:
+	Profiler();
+
+	void reset();
+	void onOp(uint16_t ip, uint16_t op);
+
+	ProfileReport report() const;
+	std::set<uint16_t> callTargets() const;
+
+private:
+	struct Node {
+		uint16_t func;
+		uint32_t parent;
+		uint64_t self;
+		uint64_t calls;
+	};
+
+	struct Frame {
+		uint32_t caller;
+		uint16_t ret;
+	};
+
+	void enter(uint16_t ip);
+	void leave(uint16_t ip);
+
+	std::vector<uint64_t> m_hits;
+	std::vector<Node> m_nodes;
+	std::unordered_map<uint64_t, uint32_t> m_children;
+	std::vector<Frame> m_frames;
+
+	size_t m_overflow;
+	uint32_t m_node;
+	uint16_t m_prev_ip;
+	uint16_t m_pending;
+};
+
+/*
+ * Called by the machine before executing each instruction. CALL and RET are
+ * resolved on the following tick, when the destination is known.
+ */
+inline void
+Profiler::onOp(uint16_t ip, uint16_t op)
+{
+	if (m_pending == CALL) {
+		enter(ip);
+	} else if (m_pending == RET) {
+		leave(ip);
+	}
+
+	m_hits[ip & (PROFILE_ADDR_SPACE - 1)]++;
+	m_nodes[m_node].self++;
+	m_pending = (op == CALL || op == RET) ? op : 0;
+	m_prev_ip = ip;
+}
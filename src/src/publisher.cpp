@@ -0,0 +1,67 @@
+#include "publisher.hpp"
+
+#include <chrono>
+
+StatePublisher::StatePublisher() :
+	m_machine(nullptr),
+	m_due(false),
+	m_stopping(false)
+{
+}
+
+StatePublisher::~StatePublisher()
+{
+}
+
+/*
+ * Attaches to the machine and publishes hz times per second of wall time.
+ * Call it from the machine's thread, or while the machine is not running.
+ */
+bool
+StatePublisher::start(Machine& m, unsigned hz)
+{
+	if (m_machine)
+		return false;
+
+	m_machine = &m;
+	m_stopping = false;
+	m.addPublisher(this);
+	if (hz > 0)
+		m_ticker = std::thread(&StatePublisher::tickerLoop, this, hz);
+	return true;
+}
+
+void
+StatePublisher::stop()
+{
+	if (!m_machine)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_stopping = true;
+	}
+	m_cv.notify_all();
+	if (m_ticker.joinable())
+		m_ticker.join();
+
+	m_machine->removePublisher(this);
+	m_machine = nullptr;
+	m_due.store(false, std::memory_order_relaxed);
+}
+
+void
+StatePublisher::tickerLoop(unsigned hz)
+{
+	auto period = std::chrono::nanoseconds(1000000000L / hz);
+	auto next = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(m_mux);
+	while (!m_stopping) {
+		next += period;
+		if (m_cv.wait_until(lock, next, [this] { return m_stopping; }))
+			break;
+		m_due.store(true, std::memory_order_relaxed);
+		m_machine->requestPublish();
+	}
+}
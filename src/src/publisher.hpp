@@ -0,0 +1,45 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/*
+ * class StatePublisher: Something that wants a copy of the machine's state
+ * a few times a second, without a callback on every instruction.
+ *
+ * While started, a timer thread marks the publisher due and asks the
+ * machine for a publish; the machine then calls publish() on its own
+ * thread between two instructions, so the state is consistent. The
+ * machine also publishes to every attached publisher when it blocks on
+ * input; started with 0 hz, that is the only time it does. Subclasses must
+ * call stop() in their destructor.
+ */
+class StatePublisher {
+public:
+	StatePublisher();
+	virtual ~StatePublisher();
+
+	bool start(Machine& m, unsigned hz);
+	void stop();
+	bool started() const { return m_machine != nullptr; }
+
+	bool takeDue() {
+		return m_due.exchange(false, std::memory_order_relaxed);
+	}
+
+	virtual void publish(const Machine::State& s, bool waiting) = 0;
+
+private:
+	void tickerLoop(unsigned hz);
+
+	Machine* m_machine;
+	std::atomic<bool> m_due;
+	std::thread m_ticker;
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+	bool m_stopping;
+};
@@ -0,0 +1,207 @@
+#include "sampler.hpp"
+#include "common.hpp"
+#include "opcodes.hpp"
+#include "data_structures/stack.h"
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+
+#define SAMPLE_SIGNAL SIGPROF
+
+/* Older glibc headers only expose the raw union member */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+ * Only one sampler can drive the timer signal at a time. The handler reads
+ * the target through an atomic, so a late signal after stop() is harmless.
+ */
+static std::atomic<Machine*> s_target{nullptr};
+
+static void on_sample_signal(int, siginfo_t*, void*)
+{
+	Machine* m = s_target.load();
+	if (m) {
+		m->requestSample();
+	}
+}
+
+Sampler::Sampler(size_t capacity) :
+	m_ring(MAX(capacity, size_t(1))),
+	m_taken(0),
+	m_machine(nullptr),
+	m_timer(),
+	m_old_action(),
+	m_running(false)
+{
+
+}
+
+Sampler::~Sampler()
+{
+	this->stop();
+}
+
+/*
+ * Starts sampling at the given frequency, measured in CPU time of the
+ * calling thread, which must be the one running the machine.
+ */
+bool
+Sampler::start(Machine& m, unsigned hz)
+{
+	if (m_running || hz == 0)
+		return false;
+
+	Machine* expected = nullptr;
+	if (!s_target.compare_exchange_strong(expected, &m))
+		return false;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = on_sample_signal;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SAMPLE_SIGNAL, &sa, &m_old_action);
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SAMPLE_SIGNAL;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &m_timer) != 0) {
+		sigaction(SAMPLE_SIGNAL, &m_old_action, NULL);
+		s_target.store(nullptr);
+		return false;
+	}
+
+	long period = 1000000000L / hz;
+	struct itimerspec its;
+	its.it_interval.tv_sec = period / 1000000000L;
+	its.it_interval.tv_nsec = period % 1000000000L;
+	its.it_value = its.it_interval;
+	timer_settime(m_timer, 0, &its, NULL);
+
+	m_machine = &m;
+	m_machine->setSampler(this);
+	m_running = true;
+	return true;
+}
+
+void
+Sampler::stop()
+{
+	if (!m_running)
+		return;
+
+	timer_delete(m_timer);
+	s_target.store(nullptr);
+	restoreSignal();
+	m_machine->setSampler(nullptr);
+	m_machine = nullptr;
+	m_running = false;
+}
+
+/*
+ * Gives the signal back to whoever had it before start(). A sample signal
+ * still pending from the deleted timer is taken first, as the previous
+ * disposition may be the default one, which would end the process.
+ */
+void
+Sampler::restoreSignal()
+{
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SAMPLE_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	struct timespec now = {0, 0};
+	while (sigtimedwait(&set, NULL, &now) == SAMPLE_SIGNAL);
+
+	sigaction(SAMPLE_SIGNAL, &m_old_action, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+bool
+Sampler::running() const
+{
+	return m_running;
+}
+
+void
+Sampler::take(const Machine::State& s)
+{
+	Sample& sample = m_ring[m_taken % m_ring.size()];
+	m_taken++;
+
+	sample.ip = s.ip;
+	sample.depth = 0;
+	sample.truncated = false;
+
+	const auto& stack = stack_container(s.stack);
+	size_t scanned = 0;
+	for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+		if (scanned++ == SAMPLE_SCAN_DEPTH ||
+				sample.depth == SAMPLE_MAX_FRAMES) {
+			sample.truncated = true;
+			break;
+		}
+
+		uint16_t ret = *it;
+		if (ret < 2 || ret > 0x7fff || s.ram[ret - 2] != CALL)
+			continue;
+
+		// Indirect calls are named after their call site
+		uint16_t target = s.ram[ret - 1];
+		sample.frames[sample.depth++] = target <= 0x7fff ?
+			target : (0x8000 | (ret - 2));
+	}
+}
+
+void
+Sampler::clear()
+{
+	m_taken = 0;
+}
+
+size_t
+Sampler::size() const
+{
+	return MIN(m_taken, uint64_t(m_ring.size()));
+}
+
+uint64_t
+Sampler::dropped() const
+{
+	return m_taken - size();
+}
+
+ProfileReport
+Sampler::report() const
+{
+	ProfileReport res;
+	res.unit = "samples";
+
+	std::vector<uint16_t> stack;
+	for (size_t i = 0; i < size(); i++) {
+		const Sample& sample = m_ring[i];
+
+		stack.clear();
+		stack.push_back(sample.truncated ?
+				PROFILE_TRUNCATED_FRAME : PROFILE_ROOT_FRAME);
+		for (size_t j = sample.depth; j > 0; j--) {
+			stack.push_back(sample.frames[j - 1]);
+		}
+
+		res.hits[sample.ip & (PROFILE_ADDR_SPACE - 1)]++;
+		res.stacks[stack]++;
+		res.total++;
+	}
+
+	return res;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "machine.hpp"
+#include "profiler.hpp"
+
+#include <signal.h>
+#include <time.h>
+
+#include <vector>
+
+#define SAMPLE_MAX_FRAMES 32
+#define SAMPLE_SCAN_DEPTH 512
+#define SAMPLE_DEFAULT_HZ 1000
+
+/*
+ * class Sampler: Statistical profiler. A CPU-time timer on the machine's
+ * thread periodically asks the machine for a sample, which is then taken
+ * between two instructions and stored in a preallocated ring.
+ *
+ * Backtraces are recovered by scanning the guest stack for values that point
+ * right after a CALL instruction, as the guest keeps no frame pointers.
+ */
+class Sampler {
+public:
+	Sampler(size_t capacity = 1 << 16);
+	~Sampler();
+
+	bool start(Machine& m, unsigned hz);
+	void stop();
+	bool running() const;
+
+	void take(const Machine::State& s);
+	void clear();
+
+	size_t size() const;
+	uint64_t dropped() const;
+
+	ProfileReport report() const;
+
+private:
+	struct Sample {
+		uint16_t ip;
+		uint16_t depth;
+		bool truncated;
+		uint16_t frames[SAMPLE_MAX_FRAMES];
+	};
+
+	void restoreSignal();
+
+	std::vector<Sample> m_ring;
+	uint64_t m_taken;
+
+	Machine* m_machine;
+	timer_t m_timer;
+	struct sigaction m_old_action;
+	bool m_running;
+};
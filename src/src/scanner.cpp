@@ -0,0 +1,220 @@
+#include "scanner.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef __SSE2__
+static bool
+matches(Scanner::Op op, uint16_t cur, uint16_t prev, uint16_t value)
+{
+	switch (op) {
+	case Scanner::SCAN_ANY:       return true;
+	case Scanner::SCAN_EQ:        return cur == value;
+	case Scanner::SCAN_NE:        return cur != value;
+	case Scanner::SCAN_GT:        return cur > value;
+	case Scanner::SCAN_LT:        return cur < value;
+	case Scanner::SCAN_CHANGED:   return cur != prev;
+	case Scanner::SCAN_UNCHANGED: return cur == prev;
+	case Scanner::SCAN_INCREASED: return cur > prev;
+	case Scanner::SCAN_DECREASED: return cur < prev;
+	}
+	return false;
+}
+#else
+/*
+ * Lanes where the predicate holds. Inequalities are unsigned, done as
+ * signed compares after flipping the top bit. Negated predicates return
+ * the lanes where it does not hold and set invert.
+ */
+static __m128i
+matches(Scanner::Op op, __m128i cur, __m128i prev, __m128i value,
+		bool& invert)
+{
+	const __m128i bias = _mm_set1_epi16(-0x8000);
+	invert = op == Scanner::SCAN_NE || op == Scanner::SCAN_CHANGED;
+
+	switch (op) {
+	case Scanner::SCAN_ANY:
+		return _mm_set1_epi16(-1);
+	case Scanner::SCAN_EQ:
+	case Scanner::SCAN_NE:
+		return _mm_cmpeq_epi16(cur, value);
+	case Scanner::SCAN_GT:
+		return _mm_cmpgt_epi16(_mm_xor_si128(cur, bias),
+				_mm_xor_si128(value, bias));
+	case Scanner::SCAN_LT:
+		return _mm_cmplt_epi16(_mm_xor_si128(cur, bias),
+				_mm_xor_si128(value, bias));
+	case Scanner::SCAN_CHANGED:
+	case Scanner::SCAN_UNCHANGED:
+		return _mm_cmpeq_epi16(cur, prev);
+	case Scanner::SCAN_INCREASED:
+		return _mm_cmpgt_epi16(_mm_xor_si128(cur, bias),
+				_mm_xor_si128(prev, bias));
+	case Scanner::SCAN_DECREASED:
+		return _mm_cmplt_epi16(_mm_xor_si128(cur, bias),
+				_mm_xor_si128(prev, bias));
+	}
+	return _mm_setzero_si128();
+}
+#endif
+
+Scanner::Scanner() :
+	m_started(false)
+{
+	reset();
+}
+
+/*
+ * Makes every address a candidate again and forgets the previous values
+ */
+void
+Scanner::reset()
+{
+	m_bits.fill(~uint64_t(0));
+	m_prev.clear();
+	m_started = false;
+}
+
+/*
+ * Drops the candidates that do not satisfy the predicate, then remembers
+ * the current values for the next relative scan. On the first scan there
+ * is nothing to compare with, so relative predicates keep everything.
+ * Returns how many candidates are left.
+ */
+size_t
+Scanner::scan(const uint16_t* ram, Op op, uint16_t value)
+{
+	bool relative = op >= SCAN_CHANGED;
+	if (relative && !m_started)
+		op = SCAN_ANY;
+	const uint16_t* prev = m_started ? m_prev.data() : ram;
+
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi16(value);
+#endif
+	for (size_t w = 0; w < m_bits.size(); w++) {
+		uint64_t bits = m_bits[w];
+		if (!bits || op == SCAN_ANY)
+			continue;
+
+		size_t base = w * 64;
+		uint64_t keep = 0;
+#ifdef __SSE2__
+		for (size_t i = 0; i < 64; i += 16) {
+			const __m128i* pc = (const __m128i*)(ram + base + i);
+			const __m128i* pp = (const __m128i*)(prev + base + i);
+			bool invert;
+			__m128i lo = matches(op, _mm_loadu_si128(pc),
+					_mm_loadu_si128(pp), v, invert);
+			__m128i hi = matches(op, _mm_loadu_si128(pc + 1),
+					_mm_loadu_si128(pp + 1), v, invert);
+			uint32_t mask = _mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+			if (invert)
+				mask = ~mask;
+			keep |= uint64_t(mask & 0xffff) << i;
+		}
+#else
+		for (size_t i = 0; i < 64; i++) {
+			if (matches(op, ram[base + i], prev[base + i], value))
+				keep |= uint64_t(1) << i;
+		}
+#endif
+		m_bits[w] = bits & keep;
+	}
+
+	m_prev.assign(ram, ram + SCAN_WORDS);
+	m_started = true;
+	return count();
+}
+
+size_t
+Scanner::count() const
+{
+	size_t total = 0;
+	for (uint64_t bits : m_bits) {
+		total += __builtin_popcountll(bits);
+	}
+	return total;
+}
+
+std::vector<uint16_t>
+Scanner::candidates(size_t max) const
+{
+	std::vector<uint16_t> res;
+	for (size_t w = 0; w < m_bits.size() && res.size() < max; w++) {
+		uint64_t bits = m_bits[w];
+		while (bits && res.size() < max) {
+			res.push_back(w * 64 + __builtin_ctzll(bits));
+			bits &= bits - 1;
+		}
+	}
+	return res;
+}
+
+void
+Scanner::print(FILE* out, const uint16_t* ram, size_t max) const
+{
+	size_t total = count();
+	fprintf(out, "%lu candidates\n", total);
+	for (uint16_t addr : candidates(max)) {
+		fprintf(out, "  %04x: %04x (%u)\n", addr, ram[addr], ram[addr]);
+	}
+	if (total > max)
+		fprintf(out, "  ... %lu more\n", total - max);
+}
+
+/*
+ * Parses "== N", "!= N", "> N", "< N", "changed", "unchanged", "increased",
+ * "decreased" or "any". A bare number means "== N". Numbers take a 0x
+ * prefix for hex.
+ */
+bool
+Scanner::parse(const char* text, Op& op, uint16_t& value)
+{
+	static const struct Name {
+		const char* name;
+		Op op;
+	} words[] = {
+		{"any", SCAN_ANY},
+		{"changed", SCAN_CHANGED},
+		{"unchanged", SCAN_UNCHANGED},
+		{"increased", SCAN_INCREASED},
+		{"decreased", SCAN_DECREASED},
+	}, ops[] = {
+		{"==", SCAN_EQ},
+		{"!=", SCAN_NE},
+		{">", SCAN_GT},
+		{"<", SCAN_LT},
+	};
+
+	text += strspn(text, " \t");
+	size_t len = strcspn(text, " \t\n");
+	value = 0;
+	for (auto& w : words) {
+		if (len == strlen(w.name) && strncmp(text, w.name, len) == 0) {
+			op = w.op;
+			return true;
+		}
+	}
+
+	op = SCAN_EQ;
+	for (auto& o : ops) {
+		if (strncmp(text, o.name, strlen(o.name)) == 0) {
+			op = o.op;
+			text += strlen(o.name);
+			break;
+		}
+	}
+
+	char* end;
+	long n = strtol(text, &end, 0);
+	if (end == text || n < 0 || n > 0xffff)
+		return false;
+	value = n;
+	return true;
+}
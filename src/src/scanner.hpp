@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <array>
+#include <vector>
+
+#define SCAN_WORDS 0x8000
+
+/*
+ * class Scanner: Finds where the game keeps a value by narrowing down a
+ * candidate set of addresses, cheat engine style. A scan keeps the words
+ * that match a predicate, either against a constant or against the value
+ * they had at the previous scan.
+ *
+ * Candidates are a bitset over the address space. Scans test 16 words at a
+ * time with SSE2 and skip 64-word blocks that have no candidates left, so
+ * rescans get cheaper as the set shrinks.
+ */
+class Scanner {
+public:
+	enum Op : uint8_t {
+		SCAN_ANY,
+		SCAN_EQ,
+		SCAN_NE,
+		SCAN_GT,
+		SCAN_LT,
+		SCAN_CHANGED,
+		SCAN_UNCHANGED,
+		SCAN_INCREASED,
+		SCAN_DECREASED,
+	};
+
+	Scanner();
+
+	void reset();
+	size_t scan(const uint16_t* ram, Op op, uint16_t value);
+
+	bool started() const { return m_started; }
+	size_t count() const;
+	std::vector<uint16_t> candidates(size_t max) const;
+	void print(FILE* out, const uint16_t* ram, size_t max) const;
+
+	static bool parse(const char* text, Op& op, uint16_t& value);
+
+private:
+	std::array<uint64_t, SCAN_WORDS / 64> m_bits;
+	std::vector<uint16_t> m_prev;
+	bool m_started;
+};
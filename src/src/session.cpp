@@ -0,0 +1,194 @@
+#include "session.hpp"
+
+#include <string.h>
+
+Session::Session() :
+	m_image_hash(0),
+	m_start_tick(0),
+	m_end_tick(0),
+	m_end_bytes(0),
+	m_end_hash(SESSION_HASH_SEED),
+	m_output_bytes(0),
+	m_output_hash(SESSION_HASH_SEED)
+{
+}
+
+Session::~Session() {}
+
+/*
+ * Starts a new recording from the given state. Ticks are stored relative to
+ * it, so a replay only needs the same image, not the same tick count.
+ */
+void
+Session::start(const Machine::State& s)
+{
+	m_image_hash = Machine::ramHash(s);
+	m_start_tick = s.ticks;
+	m_inputs.clear();
+	m_end_tick = 0;
+	m_end_bytes = 0;
+	m_end_hash = SESSION_HASH_SEED;
+	m_output_bytes = 0;
+	m_output_hash = SESSION_HASH_SEED;
+}
+
+void
+Session::onInput(size_t tick, const char* line)
+{
+	Input in;
+	in.tick = tick - m_start_tick;
+	in.output_bytes = m_output_bytes;
+	in.output_hash = m_output_hash;
+	in.line = line;
+	if (!in.line.empty() && in.line.back() == '\n')
+		in.line.pop_back();
+	m_inputs.push_back(in);
+}
+
+void
+Session::finish(const Machine::State& s)
+{
+	m_end_tick = s.ticks - m_start_tick;
+	m_end_bytes = m_output_bytes;
+	m_end_hash = m_output_hash;
+}
+
+/*
+ * Session files are text, one record per line:
+ *   image <hash>
+ *   input <tick> <output bytes> <output hash> <line>
+ *   end <tick> <output bytes> <output hash>
+ */
+bool
+Session::save(const char* path) const
+{
+	FILE* out = fopen(path, "w");
+	if (!out)
+		return false;
+
+	fprintf(out, "%s\n", SESSION_MAGIC);
+	fprintf(out, "image\t%016lx\n", m_image_hash);
+	for (const Input& in : m_inputs) {
+		fprintf(out, "input\t%lu\t%lu\t%016lx\t%s\n", in.tick,
+				in.output_bytes, in.output_hash, in.line.c_str());
+	}
+	fprintf(out, "end\t%lu\t%lu\t%016lx\n", m_end_tick,
+			m_end_bytes, m_end_hash);
+
+	return fclose(out) == 0;
+}
+
+bool
+Session::load(const char* path)
+{
+	FILE* in = fopen(path, "r");
+	if (!in)
+		return false;
+
+	char line[MAX_INPUT_SIZE + 128];
+	if (!fgets(line, sizeof(line), in) ||
+			strncmp(line, SESSION_MAGIC, strlen(SESSION_MAGIC))) {
+		fclose(in);
+		return false;
+	}
+
+	Session s;
+	bool ok = false;
+	while (fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		Input input;
+		int pos = 0;
+		if (sscanf(line, "image\t%lx", &s.m_image_hash) == 1) {
+			continue;
+		} else if (sscanf(line, "input\t%lu\t%lu\t%lx\t%n",
+					&input.tick, &input.output_bytes,
+					&input.output_hash, &pos) == 3 && pos) {
+			input.line = line + pos;
+			s.m_inputs.push_back(input);
+		} else if (sscanf(line, "end\t%lu\t%lu\t%lx", &s.m_end_tick,
+					&s.m_end_bytes, &s.m_end_hash) == 3) {
+			ok = true;
+		} else if (line[0] != '#' && line[0] != '\0') {
+			ok = false;
+			break;
+		}
+	}
+	fclose(in);
+
+	if (ok)
+		*this = s;
+	return ok;
+}
+
+/*
+ * Runs the machine through the session, which must have been recorded from
+ * the image it has loaded. Every line is fed at the tick where the guest
+ * read it during the recording, after checking the output up to there.
+ * Reports the first divergence to log and returns false.
+ */
+bool
+Session::replay(Machine& m, FILE* log) const
+{
+	if (Machine::ramHash(m.state()) != m_image_hash) {
+		fprintf(log, "Image does not match the session\n");
+		return false;
+	}
+
+	Session actual;
+	actual.start(m.state());
+	m.setSession(&actual);
+
+	size_t base = m.state().ticks;
+	bool ok = true;
+	for (size_t i = 0; i < m_inputs.size() && ok; i++) {
+		const Input& in = m_inputs[i];
+		size_t target = base + in.tick;
+		size_t now = m.state().ticks;
+
+		if (target <= now || !m.runUntilInput(target - now) ||
+				m.state().ticks + 1 != target) {
+			fprintf(log, "Input %lu (%s): expected at tick %lu, "
+					"machine at %lu\n", i, in.line.c_str(),
+					in.tick, m.state().ticks - base);
+			ok = false;
+		} else if (actual.m_output_bytes != in.output_bytes ||
+				actual.m_output_hash != in.output_hash) {
+			fprintf(log, "Input %lu (%s): output differs before "
+					"tick %lu\n", i, in.line.c_str(), in.tick);
+			ok = false;
+		} else {
+			m.feed((in.line + "\n").c_str());
+		}
+	}
+
+	if (ok) {
+		// A recording that ended blocked on input counted the tick of
+		// that IN, which never ran
+		size_t end = base + m_end_tick;
+		while (m.state().ticks < end && !m.waitingInput() &&
+				m.tick(nullptr));
+
+		size_t ticks = m.state().ticks;
+		if (ticks != end && !(m.waitingInput() && ticks + 1 == end)) {
+			fprintf(log, "Ended at tick %lu, expected %lu\n",
+					ticks - base, m_end_tick);
+			ok = false;
+		} else if (actual.m_output_bytes != m_end_bytes ||
+				actual.m_output_hash != m_end_hash) {
+			fprintf(log, "Output differs at the end\n");
+			ok = false;
+		}
+	}
+
+	m.setSession(nullptr);
+	return ok;
+}
+
+void
+Session::printSummary(FILE* out) const
+{
+	fprintf(out, "Session: image %016lx, %lu inputs, %lu ticks, "
+			"%lu bytes of output\n", m_image_hash, m_inputs.size(),
+			m_end_tick, m_end_bytes);
+}
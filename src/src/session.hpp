@@ -0,0 +1,67 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#define SESSION_MAGIC "# synacor session 1"
+#define SESSION_HASH_SEED 0xcbf29ce484222325ull
+#define SESSION_HASH_PRIME 0x100000001b3ull
+
+/*
+ * class Session: Record of a run of the machine, enough to reproduce it.
+ * Holds the hash of the image it started from and every input line with
+ * the tick at which the guest started reading it. Each line also carries a
+ * checkpoint of the output written before it (byte count and FNV-1a hash),
+ * so a replay can tell where it diverged.
+ *
+ * While attached to a machine, it records: the machine reports every output
+ * character and every line it starts to read.
+ */
+class Session {
+public:
+	struct Input {
+		size_t tick;
+		size_t output_bytes;
+		uint64_t output_hash;
+		std::string line;
+	};
+
+	Session();
+	~Session();
+
+	void start(const Machine::State& s);
+	void onInput(size_t tick, const char* line);
+	void onOutput(uint16_t c) {
+		m_output_hash = (m_output_hash ^ (c & 0xff)) * SESSION_HASH_PRIME;
+		m_output_bytes++;
+	}
+	void finish(const Machine::State& s);
+
+	bool load(const char* path);
+	bool save(const char* path) const;
+
+	bool replay(Machine& m, FILE* log) const;
+
+	uint64_t imageHash() const { return m_image_hash; }
+	const std::vector<Input>& inputs() const { return m_inputs; }
+	size_t endTick() const { return m_end_tick; }
+
+	void printSummary(FILE* out) const;
+
+private:
+	uint64_t m_image_hash;
+	size_t m_start_tick;
+	std::vector<Input> m_inputs;
+
+	size_t m_end_tick;
+	size_t m_end_bytes;
+	uint64_t m_end_hash;
+
+	size_t m_output_bytes;
+	uint64_t m_output_hash;
+};
@@ -0,0 +1,226 @@
+#include "shadow.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+Shadow::Shadow() :
+	m_reads(new std::atomic<uint32_t>[SHADOW_WORDS]),
+	m_writes(new std::atomic<uint32_t>[SHADOW_WORDS]),
+	m_fetches(new std::atomic<uint32_t>[SHADOW_WORDS]),
+	m_hit(),
+	m_hits(0),
+	m_triggered(false)
+{
+	reset();
+	clearWatches();
+}
+
+Shadow::~Shadow() {}
+
+uint32_t
+Shadow::reads(uint16_t addr) const
+{
+	return count(addr, READ);
+}
+
+uint32_t
+Shadow::writes(uint16_t addr) const
+{
+	return count(addr, WRITE);
+}
+
+uint32_t
+Shadow::fetches(uint16_t addr) const
+{
+	return count(addr, FETCH);
+}
+
+/*
+ * Sum of the counters of a word for the given kinds of access
+ */
+uint32_t
+Shadow::count(uint16_t addr, uint8_t kinds) const
+{
+	if (addr >= SHADOW_WORDS)
+		return 0;
+
+	uint32_t total = 0;
+	if (kinds & READ)
+		total += m_reads[addr].load(std::memory_order_relaxed);
+	if (kinds & WRITE)
+		total += m_writes[addr].load(std::memory_order_relaxed);
+	if (kinds & FETCH)
+		total += m_fetches[addr].load(std::memory_order_relaxed);
+	return total;
+}
+
+void
+Shadow::reset()
+{
+	for (size_t i = 0; i < SHADOW_WORDS; i++) {
+		m_reads[i].store(0, std::memory_order_relaxed);
+		m_writes[i].store(0, std::memory_order_relaxed);
+		m_fetches[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void
+Shadow::watch(uint16_t addr, uint16_t size, uint8_t kinds, bool active)
+{
+	uint64_t* maps[] = {m_watch_read, m_watch_write, m_watch_fetch};
+	for (size_t k = 0; k < 3; k++) {
+		if (!(kinds & (1 << k)))
+			continue;
+		for (uint32_t a = addr; a < uint32_t(addr) + size &&
+				a < SHADOW_WORDS; a++) {
+			uint64_t bit = uint64_t(1) << (a % 64);
+			if (active) {
+				maps[k][a / 64] |= bit;
+			} else {
+				maps[k][a / 64] &= ~bit;
+			}
+		}
+	}
+}
+
+void
+Shadow::clearWatches()
+{
+	memset(m_watch_read, 0, sizeof(m_watch_read));
+	memset(m_watch_write, 0, sizeof(m_watch_write));
+	memset(m_watch_fetch, 0, sizeof(m_watch_fetch));
+}
+
+bool
+Shadow::watching(uint16_t addr, uint8_t kind) const
+{
+	if (addr >= SHADOW_WORDS)
+		return false;
+	return ((kind & READ) && watched(m_watch_read, addr)) ||
+		((kind & WRITE) && watched(m_watch_write, addr)) ||
+		((kind & FETCH) && watched(m_watch_fetch, addr));
+}
+
+/*
+ * Lists watched ranges, merging consecutive words watched the same way
+ */
+void
+Shadow::printWatches(FILE* out) const
+{
+	auto kinds_at = [this](uint32_t addr) {
+		uint8_t kinds = 0;
+		for (uint8_t kind : {READ, WRITE, FETCH}) {
+			if (watching(addr, kind))
+				kinds |= kind;
+		}
+		return kinds;
+	};
+
+	size_t count = 0;
+	uint32_t addr = 0;
+	while (addr < SHADOW_WORDS) {
+		uint8_t kinds = kinds_at(addr);
+		if (!kinds) {
+			addr++;
+			continue;
+		}
+
+		uint32_t end = addr + 1;
+		while (end < SHADOW_WORDS && kinds_at(end) == kinds) {
+			end++;
+		}
+		fprintf(out, "%04x-%04x %s\n", addr, end - 1,
+				access_repr(kinds).c_str());
+		count++;
+		addr = end;
+	}
+
+	if (!count)
+		fprintf(out, "No watchpoints.\n");
+}
+
+void
+Shadow::hit(Access kind, uint16_t addr, uint16_t ip, uint16_t old_value,
+		uint16_t value)
+{
+	m_hit.kind = kind;
+	m_hit.addr = addr;
+	m_hit.ip = ip;
+	m_hit.old_value = old_value;
+	m_hit.value = value;
+	m_hits++;
+	m_triggered.store(true, std::memory_order_relaxed);
+}
+
+/*
+ * Returns the last watchpoint hit, if there was one since the last call
+ */
+bool
+Shadow::takeHit(Hit& hit)
+{
+	if (!m_triggered.exchange(false, std::memory_order_relaxed))
+		return false;
+	hit = m_hit;
+	return true;
+}
+
+/*
+ * Prints the most accessed words for the given kinds of access
+ */
+void
+Shadow::print(FILE* out, uint8_t kinds, size_t top) const
+{
+	std::vector<std::pair<uint32_t, uint16_t>> words;
+	for (uint32_t addr = 0; addr < SHADOW_WORDS; addr++) {
+		uint32_t n = count(addr, kinds);
+		if (n)
+			words.push_back({n, addr});
+	}
+
+	top = std::min(top, words.size());
+	std::partial_sort(words.begin(), words.begin() + top, words.end(),
+			[](const std::pair<uint32_t, uint16_t>& a,
+				const std::pair<uint32_t, uint16_t>& b) {
+		return a.first > b.first;
+	});
+
+	fprintf(out, "%lu words accessed (%s)\n", words.size(),
+			access_repr(kinds).c_str());
+	fprintf(out, "%-6s %10s %10s %10s\n", "ADDR", "READS", "WRITES",
+			"FETCHES");
+	for (size_t i = 0; i < top; i++) {
+		uint16_t addr = words[i].second;
+		fprintf(out, "%04x   %10u %10u %10u\n", addr, reads(addr),
+				writes(addr), fetches(addr));
+	}
+}
+
+std::string
+access_repr(uint8_t kinds)
+{
+	std::string res;
+	res += kinds & Shadow::READ ? 'r' : '-';
+	res += kinds & Shadow::WRITE ? 'w' : '-';
+	res += kinds & Shadow::FETCH ? 'x' : '-';
+	return res;
+}
+
+/*
+ * Parses a combination of 'r', 'w' and 'x'. Returns 0 on anything else.
+ */
+uint8_t
+parse_access(const char* text)
+{
+	uint8_t kinds = 0;
+	for (; *text; text++) {
+		switch (*text) {
+		case 'r': kinds |= Shadow::READ; break;
+		case 'w': kinds |= Shadow::WRITE; break;
+		case 'x': kinds |= Shadow::FETCH; break;
+		default: return 0;
+		}
+	}
+	return kinds;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define SHADOW_WORDS 0x8000
+#define SHADOW_WATCH_WORDS (SHADOW_WORDS / 64)
+
+/*
+ * class Shadow: Shadow memory for the 32K words of the address space. Keeps
+ * read, write and (optionally) instruction fetch counters for every word,
+ * plus one watch bitmap per kind of access.
+ *
+ * The machine thread is the only writer of the counters. They are relaxed
+ * atomics so that a UI thread can read them while the machine runs, at the
+ * cost of a plain load and store on the hot path. A watchpoint costs a
+ * single bit test; when one fires the access is recorded and triggered()
+ * turns true until the hit is taken.
+ */
+class Shadow {
+public:
+	enum Access : uint8_t {
+		READ = 1 << 0,
+		WRITE = 1 << 1,
+		FETCH = 1 << 2,
+	};
+
+	struct Hit {
+		Access kind;
+		uint16_t addr;
+		uint16_t ip;
+		uint16_t old_value;
+		uint16_t value;
+	};
+
+	Shadow();
+	~Shadow();
+
+	void onRead(uint16_t addr, uint16_t ip, uint16_t value) {
+		if (addr >= SHADOW_WORDS)
+			return;
+		bump(m_reads[addr]);
+		if (watched(m_watch_read, addr))
+			hit(READ, addr, ip, value, value);
+	}
+
+	void onWrite(uint16_t addr, uint16_t ip, uint16_t old_value,
+			uint16_t value) {
+		if (addr >= SHADOW_WORDS)
+			return;
+		bump(m_writes[addr]);
+		if (watched(m_watch_write, addr))
+			hit(WRITE, addr, ip, old_value, value);
+	}
+
+	void onFetch(uint16_t ip, uint16_t op) {
+		if (ip >= SHADOW_WORDS)
+			return;
+		bump(m_fetches[ip]);
+		if (watched(m_watch_fetch, ip))
+			hit(FETCH, ip, ip, op, op);
+	}
+
+	uint32_t reads(uint16_t addr) const;
+	uint32_t writes(uint16_t addr) const;
+	uint32_t fetches(uint16_t addr) const;
+	uint32_t count(uint16_t addr, uint8_t kinds) const;
+	void reset();
+
+	void watch(uint16_t addr, uint16_t size, uint8_t kinds, bool active);
+	void clearWatches();
+	bool watching(uint16_t addr, uint8_t kind) const;
+	void printWatches(FILE* out) const;
+
+	bool triggered() const {
+		return m_triggered.load(std::memory_order_relaxed);
+	}
+	bool takeHit(Hit& hit);
+	uint64_t hits() const { return m_hits; }
+
+	void print(FILE* out, uint8_t kinds, size_t top) const;
+
+private:
+	typedef std::unique_ptr<std::atomic<uint32_t>[]> Counters;
+
+	static void bump(std::atomic<uint32_t>& counter) {
+		counter.store(counter.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+	}
+
+	static bool watched(const uint64_t* bits, uint16_t addr) {
+		return bits[addr / 64] >> (addr % 64) & 1;
+	}
+
+	void hit(Access kind, uint16_t addr, uint16_t ip, uint16_t old_value,
+			uint16_t value);
+
+	Counters m_reads;
+	Counters m_writes;
+	Counters m_fetches;
+
+	uint64_t m_watch_read[SHADOW_WATCH_WORDS];
+	uint64_t m_watch_write[SHADOW_WATCH_WORDS];
+	uint64_t m_watch_fetch[SHADOW_WATCH_WORDS];
+
+	Hit m_hit;
+	uint64_t m_hits;
+	std::atomic<bool> m_triggered;
+};
+
+std::string access_repr(uint8_t kinds);
+uint8_t parse_access(const char* text);
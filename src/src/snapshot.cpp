@@ -0,0 +1,78 @@
+#include "snapshot.hpp"
+#include "data_structures/stack.h"
+
+#include <string.h>
+
+SnapshotBuffer::SnapshotBuffer() :
+	m_front(0),
+	m_publishes(0),
+	m_skipped(0)
+{
+}
+
+SnapshotBuffer::~SnapshotBuffer()
+{
+	this->stop();
+}
+
+/*
+ * Copies the state into the back buffer and makes it the front one. Runs
+ * on the machine's thread.
+ */
+void
+SnapshotBuffer::publish(const Machine::State& s, bool waiting)
+{
+	unsigned back = m_front.load(std::memory_order_relaxed) ^ 1;
+	Slot& slot = m_slots[back];
+
+	std::unique_lock<std::mutex> lock(slot.mux, std::try_to_lock);
+	if (!lock.owns_lock()) {
+		m_skipped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Snapshot& snap = slot.snap;
+	snap.seq = m_publishes.load(std::memory_order_relaxed) + 1;
+	snap.ticks = s.ticks;
+	snap.ip = s.ip;
+	snap.reg = s.reg;
+	auto& stack = stack_container(s.stack);
+	snap.stack.assign(stack.begin(), stack.end());
+	memcpy(snap.ram.data(), s.ram.data(), sizeof(snap.ram));
+	snap.waiting = waiting;
+	lock.unlock();
+
+	m_front.store(back, std::memory_order_release);
+	m_publishes.store(snap.seq, std::memory_order_relaxed);
+}
+
+/*
+ * Copies the front buffer into out, unless out already holds it. Returns
+ * whether out changed.
+ */
+bool
+SnapshotBuffer::read(Snapshot& out) const
+{
+	if (out.seq == m_publishes.load(std::memory_order_relaxed))
+		return false;
+
+	const Slot& slot = m_slots[m_front.load(std::memory_order_acquire)];
+
+	std::lock_guard<std::mutex> lock(slot.mux);
+	if (slot.snap.seq == out.seq)
+		return false;
+	out = slot.snap;
+	return true;
+}
+
+uint64_t
+SnapshotBuffer::publishes() const
+{
+	return m_publishes.load(std::memory_order_relaxed);
+}
+
+uint64_t
+SnapshotBuffer::skipped() const
+{
+	return m_skipped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "publisher.hpp"
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define SNAPSHOT_DEFAULT_HZ 30
+
+/*
+ * struct Snapshot: A consistent copy of the machine, as of one publish.
+ * seq grows with every publish, so readers can tell whether it changed.
+ */
+struct Snapshot {
+	uint64_t seq = 0;
+	uint64_t ticks = 0;
+	uint16_t ip = 0;
+	std::array<uint16_t, 8> reg{};
+	std::vector<uint16_t> stack;
+	std::array<uint16_t, 0x1 << 16> ram{};
+	bool waiting = false;
+};
+
+/*
+ * class SnapshotBuffer: Hands the machine's state to a viewer on another
+ * thread through a double buffer. The machine fills the back buffer and
+ * flips it to the front; readers copy out of the front one.
+ *
+ * Each buffer has its own lock, so the machine only waits when a reader is
+ * slow enough to still hold the back buffer from before the last flip. It
+ * does not wait even then: that publish is skipped, and the next one goes
+ * through.
+ */
+class SnapshotBuffer : public StatePublisher {
+public:
+	SnapshotBuffer();
+	~SnapshotBuffer();
+
+	void publish(const Machine::State& s, bool waiting) override;
+	bool read(Snapshot& out) const;
+
+	uint64_t publishes() const;
+	uint64_t skipped() const;
+
+private:
+	struct Slot {
+		mutable std::mutex mux;
+		Snapshot snap;
+	};
+
+	std::array<Slot, 2> m_slots;
+	std::atomic<unsigned> m_front;
+	std::atomic<uint64_t> m_publishes;
+	std::atomic<uint64_t> m_skipped;
+};
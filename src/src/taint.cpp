@@ -0,0 +1,240 @@
+#include "taint.hpp"
+#include "opcodes.hpp"
+
+Taint::Taint(Mode mode) :
+	m_mode(mode),
+	m_lines(0),
+	m_reg(),
+	m_ram(0x1 << 16, 0),
+	m_uses(TAINT_CODE_WORDS, 0),
+	m_branch_labels(TAINT_CODE_WORDS, 0),
+	m_branch_taken(TAINT_CODE_WORDS, 0),
+	m_branch_not_taken(TAINT_CODE_WORDS, 0)
+{
+}
+
+Taint::~Taint() {}
+
+void
+Taint::reset()
+{
+	m_lines = 0;
+	m_reg.fill(0);
+	std::fill(m_ram.begin(), m_ram.end(), 0);
+	m_stack.clear();
+	std::fill(m_uses.begin(), m_uses.end(), 0);
+	std::fill(m_branch_labels.begin(), m_branch_labels.end(), 0);
+	std::fill(m_branch_taken.begin(), m_branch_taken.end(), 0);
+	std::fill(m_branch_not_taken.begin(), m_branch_not_taken.end(), 0);
+}
+
+uint64_t
+Taint::uses(uint16_t ip) const
+{
+	return ip < TAINT_CODE_WORDS ? m_uses[ip] : 0;
+}
+
+void
+Taint::branch(uint16_t ip, uint64_t labels, bool taken)
+{
+	if (!labels || ip >= TAINT_CODE_WORDS)
+		return;
+	m_branch_labels[ip] |= labels;
+	if (taken) {
+		m_branch_taken[ip]++;
+	} else {
+		m_branch_not_taken[ip]++;
+	}
+}
+
+/*
+ * Propagates labels for the instruction about to run at s.ip. Runs before
+ * the machine executes it, so operands still hold their old values.
+ */
+void
+Taint::step(const Machine::State& s, uint16_t op)
+{
+	uint16_t ip = s.ip;
+	const uint16_t* p = &s.ram[ip];
+	auto val = [&s](uint16_t a) -> uint16_t {
+		return a >= 0x8000 ? s.reg[a & 7] : a;
+	};
+
+	uint64_t l;
+	switch (op) {
+	case SET:
+	case NOT:
+		l = src(p[2]);
+		use(ip, l);
+		m_reg[p[1] & 7] = l;
+		break;
+
+	case EQ: case GT: case ADD: case MULT: case MOD: case AND: case OR:
+		l = src(p[2]) | src(p[3]);
+		use(ip, l);
+		m_reg[p[1] & 7] = l;
+		break;
+
+	case PUSH:
+		l = src(p[1]);
+		use(ip, l);
+		m_stack.push_back(l);
+		break;
+
+	case POP:
+		l = 0;
+		if (!m_stack.empty()) {
+			l = m_stack.back();
+			m_stack.pop_back();
+		}
+		m_reg[p[1] & 7] = l;
+		break;
+
+	case JMP:
+		l = src(p[1]);
+		use(ip, l);
+		branch(ip, l, true);
+		break;
+
+	case JNZ:
+	case JZ:
+		l = src(p[1]) | src(p[2]);
+		use(ip, l);
+		branch(ip, l, (val(p[1]) != 0) == (op == JNZ));
+		break;
+
+	case RMEM:
+		l = m_ram[val(p[2])];
+		use(ip, l);
+		m_reg[p[1] & 7] = l;
+		break;
+
+	case WMEM:
+		l = src(p[2]);
+		use(ip, l);
+		m_ram[val(p[1])] = l;
+		break;
+
+	case CALL:
+		l = src(p[1]);
+		use(ip, l);
+		branch(ip, l, true);
+		m_stack.push_back(0);
+		break;
+
+	case RET:
+		l = 0;
+		if (!m_stack.empty()) {
+			l = m_stack.back();
+			m_stack.pop_back();
+		}
+		use(ip, l);
+		branch(ip, l, true);
+		break;
+
+	case OUT:
+		use(ip, src(p[1]));
+		break;
+
+	case IN: {
+		// Either a new line gets read now, or one was just fed
+		size_t offset = s.buffer_offset;
+		if (offset == s.buffer_sz || offset == 0) {
+			offset = 0;
+			m_lines++;
+		}
+		size_t bit = m_mode == TAINT_BYTES ? offset : m_lines - 1;
+		m_reg[p[1] & 7] = uint64_t(1) << (bit % TAINT_LABELS);
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Label sets as ranges of bit numbers, e.g. "0-3,7"
+ */
+std::string
+Taint::labelRepr(uint64_t labels) const
+{
+	std::string res;
+	for (size_t i = 0; i < TAINT_LABELS; i++) {
+		if (!(labels >> i & 1))
+			continue;
+		size_t j = i;
+		while (j + 1 < TAINT_LABELS && (labels >> (j + 1) & 1)) {
+			j++;
+		}
+		if (!res.empty())
+			res += ',';
+		res += std::to_string(i);
+		if (j > i)
+			res += '-' + std::to_string(j);
+		i = j;
+	}
+	return res.empty() ? "-" : res;
+}
+
+void
+Taint::printSummary(FILE* out) const
+{
+	size_t words = 0;
+	for (uint64_t l : m_ram) {
+		words += l != 0;
+	}
+	size_t sites = 0;
+	size_t branches = 0;
+	for (size_t ip = 0; ip < TAINT_CODE_WORDS; ip++) {
+		sites += m_uses[ip] != 0;
+		branches += m_branch_labels[ip] != 0;
+	}
+
+	fprintf(out, "Taint by input %s, %lu lines read\n",
+			m_mode == TAINT_BYTES ? "byte" : "line", m_lines);
+	fprintf(out, "%lu tainted words, %lu instructions read tainted "
+			"values, %lu branches depend on input\n", words, sites,
+			branches);
+	for (size_t r = 0; r < 8; r++) {
+		if (m_reg[r])
+			fprintf(out, "  R%lu: %s\n", r,
+					labelRepr(m_reg[r]).c_str());
+	}
+}
+
+/*
+ * Lists the jumps whose condition or target carried any of the labels
+ */
+void
+Taint::printBranches(FILE* out, const Machine::State& s,
+		uint64_t labels) const
+{
+	fprintf(out, "%-6s %-4s %10s %10s  %s\n", "ADDR", "OP", "TAKEN",
+			"NOT TAKEN", "LABELS");
+	for (size_t ip = 0; ip < TAINT_CODE_WORDS; ip++) {
+		if (!(m_branch_labels[ip] & labels))
+			continue;
+		uint16_t op = s.ram[ip];
+		fprintf(out, "%04lx   %-4s %10u %10u  %s\n", ip,
+				op < NUM_OPS ? op_names[op] : "?",
+				m_branch_taken[ip], m_branch_not_taken[ip],
+				labelRepr(m_branch_labels[ip]).c_str());
+	}
+}
+
+/*
+ * Lists the instructions that read values carrying any of the labels
+ */
+void
+Taint::printUses(FILE* out, const Machine::State& s, uint64_t labels) const
+{
+	for (size_t ip = 0; ip < TAINT_CODE_WORDS; ip++) {
+		if (!(m_uses[ip] & labels))
+			continue;
+		uint16_t op = s.ram[ip];
+		fprintf(out, "%04lx   %-4s  %s\n", ip,
+				op < NUM_OPS ? op_names[op] : "?",
+				labelRepr(m_uses[ip]).c_str());
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#define TAINT_CODE_WORDS 0x8000
+#define TAINT_LABELS 64
+
+/*
+ * class Taint: Follows input through the machine. Every register, memory
+ * word and stack slot carries a set of labels, one bit per input byte
+ * position in the current line (or per input line, modulo 64). IN sets the
+ * label of the byte it reads; ALU ops, SET, RMEM/WMEM and PUSH/POP carry
+ * the union of their sources to their destination. Addresses are not
+ * propagated, only values.
+ *
+ * For each instruction address it remembers the labels of the values it
+ * read, and for conditional and indirect jumps, the labels their outcome
+ * depended on and which way they went.
+ *
+ * The shadow state is a set of parallel arrays indexed like the machine's
+ * own, updated by a per-tick hook before each instruction runs.
+ */
+class Taint {
+public:
+	enum Mode : uint8_t {
+		TAINT_BYTES,
+		TAINT_LINES,
+	};
+
+	Taint(Mode mode = TAINT_BYTES);
+	~Taint();
+
+	void reset();
+	Mode mode() const { return m_mode; }
+
+	void step(const Machine::State& s, uint16_t op);
+
+	uint64_t reg(size_t r) const { return m_reg[r & 7]; }
+	uint64_t mem(uint16_t addr) const { return m_ram[addr]; }
+	uint64_t uses(uint16_t ip) const;
+	size_t lines() const { return m_lines; }
+
+	void printSummary(FILE* out) const;
+	void printBranches(FILE* out, const Machine::State& s,
+			uint64_t labels) const;
+	void printUses(FILE* out, const Machine::State& s,
+			uint64_t labels) const;
+
+	std::string labelRepr(uint64_t labels) const;
+
+private:
+	uint64_t src(uint16_t a) const {
+		return a >= 0x8000 ? m_reg[a & 7] : 0;
+	}
+
+	void use(uint16_t ip, uint64_t labels) {
+		if (labels && ip < TAINT_CODE_WORDS)
+			m_uses[ip] |= labels;
+	}
+
+	void branch(uint16_t ip, uint64_t labels, bool taken);
+
+	Mode m_mode;
+	size_t m_lines;
+
+	std::array<uint64_t, 8> m_reg;
+	std::vector<uint64_t> m_ram;
+	std::vector<uint64_t> m_stack;
+
+	std::vector<uint64_t> m_uses;
+	std::vector<uint64_t> m_branch_labels;
+	std::vector<uint32_t> m_branch_taken;
+	std::vector<uint32_t> m_branch_not_taken;
+};
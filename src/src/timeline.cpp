@@ -0,0 +1,407 @@
+#include "timeline.hpp"
+#include "common.hpp"
+#include "opcodes.hpp"
+#include "analysis/symbols.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <thread>
+
+static bool parse_tick_range(const std::string& text, uint64_t& from,
+		uint64_t& to)
+{
+	size_t colon = text.find(':');
+	if (colon == std::string::npos)
+		return false;
+
+	char* end;
+	std::string first = text.substr(0, colon);
+	std::string second = text.substr(colon + 1);
+	if (!first.empty()) {
+		from = strtoull(first.c_str(), &end, 10);
+		if (*end != '\0')
+			return false;
+	}
+	if (!second.empty()) {
+		to = strtoull(second.c_str(), &end, 10);
+		if (*end != '\0')
+			return false;
+	}
+	return from < to;
+}
+
+static bool parse_address(const std::string& text, const SymbolTable* symbols,
+		uint16_t& addr)
+{
+	if (symbols)
+		return symbols->parseAddress(text.c_str(), addr);
+
+	char* end;
+	unsigned long value = strtoul(text.c_str(), &end, 16);
+	if (text.empty() || *end != '\0' || value > 0xffff)
+		return false;
+	addr = value;
+	return true;
+}
+
+static bool parse_cmp(const std::string& text, TimelineQuery::Cmp& cmp)
+{
+	static const char* const names[] = {"==", "!=", "<", "<=", ">", ">="};
+	for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+		if (text == names[i]) {
+			cmp = TimelineQuery::Cmp(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Parses a query as described in timeline.hpp. Reports what is wrong with
+ * it to stderr.
+ */
+bool
+TimelineQuery::parse(const char* text, TimelineQuery& q,
+		const SymbolTable* symbols)
+{
+	std::vector<std::string> tokens;
+	for (const char* p = text; *p;) {
+		size_t len = strcspn(p, " \t\r\n");
+		if (len)
+			tokens.push_back(std::string(p, len));
+		p += len;
+		p += strspn(p, " \t\r\n");
+	}
+
+	TimelineQuery res;
+	size_t i = 0;
+	auto next = [&]() { return i < tokens.size() ? tokens[i++] : ""; };
+	auto fail = [&](const char* why) {
+		fprintf(stderr, "Bad query \"%s\": %s\n", text, why);
+		return false;
+	};
+
+	std::string word = next();
+	if (word == "first" || word == "last") {
+		res.last = word == "last";
+		word = next();
+	}
+	if (word == "write") {
+		res.kind = WRITE;
+	} else if (word == "change") {
+		res.kind = CHANGE;
+	} else if (word == "when") {
+		res.kind = WHEN;
+	} else {
+		return fail("expected write, change or when");
+	}
+
+	word = next();
+	uint16_t addr;
+	if (word.size() == 2 && word[0] == 'r' && word[1] >= '0' &&
+			word[1] <= '7') {
+		res.target = REG;
+		res.index = word[1] - '0';
+	} else if (word == "ip") {
+		if (res.kind != WHEN)
+			return fail("ip only works with when");
+		res.target = IP;
+	} else if (parse_address(word, symbols, addr) && addr <= 0x7fff) {
+		res.target = RAM;
+		res.index = addr;
+	} else {
+		return fail("expected rN, ip or a memory address");
+	}
+
+	if (res.kind == WHEN) {
+		if (!parse_cmp(next(), res.cmp))
+			return fail("expected one of == != < <= > >=");
+		word = next();
+		char* end;
+		unsigned long value = strtoul(word.c_str(), &end, 16);
+		if (word.empty() || *end != '\0' || value > 0xffff)
+			return fail("expected a value in hex");
+		res.value = value;
+	}
+
+	word = next();
+	if (word == "in") {
+		if (!parse_tick_range(next(), res.from, res.to))
+			return fail("expected a tick range FROM:TO");
+		word = next();
+	}
+	if (!word.empty())
+		return fail("unexpected text at the end");
+
+	q = res;
+	return true;
+}
+
+static inline uint16_t
+target_value(const Machine::State& s, const TimelineQuery& q)
+{
+	switch (q.target) {
+	case TimelineQuery::REG: return s.reg[q.index];
+	case TimelineQuery::RAM: return s.ram[q.index];
+	default:                 return s.ip;
+	}
+}
+
+static inline bool
+compare(const TimelineQuery& q, uint16_t value)
+{
+	switch (q.cmp) {
+	case TimelineQuery::CMP_EQ: return value == q.value;
+	case TimelineQuery::CMP_NE: return value != q.value;
+	case TimelineQuery::CMP_LT: return value < q.value;
+	case TimelineQuery::CMP_LE: return value <= q.value;
+	case TimelineQuery::CMP_GT: return value > q.value;
+	default:                return value >= q.value;
+	}
+}
+
+/*
+ * True if the instruction at ip writes the query's target, whether or not
+ * the value changes. Decoded before it runs, so the interpreter needs no
+ * hook for it.
+ */
+static inline bool
+writes_target(const Machine::State& s, const TimelineQuery& q)
+{
+	uint16_t op = s.ram[s.ip];
+	uint16_t a = s.ram[(s.ip + 1) & 0xffff];
+
+	if (q.target == TimelineQuery::RAM) {
+		if (op != WMEM)
+			return false;
+		uint16_t addr = a >= 0x8000 ? s.reg[a & 7] : a;
+		return addr == q.index;
+	}
+
+	switch (op) {
+	case SET: case POP: case EQ: case GT: case ADD: case MULT: case MOD:
+	case AND: case OR: case NOT: case RMEM: case IN:
+		return a == 0x8000 + q.index;
+	default:
+		return false;
+	}
+}
+
+Timeline::Timeline() :
+	m_end_tick(0),
+	m_interval(0),
+	m_threads(std::max(1u, std::thread::hardware_concurrency()))
+{
+}
+
+Timeline::~Timeline() {}
+
+void
+Timeline::setThreads(size_t threads)
+{
+	m_threads = MAX(threads, 1);
+}
+
+/*
+ * Ticks between checkpoints. 0, the default, spreads TIMELINE_CHECKPOINTS
+ * of them over the session.
+ */
+void
+Timeline::setInterval(uint64_t ticks)
+{
+	m_interval = ticks;
+}
+
+/*
+ * Replays the session from the image, which must be the one it was
+ * recorded from, keeping checkpoints along the way. Reports a divergence
+ * to log and returns false.
+ */
+bool
+Timeline::build(const uint16_t* image, size_t count, const Session& session,
+		FILE* log)
+{
+	m_checkpoints.clear();
+	m_inputs.clear();
+	m_end_tick = 0;
+
+	std::string output;
+	Machine m(-1, -1, STDERR_FILENO);
+	m.setOutput(&output);
+	m.load_program(image, count);
+	if (Machine::ramHash(m.state()) != session.imageHash()) {
+		fprintf(log, "Image does not match the session\n");
+		return false;
+	}
+
+	// Checkpoints copy only the pages written since the image
+	Machine::State& s = m.m_state;
+	s.ram.makeShared();
+
+	const std::vector<Session::Input>& inputs = session.inputs();
+	for (const Session::Input& in : inputs) {
+		m_inputs.push_back(in.line + "\n");
+	}
+	if (m_interval == 0) {
+		m_interval = MAX(TIMELINE_MIN_INTERVAL,
+				session.endTick() / TIMELINE_CHECKPOINTS);
+	}
+
+	size_t next = 0;
+	uint64_t checkpoint = 0;
+	while (true) {
+		if (s.ticks >= checkpoint) {
+			m_checkpoints.push_back({s, next});
+			checkpoint = s.ticks + m_interval;
+		}
+		if (m.waitingInput()) {
+			if (next == inputs.size())
+				break;
+			if (s.ticks + 1 != inputs[next].tick) {
+				fprintf(log, "Input %lu (%s): expected at tick "
+						"%lu, machine at %lu\n", next,
+						inputs[next].line.c_str(),
+						inputs[next].tick, s.ticks);
+				return false;
+			}
+			m.feed(m_inputs[next++].c_str());
+			output.clear();
+		}
+		if (!m.runUntilInput(checkpoint - s.ticks) &&
+				s.ticks < checkpoint)
+			break;
+	}
+	m_end_tick = s.ticks;
+	return true;
+}
+
+/*
+ * Replays one segment, from its checkpoint to the next one, leaving the
+ * query's hit in it in hit. Gives up once a segment searched before this
+ * one (a lower rank) has a hit.
+ */
+void
+Timeline::scan(size_t segment, const TimelineQuery& q, TimelineHit& hit,
+		const std::atomic<size_t>& best, size_t rank) const
+{
+	const Checkpoint& cp = m_checkpoints[segment];
+	uint64_t end = segment + 1 < m_checkpoints.size() ?
+		m_checkpoints[segment + 1].state.ticks : m_end_tick;
+	end = MIN(end, q.to);
+
+	std::string output;
+	Machine m(-1, -1, STDERR_FILENO);
+	m.setOutput(&output);
+	Machine::State& s = m.m_state;
+	s = cp.state;
+	size_t next = cp.input;
+
+	uint16_t value = target_value(s, q);
+	bool holds = compare(q, value);
+	while (s.ticks < end) {
+		if ((s.ticks & (TIMELINE_POLL_TICKS - 1)) == 0 &&
+				best.load(std::memory_order_relaxed) < rank)
+			return;
+		if (m.waitingInput()) {
+			if (next == m_inputs.size())
+				return;
+			m.feed(m_inputs[next++].c_str());
+			output.clear();
+		}
+
+		uint16_t ip = s.ip;
+		uint16_t op = s.ram[ip];
+		bool wrote = q.kind == TimelineQuery::WRITE &&
+			writes_target(s, q);
+		if (!m.tick(nullptr))
+			return;
+
+		uint16_t before = value;
+		value = target_value(s, q);
+		bool found;
+		if (q.kind == TimelineQuery::WRITE) {
+			found = wrote;
+		} else if (q.kind == TimelineQuery::CHANGE) {
+			found = value != before;
+		} else {
+			bool now = compare(q, value);
+			found = now && !holds;
+			holds = now;
+		}
+
+		if (!found || s.ticks < q.from || s.ticks >= q.to)
+			continue;
+		hit.found = true;
+		hit.tick = s.ticks;
+		hit.ip = ip;
+		hit.op = op;
+		hit.before = before;
+		hit.after = value;
+		if (!q.last)
+			return;
+	}
+}
+
+/*
+ * Finds the first or last instruction matching the query. Returns false
+ * if none does.
+ */
+bool
+Timeline::query(const TimelineQuery& q, TimelineHit& hit) const
+{
+	hit = TimelineHit();
+
+	// Segments in the order they are searched, those nearest the end the
+	// query starts from first. Segment i runs the ticks after checkpoint
+	// i up to and including checkpoint i + 1.
+	std::vector<size_t> order;
+	size_t n = m_checkpoints.size();
+	for (size_t i = 0; i < n; i++) {
+		size_t segment = q.last ? n - 1 - i : i;
+		uint64_t first = m_checkpoints[segment].state.ticks + 1;
+		uint64_t last = segment + 1 < n ?
+			m_checkpoints[segment + 1].state.ticks : m_end_tick;
+		if (first <= last && last >= q.from && first < q.to)
+			order.push_back(segment);
+	}
+
+	std::vector<TimelineHit> hits(order.size());
+	std::atomic<size_t> next{0};
+	std::atomic<size_t> best{SIZE_MAX};
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < MIN(m_threads, order.size()); t++) {
+		threads.push_back(std::thread([&]() {
+			size_t rank;
+			while ((rank = next.fetch_add(1)) < order.size() &&
+					rank < best.load()) {
+				scan(order[rank], q, hits[rank], best, rank);
+				if (!hits[rank].found)
+					continue;
+				size_t current = best.load();
+				while (rank < current &&
+						!best.compare_exchange_weak(
+							current, rank));
+			}
+		}));
+	}
+	for (std::thread& t : threads) {
+		t.join();
+	}
+
+	if (best.load() == SIZE_MAX)
+		return false;
+	hit = hits[best.load()];
+	return true;
+}
+
+MemoryUsage
+Timeline::memoryUsage() const
+{
+	MemoryUsage res;
+	for (const Checkpoint& cp : m_checkpoints) {
+		res += cp.state.ram.usage();
+	}
+	return res;
+}
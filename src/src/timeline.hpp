@@ -0,0 +1,108 @@
+#pragma once
+
+#include "machine.hpp"
+#include "session.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/* Fewest ticks between two checkpoints */
+#define TIMELINE_MIN_INTERVAL (0x1 << 20)
+/* Checkpoints to aim for over the whole run */
+#define TIMELINE_CHECKPOINTS 1024
+/* How often a replay checks whether a better hit made it pointless */
+#define TIMELINE_POLL_TICKS (0x1 << 16)
+
+class SymbolTable;
+
+/*
+ * struct TimelineQuery: What to look for in a recorded run.
+ *
+ *   [first|last] write TARGET      an instruction writes TARGET
+ *   [first|last] change TARGET     TARGET ends up with another value
+ *   [first|last] when TARGET OP V  the comparison goes from false to true
+ *
+ * TARGET is rN, ip (only for when) or a memory address, in hex or as a
+ * symbol; OP is one of == != < <= > >=. "in FROM:TO" limits the search to
+ * those ticks, either side may be left out.
+ */
+struct TimelineQuery {
+	enum Kind { WRITE, CHANGE, WHEN };
+	enum Target { REG, RAM, IP };
+	enum Cmp { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+	Kind kind = WRITE;
+	bool last = false;
+	Target target = RAM;
+	uint16_t index = 0;
+	Cmp cmp = CMP_EQ;
+	uint16_t value = 0;
+	uint64_t from = 0;
+	uint64_t to = UINT64_MAX;
+
+	static bool parse(const char* text, TimelineQuery& q,
+			const SymbolTable* symbols = nullptr);
+};
+
+/*
+ * struct TimelineHit: The instruction a query stopped at, with the value
+ * of its target before and after it ran
+ */
+struct TimelineHit {
+	bool found = false;
+	uint64_t tick = 0;
+	uint16_t ip = 0;
+	uint16_t op = 0;
+	uint16_t before = 0;
+	uint16_t after = 0;
+};
+
+/*
+ * class Timeline: Answers questions about a run recorded as a Session,
+ * without a trace of every instruction. Building it replays the session
+ * once and keeps a checkpoint of the machine every so many ticks. The
+ * checkpoints share the memory of the image and only hold the pages the
+ * run has written, so there can be many of them.
+ *
+ * A query replays the segments between checkpoints on a pool of threads,
+ * nearest ones first for the direction asked. Replays are deterministic,
+ * so the hit in the earliest (or latest) segment that has one is exact,
+ * and segments past it are dropped as soon as it is known.
+ */
+class Timeline {
+public:
+	Timeline();
+	~Timeline();
+
+	void setThreads(size_t threads);
+	void setInterval(uint64_t ticks);
+
+	bool build(const uint16_t* image, size_t count, const Session& session,
+			FILE* log);
+
+	bool query(const TimelineQuery& q, TimelineHit& hit) const;
+
+	size_t checkpoints() const { return m_checkpoints.size(); }
+	uint64_t interval() const { return m_interval; }
+	uint64_t endTick() const { return m_end_tick; }
+	MemoryUsage memoryUsage() const;
+
+private:
+	struct Checkpoint {
+		Machine::State state;
+		size_t input;
+	};
+
+	void scan(size_t segment, const TimelineQuery& q, TimelineHit& hit,
+			const std::atomic<size_t>& best, size_t rank) const;
+
+	std::vector<Checkpoint> m_checkpoints;
+	std::vector<std::string> m_inputs;
+	uint64_t m_end_tick;
+	uint64_t m_interval;
+	size_t m_threads;
+};
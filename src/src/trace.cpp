@@ -0,0 +1,574 @@
+#include "trace.hpp"
+#include "opcodes.hpp"
+
+#include <string.h>
+#include <zlib.h>
+
+static uint32_t
+zigzag(int16_t value)
+{
+	return uint32_t(int32_t(value) * 2) ^ uint32_t(int32_t(value) >> 31);
+}
+
+static int16_t
+unzigzag(uint32_t value)
+{
+	return int16_t((value >> 1) ^ -(value & 1));
+}
+
+TraceWriter::TraceWriter() :
+	m_file(nullptr),
+	m_pos(0),
+	m_header(),
+	m_reg(),
+	m_last_write(0),
+	m_pending(false),
+	m_ip(0),
+	m_op(0),
+	m_records(0),
+	m_raw_bytes(0),
+	m_compressed_bytes(0),
+	m_failed(false),
+	m_closing(false)
+{
+}
+
+/*
+ * Closing without the final state drops the record of the instruction
+ * that was running
+ */
+TraceWriter::~TraceWriter()
+{
+	if (m_file) {
+		m_pending = false;
+		if (m_header.records) {
+			endChunk();
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mux);
+			m_closing = true;
+		}
+		m_cond.notify_all();
+		m_thread.join();
+		fclose(m_file);
+	}
+}
+
+/*
+ * Starts a trace at the given state. The memory image is stored once in the
+ * file header; everything after it is recorded as writes.
+ */
+bool
+TraceWriter::open(const char* path, const Machine::State& s)
+{
+	if (m_file)
+		return false;
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return false;
+	}
+
+	uLongf image_size = compressBound(MEMORY_BYTES);
+	std::vector<uint8_t> image(image_size);
+	compress2(image.data(), &image_size,
+			reinterpret_cast<const Bytef*>(s.ram.data()),
+			MEMORY_BYTES, Z_BEST_SPEED);
+
+	TraceFileHeader header = {};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.image_size = image_size;
+	header.first_tick = s.ticks + 1;
+	memcpy(header.reg, s.reg.data(), sizeof(header.reg));
+	header.ip = s.ip;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+			fwrite(image.data(), image_size, 1, file) != 1) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		fclose(file);
+		return false;
+	}
+
+	m_file = file;
+	m_data.assign(TRACE_CHUNK_BYTES + TRACE_MAX_RECORD, 0);
+	m_pos = 0;
+	m_header = TraceChunkHeader();
+	m_pending = false;
+	m_writes.clear();
+	m_records = 0;
+	m_raw_bytes = 0;
+	m_compressed_bytes = sizeof(header) + image_size;
+	m_failed = false;
+	m_closing = false;
+	m_thread = std::thread(&TraceWriter::compressor, this);
+	return true;
+}
+
+/*
+ * Completes the last record with the final state, then waits for the
+ * background thread to write out every chunk. Returns false if any write
+ * failed.
+ */
+bool
+TraceWriter::close(const Machine::State& s)
+{
+	if (!m_file)
+		return false;
+
+	if (m_pending)
+		finishRecord(s.reg, s.ip);
+	if (m_header.records)
+		endChunk();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_closing = true;
+	}
+	m_cond.notify_all();
+	m_thread.join();
+
+	bool ok = !m_failed && fclose(m_file) == 0;
+	m_file = nullptr;
+	return ok;
+}
+
+uint64_t
+TraceWriter::compressedBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+	return m_compressed_bytes;
+}
+
+void
+TraceWriter::putVarint(uint32_t value)
+{
+	while (value >= 0x80) {
+		put(uint8_t(value) | 0x80);
+		value >>= 7;
+	}
+	put(uint8_t(value));
+}
+
+/*
+ * Encodes the pending instruction now that its effects are known: where
+ * execution went next, which registers changed and what it wrote.
+ */
+void
+TraceWriter::finishRecord(const std::array<uint16_t, 8>& reg, uint16_t next)
+{
+	size_t need = m_pos + TRACE_MAX_RECORD + m_writes.size() * 6;
+	if (need > m_data.size())
+		m_data.resize(need);
+
+	uint16_t fall = m_ip + 1 + op_size[m_op];
+	uint8_t mask = 0;
+	for (size_t i = 0; i < 8; i++) {
+		if (reg[i] != m_reg[i])
+			mask |= 1 << i;
+	}
+
+	uint8_t flags = m_op;
+	if (next != fall)
+		flags |= TRACE_JUMP;
+	if (mask)
+		flags |= TRACE_REGS;
+	if (!m_writes.empty())
+		flags |= TRACE_WRITES;
+	put(flags);
+
+	if (flags & TRACE_JUMP)
+		putVarint(zigzag(next - fall));
+
+	if (mask) {
+		put(mask);
+		for (size_t i = 0; i < 8; i++) {
+			if (mask & (1 << i)) {
+				putVarint(zigzag(reg[i] - m_reg[i]));
+				m_reg[i] = reg[i];
+			}
+		}
+	}
+
+	if (!m_writes.empty()) {
+		putVarint(m_writes.size());
+		for (auto& w : m_writes) {
+			putVarint(zigzag(w.first - m_last_write));
+			putVarint(w.second);
+			m_last_write = w.first;
+		}
+		m_writes.clear();
+	}
+
+	m_header.records++;
+	m_records++;
+	m_pending = false;
+}
+
+void
+TraceWriter::startChunk(const Machine::State& s)
+{
+	m_header = TraceChunkHeader();
+	m_header.magic = TRACE_CHUNK_MAGIC;
+	m_header.first_tick = s.ticks;
+	memcpy(m_header.reg, s.reg.data(), sizeof(m_header.reg));
+	m_header.ip = s.ip;
+	m_reg = s.reg;
+	m_last_write = 0;
+}
+
+/*
+ * Hands the chunk to the compressor. Waits if it is too far behind, so a
+ * slow disk bounds memory instead of growing the queue.
+ */
+void
+TraceWriter::endChunk()
+{
+	Chunk chunk;
+	chunk.header = m_header;
+	chunk.header.raw_size = m_pos;
+	m_data.resize(m_pos);
+	chunk.data.swap(m_data);
+	m_raw_bytes += m_pos;
+
+	{
+		std::unique_lock<std::mutex> lock(m_mux);
+		m_cond.wait(lock, [this]() {
+			return m_queue.size() < TRACE_QUEUE_DEPTH;
+		});
+		m_queue.push_back(std::move(chunk));
+	}
+	m_cond.notify_all();
+
+	m_data.assign(TRACE_CHUNK_BYTES + TRACE_MAX_RECORD, 0);
+	m_pos = 0;
+	m_header.records = 0;
+}
+
+void
+TraceWriter::compressor()
+{
+	std::vector<uint8_t> out;
+	std::unique_lock<std::mutex> lock(m_mux);
+	for (;;) {
+		m_cond.wait(lock, [this]() {
+			return !m_queue.empty() || m_closing;
+		});
+		if (m_queue.empty())
+			break;
+
+		Chunk chunk = std::move(m_queue.front());
+		m_queue.pop_front();
+		lock.unlock();
+		m_cond.notify_all();
+
+		uLongf size = compressBound(chunk.data.size());
+		out.resize(size);
+		bool ok = compress2(out.data(), &size, chunk.data.data(),
+				chunk.data.size(), Z_BEST_SPEED) == Z_OK;
+		chunk.header.compressed_size = size;
+		ok = ok && fwrite(&chunk.header, sizeof(chunk.header), 1,
+				m_file) == 1;
+		ok = ok && fwrite(out.data(), size, 1, m_file) == 1;
+
+		lock.lock();
+		m_compressed_bytes += sizeof(chunk.header) + size;
+		if (!ok)
+			m_failed = true;
+	}
+}
+
+TraceReader::TraceReader() :
+	m_file(nullptr),
+	m_header()
+{
+}
+
+TraceReader::~TraceReader()
+{
+	if (m_file)
+		fclose(m_file);
+}
+
+/*
+ * Reads the file header, the memory image and the header of every chunk
+ */
+bool
+TraceReader::open(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return false;
+	}
+
+	TraceFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+			memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+			header.version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		fclose(file);
+		return false;
+	}
+
+	std::vector<uint8_t> compressed(header.image_size);
+	std::vector<uint16_t> image(0x1 << 16);
+	uLongf size = image.size() * sizeof(uint16_t);
+	if (fread(compressed.data(), compressed.size(), 1, file) != 1 ||
+			uncompress(reinterpret_cast<Bytef*>(image.data()), &size,
+				compressed.data(), compressed.size()) != Z_OK ||
+			size != image.size() * sizeof(uint16_t)) {
+		fprintf(stderr, "%s: bad memory image\n", path);
+		fclose(file);
+		return false;
+	}
+
+	std::vector<ChunkInfo> chunks;
+	ChunkInfo chunk;
+	while (fread(&chunk.header, sizeof(chunk.header), 1, file) == 1) {
+		if (chunk.header.magic != TRACE_CHUNK_MAGIC) {
+			fprintf(stderr, "%s: bad chunk at %ld\n", path,
+					ftell(file));
+			break;
+		}
+		chunk.offset = ftell(file);
+		if (fseek(file, chunk.header.compressed_size, SEEK_CUR))
+			break;
+		chunks.push_back(chunk);
+	}
+
+	if (m_file)
+		fclose(m_file);
+	m_file = file;
+	m_header = header;
+	m_image.swap(image);
+	m_chunks.swap(chunks);
+	return true;
+}
+
+uint64_t
+TraceReader::records() const
+{
+	uint64_t total = 0;
+	for (auto& c : m_chunks) {
+		total += c.header.records;
+	}
+	return total;
+}
+
+/*
+ * One past the tick of the last record
+ */
+uint64_t
+TraceReader::endTick() const
+{
+	if (m_chunks.empty())
+		return m_header.first_tick;
+	auto& last = m_chunks.back().header;
+	return last.first_tick + last.records;
+}
+
+uint64_t
+TraceReader::rawBytes() const
+{
+	uint64_t total = 0;
+	for (auto& c : m_chunks) {
+		total += c.header.raw_size;
+	}
+	return total;
+}
+
+uint64_t
+TraceReader::compressedBytes() const
+{
+	uint64_t total = sizeof(m_header) + m_header.image_size;
+	for (auto& c : m_chunks) {
+		total += sizeof(c.header) + c.header.compressed_size;
+	}
+	return total;
+}
+
+/*
+ * Visits every record with a tick in [from, to), until the visitor returns
+ * false
+ */
+bool
+TraceReader::scan(uint64_t from, uint64_t to, Visitor visit) const
+{
+	bool stop = false;
+	for (auto& c : m_chunks) {
+		if (c.header.first_tick + c.header.records <= from)
+			continue;
+		if (c.header.first_tick >= to || stop)
+			break;
+		if (!decode(c, from, to, visit, stop))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Visits the records in [from, to) that execute the instruction at addr or
+ * write to it. Chunks that never touched its page are not decompressed.
+ */
+bool
+TraceReader::scanAddress(uint16_t addr, uint64_t from, uint64_t to,
+		Visitor visit) const
+{
+	size_t page = addr / TRACE_PAGE_WORDS;
+	uint64_t bit = uint64_t(1) << (page % 64);
+
+	auto filter = [addr, &visit](const TraceEvent& e) {
+		bool hit = e.ip == addr;
+		for (auto& w : e.writes) {
+			hit = hit || w.first == addr;
+		}
+		return !hit || visit(e);
+	};
+
+	bool stop = false;
+	for (auto& c : m_chunks) {
+		if (c.header.first_tick + c.header.records <= from)
+			continue;
+		if (c.header.first_tick >= to || stop)
+			break;
+		if (!(c.header.code_pages[page / 64] & bit) &&
+				!(c.header.write_pages[page / 64] & bit))
+			continue;
+		if (!decode(c, from, to, filter, stop))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Rebuilds memory as it was after the instruction at the given tick, by
+ * applying every write since the start of the trace. The record of that
+ * instruction goes into last.
+ */
+bool
+TraceReader::stateAt(uint64_t tick, TraceEvent& last,
+		std::vector<uint16_t>& ram) const
+{
+	if (tick < firstTick() || tick >= endTick())
+		return false;
+
+	ram = m_image;
+	auto apply = [&ram, &last](const TraceEvent& e) {
+		for (auto& w : e.writes) {
+			ram[w.first] = w.second;
+		}
+		last = e;
+		return true;
+	};
+
+	bool stop = false;
+	for (auto& c : m_chunks) {
+		if (c.header.first_tick > tick)
+			break;
+		if (!decode(c, 0, tick + 1, apply, stop))
+			return false;
+	}
+	return true;
+}
+
+static bool
+get_varint(const uint8_t*& p, const uint8_t* end, uint32_t& value)
+{
+	value = 0;
+	for (int shift = 0; p < end && shift < 32; shift += 7) {
+		uint8_t byte = *p++;
+		value |= uint32_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool
+TraceReader::decode(const ChunkInfo& chunk, uint64_t from, uint64_t to,
+		Visitor visit, bool& stop) const
+{
+	const TraceChunkHeader& h = chunk.header;
+	std::vector<uint8_t> compressed(h.compressed_size);
+	std::vector<uint8_t> raw(h.raw_size);
+	uLongf size = raw.size();
+	if (fseek(m_file, chunk.offset, SEEK_SET) ||
+			fread(compressed.data(), compressed.size(), 1, m_file) != 1 ||
+			uncompress(raw.data(), &size, compressed.data(),
+				compressed.size()) != Z_OK || size != raw.size()) {
+		fprintf(stderr, "Cannot read chunk at tick %lu\n", h.first_tick);
+		return false;
+	}
+
+	TraceEvent e;
+	e.tick = h.first_tick;
+	e.ip = h.ip;
+	memcpy(e.reg.data(), h.reg, sizeof(h.reg));
+	uint16_t last_write = 0;
+
+	const uint8_t* p = raw.data();
+	const uint8_t* end = p + raw.size();
+	for (uint32_t i = 0; i < h.records && e.tick < to; i++) {
+		if (p >= end)
+			goto corrupt;
+
+		uint8_t flags = *p++;
+		e.op = flags & TRACE_OP_MASK;
+		if (e.op >= NUM_OPS)
+			goto corrupt;
+
+		uint32_t value;
+		uint16_t next = e.ip + 1 + op_size[e.op];
+		e.jumped = flags & TRACE_JUMP;
+		if (e.jumped) {
+			if (!get_varint(p, end, value))
+				goto corrupt;
+			next += unzigzag(value);
+		}
+
+		e.reg_mask = 0;
+		if (flags & TRACE_REGS) {
+			if (p >= end)
+				goto corrupt;
+			e.reg_mask = *p++;
+			for (size_t r = 0; r < 8; r++) {
+				if (!(e.reg_mask & (1 << r)))
+					continue;
+				if (!get_varint(p, end, value))
+					goto corrupt;
+				e.reg[r] += unzigzag(value);
+			}
+		}
+
+		e.writes.clear();
+		if (flags & TRACE_WRITES) {
+			uint32_t count;
+			if (!get_varint(p, end, count))
+				goto corrupt;
+			for (uint32_t w = 0; w < count; w++) {
+				uint32_t addr;
+				if (!get_varint(p, end, value))
+					goto corrupt;
+				addr = uint16_t(last_write + unzigzag(value));
+				if (!get_varint(p, end, value))
+					goto corrupt;
+				e.writes.push_back({addr, value});
+				last_write = addr;
+			}
+		}
+
+		if (e.tick >= from && !visit(e)) {
+			stop = true;
+			return true;
+		}
+		e.ip = next;
+		e.tick++;
+	}
+	return true;
+
+corrupt:
+	fprintf(stderr, "Corrupt chunk at tick %lu\n", h.first_tick);
+	return false;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "machine.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TRACE_MAGIC "SYNTRACE"
+#define TRACE_CHUNK_MAGIC 0x4b435254
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_BYTES (256 * 1024)
+#define TRACE_QUEUE_DEPTH 8
+#define TRACE_PAGE_WORDS 256
+#define TRACE_PAGES ((0x1 << 16) / TRACE_PAGE_WORDS)
+#define TRACE_MAX_RECORD 64
+
+/*
+ * Every record starts with the opcode of the instruction, plus flags for
+ * what follows it:
+ *   TRACE_JUMP    varint, zigzag: ip minus the fall-through ip
+ *   TRACE_REGS    byte with the changed registers, then a zigzag varint
+ *                 delta for each of them
+ *   TRACE_WRITES  varint count, then per write a zigzag varint address
+ *                 delta (from the previous write in the chunk) and a varint
+ *                 value
+ */
+#define TRACE_OP_MASK 0x1f
+#define TRACE_JUMP 0x20
+#define TRACE_REGS 0x40
+#define TRACE_WRITES 0x80
+
+/*
+ * struct TraceFileHeader: Start of a trace file. It is followed by the
+ * zlib compressed memory image at first_tick, then by the chunks.
+ */
+struct TraceFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t image_size;
+	uint64_t first_tick;
+	uint16_t reg[8];
+	uint16_t ip;
+	uint16_t pad[3];
+};
+
+/*
+ * struct TraceChunkHeader: Each chunk decodes on its own, starting from the
+ * registers and ip stored here. The page masks tell which pages of memory
+ * its instructions were fetched from and wrote to, so address queries can
+ * skip whole chunks.
+ */
+struct TraceChunkHeader {
+	uint32_t magic;
+	uint32_t raw_size;
+	uint32_t compressed_size;
+	uint32_t records;
+	uint64_t first_tick;
+	uint64_t code_pages[TRACE_PAGES / 64];
+	uint64_t write_pages[TRACE_PAGES / 64];
+	uint16_t reg[8];
+	uint16_t ip;
+	uint16_t pad[3];
+};
+
+static_assert(sizeof(TraceFileHeader) == 48, "trace header layout");
+static_assert(sizeof(TraceChunkHeader) == 112, "trace chunk layout");
+
+/*
+ * class TraceWriter: Records every executed instruction into a compact
+ * binary stream. The machine calls step() before each instruction, which
+ * completes the record of the previous one, and onWrite() for every memory
+ * write. Full chunks are compressed and written by a background thread.
+ */
+class TraceWriter {
+public:
+	TraceWriter();
+	~TraceWriter();
+
+	bool open(const char* path, const Machine::State& s);
+	bool close(const Machine::State& s);
+	bool isOpen() const { return m_file != nullptr; }
+
+	void step(const Machine::State& s, uint16_t op) {
+		if (m_pending)
+			finishRecord(s.reg, s.ip);
+		if (m_pos >= TRACE_CHUNK_BYTES)
+			endChunk();
+		if (m_header.records == 0)
+			startChunk(s);
+
+		m_pending = true;
+		m_ip = s.ip;
+		m_op = op;
+		setPage(m_header.code_pages, s.ip);
+	}
+
+	void onWrite(uint16_t addr, uint16_t value) {
+		m_writes.push_back({addr, value});
+		setPage(m_header.write_pages, addr);
+	}
+
+	uint64_t records() const { return m_records; }
+	uint64_t rawBytes() const { return m_raw_bytes; }
+	uint64_t compressedBytes() const;
+
+private:
+	struct Chunk {
+		TraceChunkHeader header;
+		std::vector<uint8_t> data;
+	};
+
+	static void setPage(uint64_t* pages, uint16_t addr) {
+		size_t page = addr / TRACE_PAGE_WORDS;
+		pages[page / 64] |= uint64_t(1) << (page % 64);
+	}
+
+	void put(uint8_t byte) { m_data[m_pos++] = byte; }
+	void putVarint(uint32_t value);
+
+	void finishRecord(const std::array<uint16_t, 8>& reg, uint16_t next);
+	void startChunk(const Machine::State& s);
+	void endChunk();
+	void compressor();
+
+	FILE* m_file;
+	std::vector<uint8_t> m_data;
+	size_t m_pos;
+
+	TraceChunkHeader m_header;
+	std::array<uint16_t, 8> m_reg;
+	uint16_t m_last_write;
+
+	bool m_pending;
+	uint16_t m_ip;
+	uint16_t m_op;
+	std::vector<std::pair<uint16_t, uint16_t>> m_writes;
+
+	uint64_t m_records;
+	uint64_t m_raw_bytes;
+	uint64_t m_compressed_bytes;
+	bool m_failed;
+
+	std::thread m_thread;
+	std::deque<Chunk> m_queue;
+	bool m_closing;
+	mutable std::mutex m_mux;
+	std::condition_variable m_cond;
+};
+
+/*
+ * struct TraceEvent: One decoded record. Registers are the values after
+ * the instruction ran.
+ */
+struct TraceEvent {
+	uint64_t tick;
+	uint16_t ip;
+	uint8_t op;
+	bool jumped;
+	uint8_t reg_mask;
+	std::array<uint16_t, 8> reg;
+	std::vector<std::pair<uint16_t, uint16_t>> writes;
+};
+
+/*
+ * class TraceReader: Random access to a trace file by tick range and
+ * address. Only the chunk headers are kept in memory; chunks are
+ * decompressed when a query needs them.
+ */
+class TraceReader {
+public:
+	typedef std::function<bool(const TraceEvent& e)> Visitor;
+
+	TraceReader();
+	~TraceReader();
+
+	bool open(const char* path);
+
+	const TraceFileHeader& header() const { return m_header; }
+	const std::vector<uint16_t>& image() const { return m_image; }
+
+	size_t chunks() const { return m_chunks.size(); }
+	uint64_t records() const;
+	uint64_t firstTick() const { return m_header.first_tick; }
+	uint64_t endTick() const;
+	uint64_t rawBytes() const;
+	uint64_t compressedBytes() const;
+
+	bool scan(uint64_t from, uint64_t to, Visitor visit) const;
+	bool scanAddress(uint16_t addr, uint64_t from, uint64_t to,
+			Visitor visit) const;
+	bool stateAt(uint64_t tick, TraceEvent& last,
+			std::vector<uint16_t>& ram) const;
+
+private:
+	struct ChunkInfo {
+		TraceChunkHeader header;
+		long offset;
+	};
+
+	bool decode(const ChunkInfo& chunk, uint64_t from, uint64_t to,
+			Visitor visit, bool& stop) const;
+
+	FILE* m_file;
+	TraceFileHeader m_header;
+	std::vector<uint16_t> m_image;
+	std::vector<ChunkInfo> m_chunks;
+};
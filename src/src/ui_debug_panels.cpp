@@ -0,0 +1,322 @@
+#include "ui_debug_panels.hpp"
+#include "analysis/disasm.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+UiRowView::UiRowView(int columns) :
+	m_adjustment(Gtk::Adjustment::create(0, 0, 0, 1, 1, 1)),
+	m_layout(create_pango_layout("0")),
+	m_row_height(1),
+	m_rows(0)
+{
+	m_layout->set_font_description(Pango::FontDescription(PANELS_FONT));
+	int width;
+	m_layout->get_pixel_size(width, m_row_height);
+	if (m_row_height < 1)
+		m_row_height = 1;
+
+	set_size_request(width * columns + 8, m_row_height * 16);
+	add_events(Gdk::SCROLL_MASK | Gdk::SMOOTH_SCROLL_MASK);
+	m_adjustment->signal_value_changed().connect(
+			sigc::mem_fun(*this, &UiRowView::queue_draw));
+}
+
+void
+UiRowView::setRows(size_t rows)
+{
+	if (rows == m_rows)
+		return;
+	m_rows = rows;
+	updatePage();
+	queue_draw();
+}
+
+/*
+ * Scrolls just enough for the row to be in view, leaving some rows above
+ * it when it has to move
+ */
+void
+UiRowView::scrollTo(size_t row)
+{
+	size_t first = m_adjustment->get_value();
+	size_t page = visibleRows();
+	if (row >= first && row < first + page)
+		return;
+	m_adjustment->set_value(row > page / 3 ? row - page / 3 : 0);
+}
+
+bool
+UiRowView::rowMarked(size_t) const
+{
+	return false;
+}
+
+size_t
+UiRowView::visibleRows() const
+{
+	size_t rows = get_allocated_height() / m_row_height;
+	return rows > 0 ? rows : 1;
+}
+
+void
+UiRowView::updatePage()
+{
+	size_t page = visibleRows();
+	m_adjustment->configure(m_adjustment->get_value(), 0, m_rows, 1,
+			page, page);
+}
+
+void
+UiRowView::on_size_allocate(Gtk::Allocation& alloc)
+{
+	Gtk::DrawingArea::on_size_allocate(alloc);
+	updatePage();
+}
+
+bool
+UiRowView::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
+{
+	cr->set_source_rgb(1, 1, 1);
+	cr->paint();
+
+	int width = get_allocated_width();
+	size_t first = m_adjustment->get_value();
+	size_t last = std::min(m_rows, first + visibleRows() + 1);
+
+	for (size_t row = first; row < last; row++) {
+		int y = (row - first) * m_row_height;
+		if (rowMarked(row)) {
+			cr->set_source_rgb(1, 0.93, 0.6);
+			cr->rectangle(0, y, width, m_row_height);
+			cr->fill();
+		}
+
+		cr->set_source_rgb(0, 0, 0);
+		m_layout->set_text(rowText(row));
+		cr->move_to(4, y);
+		m_layout->show_in_cairo_context(cr);
+	}
+	return true;
+}
+
+bool
+UiRowView::on_scroll_event(GdkEventScroll* event)
+{
+	double delta;
+	switch (event->direction) {
+	case GDK_SCROLL_UP:
+		delta = -3;
+		break;
+	case GDK_SCROLL_DOWN:
+		delta = 3;
+		break;
+	case GDK_SCROLL_SMOOTH:
+		delta = event->delta_y * 3;
+		break;
+	default:
+		return false;
+	}
+
+	double upper = m_adjustment->get_upper() - m_adjustment->get_page_size();
+	double value = m_adjustment->get_value() + delta;
+	m_adjustment->set_value(std::max(0.0, std::min(value, upper)));
+	return true;
+}
+
+UiHexView::UiHexView(const Snapshot& snap) :
+	UiRowView(6 + HEX_WORDS_PER_ROW * 6),
+	m_snap(snap)
+{
+	setRows(HEX_ROWS);
+}
+
+std::string
+UiHexView::rowText(size_t row) const
+{
+	char text[128];
+	size_t addr = row * HEX_WORDS_PER_ROW;
+	int n = snprintf(text, sizeof(text), "%04lx:", addr);
+	for (size_t i = 0; i < HEX_WORDS_PER_ROW; i++) {
+		n += snprintf(text + n, sizeof(text) - n, " %04x",
+				m_snap.ram[addr + i]);
+	}
+	n += snprintf(text + n, sizeof(text) - n, "  ");
+	for (size_t i = 0; i < HEX_WORDS_PER_ROW; i++) {
+		uint16_t c = m_snap.ram[addr + i];
+		text[n++] = c >= 0x20 && c < 0x7f ? c : '.';
+	}
+	text[n] = '\0';
+	return text;
+}
+
+bool
+UiHexView::rowMarked(size_t row) const
+{
+	return m_snap.ip / HEX_WORDS_PER_ROW == row;
+}
+
+UiDisasmView::UiDisasmView(const Snapshot& snap) :
+	UiRowView(44),
+	m_snap(snap)
+{
+}
+
+/*
+ * Sweeps the code space again if it changed since the last sweep
+ */
+void
+UiDisasmView::update()
+{
+	const uint16_t* ram = m_snap.ram.data();
+	if (!m_starts.empty() && std::equal(m_code.begin(), m_code.end(), ram))
+		return;
+
+	m_code.assign(ram, ram + CODE_SPACE);
+	m_starts.clear();
+	for (size_t addr = 0; addr < CODE_SPACE;
+			addr += decode(ram, addr).size()) {
+		m_starts.push_back(addr);
+	}
+	setRows(m_starts.size());
+}
+
+/*
+ * Row of the instruction covering addr
+ */
+size_t
+UiDisasmView::rowOf(uint16_t addr) const
+{
+	auto it = std::upper_bound(m_starts.begin(), m_starts.end(), addr);
+	return it == m_starts.begin() ? 0 : it - m_starts.begin() - 1;
+}
+
+std::string
+UiDisasmView::rowText(size_t row) const
+{
+	uint16_t addr = m_starts[row];
+	char text[96];
+	snprintf(text, sizeof(text), "%c %04x: %s",
+			addr == m_snap.ip ? '>' : ' ', addr,
+			format(decode(m_snap.ram.data(), addr)).c_str());
+	return text;
+}
+
+bool
+UiDisasmView::rowMarked(size_t row) const
+{
+	return m_snap.ip < CODE_SPACE && rowOf(m_snap.ip) == row;
+}
+
+UiStackView::UiStackView(const Snapshot& snap) :
+	UiRowView(12),
+	m_snap(snap)
+{
+}
+
+std::string
+UiStackView::rowText(size_t row) const
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%5lu  %04x", row,
+			m_snap.stack[m_snap.stack.size() - 1 - row]);
+	return text;
+}
+
+UiDebugPanels::UiDebugPanels(const SnapshotBuffer& source) :
+	Gtk::Box(Gtk::ORIENTATION_HORIZONTAL, 6),
+	m_source(source),
+	m_last_ip(0),
+	m_left(Gtk::ORIENTATION_VERTICAL, 6),
+	m_stack(m_snap),
+	m_stack_bar(m_stack.adjustment(), Gtk::ORIENTATION_VERTICAL),
+	m_code_column(Gtk::ORIENTATION_VERTICAL, 6),
+	m_follow("Follow ip"),
+	m_code(m_snap),
+	m_code_bar(m_code.adjustment(), Gtk::ORIENTATION_VERTICAL),
+	m_ram_column(Gtk::ORIENTATION_VERTICAL, 6),
+	m_ram(m_snap),
+	m_ram_bar(m_ram.adjustment(), Gtk::ORIENTATION_VERTICAL)
+{
+	set_border_width(6);
+
+	m_regs.set_xalign(0);
+	m_regs.set_yalign(0);
+	m_stack_box.pack_start(m_stack, true, true);
+	m_stack_box.pack_start(m_stack_bar, false, false);
+	m_left.pack_start(m_regs, false, false);
+	m_left.pack_start(m_stack_box, true, true);
+
+	m_follow.set_active(true);
+	m_code_box.pack_start(m_code, true, true);
+	m_code_box.pack_start(m_code_bar, false, false);
+	m_code_column.pack_start(m_follow, false, false);
+	m_code_column.pack_start(m_code_box, true, true);
+
+	m_address.set_placeholder_text("Go to address (hex)");
+	m_address.signal_activate().connect(
+			sigc::mem_fun(*this, &UiDebugPanels::goToAddress));
+	m_ram_box.pack_start(m_ram, true, true);
+	m_ram_box.pack_start(m_ram_bar, false, false);
+	m_ram_column.pack_start(m_address, false, false);
+	m_ram_column.pack_start(m_ram_box, true, true);
+
+	pack_start(m_left, false, false);
+	pack_start(m_code_column, true, true);
+	pack_start(m_ram_column, true, true);
+
+	m_timer = Glib::signal_timeout().connect(
+			sigc::mem_fun(*this, &UiDebugPanels::refresh),
+			PANELS_REFRESH_MS);
+	refresh();
+}
+
+UiDebugPanels::~UiDebugPanels()
+{
+	m_timer.disconnect();
+}
+
+/*
+ * Takes the latest snapshot, if there is a new one, and redraws the rows
+ * in view
+ */
+bool
+UiDebugPanels::refresh()
+{
+	if (!m_source.read(m_snap))
+		return true;
+
+	char text[256];
+	int n = snprintf(text, sizeof(text), "ip    %04x\ntick  %lu\nstack %lu%s\n",
+			m_snap.ip, m_snap.ticks, m_snap.stack.size(),
+			m_snap.waiting ? "\nwaiting for input" : "");
+	for (size_t r = 0; r < 8; r++) {
+		n += snprintf(text + n, sizeof(text) - n, "%sR%lu %04x",
+				r % 2 ? "  " : "\n", r, m_snap.reg[r]);
+	}
+	m_regs.set_markup(std::string("<tt>") + text + "</tt>");
+
+	m_stack.setRows(m_snap.stack.size());
+	m_code.update();
+	if (m_follow.get_active() && m_snap.ip != m_last_ip)
+		m_code.scrollTo(m_code.rowOf(m_snap.ip));
+	m_last_ip = m_snap.ip;
+
+	m_stack.queue_draw();
+	m_code.queue_draw();
+	m_ram.queue_draw();
+	return true;
+}
+
+void
+UiDebugPanels::goToAddress()
+{
+	std::string text = m_address.get_text();
+	char* end;
+	unsigned long addr = strtoul(text.c_str(), &end, 16);
+	if (text.empty() || *end != '\0' || addr > 0xffff)
+		return;
+	m_ram.scrollTo(addr / HEX_WORDS_PER_ROW);
+}
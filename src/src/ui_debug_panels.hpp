@@ -0,0 +1,137 @@
+#ifndef UI_DEBUG_PANELS_HPP
+#define UI_DEBUG_PANELS_HPP
+
+#include <gtkmm.h>
+
+#include "snapshot.hpp"
+
+#include <string>
+#include <vector>
+
+#define PANELS_REFRESH_MS 33
+#define PANELS_FONT "Monospace 9"
+#define HEX_WORDS_PER_ROW 8
+#define HEX_ROWS ((0x1 << 16) / HEX_WORDS_PER_ROW)
+
+/*
+ * class UiRowView: A list of text rows that may be very long. Only the
+ * rows in view are formatted and drawn, so the row count costs nothing.
+ * Scrolled through its adjustment, which a Gtk::Scrollbar can share.
+ */
+class UiRowView : public Gtk::DrawingArea {
+public:
+	UiRowView(int columns);
+
+	Glib::RefPtr<Gtk::Adjustment> adjustment() const { return m_adjustment; }
+	void setRows(size_t rows);
+	void scrollTo(size_t row);
+
+protected:
+	virtual std::string rowText(size_t row) const = 0;
+	virtual bool rowMarked(size_t row) const;
+
+	bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
+	bool on_scroll_event(GdkEventScroll* event) override;
+	void on_size_allocate(Gtk::Allocation& alloc) override;
+
+private:
+	size_t visibleRows() const;
+	void updatePage();
+
+	Glib::RefPtr<Gtk::Adjustment> m_adjustment;
+	Glib::RefPtr<Pango::Layout> m_layout;
+	int m_row_height;
+	size_t m_rows;
+};
+
+/*
+ * class UiHexView: The whole 64K word memory, HEX_WORDS_PER_ROW words a
+ * row with their characters alongside
+ */
+class UiHexView : public UiRowView {
+public:
+	UiHexView(const Snapshot& snap);
+
+protected:
+	std::string rowText(size_t row) const override;
+	bool rowMarked(size_t row) const override;
+
+private:
+	const Snapshot& m_snap;
+};
+
+/*
+ * class UiDisasmView: The 32K word code space, one row per instruction
+ * from a linear sweep. The sweep is redone only when code changes.
+ */
+class UiDisasmView : public UiRowView {
+public:
+	UiDisasmView(const Snapshot& snap);
+
+	void update();
+	size_t rowOf(uint16_t addr) const;
+
+protected:
+	std::string rowText(size_t row) const override;
+	bool rowMarked(size_t row) const override;
+
+private:
+	const Snapshot& m_snap;
+	std::vector<uint16_t> m_code;
+	std::vector<uint16_t> m_starts;
+};
+
+/*
+ * class UiStackView: The guest stack, top first
+ */
+class UiStackView : public UiRowView {
+public:
+	UiStackView(const Snapshot& snap);
+
+protected:
+	std::string rowText(size_t row) const override;
+
+private:
+	const Snapshot& m_snap;
+};
+
+/*
+ * class UiDebugPanels: Registers, stack, disassembly and memory of a
+ * running machine. Reads the controller's snapshot buffer on a timer and
+ * redraws only when it changed, so the machine never calls into the UI.
+ */
+class UiDebugPanels : public Gtk::Box {
+public:
+	UiDebugPanels(const SnapshotBuffer& source);
+	~UiDebugPanels();
+
+private:
+	bool refresh();
+	void goToAddress();
+
+	const SnapshotBuffer& m_source;
+	Snapshot m_snap;
+	uint16_t m_last_ip;
+
+	Gtk::Box m_left;
+	Gtk::Label m_regs;
+	Gtk::Box m_stack_box;
+	UiStackView m_stack;
+	Gtk::Scrollbar m_stack_bar;
+
+	Gtk::Box m_code_column;
+	Gtk::CheckButton m_follow;
+	Gtk::Box m_code_box;
+	UiDisasmView m_code;
+	Gtk::Scrollbar m_code_bar;
+
+	Gtk::Box m_ram_column;
+	Gtk::Entry m_address;
+	Gtk::Box m_ram_box;
+	UiHexView m_ram;
+	Gtk::Scrollbar m_ram_bar;
+
+	sigc::connection m_timer;
+};
+
+#endif  // UI_DEBUG_PANELS_HPP
@@ -0,0 +1,103 @@
+#include "ui_heatmap.hpp"
+
+#include <math.h>
+#include <stdio.h>
+
+/*
+ * Maps a counter to a colour channel: untouched words stay black and the
+ * rest span the channel on a log scale
+ */
+static uint32_t level(uint32_t count)
+{
+	if (count == 0)
+		return 0;
+	double value = 48 + 207 * log2(count) / 24;
+	return value > 255 ? 255 : uint32_t(value);
+}
+
+UiHeatmap::UiHeatmap(const Shadow& shadow) :
+	m_shadow(shadow),
+	m_image(Cairo::ImageSurface::create(Cairo::FORMAT_RGB24,
+				HEATMAP_COLUMNS, HEATMAP_ROWS))
+{
+	set_size_request(HEATMAP_COLUMNS * 2, HEATMAP_ROWS * 2);
+	set_has_tooltip(true);
+	add_events(Gdk::POINTER_MOTION_MASK);
+
+	m_timer = Glib::signal_timeout().connect(
+			sigc::mem_fun(*this, &UiHeatmap::refresh),
+			HEATMAP_REFRESH_MS);
+	refresh();
+}
+
+UiHeatmap::~UiHeatmap()
+{
+	m_timer.disconnect();
+}
+
+bool
+UiHeatmap::refresh()
+{
+	m_image->flush();
+	unsigned char* data = m_image->get_data();
+	int stride = m_image->get_stride();
+
+	for (uint32_t addr = 0; addr < SHADOW_WORDS; addr++) {
+		uint32_t* pixel = (uint32_t*) (data +
+				(addr / HEATMAP_COLUMNS) * stride) +
+			addr % HEATMAP_COLUMNS;
+		*pixel = level(m_shadow.writes(addr)) << 16 |
+			level(m_shadow.reads(addr)) << 8 |
+			level(m_shadow.fetches(addr));
+	}
+
+	m_image->mark_dirty();
+	queue_draw();
+	return true;
+}
+
+bool
+UiHeatmap::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
+{
+	Gtk::Allocation alloc = get_allocation();
+	cr->scale(double(alloc.get_width()) / HEATMAP_COLUMNS,
+			double(alloc.get_height()) / HEATMAP_ROWS);
+
+	auto pattern = Cairo::SurfacePattern::create(m_image);
+	pattern->set_filter(Cairo::FILTER_NEAREST);
+	cr->set_source(pattern);
+	cr->paint();
+	return true;
+}
+
+int
+UiHeatmap::addressAt(double x, double y) const
+{
+	Gtk::Allocation alloc = get_allocation();
+	if (alloc.get_width() <= 0 || alloc.get_height() <= 0)
+		return -1;
+
+	int col = x * HEATMAP_COLUMNS / alloc.get_width();
+	int row = y * HEATMAP_ROWS / alloc.get_height();
+	if (col < 0 || col >= HEATMAP_COLUMNS || row < 0 ||
+			row >= HEATMAP_ROWS)
+		return -1;
+	return row * HEATMAP_COLUMNS + col;
+}
+
+bool
+UiHeatmap::on_motion_notify_event(GdkEventMotion* event)
+{
+	int addr = addressAt(event->x, event->y);
+	if (addr < 0) {
+		set_tooltip_text("");
+		return false;
+	}
+
+	char text[64];
+	snprintf(text, sizeof(text), "%04x  r %u  w %u  x %u", addr,
+			m_shadow.reads(addr), m_shadow.writes(addr),
+			m_shadow.fetches(addr));
+	set_tooltip_text(text);
+	return false;
+}
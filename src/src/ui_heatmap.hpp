@@ -0,0 +1,36 @@
+#ifndef UI_HEATMAP_HPP
+#define UI_HEATMAP_HPP
+
+#include <gtkmm.h>
+
+#include "shadow.hpp"
+
+#define HEATMAP_COLUMNS 256
+#define HEATMAP_ROWS (SHADOW_WORDS / HEATMAP_COLUMNS)
+#define HEATMAP_REFRESH_MS 250
+
+/*
+ * class UiHeatmap: The 32K word address space as a grid with one cell per
+ * word, coloured on a log scale by how often it was read (green), written
+ * (red) and fetched as code (blue). Redrawn from the shadow counters a few
+ * times a second, so the machine thread is never held up by it.
+ */
+class UiHeatmap : public Gtk::DrawingArea {
+public:
+	UiHeatmap(const Shadow& shadow);
+	~UiHeatmap();
+
+protected:
+	bool on_draw(const Cairo::RefPtr<Cairo::Context>& cr) override;
+	bool on_motion_notify_event(GdkEventMotion* event) override;
+
+private:
+	bool refresh();
+	int addressAt(double x, double y) const;
+
+	const Shadow& m_shadow;
+	Cairo::RefPtr<Cairo::ImageSurface> m_image;
+	sigc::connection m_timer;
+};
+
+#endif  // UI_HEATMAP_HPP
@@ -1,5 +1,6 @@
 #include "ui_machine.hpp"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <gtkmm.h>
 #include <stdexcept>
@@ -17,13 +18,25 @@ UiMachine::UiMachine() :
 			std::bind(&UiMachine::handle_output, this, 0,
 				std::placeholders::_1),
 			std::bind(&UiMachine::handle_output, this, 1,
-				std::placeholders::_1))
+				std::placeholders::_1)),
+	m_feed_box(Gtk::ORIENTATION_HORIZONTAL, 6),
+	m_feed_cancel("Cancel"),
+	m_feed_cancelled(false)
 {
 	Gtk::Box* cont;
 	m_builder->get_widget("container", cont);
 	if (cont) {
 		add(*cont);
+
+		// Shown only while a script is being fed
+		m_feed_progress.set_show_text(true);
+		m_feed_box.pack_start(m_feed_progress, true, true);
+		m_feed_box.pack_start(m_feed_cancel, false, false);
+		m_feed_box.set_no_show_all(true);
+		cont->pack_start(m_feed_box, false, false);
 	}
+	m_feed_cancel.signal_clicked().connect(
+			sigc::mem_fun(*this, &UiMachine::cancel_feed));
 
 	this->signal_key_press_event().connect_notify(
 			std::bind(&UiMachine::key_pressed, this,
@@ -39,12 +52,42 @@ UiMachine::UiMachine() :
 	menu_item->signal_activate().connect_notify(
 				std::bind(&UiMachine::load_program, this));
 
+	obj = m_builder->get_object("bar_record");
+	menu_item = Glib::RefPtr<Gtk::MenuItem>::cast_dynamic(obj);
+	menu_item->signal_activate().connect_notify(
+				std::bind(&UiMachine::record_session, this));
+
+	obj = m_builder->get_object("bar_feed");
+	menu_item = Glib::RefPtr<Gtk::MenuItem>::cast_dynamic(obj);
+	menu_item->signal_activate().connect_notify(
+				std::bind(&UiMachine::feed_script, this));
+
+	obj = m_builder->get_object("bar_feed_clipboard");
+	menu_item = Glib::RefPtr<Gtk::MenuItem>::cast_dynamic(obj);
+	menu_item->signal_activate().connect_notify(
+				std::bind(&UiMachine::feed_clipboard, this));
+
+	obj = m_builder->get_object("bar_heatmap");
+	menu_item = Glib::RefPtr<Gtk::MenuItem>::cast_dynamic(obj);
+	menu_item->signal_activate().connect_notify(
+				std::bind(&UiMachine::show_heatmap, this));
+
+	obj = m_builder->get_object("bar_debug");
+	menu_item = Glib::RefPtr<Gtk::MenuItem>::cast_dynamic(obj);
+	menu_item->signal_activate().connect_notify(
+				std::bind(&UiMachine::show_debug_panels, this));
+
 	obj = m_builder->get_object("app_output");
 	m_text_window = Glib::RefPtr<Gtk::TextView>::cast_dynamic(obj);
 
 	obj = m_builder->get_object("user_input");
 	m_user_input = Glib::RefPtr<Gtk::Entry>::cast_dynamic(obj);
 
+	if (const char* path = getenv("SYNACOR_METRICS_SOCKET")) {
+		if (!m_ctrl.serve_metrics(path))
+			this->handle_output(1, "Could not serve metrics\n");
+	}
+
 	set_title("Simple Demo");
 	set_default_size(800, 400);
 	show_all();
@@ -52,6 +95,7 @@ UiMachine::UiMachine() :
 
 UiMachine::~UiMachine()
 {
+	m_feed_timer.disconnect();
 	this->stop_running();
 }
 
@@ -87,12 +131,156 @@ UiMachine::load_program()
 	}
 }
 
+void
+UiMachine::record_session()
+{
+	Gtk::FileChooserDialog dialog(*this,
+			"Record Session",
+			Gtk::FILE_CHOOSER_ACTION_SAVE);
+
+	dialog.add_button("Cancel", Gtk::RESPONSE_CANCEL);
+	dialog.add_button("Record", Gtk::RESPONSE_ACCEPT);
+	dialog.set_do_overwrite_confirmation(true);
+
+	int res = dialog.run();
+
+	if (res == Gtk::RESPONSE_ACCEPT) {
+		std::string filename = dialog.get_filename();
+		if (!m_ctrl.record_session(filename.c_str())) {
+			this->handle_output(1, "Stop the machine before recording\n");
+		} else {
+			std::string msg = "The next run will be recorded to " +
+				filename + "\n";
+			this->handle_output(2, msg.c_str());
+		}
+	}
+}
+
+void
+UiMachine::feed_script()
+{
+	Gtk::FileChooserDialog dialog(*this,
+			"Feed Script",
+			Gtk::FILE_CHOOSER_ACTION_OPEN);
+
+	dialog.add_button("Cancel", Gtk::RESPONSE_CANCEL);
+	dialog.add_button("Feed", Gtk::RESPONSE_ACCEPT);
+
+	if (dialog.run() == Gtk::RESPONSE_ACCEPT) {
+		std::string filename = dialog.get_filename();
+		start_feed(m_ctrl.feed_script_file(filename.c_str()));
+	}
+}
+
+/*
+ * Feeds whatever text is on the clipboard, once it arrives
+ */
+void
+UiMachine::feed_clipboard()
+{
+	Gtk::Clipboard::get()->request_text([this](const Glib::ustring& text) {
+		start_feed(m_ctrl.feed_script(text));
+	});
+}
+
+void
+UiMachine::cancel_feed()
+{
+	m_feed_cancelled = true;
+	m_ctrl.cancel_script();
+}
+
+void
+UiMachine::start_feed(bool started)
+{
+	if (!started) {
+		this->handle_output(1, m_ctrl.feeder().feeding() ?
+				"A script is already being fed\n" :
+				"Run the machine before feeding it a script\n");
+		return;
+	}
+
+	m_feed_cancelled = false;
+	m_feed_progress.set_fraction(0);
+	m_feed_progress.set_text("Reading script");
+	m_feed_box.set_no_show_all(false);
+	m_feed_box.show_all();
+
+	m_feed_timer.disconnect();
+	m_feed_timer = Glib::signal_timeout().connect(
+			sigc::mem_fun(*this, &UiMachine::update_feed),
+			FEED_REFRESH_MS);
+}
+
+/*
+ * Polls the feeder's counters, which never blocks, and reports how the
+ * script ended
+ */
+bool
+UiMachine::update_feed()
+{
+	const InputFeeder& feeder = m_ctrl.feeder();
+	size_t total = feeder.total();
+	size_t consumed = feeder.consumed();
+
+	char text[64];
+	snprintf(text, sizeof(text), "%lu / %lu lines", consumed, total);
+	m_feed_progress.set_text(text);
+	m_feed_progress.set_fraction(total ? double(consumed) / total : 0);
+
+	if (feeder.feeding())
+		return true;
+
+	m_feed_box.hide();
+	if (!feeder.error().empty()) {
+		this->handle_output(1, ("Script stopped: " + feeder.error() +
+					"\n").c_str());
+	} else if (m_feed_cancelled) {
+		snprintf(text, sizeof(text), "Script cancelled after %lu lines\n",
+				feeder.sent());
+		this->handle_output(1, text);
+	} else {
+		snprintf(text, sizeof(text), "Script of %lu lines sent\n", total);
+		this->handle_output(2, text);
+	}
+	return false;
+}
+
 void
 UiMachine::stop_running()
 {
 	m_ctrl.stop_running();
 }
 
+void
+UiMachine::show_heatmap()
+{
+	if (!m_heatmap_window) {
+		m_heatmap.reset(new UiHeatmap(m_ctrl.shadow()));
+		m_heatmap_window.reset(new Gtk::Window());
+		m_heatmap_window->set_title("Memory heatmap");
+		m_heatmap_window->set_transient_for(*this);
+		m_heatmap_window->add(*m_heatmap);
+	}
+	m_heatmap_window->show_all();
+	m_heatmap_window->present();
+}
+
+void
+UiMachine::show_debug_panels()
+{
+	if (!m_debug_window) {
+		m_debug_panels.reset(new UiDebugPanels(m_ctrl.snapshots()));
+		m_debug_window.reset(new Gtk::Window());
+		m_debug_window->set_title("Debugger");
+		m_debug_window->set_transient_for(*this);
+		m_debug_window->set_default_size(1000, 500);
+		m_debug_window->add(*m_debug_panels);
+	}
+	m_debug_window->show_all();
+	m_debug_window->present();
+}
+
 void
 UiMachine::key_pressed(GdkEventKey* event)
 {
@@ -104,7 +292,10 @@ UiMachine::key_pressed(GdkEventKey* event)
 		Glib::signal_idle().connect([this]() {
 			auto text = this->m_user_input->get_text();
 			std::string input = text + "\n";
-			this->m_ctrl.send_input(input.c_str(), input.size());
+			if (!this->m_ctrl.send_input(input.c_str(), input.size())) {
+				this->handle_output(1,
+						"The machine is not reading input\n");
+			}
 			this->m_user_input->set_text("");
 			return false;
 		});
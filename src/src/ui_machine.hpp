@@ -4,6 +4,12 @@
 #include <gtkmm.h>
 
 #include "ctrl/ui_machine_ctrl.hpp"
+#include "ui_heatmap.hpp"
+#include "ui_debug_panels.hpp"
+
+#include <memory>
+
+#define FEED_REFRESH_MS 100
 
 class UiMachine : public Gtk::ApplicationWindow {
 public:
@@ -13,8 +19,16 @@ public:
 	void run_program();
 	void load_program();
 	void stop_running();
+	void show_heatmap();
+	void show_debug_panels();
+	void record_session();
+	void feed_script();
+	void feed_clipboard();
+	void cancel_feed();
 
 private:
+	void start_feed(bool started);
+	bool update_feed();
 	void key_pressed(GdkEventKey* event);
 	void handle_output(int type, const char* output);
 
@@ -23,6 +37,18 @@ private:
 	Glib::RefPtr<Gtk::Entry> m_user_input;
 
 	MachineController m_ctrl;
+
+	Gtk::Box m_feed_box;
+	Gtk::ProgressBar m_feed_progress;
+	Gtk::Button m_feed_cancel;
+	sigc::connection m_feed_timer;
+	bool m_feed_cancelled;
+
+	std::unique_ptr<Gtk::Window> m_heatmap_window;
+	std::unique_ptr<UiHeatmap> m_heatmap;
+
+	std::unique_ptr<Gtk::Window> m_debug_window;
+	std::unique_ptr<UiDebugPanels> m_debug_panels;
 };
 
 #endif  // UI_MACHINE_HPP
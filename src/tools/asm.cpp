@@ -0,0 +1,49 @@
+#include "assembler.hpp"
+
+#include <getopt.h>
+#include <stdio.h>
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s [-l] SOURCE IMAGE\n", prog);
+	printf("  -l  print the labels and constants with their values\n");
+	printf("See src/assembler.hpp for the syntax.\n");
+}
+
+int main(int argc, char* argv[])
+{
+	bool labels = false;
+
+	int c;
+	while ((c = getopt(argc, argv, "lh")) != -1) {
+		switch (c) {
+		case 'l': labels = true; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	Assembler as;
+	if (!as.assembleFile(argv[optind])) {
+		for (auto& e : as.errors()) {
+			fprintf(stderr, "%s\n", e.c_str());
+		}
+		return 1;
+	}
+	if (!as.write(argv[optind + 1]))
+		return 1;
+
+	if (labels) {
+		for (auto& s : as.symbols()) {
+			printf("%04x %s\n", s.second, s.first.c_str());
+		}
+	}
+	printf("%lu words\n", as.words().size());
+	return 0;
+}
@@ -0,0 +1,245 @@
+#include "debug_proto.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Drives a machine served by the debugger's "serve" command. Each argument
+ * after the socket is one command, run in order.
+ */
+
+static const char* stop_reason(uint8_t reason)
+{
+	switch (reason) {
+	case DBG_STOP_ATTACH:    return "attached";
+	case DBG_STOP_STEP:      return "step";
+	case DBG_STOP_BREAK:     return "breakpoint";
+	case DBG_STOP_INTERRUPT: return "interrupted";
+	case DBG_STOP_HALT:      return "halted";
+	}
+	return "?";
+}
+
+static bool check(const DebugFrame& resp, uint16_t type)
+{
+	if (resp.type == type)
+		return true;
+	if (resp.type == DBG_ERROR && resp.payload.size() >= 2) {
+		fprintf(stderr, "error: %.*s\n", int(resp.payload.size() - 2),
+				(const char*)resp.payload.data() + 2);
+	} else {
+		fprintf(stderr, "unexpected response %04x\n", resp.type);
+	}
+	return false;
+}
+
+static bool wait_stop(DebugClient& client)
+{
+	DebugStop stop;
+	if (!client.waitStop(stop))
+		return false;
+	printf("stopped (%s) at %04x, tick %lu\n", stop_reason(stop.reason),
+			stop.ip, stop.ticks);
+	return true;
+}
+
+static bool print_regs(DebugClient& client)
+{
+	DebugFrame resp;
+	if (!client.request(DBG_READ_REGS, resp) || !check(resp, DBG_REGS))
+		return false;
+
+	DebugRegs regs;
+	size_t pos = 0;
+	resp.get(pos, regs);
+	printf("ip %04x  tick %lu  stack %u%s\n", regs.ip, regs.ticks,
+			regs.stack_depth, regs.waiting ? "  (waiting input)" : "");
+	for (size_t r = 0; r < 8; r++) {
+		printf("R%lu=%04x%s", r, regs.reg[r], r == 7 ? "\n" : " ");
+	}
+	return true;
+}
+
+static bool print_stack(DebugClient& client, uint32_t max)
+{
+	DebugFrame req, resp;
+	req.type = DBG_READ_STACK;
+	req.put(max);
+	if (!client.request(req, resp) || !check(resp, DBG_STACK))
+		return false;
+
+	size_t pos = 0;
+	uint32_t depth = 0;
+	uint16_t val;
+	resp.get(pos, depth);
+	printf("stack (%u):", depth);
+	while (resp.get(pos, val)) {
+		printf(" %04x", val);
+	}
+	printf("\n");
+	return true;
+}
+
+static bool print_ram(DebugClient& client, uint32_t addr, uint32_t count)
+{
+	DebugFrame req, resp;
+	req.type = DBG_READ_RAM;
+	req.put(DebugRange{addr, count});
+	if (!client.request(req, resp) || !check(resp, DBG_RAM))
+		return false;
+
+	size_t pos = sizeof(DebugRange);
+	uint16_t val;
+	for (uint32_t i = 0; resp.get(pos, val); i++) {
+		if (i % 8 == 0)
+			printf("%s%04x:", i ? "\n" : "", addr + i);
+		printf(" %04x", val);
+	}
+	printf("\n");
+	return true;
+}
+
+static bool breakpoints(DebugClient& client, uint16_t type, bool has_addr,
+		uint16_t addr)
+{
+	DebugFrame req, resp;
+	req.type = type;
+	if (has_addr)
+		req.put(addr);
+	if (!client.request(req, resp))
+		return false;
+
+	if (type != DBG_BREAK_LIST)
+		return check(resp, DBG_OK);
+	if (!check(resp, DBG_BREAKS))
+		return false;
+
+	size_t pos = 0;
+	printf("breakpoints:");
+	while (resp.get(pos, addr)) {
+		printf(" %04x", addr);
+	}
+	printf("\n");
+	return true;
+}
+
+/*
+ * Reads the whole memory over and over, to see how fast state comes out
+ */
+static bool bench(DebugClient& client, size_t rounds)
+{
+	DebugFrame req, resp;
+	req.type = DBG_READ_RAM;
+	req.put(DebugRange{0, 0x1 << 16});
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t i = 0; i < rounds; i++) {
+		if (!client.request(req, resp) || !check(resp, DBG_RAM))
+			return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	double mb = rounds * resp.payload.size() / 1e6;
+	printf("%lu full memory reads in %.3f s: %.1f MB/s, %.1f us each\n",
+			rounds, secs, mb / secs, secs * 1e6 / rounds);
+	return true;
+}
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s SOCKET COMMAND...\n", prog);
+	printf("  regs, stack [N], ram ADDR [N]      inspect (hex addresses)\n");
+	printf("  break ADDR, unbreak [ADDR], breaks manage breakpoints\n");
+	printf("  step [N], cont                     resume, wait for the stop\n");
+	printf("  wait, stop, detach                 run control\n");
+	printf("  bench [N]                          time N full memory reads\n");
+}
+
+/*
+ * Takes the next argument if it is a number
+ */
+static bool number_arg(int argc, char* argv[], int& i, int base,
+		unsigned long& value)
+{
+	if (i + 1 >= argc)
+		return false;
+
+	char* end;
+	value = strtoul(argv[i + 1], &end, base);
+	if (end == argv[i + 1] || *end != '\0')
+		return false;
+	i++;
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	DebugClient client;
+	if (!client.connect(argv[1])) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		const char* cmd = argv[i];
+		unsigned long a = 0;
+		unsigned long b = 0;
+		DebugFrame req, resp;
+		bool ok;
+
+		if (strcmp(cmd, "regs") == 0) {
+			ok = print_regs(client);
+		} else if (strcmp(cmd, "stack") == 0) {
+			ok = print_stack(client,
+					number_arg(argc, argv, i, 10, a) ? a : 16);
+		} else if (strcmp(cmd, "ram") == 0 &&
+				number_arg(argc, argv, i, 16, a)) {
+			ok = print_ram(client, a,
+					number_arg(argc, argv, i, 10, b) ? b : 64);
+		} else if (strcmp(cmd, "break") == 0 &&
+				number_arg(argc, argv, i, 16, a)) {
+			ok = breakpoints(client, DBG_BREAK_SET, true, a);
+		} else if (strcmp(cmd, "unbreak") == 0) {
+			bool one = number_arg(argc, argv, i, 16, a);
+			ok = breakpoints(client, DBG_BREAK_CLEAR, one, a);
+		} else if (strcmp(cmd, "breaks") == 0) {
+			ok = breakpoints(client, DBG_BREAK_LIST, false, 0);
+		} else if (strcmp(cmd, "step") == 0) {
+			req.type = DBG_STEP;
+			req.put(uint32_t(number_arg(argc, argv, i, 10, a) ? a : 1));
+			ok = client.request(req, resp) && check(resp, DBG_OK) &&
+				wait_stop(client);
+		} else if (strcmp(cmd, "cont") == 0) {
+			ok = client.request(DBG_CONTINUE, resp) &&
+				check(resp, DBG_OK) && wait_stop(client);
+		} else if (strcmp(cmd, "wait") == 0) {
+			ok = wait_stop(client);
+		} else if (strcmp(cmd, "stop") == 0) {
+			ok = client.request(DBG_STOP, resp) && check(resp, DBG_OK) &&
+				wait_stop(client);
+		} else if (strcmp(cmd, "detach") == 0) {
+			ok = client.request(DBG_DETACH, resp) && check(resp, DBG_OK);
+		} else if (strcmp(cmd, "bench") == 0) {
+			ok = bench(client,
+					number_arg(argc, argv, i, 10, a) ? a : 1000);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+
+		if (!ok) {
+			fprintf(stderr, "%s: failed\n", cmd);
+			return 1;
+		}
+	}
+	return 0;
+}
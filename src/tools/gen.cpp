@@ -0,0 +1,222 @@
+#include "assembler.hpp"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+/*
+ * Generates synthetic guest programs that stress one part of the
+ * interpreter each. Every program runs its kernel REPEAT times over SIZE
+ * and prints a letter derived from R0, so runs can be checked against
+ * each other, then halts.
+ */
+
+static const char* s_prelude =
+	".macro loop reg, target\n"
+	"\tADD  reg reg 7fff\n"
+	"\tJNZ  reg target\n"
+	".endm\n"
+	"\n"
+	".macro report\n"
+	"\tMOD  R0 R0 001a\n"
+	"\tADD  R0 R0 'a'\n"
+	"\tOUT  R0\n"
+	"\tOUT  '\\n'\n"
+	"\tHALT\n"
+	".endm\n"
+	"\n";
+
+/*
+ * Data dependent branches on a linear congruential sequence, so the host's
+ * predictor cannot learn the guest's control flow
+ */
+static const char* s_branch =
+	"\tSET  R7 %04x\n"
+	"outer:\n"
+	"\tSET  R6 %04x\n"
+	"\tSET  R1 0001\n"
+	"inner:\n"
+	"\tMULT R1 R1 0ad5\n"
+	"\tADD  R1 R1 3039\n"
+	"\tAND  R2 R1 0010\n"
+	"\tJZ   R2 skip_a\n"
+	"\tADD  R0 R0 0001\n"
+	"skip_a:\n"
+	"\tAND  R2 R1 0200\n"
+	"\tJNZ  R2 skip_b\n"
+	"\tADD  R0 R0 0003\n"
+	"skip_b:\n"
+	"\tGT   R3 R1 4000\n"
+	"\tJZ   R3 low\n"
+	"\tADD  R0 R0 0005\n"
+	"\tJMP  next\n"
+	"low:\n"
+	"\tMULT R0 R0 0003\n"
+	"next:\n"
+	"\tloop R6 inner\n"
+	"\tloop R7 outer\n"
+	"\treport\n";
+
+/*
+ * Recursion SIZE calls deep, saving a register in every frame
+ */
+static const char* s_recursion =
+	"\tSET  R7 %04x\n"
+	"outer:\n"
+	"\tSET  R1 %04x\n"
+	"\tCALL down\n"
+	"\tloop R7 outer\n"
+	"\treport\n"
+	"\n"
+	"down:\n"
+	"\tJZ   R1 base\n"
+	"\tPUSH R1\n"
+	"\tADD  R1 R1 7fff\n"
+	"\tCALL down\n"
+	"\tPOP  R1\n"
+	"\tADD  R0 R0 R1\n"
+	"base:\n"
+	"\tRET\n";
+
+/*
+ * Reads, updates and writes back a SIZE word buffer after the code
+ */
+static const char* s_stream =
+	"\tSET  R7 %04x\n"
+	"outer:\n"
+	"\tSET  R6 %04x\n"
+	"\tSET  R1 buffer\n"
+	"inner:\n"
+	"\tRMEM R2 R1\n"
+	"\tADD  R2 R2 R6\n"
+	"\tWMEM R1 R2\n"
+	"\tADD  R0 R0 R2\n"
+	"\tADD  R1 R1 0001\n"
+	"\tloop R6 inner\n"
+	"\tloop R7 outer\n"
+	"\treport\n"
+	"\n"
+	"buffer:\n";
+
+/*
+ * Rewrites the instruction it is about to run: its operand every time and
+ * its opcode between ADD and MULT
+ */
+static const char* s_selfmod =
+	"\tSET  R7 %04x\n"
+	"outer:\n"
+	"\tSET  R6 %04x\n"
+	"inner:\n"
+	"\tWMEM patched+3 R6\n"
+	"\tAND  R2 R6 0001\n"
+	"\tADD  R2 R2 0009\n"
+	"\tWMEM patched R2\n"
+	"patched:\n"
+	"\tADD  R0 R0 0000\n"
+	"\tMOD  R0 R0 7ff1\n"
+	"\tADD  R0 R0 0001\n"
+	"\tloop R6 inner\n"
+	"\tloop R7 outer\n"
+	"\treport\n";
+
+struct Workload {
+	const char* name;
+	const char* code;
+	unsigned size;
+	unsigned max_size;
+	const char* help;
+};
+
+static const Workload s_workloads[] = {
+	{"branch",    s_branch,    10000, 0x7fff, "data dependent branches"},
+	{"recursion", s_recursion, 1000,  0x7fff, "deep CALL/RET recursion"},
+	{"stream",    s_stream,    10000, 0x7f00, "RMEM/WMEM over a buffer"},
+	{"selfmod",   s_selfmod,   10000, 0x7fff, "self-modifying code"},
+};
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s [-n REPEAT] [-s SIZE] [-S] KIND OUT\n", prog);
+	printf("  -n  times the kernel runs (default 100, at most 32767)\n");
+	printf("  -s  loop length, recursion depth or buffer size\n");
+	printf("  -S  write the assembly source instead of the image\n");
+	printf("Kinds:\n");
+	for (auto& w : s_workloads) {
+		printf("  %-10s %s (default size %u)\n", w.name, w.help, w.size);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned repeat = 100;
+	unsigned size = 0;
+	bool source = false;
+
+	int c;
+	while ((c = getopt(argc, argv, "n:s:Sh")) != -1) {
+		switch (c) {
+		case 'n': repeat = strtoul(optarg, NULL, 10); break;
+		case 's': size = strtoul(optarg, NULL, 10); break;
+		case 'S': source = true; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const Workload* w = nullptr;
+	for (auto& candidate : s_workloads) {
+		if (strcmp(argv[optind], candidate.name) == 0)
+			w = &candidate;
+	}
+	if (!w) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (size == 0)
+		size = w->size;
+	if (repeat == 0 || repeat > 0x7fff || size > w->max_size) {
+		fprintf(stderr, "REPEAT must be 1..32767 and SIZE at most %u\n",
+				w->max_size);
+		return 1;
+	}
+
+	char header[128];
+	snprintf(header, sizeof(header), "; %s, %u times over %u\n\n", w->name,
+			repeat, size);
+	char body[2048];
+	snprintf(body, sizeof(body), w->code, repeat, size);
+	std::string text = std::string(header) + s_prelude + body;
+
+	const char* out = argv[optind + 1];
+	if (source) {
+		FILE* f = fopen(out, "w");
+		if (!f || fputs(text.c_str(), f) < 0 || fclose(f) != 0) {
+			perror(out);
+			return 1;
+		}
+		return 0;
+	}
+
+	Assembler as;
+	if (!as.assemble(text, w->name)) {
+		for (auto& e : as.errors()) {
+			fprintf(stderr, "%s\n", e.c_str());
+		}
+		return 1;
+	}
+	if (as.words().size() + (w->code == s_stream ? size : 0) > 0x8000) {
+		fprintf(stderr, "program does not fit in memory\n");
+		return 1;
+	}
+	return as.write(out) ? 0 : 1;
+}
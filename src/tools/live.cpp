@@ -0,0 +1,117 @@
+#include "live_state.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Reads a machine's live state from shared memory, using nothing but the
+ * layout in live_state.h, as any outside viewer would
+ */
+
+static void print_state(const live_state& s, const live_state* prev,
+		long dump)
+{
+	printf("tick %lu  ip %04x%s", s.ticks, s.ip,
+			s.waiting_input ? "  (waiting input)" : "");
+	if (prev && s.time_ns > prev->time_ns) {
+		double secs = (s.time_ns - prev->time_ns) / 1e9;
+		printf("  %.2f Mticks/s", (s.ticks - prev->ticks) / secs / 1e6);
+	}
+	printf("\n");
+
+	for (size_t r = 0; r < 8; r++) {
+		printf("R%lu=%04x%s", r, s.reg[r], r == 7 ? "\n" : " ");
+	}
+
+	printf("stack (%u):", s.stack_depth);
+	for (uint32_t i = 0; i < s.stack_words && i < 8; i++) {
+		printf(" %04x", s.stack[s.stack_words - 1 - i]);
+	}
+	printf("%s\n", s.stack_depth > 8 ? " ..." : "");
+
+	if (dump < 0)
+		return;
+	for (long addr = dump; addr < dump + 64 && addr < LIVE_RAM_WORDS;
+			addr += 8) {
+		printf("%04lx:", addr);
+		for (long i = addr; i < addr + 8; i++) {
+			printf(" %04x", s.ram[i]);
+		}
+		printf("\n");
+	}
+}
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s NAME [-w MS] [-d ADDR]\n", prog);
+	printf("  -w  keep reading every MS milliseconds\n");
+	printf("  -d  dump 64 words of memory from ADDR (hex)\n");
+	printf("NAME is the segment given to live_on, e.g. /synacor-1234.\n");
+}
+
+int main(int argc, char* argv[])
+{
+	long every = 0;
+	long dump = -1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:d:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			every = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			dump = strtol(optarg, NULL, 16);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int fd = shm_open(argv[optind], O_RDONLY, 0);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	void* mem = mmap(NULL, sizeof(live_state), PROT_READ, MAP_SHARED, fd,
+			0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	const live_state* live = static_cast<const live_state*>(mem);
+	if (live->magic != LIVE_MAGIC || live->version != LIVE_VERSION ||
+			live->size != sizeof(live_state)) {
+		fprintf(stderr, "%s: not a live state segment\n", argv[optind]);
+		return 1;
+	}
+
+	static live_state snap[2];
+	size_t retries = 0;
+	for (size_t n = 0; ; n++) {
+		live_state& cur = snap[n % 2];
+		while (!live_state_read(live, &cur)) {
+			retries++;
+		}
+		print_state(cur, n ? &snap[(n + 1) % 2] : nullptr, dump);
+
+		if (!every)
+			break;
+		usleep(every * 1000);
+	}
+	if (retries)
+		fprintf(stderr, "%lu torn reads retried\n", retries);
+	return 0;
+}
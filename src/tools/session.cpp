@@ -0,0 +1,178 @@
+#include "machine.hpp"
+#include "opcodes.hpp"
+#include "session.hpp"
+#include "timeline.hpp"
+#include "analysis/symbols.hpp"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s [-r INPUT] [-v] [-q QUERY]... [-j THREADS] "
+			"[-c TICKS] [-y SYMBOLS] IMAGE SESSION\n", prog);
+	printf("  -r  record: run IMAGE reading lines from INPUT and save the"
+			" session\n");
+	printf("  -v  show the output of the guest\n");
+	printf("  -q  find when something happened in SESSION, e.g.\n");
+	printf("        \"last write 0aac in :500000\", \"first change r7\",\n");
+	printf("        \"first when ip == 05b2\"\n");
+	printf("  -j  threads replaying for the queries (default: all cores)\n");
+	printf("  -c  ticks between the checkpoints the queries start from\n");
+	printf("  -y  load a symbol file for addresses in queries and hits\n");
+	printf("Without -r or -q replays SESSION headless and checks its "
+			"output.\n");
+}
+
+/*
+ * Builds the checkpoints once, then answers every query from them
+ */
+static bool run_queries(Machine& m, const Session& session,
+		const std::vector<std::string>& queries, size_t threads,
+		uint64_t interval, const SymbolTable& symbols)
+{
+	std::vector<TimelineQuery> parsed(queries.size());
+	for (size_t i = 0; i < queries.size(); i++) {
+		if (!TimelineQuery::parse(queries[i].c_str(), parsed[i],
+					&symbols))
+			return false;
+	}
+
+	Timeline timeline;
+	if (threads)
+		timeline.setThreads(threads);
+	timeline.setInterval(interval);
+
+	double start = now();
+	const Memory& ram = m.state().ram;
+	if (!timeline.build(ram.data(), ram.size(), session, stderr))
+		return false;
+	MemoryUsage mem = timeline.memoryUsage();
+	printf("%lu checkpoints every %lu ticks up to tick %lu in %.3fs, "
+			"%luK private memory\n", timeline.checkpoints(),
+			timeline.interval(), timeline.endTick(), now() - start,
+			mem.priv / 1024);
+
+	for (size_t i = 0; i < parsed.size(); i++) {
+		TimelineHit hit;
+		start = now();
+		bool found = timeline.query(parsed[i], hit);
+		double elapsed = now() - start;
+
+		if (!found) {
+			printf("%s: not found (%.3fs)\n", queries[i].c_str(),
+					elapsed);
+			continue;
+		}
+		std::string where = symbols.describe(hit.ip);
+		printf("%s: tick %lu at %04x%s%s %s, %04x -> %04x (%.3fs)\n",
+				queries[i].c_str(), hit.tick, hit.ip,
+				where.empty() ? "" : " ", where.c_str(),
+				hit.op < NUM_OPS ? op_names[hit.op] : "???",
+				hit.before, hit.after, elapsed);
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* input = nullptr;
+	bool verbose = false;
+	std::vector<std::string> queries;
+	size_t threads = 0;
+	uint64_t interval = 0;
+	SymbolTable symbols;
+
+	int c;
+	while ((c = getopt(argc, argv, "r:vq:j:c:y:h")) != -1) {
+		switch (c) {
+		case 'r': input = optarg; break;
+		case 'v': verbose = true; break;
+		case 'q': queries.push_back(optarg); break;
+		case 'j': threads = strtoul(optarg, NULL, 10); break;
+		case 'c': interval = strtoull(optarg, NULL, 10); break;
+		case 'y':
+			if (!symbols.load(optarg))
+				return 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char* image_path = argv[optind];
+	const char* session_path = argv[optind + 1];
+
+	int in_fd = input ? open(input, O_RDONLY) : -1;
+	if (input && in_fd < 0) {
+		perror(input);
+		return 1;
+	}
+
+	int null_fd = open("/dev/null", O_RDWR);
+	int out_fd = verbose ? STDOUT_FILENO : null_fd;
+	Machine m(in_fd, out_fd, STDERR_FILENO);
+
+	int image = open(image_path, O_RDONLY);
+	if (image < 0 || m.load_program(image) == 0) {
+		perror(image_path);
+		return 1;
+	}
+	close(image);
+
+	Session session;
+	double start = now();
+	bool ok;
+	if (input) {
+		session.start(m.state());
+		m.setSession(&session);
+		m.run(nullptr);
+		m.setSession(nullptr);
+		session.finish(m.state());
+		ok = session.save(session_path);
+		if (!ok)
+			perror(session_path);
+	} else {
+		if (!session.load(session_path)) {
+			fprintf(stderr, "Cannot load session %s\n", session_path);
+			return 1;
+		}
+		if (!queries.empty()) {
+			ok = run_queries(m, session, queries, threads, interval,
+					symbols);
+			close(null_fd);
+			return ok ? 0 : 1;
+		}
+		ok = session.replay(m, stderr);
+	}
+	double elapsed = now() - start;
+
+	session.printSummary(stdout);
+	printf("%s in %.3fs (%.0f ticks/s)\n", !input ? (ok ? "Replayed" :
+				"Diverged") : "Recorded", elapsed,
+			elapsed > 0 ? m.state().ticks / elapsed : 0.0);
+
+	close(null_fd);
+	if (in_fd >= 0)
+		close(in_fd);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+#include "machine.hpp"
+#include "machine_debug.hpp"
+#include "hle.hpp"
+#include "opcodes.hpp"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Runs an image without the GUI, for batch use. Input comes from a file or
+ * from stdin; the guest's output goes to stdout.
+ */
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s [-i INPUT] [-e ENGINE] [-t MAX_TICKS] [-s] [-d]"
+			" [-x SCRIPT] [-y SYMBOLS] IMAGE\n", prog);
+	printf("  -i  read input lines from INPUT instead of stdin\n");
+	printf("  -e  interp (default), hle to run known routines natively,\n");
+	printf("      hle-verify to also check them against the guest code,\n");
+	printf("      spec to run handlers specialized for operand kinds\n");
+	printf("  -t  stop after this many instructions\n");
+	printf("  -s  print run statistics to stderr when done\n");
+	printf("  -d  start in the debugger shell\n");
+	printf("  -x  run debugger commands from SCRIPT, then let the machine\n");
+	printf("      run on, stopping only for the script's handlers\n");
+	printf("  -y  load a symbol file for the debugger\n");
+}
+
+static void print_stats(const Machine& m, double elapsed, bool limited)
+{
+	MetricsSnapshot s = m.metrics().snapshot();
+	double run = s.run_ns / 1e9;
+
+	fprintf(stderr, "ticks       %lu%s\n", s.ticks,
+			limited ? " (tick limit reached)" : "");
+	fprintf(stderr, "elapsed     %.3f s (%.3f s waiting for input)\n",
+			elapsed, s.input_ns / 1e9);
+	if (s.ticks > 0 && run > 0) {
+		fprintf(stderr, "speed       %.0f ticks/s, %.2f ns/tick\n",
+				s.ticks / run, run * 1e9 / s.ticks);
+	}
+	fprintf(stderr, "output      %lu bytes\n", s.out_bytes);
+	fprintf(stderr, "input       %lu lines\n", s.in_lines);
+	fprintf(stderr, "stack max   %lu\n", s.stack_max);
+	MemoryUsage mem = m.state().ram.usage();
+	fprintf(stderr, "memory      %luK private, %luK shared\n",
+			mem.priv / 1024, mem.shared / 1024);
+	fprintf(stderr, "ops        ");
+	for (size_t op = 0; op < METRICS_OPS; op++) {
+		if (s.ops[op])
+			fprintf(stderr, " %s=%lu", op_names[op], s.ops[op]);
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* input = nullptr;
+	const char* engine = "interp";
+	uint64_t max_ticks = 0;
+	bool stats = false;
+	bool debug = false;
+	const char* script = nullptr;
+	const char* symbols = nullptr;
+
+	int c;
+	while ((c = getopt(argc, argv, "i:e:t:sdx:y:h")) != -1) {
+		switch (c) {
+		case 'i': input = optarg; break;
+		case 'e': engine = optarg; break;
+		case 't': max_ticks = strtoull(optarg, NULL, 10); break;
+		case 's': stats = true; break;
+		case 'd': debug = true; break;
+		case 'x': script = optarg; break;
+		case 'y': symbols = optarg; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	bool hle = strcmp(engine, "hle") == 0;
+	bool verify = strcmp(engine, "hle-verify") == 0;
+	bool spec = strcmp(engine, "spec") == 0;
+	if (optind + 1 != argc || (!hle && !verify && !spec &&
+				strcmp(engine, "interp") != 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int in_fd = input ? open(input, O_RDONLY) : STDIN_FILENO;
+	if (in_fd < 0) {
+		perror(input);
+		return 1;
+	}
+
+	Machine m(in_fd, STDOUT_FILENO, STDERR_FILENO);
+	int image = open(argv[optind], O_RDONLY);
+	if (image < 0 || m.load_program(image) == 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	close(image);
+	m.setSpecialized(spec);
+
+	Hle routines;
+	if (hle || verify) {
+		routines.addChallengeRoutines();
+		routines.setVerifyAll(verify);
+		m.setHle(&routines);
+	}
+
+	Debugger dbg;
+	dbg.setDebug(debug || script);
+	dbg.setBatch(script && !debug);
+	if (symbols && !dbg.loadSymbols(symbols))
+		return 1;
+	if (script && !dbg.source(script))
+		return 1;
+
+	double start = now();
+	m.run(debug || script ? &dbg : nullptr, max_ticks);
+	double elapsed = now() - start;
+
+	if (stats) {
+		fflush(stdout);
+		print_stats(m, elapsed, max_ticks && m.state().ticks >= max_ticks);
+	}
+
+	if (verify) {
+		for (auto& e : routines.entries()) {
+			if (e.second.mismatches) {
+				fprintf(stderr, "%s: %lu of %lu calls differ\n",
+						e.second.name, e.second.mismatches,
+						e.second.verified);
+				return 2;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include "trace.hpp"
+#include "opcodes.hpp"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Prints one record: tick, address, opcode, the registers it changed, the
+ * words it wrote and where it jumped to
+ */
+static void print_event(const TraceEvent& e)
+{
+	printf("%10lu  %04x  %-4s", e.tick, e.ip, op_names[e.op]);
+	for (size_t r = 0; r < 8; r++) {
+		if (e.reg_mask & (1 << r))
+			printf("  R%lu=%04x", r, e.reg[r]);
+	}
+	for (auto& w : e.writes) {
+		printf("  [%04x]=%04x", w.first, w.second);
+	}
+	if (e.jumped)
+		printf("  (taken)");
+	printf("\n");
+}
+
+static void print_summary(const TraceReader& trace)
+{
+	uint64_t records = trace.records();
+	uint64_t raw = trace.rawBytes();
+	uint64_t compressed = trace.compressedBytes();
+
+	printf("Ticks %lu-%lu, %lu records in %lu chunks\n", trace.firstTick(),
+			trace.endTick(), records, trace.chunks());
+	printf("%lu bytes encoded, %lu on disk (%.2f bytes/record)\n", raw,
+			compressed, records ? double(compressed) / records : 0.0);
+}
+
+static void print_state(const TraceEvent& e, const std::vector<uint16_t>& ram,
+		long dump)
+{
+	printf("After tick %lu, at %04x %s\n", e.tick, e.ip, op_names[e.op]);
+	for (size_t r = 0; r < 8; r++) {
+		printf("R%lu=%04x%s", r, e.reg[r], r == 7 ? "\n" : " ");
+	}
+
+	if (dump < 0)
+		return;
+	for (long addr = dump; addr < dump + 64 && addr < 0x8000; addr += 8) {
+		printf("%04lx:", addr);
+		for (long i = addr; i < addr + 8; i++) {
+			printf(" %04x", ram[i]);
+		}
+		printf("\n");
+	}
+}
+
+static bool parse_range(const char* text, uint64_t& from, uint64_t& to)
+{
+	char* end;
+	from = strtoull(text, &end, 10);
+	if (*end == '\0') {
+		to = from + 1;
+		return true;
+	}
+	if (*end != ':')
+		return false;
+	if (end[1] != '\0')
+		to = strtoull(end + 1, &end, 10);
+	return *end == '\0' || *end == ':';
+}
+
+static void usage(const char* prog)
+{
+	printf("USAGE: %s TRACE [-r FROM:TO] [-a ADDR] [-n MAX]"
+			" [-t TICK [-d ADDR]]\n", prog);
+	printf("  -r  print the records in a range of ticks\n");
+	printf("  -a  only records that execute or write ADDR (hex)\n");
+	printf("  -n  print at most MAX records (default 1000)\n");
+	printf("  -t  rebuild the registers and memory after TICK\n");
+	printf("  -d  with -t, dump 64 words of memory from ADDR (hex)\n");
+	printf("Without -r, -a or -t prints a summary of the trace.\n");
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t from = 0;
+	uint64_t to = UINT64_MAX;
+	bool range = false;
+	long addr = -1;
+	long dump = -1;
+	long long state = -1;
+	size_t max = 1000;
+
+	int c;
+	while ((c = getopt(argc, argv, "r:a:n:t:d:h")) != -1) {
+		switch (c) {
+		case 'r':
+			range = parse_range(optarg, from, to);
+			if (!range) {
+				fprintf(stderr, "Bad tick range: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'a': addr = strtol(optarg, NULL, 16) & 0x7fff; break;
+		case 'n': max = strtoull(optarg, NULL, 10); break;
+		case 't': state = strtoll(optarg, NULL, 10); break;
+		case 'd': dump = strtol(optarg, NULL, 16) & 0x7fff; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	TraceReader trace;
+	if (!trace.open(argv[optind]))
+		return 1;
+
+	if (state >= 0) {
+		TraceEvent last;
+		std::vector<uint16_t> ram;
+		if (!trace.stateAt(state, last, ram)) {
+			fprintf(stderr, "Tick %lld is not in the trace\n", state);
+			return 1;
+		}
+		print_state(last, ram, dump);
+		return 0;
+	}
+
+	if (!range && addr < 0) {
+		print_summary(trace);
+		return 0;
+	}
+
+	size_t printed = 0;
+	auto visit = [&](const TraceEvent& e) {
+		print_event(e);
+		return ++printed < max;
+	};
+
+	bool ok = addr < 0 ? trace.scan(from, to, visit) :
+		trace.scanAddress(addr, from, to, visit);
+	if (printed == max)
+		printf("(stopped after %lu records)\n", max);
+	return ok ? 0 : 1;
+}